@@ -31,8 +31,14 @@
  *                                        a subscription.
  *   meta TEXT       -- Copy of the meta data as put into the journal.
  *                   -- This is also encrypted using the database key.
+ *   stripe_cus_hash TEXT,             -- HMAC of the customer id.
+ *   paypal_payer_hash TEXT            -- HMAC of the payer id.
  * )
  *
+ * The two hash columns allow to find an account by the encrypted
+ * ids; see account_find_id.  The HMAC key is kept in a separate file
+ * so that a reader of the database can't link the rows to known ids.
+ *
  * CREATE TABLE pending (
  *   token TEXT NOT NULL PRIMARY KEY,
  *   email TEXT NOT NULL,
@@ -46,10 +52,12 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
-#include <npth.h>
 #include <gcrypt.h>
 #include <sqlite3.h>
 
@@ -60,32 +68,52 @@
 #include "membuf.h"
 #include "dbutil.h"
 #include "encrypt.h"
+#include "storage.h"
 #include "account.h"
 
 
-/* The name of the account database file.  */
+/* The name of the account database file.  The name of the test
+   database may be changed by the regression test.  */
 static const char account_db_fname[] = "/var/lib/payproc/account.db";
-static const char account_test_db_fname[] = "/var/lib/payproc-test/account.db";
+static const char *account_test_db_fname
+  = "/var/lib/payproc-test/account.db";
+
+/* The name of the file with the key for the hashes of the Stripe
+   customer id and the Paypal payer id.  It is created with a random
+   key on first use and copied to the backup directory along with the
+   database.  If the file is lost the accounts can't be found by these
+   ids until they are updated again.  */
+static const char account_hashkey_fname[]
+  = "/var/lib/payproc/account-hash.key";
+static const char *account_test_hashkey_fname
+  = "/var/lib/payproc-test/account-hash.key";
 
 /* The database handle used for the account database.  This handle
    may only used after a successful open_account_db call and not
-   after a close_account_db call.  The lock variable is maintained by
-   the mentioned open and close functions. */
+   after a close_account_db call.  The handle and the statements
+   below are only used by the storage thread.  */
 static sqlite3 *account_db;
-static npth_mutex_t account_db_lock = NPTH_MUTEX_INITIALIZER;
 
-/* This is a prepared statement for the INSERT operation.  It is
-   protected by account_db_lock.  */
+/* This is a prepared statement for the INSERT operation.  */
 static sqlite3_stmt *account_insert_stmt;
 
-/* This is a prepared statement for the UPDATE operation.  It is
-   protected by account_db_lock.  */
+/* This is a prepared statement for the UPDATE operation.  */
 static sqlite3_stmt *account_update_stmt;
 
-/* This is a prepared statement for the SELECT by REF operation.  It
-   is protected by account_db_lock.  */
+/* This is a prepared statement for the SELECT by REF operation.  */
 static sqlite3_stmt *account_select_stmt;
 
+/* This is a prepared statement to update only the timestamp.  */
+static sqlite3_stmt *account_touch_stmt;
+
+/* These are prepared statements for the SELECT by the hash of the
+   Stripe customer id or the Paypal payer id.  */
+static sqlite3_stmt *account_find_cus_stmt;
+static sqlite3_stmt *account_find_payer_stmt;
+
+/* The state of the online backup.  */
+static struct db_backup_s account_backup;
+
 
 
 
@@ -115,16 +143,482 @@ make_account_id (char *buffer, size_t bufsize)
 
 
 
-/* Relinquishes the lock on the account handle and if DO_CLOSE is
- * true also close the database handle.  Note that we usually keep the
+/* The account cache keeps a digest of the values of recently written
+ * account rows so that repeated updates of an account during a
+ * subscription flow do not need to encrypt and write the values
+ * again.  The entries are kept in an LRU list and are indexed by the
+ * account id as well as by the hash of the Stripe customer id and
+ * the hash of the Paypal payer id.  We store only digests so that the
+ * plaintext of the encrypted values is not kept in memory.  The cache
+ * is only used by the storage thread.
+ *
+ * A cache hit only needs to update the timestamp of the row.  This is
+ * not done right away but collected in the item and written for up
+ * to ACCOUNT_TOUCH_BATCH items at once or by the housekeeping.  */
+#define ACCOUNT_CACHE_SIZE    1024
+#define ACCOUNT_TOUCH_BATCH   64
+#define ACCOUNT_CACHE_BUCKETS 256
+#define ACCOUNT_CACHE_DIGEST  GCRY_MD_SHA256
+#define ACCOUNT_CACHE_DIGESTLEN 32
+
+/* The size of a buffer for the hex encoded HMAC of a Stripe customer
+ * id or a Paypal payer id and the length of its key.  */
+#define ACCOUNT_KEYHASH_SIZE (2*32+1)
+#define ACCOUNT_HASHKEY_LEN  32
+
+struct account_cache_s;
+typedef struct account_cache_s *account_cache_t;
+struct account_cache_s
+{
+  account_cache_t lru_prev;   /* Towards the most recently used item.  */
+  account_cache_t lru_next;   /* Towards the least recently used item.  */
+  account_cache_t id_next;    /* Next item in the account id bucket.  */
+  account_cache_t cus_next;   /* Next item in the stripe_cus bucket.  */
+  account_cache_t payer_next; /* Next item in the paypal_payer_id bucket.  */
+  unsigned char digest[ACCOUNT_CACHE_DIGESTLEN]; /* See cache_digest.  */
+  char cus_hash[ACCOUNT_KEYHASH_SIZE];   /* See hash_account_key.  */
+  char payer_hash[ACCOUNT_KEYHASH_SIZE]; /* See hash_account_key.  */
+  char touched[DB_DATETIME_SIZE]; /* Pending timestamp or empty.  */
+  char account_id[16];
+};
+
+static account_cache_t cache_by_id[ACCOUNT_CACHE_BUCKETS];
+static account_cache_t cache_by_cus[ACCOUNT_CACHE_BUCKETS];
+static account_cache_t cache_by_payer[ACCOUNT_CACHE_BUCKETS];
+static account_cache_t cache_lru_head;
+static account_cache_t cache_lru_tail;
+static unsigned int cache_entries;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+static unsigned int cache_touches;  /* Number of pending timestamps.  */
+
+/* The key for hash_account_key and a flag telling whether it has
+ * been loaded.  */
+static unsigned char account_hashkey[ACCOUNT_HASHKEY_LEN];
+static int account_hashkey_loaded;
+
+
+
+
+static gpg_error_t touch_account_record (const char *account_id,
+                                         const char *datetime);
+
+
+
+/* Return the bucket index for STRING.  */
+static unsigned int
+cache_hash (const char *string)
+{
+  const unsigned char *s = (const unsigned char *)string;
+  unsigned int h = 2166136261u;
+
+  for (; *s; s++)
+    h = (h ^ *s) * 16777619u;
+  return h % ACCOUNT_CACHE_BUCKETS;
+}
+
+
+/* Store the digest of the values EMAIL, STRIPE_CUS and
+ * PAYPAL_PAYER_ID at DIGEST.  NULL is taken as the empty string.  */
+static void
+cache_digest (unsigned char *digest, const char *email,
+              const char *stripe_cus, const char *paypal_payer_id)
+{
+  gcry_buffer_t iov[3];
+  const char *values[3];
+  int i;
+
+  values[0] = email? email : "";
+  values[1] = stripe_cus? stripe_cus : "";
+  values[2] = paypal_payer_id? paypal_payer_id : "";
+  memset (iov, 0, sizeof iov);
+  for (i=0; i < DIM (iov); i++)
+    {
+      /* Include the Nul to delimit the values.  */
+      iov[i].data = (void *)values[i];
+      iov[i].len = strlen (values[i]) + 1;
+    }
+  if (gcry_md_hash_buffers (ACCOUNT_CACHE_DIGEST, 0, digest, iov, DIM (iov)))
+    BUG ();
+}
+
+
+/* Write the key for hash_account_key to FNAME.  The key is first
+ * written to a temporary file which is then renamed so that a crash
+ * does not leave a truncated key.  */
+static gpg_error_t
+write_account_hashkey (const char *fname)
+{
+  gpg_error_t err = 0;
+  char *tmpfname;
+  int fd;
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    return gpg_error_from_syserror ();
+
+  fd = open (tmpfname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1
+      || write (fd, account_hashkey, sizeof account_hashkey)
+         != sizeof account_hashkey)
+    err = gpg_error_from_syserror ();
+  if (fd != -1 && close (fd) && !err)
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = db_sync_file (tmpfname, 0);
+  if (!err && rename (tmpfname, fname))
+    err = gpg_error_from_syserror ();
+  if (!err)
+    err = db_sync_file (fname, 1);
+  if (err)
+    {
+      log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+      remove (tmpfname);
+    }
+  xfree (tmpfname);
+  return err;
+}
+
+
+/* Storage function to read the key for hash_account_key from its
+ * file or to create the file with a new random key.  This is done by
+ * the storage thread so that only one thread creates the file.  */
+static gpg_error_t
+load_account_hashkey (void *opaque)
+{
+  gpg_error_t err = 0;
+  const char *fname;
+  int fd;
+  ssize_t n;
+
+  (void)opaque;
+
+  if (account_hashkey_loaded)
+    return 0;
+
+  fname = opt.livemode? account_hashkey_fname : account_test_hashkey_fname;
+  fd = open (fname, O_RDONLY);
+  if (fd != -1)
+    {
+      n = read (fd, account_hashkey, sizeof account_hashkey);
+      if (n == -1)
+        err = gpg_error_from_syserror ();
+      else if (n != sizeof account_hashkey)
+        err = gpg_error (GPG_ERR_INV_KEYLEN);
+      close (fd);
+      if (err)
+        log_error ("error reading the account hash key '%s': %s\n",
+                   fname, gpg_strerror (err));
+    }
+  else if (errno == ENOENT)
+    {
+      gcry_randomize (account_hashkey, sizeof account_hashkey,
+                      GCRY_STRONG_RANDOM);
+      err = write_account_hashkey (fname);
+      if (!err && opt.verbose)
+        log_info ("new account hash key created\n");
+    }
+  else
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error opening the account hash key '%s': %s\n",
+                 fname, gpg_strerror (err));
+    }
+
+  if (err)
+    {
+      wipememory (account_hashkey, sizeof account_hashkey);
+      return err;
+    }
+  account_hashkey_loaded = 1;
+  return 0;
+}
+
+
+/* Store the hex encoded HMAC-SHA-256 of the Stripe customer id or
+ * Paypal payer id VALUE at HEXBUF which must have a size of
+ * ACCOUNT_KEYHASH_SIZE.  An empty string is stored for an empty or
+ * NULL VALUE.  This must not be called by a storage function.  */
+static gpg_error_t
+hash_account_key (char *hexbuf, const char *value)
+{
+  gpg_error_t err;
+  gcry_mac_hd_t hd;
+  unsigned char digest[32];
+  size_t digestlen = sizeof digest;
+  int i;
+
+  *hexbuf = 0;
+  if (!value || !*value)
+    return 0;
+
+  if (!account_hashkey_loaded)
+    {
+      err = storage_run (load_account_hashkey, NULL);
+      if (err)
+        return err;
+    }
+  err = gcry_mac_open (&hd, GCRY_MAC_HMAC_SHA256, 0, NULL);
+  if (err)
+    return err;
+  err = gcry_mac_setkey (hd, account_hashkey, sizeof account_hashkey);
+  if (!err)
+    err = gcry_mac_write (hd, value, strlen (value));
+  if (!err)
+    err = gcry_mac_read (hd, digest, &digestlen);
+  gcry_mac_close (hd);
+  if (err)
+    return err;
+  for (i=0; i < sizeof digest; i++)
+    snprintf (hexbuf + 2*i, 3, "%02x", digest[i]);
+  return 0;
+}
+
+
+/* Remove ITEM from the bucket list at TABLE using the next pointer at
+ * byte OFFSET of an item.  */
+static void
+cache_unlink_bucket (account_cache_t *table, const char *key,
+                     account_cache_t item, size_t offset)
+{
+  account_cache_t *pp;
+
+  if (!*key)
+    return;
+  for (pp = table + cache_hash (key); *pp;
+       pp = (account_cache_t *)((char *)*pp + offset))
+    if (*pp == item)
+      {
+        *pp = *(account_cache_t *)((char *)item + offset);
+        return;
+      }
+}
+
+
+/* Remove ITEM from all lists and release it.  */
+static void
+cache_remove (account_cache_t item)
+{
+  cache_unlink_bucket (cache_by_id, item->account_id, item,
+                       offsetof (struct account_cache_s, id_next));
+  cache_unlink_bucket (cache_by_cus, item->cus_hash, item,
+                       offsetof (struct account_cache_s, cus_next));
+  cache_unlink_bucket (cache_by_payer, item->payer_hash, item,
+                       offsetof (struct account_cache_s, payer_next));
+
+  if (item->lru_prev)
+    item->lru_prev->lru_next = item->lru_next;
+  else
+    cache_lru_head = item->lru_next;
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    cache_lru_tail = item->lru_prev;
+
+  if (*item->touched)
+    cache_touches--;
+  xfree (item);
+  cache_entries--;
+}
+
+
+/* Move ITEM to the head of the LRU list.  */
+static void
+cache_touch (account_cache_t item)
+{
+  if (item == cache_lru_head)
+    return;
+
+  item->lru_prev->lru_next = item->lru_next;
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    cache_lru_tail = item->lru_prev;
+
+  item->lru_prev = NULL;
+  item->lru_next = cache_lru_head;
+  cache_lru_head->lru_prev = item;
+  cache_lru_head = item;
+}
+
+
+/* Return the cache item for ACCOUNT_ID or NULL.  */
+static account_cache_t
+cache_find (const char *account_id)
+{
+  account_cache_t item;
+
+  for (item = cache_by_id[cache_hash (account_id)]; item; item = item->id_next)
+    if (!strcmp (item->account_id, account_id))
+      {
+        cache_touch (item);
+        return item;
+      }
+  return NULL;
+}
+
+
+/* Return the cache item with the hash CUS_HASH of the Stripe customer
+ * id or, if that is NULL, with the hash PAYER_HASH of the Paypal payer
+ * id.  Returns NULL if there is no such item.  */
+static account_cache_t
+cache_find_key (const char *cus_hash, const char *payer_hash)
+{
+  account_cache_t item;
+
+  if (cus_hash)
+    {
+      for (item = cache_by_cus[cache_hash (cus_hash)]; item;
+           item = item->cus_next)
+        if (!strcmp (item->cus_hash, cus_hash))
+          break;
+    }
+  else
+    {
+      for (item = cache_by_payer[cache_hash (payer_hash)]; item;
+           item = item->payer_next)
+        if (!strcmp (item->payer_hash, payer_hash))
+          break;
+    }
+  if (item)
+    cache_touch (item);
+  return item;
+}
+
+
+/* Remove the cache item for ACCOUNT_ID.  */
+static void
+cache_invalidate (const char *account_id)
+{
+  account_cache_t item;
+
+  for (item = cache_by_id[cache_hash (account_id)]; item; item = item->id_next)
+    if (!strcmp (item->account_id, account_id))
+      {
+        cache_remove (item);
+        return;
+      }
+}
+
+
+/* Store the DIGEST of the values of the row ACCOUNT_ID and the hashes
+ * CUS_HASH and PAYER_HASH of its Stripe customer id and Paypal payer
+ * id in the cache.  DIGEST may be NULL if the values are not known;
+ * the hashes may be NULL or empty if there is no such id.  Any
+ * existing entry is replaced.  This is a best effort function; if we
+ * run out of core the entry is merely not cached.  */
+static void
+cache_put (const char *account_id, const unsigned char *digest,
+           const char *cus_hash, const char *payer_hash)
+{
+  account_cache_t item;
+  unsigned int h;
+
+  if (strlen (account_id) >= sizeof item->account_id)
+    return;
+
+  cache_invalidate (account_id);
+  if (cache_entries >= ACCOUNT_CACHE_SIZE)
+    {
+      /* Don't lose a pending timestamp of the evicted item.  */
+      if (*cache_lru_tail->touched)
+        touch_account_record (cache_lru_tail->account_id,
+                              cache_lru_tail->touched);
+      cache_remove (cache_lru_tail);
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return;
+  strcpy (item->account_id, account_id);
+  /* An all zero digest does not match any values.  */
+  if (digest)
+    memcpy (item->digest, digest, sizeof item->digest);
+  if (cus_hash)
+    strcpy (item->cus_hash, cus_hash);
+  if (payer_hash)
+    strcpy (item->payer_hash, payer_hash);
+
+  h = cache_hash (item->account_id);
+  item->id_next = cache_by_id[h];
+  cache_by_id[h] = item;
+  if (*item->cus_hash)
+    {
+      h = cache_hash (item->cus_hash);
+      item->cus_next = cache_by_cus[h];
+      cache_by_cus[h] = item;
+    }
+  if (*item->payer_hash)
+    {
+      h = cache_hash (item->payer_hash);
+      item->payer_next = cache_by_payer[h];
+      cache_by_payer[h] = item;
+    }
+
+  item->lru_next = cache_lru_head;
+  if (cache_lru_head)
+    cache_lru_head->lru_prev = item;
+  else
+    cache_lru_tail = item;
+  cache_lru_head = item;
+  cache_entries++;
+}
+
+
+/* Release all cache entries.  */
+static void
+cache_flush (void)
+{
+  while (cache_lru_head)
+    cache_remove (cache_lru_head);
+}
+
+
+
+/* The SQL function account_deleted(ACCOUNT_ID) which is called by a
+ * trigger to remove a deleted account from the cache.  */
+static void
+account_deleted_func (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const char *s;
+
+  (void)argc;
+
+  s = (const char *)sqlite3_value_text (argv[0]);
+  if (s)
+    cache_invalidate (s);
+  sqlite3_result_null (ctx);
+}
+
+
+/* Run the single SQL statement SQL on the account database.  Returns
+ * an sqlite error code.  */
+static int
+run_account_sql (const char *sql)
+{
+  int res;
+  sqlite3_stmt *stmt;
+
+  res = sqlite3_prepare_v2 (account_db, sql, -1, &stmt, NULL);
+  if (res)
+    return res;
+  res = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+  return res == SQLITE_DONE? SQLITE_OK : res;
+}
+
+
+
+/* Close the database handle.  Note that we usually keep the
  * database open for the lifetime of the process.  */
 static void
-close_account_db (int do_close)
+close_account_db (void)
 {
   int res;
 
-  if (do_close && account_db)
+  if (account_db)
     {
+      db_backup_cancel (&account_backup);
       res = sqlite3_close (account_db);
       if (res == SQLITE_BUSY)
         {
@@ -134,23 +628,26 @@ close_account_db (int do_close)
           account_update_stmt = NULL;
           sqlite3_finalize (account_select_stmt);
           account_select_stmt = NULL;
+          sqlite3_finalize (account_touch_stmt);
+          account_touch_stmt = NULL;
+          sqlite3_finalize (account_find_cus_stmt);
+          account_find_cus_stmt = NULL;
+          sqlite3_finalize (account_find_payer_stmt);
+          account_find_payer_stmt = NULL;
           res = sqlite3_close (account_db);
         }
       if (res)
         log_error ("failed to close the account db: %s\n",
                    sqlite3_errstr (res));
       account_db = NULL;
+      cache_flush ();
     }
-
-  res = npth_mutex_unlock (&account_db_lock);
-  if (res)
-    log_fatal ("failed to release account db lock: %s\n",
-               gpg_strerror (gpg_error_from_errno (res)));
 }
 
 
 /* This function opens or creates the account database.  If the
- * database is already open it merly takes a lock ion the handle. */
+ * database is already open it does nothing.  This must only be called
+ * by the storage thread.  */
 static gpg_error_t
 open_account_db (void)
 {
@@ -158,17 +655,13 @@ open_account_db (void)
   sqlite3_stmt *stmt;
   const char *db_fname = opt.livemode? account_db_fname:account_test_db_fname;
 
-  res = npth_mutex_lock (&account_db_lock);
-  if (res)
-    log_fatal ("failed to acquire account db lock: %s\n",
-               gpg_strerror (gpg_error_from_errno (res)));
   if (account_db)
     return 0; /* Good: Already open.  */
 
   /* Database has not yet been opened.  Open or create it, make sure
-     the tables exist, and prepare the required statements.  We use
-     our own locking instead of the more complex serialization sqlite
-     would have to do. */
+     the tables exist, and prepare the required statements.  All
+     writes are serialized by the storage thread and thus we don't
+     need the more complex serialization sqlite would have to do. */
 
   res = sqlite3_open_v2 (db_fname,
                          &account_db,
@@ -180,11 +673,17 @@ open_account_db (void)
     {
       log_error ("error opening '%s': %s\n",
                  db_fname, sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   sqlite3_extended_result_codes (account_db, 1);
+  sqlite3_busy_timeout (account_db, DB_BUSY_TIMEOUT);
 
+  if (db_enable_wal (account_db, db_fname))
+    {
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
 
   /* Create the tables if needed.  */
   res = sqlite3_prepare_v2 (account_db,
@@ -196,14 +695,16 @@ open_account_db (void)
                             "updated    TEXT NOT NULL,\n"
                             "stripe_cus TEXT,\n"
                             "paypal_payer_id TEXT,\n"
-                            "meta       TEXT"
+                            "meta       TEXT,\n"
+                            "stripe_cus_hash TEXT,\n"
+                            "paypal_payer_hash TEXT"
                             ")",
                             -1, &stmt, NULL);
   if (res)
     {
       log_error ("error creating account table (prepare): %s\n",
                  sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
 
@@ -212,7 +713,7 @@ open_account_db (void)
   if (res != SQLITE_DONE)
     {
       log_error ("error creating account table: %s\n", sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
 
@@ -230,11 +731,60 @@ open_account_db (void)
         {
           log_error ("error adding column to account table: %s\n",
                      sqlite3_errstr (res));
-          close_account_db (1);
+          close_account_db ();
           return gpg_error (GPG_ERR_GENERAL);
         }
     }
 
+  /* The hash columns were added later.  Rows written before have no
+   * hashes and are thus not found by account_find_id until they are
+   * updated again.  As above, an error from prepare means that the
+   * column already exists.  */
+  res = run_account_sql ("ALTER TABLE account ADD COLUMN"
+                         " stripe_cus_hash TEXT");
+  if (!res || res == SQLITE_ERROR)
+    res = run_account_sql ("ALTER TABLE account ADD COLUMN"
+                           " paypal_payer_hash TEXT");
+  if (res && res != SQLITE_ERROR)
+    {
+      log_error ("error adding column to account table: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  res = run_account_sql ("CREATE INDEX IF NOT EXISTS account_cus_hash"
+                         " ON account (stripe_cus_hash)"
+                         " WHERE stripe_cus_hash IS NOT NULL");
+  if (!res)
+    res = run_account_sql ("CREATE INDEX IF NOT EXISTS account_payer_hash"
+                           " ON account (paypal_payer_hash)"
+                           " WHERE paypal_payer_hash IS NOT NULL");
+  if (res)
+    {
+      log_error ("error creating account index: %s\n", sqlite3_errstr (res));
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  /* Keep the cache in sync with rows deleted using this connection.
+   * Rows deleted by other processes are detected by the update.  */
+  res = sqlite3_create_function (account_db, "account_deleted", 1,
+                                 SQLITE_UTF8, NULL, account_deleted_func,
+                                 NULL, NULL);
+  if (!res)
+    res = run_account_sql ("CREATE TEMP TRIGGER account_delete"
+                           " AFTER DELETE ON account"
+                           " BEGIN SELECT account_deleted(old.account_id);"
+                           " END");
+  if (res)
+    {
+      log_error ("error creating account trigger: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
 
   /* Prepare an insert statement.  */
   res = sqlite3_prepare_v2
@@ -246,7 +796,7 @@ open_account_db (void)
     {
       log_error ("error preparing insert statement: %s\n",
                  sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   account_insert_stmt = stmt;
@@ -257,14 +807,16 @@ open_account_db (void)
                             " updated = ?2,"
                             " stripe_cus = ?3,"
                             " email = ?4,"
-                            " paypal_payer_id = ?5"
+                            " paypal_payer_id = ?5,"
+                            " stripe_cus_hash = ?6,"
+                            " paypal_payer_hash = ?7"
                             " WHERE account_id=?1",
                             -1, &stmt, NULL);
   if (res)
     {
       log_error ("error preparing update statement: %s\n",
                  sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   account_update_stmt = stmt;
@@ -277,26 +829,72 @@ open_account_db (void)
     {
       log_error ("error preparing select statement: %s\n",
                  sqlite3_errstr (res));
-      close_account_db (1);
+      close_account_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   account_select_stmt = stmt;
 
+  /* Prepare an update statement for the timestamp.  */
+  res = sqlite3_prepare_v2 (account_db,
+                            "UPDATE account SET updated = ?2"
+                            " WHERE account_id=?1",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing update statement: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  account_touch_stmt = stmt;
+
+  /* Prepare the select statements by hash.  */
+  res = sqlite3_prepare_v2 (account_db,
+                            "SELECT account_id FROM account"
+                            " WHERE stripe_cus_hash=?1",
+                            -1, &stmt, NULL);
+  if (!res)
+    {
+      account_find_cus_stmt = stmt;
+      res = sqlite3_prepare_v2 (account_db,
+                                "SELECT account_id FROM account"
+                                " WHERE paypal_payer_hash=?1",
+                                -1, &stmt, NULL);
+    }
+  if (res)
+    {
+      log_error ("error preparing select statement: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  account_find_payer_stmt = stmt;
+
   return 0;
 }
 
 
-/* Insert a new record into the account table.  No values are
- * required.  On success the account id is stored at R_ACCOUNT_ID. */
+/* Storage function to insert a new record into the account table.
+ * No values are required.  OPAQUE is a char ** to store the account
+ * id on success.  */
 static gpg_error_t
-new_account_record (char **r_account_id)
+new_account_record (void *opaque)
 {
+  gpg_error_t err;
+  char **r_account_id = opaque;
   int res;
   char account_id[16];
   char datetime_buf [DB_DATETIME_SIZE];
+  unsigned char digest[ACCOUNT_CACHE_DIGESTLEN];
 
   *r_account_id = NULL;
 
+  err = open_account_db ();
+  if (!err)
+    err = storage_begin (account_db);
+  if (err)
+    return err;
+
  retry:
   make_account_id (account_id, sizeof account_id);
 
@@ -328,6 +926,8 @@ new_account_record (char **r_account_id)
       *r_account_id = xtrystrdup (account_id);
       if (!*r_account_id)
         return gpg_error_from_syserror ();
+      cache_digest (digest, NULL, NULL, NULL);
+      cache_put (account_id, digest, NULL, NULL);
       return 0;
     }
 
@@ -337,68 +937,166 @@ new_account_record (char **r_account_id)
 }
 
 
-/* Update the row specified by 'account-id'.  The following values are
- * updated if they are in DICT.
- *
- *  | DICT name        | account name    | encrypted |
- *  |------------------+-----------------+-----------|
- *  | _stripe_cus      | stripe_cus      | yes       |
- *  | _paypal_payer_id | paypal_payer_id | yes       |
- *  | Email            | email           | no        |
- */
-static gpg_error_t
-update_account_record (keyvalue_t dict)
+/* The arguments for the storage functions updating an account.  */
+struct update_parm_s
 {
-  gpg_error_t err;
-  int res;
-  char datetime_buf [DB_DATETIME_SIZE];
   const char *account_id;
-  const char *stripe_cus;
-  char *enc_stripe_cus = NULL;
   const char *email;
+  const char *stripe_cus;
   const char *paypal_payer_id;
-  char *enc_paypal_payer_id = NULL;
+  char *enc_stripe_cus;       /* The encrypted STRIPE_CUS or NULL.  */
+  char *enc_paypal_payer_id;  /* The encrypted PAYPAL_PAYER_ID or NULL.  */
+  unsigned char digest[ACCOUNT_CACHE_DIGESTLEN]; /* Of the plain values. */
+  char cus_hash[ACCOUNT_KEYHASH_SIZE];   /* Of STRIPE_CUS.  */
+  char payer_hash[ACCOUNT_KEYHASH_SIZE]; /* Of PAYPAL_PAYER_ID.  */
+  int unchanged;              /* The cached values are the same.  */
+};
+
+
+/* Set the timestamp of the row ACCOUNT_ID to DATETIME.  Returns
+ * GPG_ERR_NOT_FOUND if there is no such row.  This must be called by
+ * a storage function.  */
+static gpg_error_t
+touch_account_record (const char *account_id, const char *datetime)
+{
+  gpg_error_t err;
+  int res;
+
+  err = open_account_db ();
+  if (!err)
+    err = storage_begin (account_db);
+  if (err)
+    return err;
 
-  account_id = keyvalue_get_string (dict, "account-id");
-  if (!*account_id)
+  sqlite3_reset (account_touch_stmt);
+  res = sqlite3_bind_text (account_touch_stmt,
+                           1, account_id, -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (account_touch_stmt,
+                             2, datetime, -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_step (account_touch_stmt);
+  if (res != SQLITE_DONE)
     {
-      log_error ("%s: value for 'account-id' missing\n", __func__);
-      err = gpg_error (GPG_ERR_MISSING_VALUE);
-      goto leave;
+      log_error ("error updating account table: %s (%d)\n",
+                 sqlite3_errstr (res), res);
+      return gpg_error (GPG_ERR_GENERAL);
     }
+  if (!sqlite3_changes (account_db))
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  return 0;
+}
 
-  email = keyvalue_get (dict, "Email");
 
-  stripe_cus = keyvalue_get_string (dict, "_stripe_cus");
-  if (*stripe_cus)
+/* Write the pending timestamps of the cache items.  Items whose row
+ * has been deleted by another process are removed from the cache.
+ * This must be called by a storage function.  */
+static gpg_error_t
+write_account_touches (void)
+{
+  gpg_error_t err, firsterr = 0;
+  account_cache_t item, next;
+
+  for (item = cache_lru_head; item && cache_touches; item = next)
     {
-      err = encrypt_string (&enc_stripe_cus, stripe_cus,
-                            (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
-      if (err)
+      next = item->lru_next;
+      if (!*item->touched)
+        continue;
+      err = touch_account_record (item->account_id, item->touched);
+      *item->touched = 0;
+      cache_touches--;
+      if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
         {
-          log_error ("encrypting the Stripe customer_id failed: %s <%s>\n",
-                     gpg_strerror (err), gpg_strsource (err));
-          goto leave;
+          if (opt.verbose)
+            log_info ("account '%s' vanished; removed from the cache\n",
+                      item->account_id);
+          cache_remove (item);
         }
+      else if (err)
+        {
+          cache_remove (item);
+          if (!firsterr)
+            firsterr = err;
+        }
+    }
+  return firsterr;
+}
+
+
+/* Storage function to write the pending timestamps.  */
+static gpg_error_t
+flush_account_touches (void *opaque)
+{
+  (void)opaque;
+  return write_account_touches ();
+}
+
+
+/* Storage function to check whether the values in the update_parm_s
+ * at OPAQUE are the same as in the cache.  If so only the timestamp
+ * of the row needs to be updated, which is deferred; see
+ * write_account_touches.  This is cheap compared to encrypting and
+ * writing the values.  */
+static gpg_error_t
+check_account_cache (void *opaque)
+{
+  struct update_parm_s *parm = opaque;
+  account_cache_t item;
+
+  item = cache_find (parm->account_id);
+  parm->unchanged = (item && !memcmp (item->digest, parm->digest,
+                                       sizeof item->digest));
+  if (!parm->unchanged)
+    {
+      cache_misses++;
+      return 0;
     }
 
-  paypal_payer_id = keyvalue_get_string (dict, "_paypal_payer_id");
-  if (*paypal_payer_id)
+  cache_hits++;
+  if (!*item->touched)
+    cache_touches++;
+  db_datetime_now (item->touched);
+  if (cache_touches >= ACCOUNT_TOUCH_BATCH)
     {
-      err = encrypt_string (&enc_paypal_payer_id, paypal_payer_id,
-                            (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
-      if (err)
-        {
-          log_error ("encrypting the Paypal paper_id failed: %s <%s>\n",
-                     gpg_strerror (err), gpg_strsource (err));
-          goto leave;
-        }
+      write_account_touches ();
+      /* The row may have been deleted by another process.  */
+      if (!cache_find (parm->account_id))
+        parm->unchanged = 0;
     }
+  return 0;
+}
+
+
+/* Storage function to remove the account id at OPAQUE from the
+ * cache.  */
+static gpg_error_t
+invalidate_account_cache (void *opaque)
+{
+  cache_invalidate (opaque);
+  return 0;
+}
+
+
+/* Storage function to update the row described by the update_parm_s
+ * at OPAQUE.  */
+static gpg_error_t
+update_account_record (void *opaque)
+{
+  struct update_parm_s *parm = opaque;
+  gpg_error_t err;
+  int res;
+  char datetime_buf [DB_DATETIME_SIZE];
+
+  err = open_account_db ();
+  if (!err)
+    err = storage_begin (account_db);
+  if (err)
+    goto leave;
 
   sqlite3_reset (account_update_stmt);
 
   res = sqlite3_bind_text (account_update_stmt,
-                           1, account_id, -1,
+                           1, parm->account_id, -1,
                            SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
@@ -406,16 +1104,24 @@ update_account_record (keyvalue_t dict)
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
-                             3, enc_stripe_cus, -1,
+                             3, parm->enc_stripe_cus, -1,
+                             SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (account_update_stmt,
+                             4, parm->email, -1,
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
-                             4, email, -1,
+                             5, parm->enc_paypal_payer_id, -1,
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
-                             5, enc_paypal_payer_id, -1,
+                             6, *parm->cus_hash? parm->cus_hash : NULL, -1,
                              SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (account_update_stmt,
+                             7, *parm->payer_hash? parm->payer_hash : NULL,
+                             -1, SQLITE_TRANSIENT);
   if (res)
     {
       log_error ("error binding a value for the account table: %s\n",
@@ -436,17 +1142,25 @@ update_account_record (keyvalue_t dict)
         err = 0;
     }
   else
-    log_error ("error updating account table: %s [%s (%d)]\n",
-               gpg_strerror (err), sqlite3_errstr (res), res);
+    {
+      err = gpg_error (GPG_ERR_GENERAL);
+      log_error ("error updating account table: %s [%s (%d)]\n",
+                 gpg_strerror (err), sqlite3_errstr (res), res);
+    }
 
  leave:
-  xfree (enc_stripe_cus);
-  xfree (enc_paypal_payer_id);
+  /* Write through to the cache.  On error we can't be sure about the
+   * state of the row and thus drop it from the cache.  */
+  if (!err)
+    cache_put (parm->account_id, parm->digest,
+               parm->cus_hash, parm->payer_hash);
+  else
+    cache_invalidate (parm->account_id);
   return err;
 }
 
 
-
+
 /*
  *   Public API
  */
@@ -461,29 +1175,355 @@ account_new_record (char **r_account_id)
 
   *r_account_id = NULL;
 
-  err = open_account_db ();
+  err = storage_run (new_account_record, r_account_id);
+  if (err && *r_account_id)
+    {
+      /* The commit failed.  */
+      storage_run (invalidate_account_cache, *r_account_id);
+      xfree (*r_account_id);
+      *r_account_id = NULL;
+    }
+
+  return err;
+}
+
+
+/* Update the row specified by 'account-id'.  The following values are
+ * updated if they are in DICT.
+ *
+ *  | DICT name        | account name    | encrypted |
+ *  |------------------+-----------------+-----------|
+ *  | _stripe_cus      | stripe_cus      | yes       |
+ *  | _paypal_payer_id | paypal_payer_id | yes       |
+ *  | Email            | email           | no        |
+ *
+ * The values are encrypted by the encryption workers before the
+ * storage thread is called so that it is not delayed.  Keyed hashes
+ * of the plaintext ids are also stored so that account_find_id can
+ * find the account.
+ */
+gpg_error_t
+account_update_record (keyvalue_t dict)
+{
+  gpg_error_t err, tmperr;
+  struct update_parm_s parm;
+  const char *strings[2];
+  const char *contexts[2];
+  char *cus_context = NULL;
+  char *payer_context = NULL;
+  encrypt_job_t jobs[2];
+  int n;
+
+  memset (&parm, 0, sizeof parm);
+  parm.account_id = keyvalue_get_string (dict, "account-id");
+  if (!*parm.account_id)
+    {
+      log_error ("%s: value for 'account-id' missing\n", __func__);
+      return gpg_error (GPG_ERR_MISSING_VALUE);
+    }
+  parm.email = keyvalue_get (dict, "Email");
+  parm.stripe_cus = keyvalue_get_string (dict, "_stripe_cus");
+  parm.paypal_payer_id = keyvalue_get_string (dict, "_paypal_payer_id");
+  cache_digest (parm.digest, parm.email, parm.stripe_cus,
+                parm.paypal_payer_id);
+  /* The hashes are only used to find the account.  Thus we store
+   * the row without them if they can't be computed.  */
+  err = hash_account_key (parm.cus_hash, parm.stripe_cus);
+  if (!err)
+    err = hash_account_key (parm.payer_hash, parm.paypal_payer_id);
   if (err)
+    {
+      log_error ("error hashing the ids of account '%s': %s\n",
+                 parm.account_id, gpg_strerror (err));
+      *parm.cus_hash = *parm.payer_hash = 0;
+    }
+
+  /* If we wrote the very same values a short time ago there is no
+   * need to do this again.  */
+  err = storage_run (check_account_cache, &parm);
+  if (gpg_err_code (err) == GPG_ERR_GENERAL)
+    storage_run (invalidate_account_cache, (void *)parm.account_id);
+  if (err || parm.unchanged)
     return err;
 
-  err = new_account_record (r_account_id);
-  close_account_db (0);
+  /* Encrypt the values in parallel.  The column and the account are
+   * bound to each value so that it can't be copied to another row.  */
+  cus_context = strconcat ("account.stripe_cus:", parm.account_id, NULL);
+  payer_context = strconcat ("account.paypal_payer_id:", parm.account_id,
+                             NULL);
+  if (!cus_context || !payer_context)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  n = 0;
+  if (*parm.stripe_cus)
+    {
+      strings[n] = parm.stripe_cus;
+      contexts[n++] = cus_context;
+    }
+  if (*parm.paypal_payer_id)
+    {
+      strings[n] = parm.paypal_payer_id;
+      contexts[n++] = payer_context;
+    }
+  err = encrypt_submit_batch (jobs, strings, contexts, n,
+                              (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    goto leave;
 
+  n = 0;
+  if (*parm.stripe_cus)
+    {
+      err = encrypt_wait (jobs[n++], &parm.enc_stripe_cus);
+      if (err)
+        log_error ("encrypting the Stripe customer_id failed: %s <%s>\n",
+                   gpg_strerror (err), gpg_strsource (err));
+    }
+  if (*parm.paypal_payer_id)
+    {
+      tmperr = encrypt_wait (jobs[n++], &parm.enc_paypal_payer_id);
+      if (tmperr)
+        {
+          log_error ("encrypting the Paypal paper_id failed: %s <%s>\n",
+                     gpg_strerror (tmperr), gpg_strsource (tmperr));
+          if (!err)
+            err = tmperr;
+        }
+    }
+  if (err)
+    goto leave;
+
+  err = storage_run (update_account_record, &parm);
+  if (gpg_err_code (err) == GPG_ERR_GENERAL)
+    storage_run (invalidate_account_cache, (void *)parm.account_id);
+
+ leave:
+  xfree (cus_context);
+  xfree (payer_context);
+  xfree (parm.enc_stripe_cus);
+  xfree (parm.enc_paypal_payer_id);
   return err;
 }
 
 
-/* See update_account_record.  */
+/* The arguments for find_account_id.  */
+struct find_parm_s
+{
+  const char *cus_hash;
+  const char *payer_hash;
+  char *account_id;
+};
+
+
+/* Storage function for account_find_id.  */
+static gpg_error_t
+find_account_id (void *opaque)
+{
+  struct find_parm_s *parm = opaque;
+  gpg_error_t err;
+  account_cache_t item;
+  sqlite3_stmt *stmt;
+  const char *s;
+  int res;
+
+  item = cache_find_key (parm->cus_hash, parm->payer_hash);
+  if (item)
+    {
+      cache_hits++;
+      parm->account_id = xtrystrdup (item->account_id);
+      if (!parm->account_id)
+        return gpg_error_from_syserror ();
+      return 0;
+    }
+  cache_misses++;
+
+  err = open_account_db ();
+  if (err)
+    return err;
+
+  stmt = parm->cus_hash? account_find_cus_stmt : account_find_payer_stmt;
+  sqlite3_reset (stmt);
+  res = sqlite3_bind_text (stmt, 1,
+                           parm->cus_hash? parm->cus_hash : parm->payer_hash,
+                           -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_step (stmt);
+  if (res == SQLITE_DONE)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  if (res != SQLITE_ROW)
+    {
+      log_error ("error selecting from the account table: %s (%d)\n",
+                 sqlite3_errstr (res), res);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  s = (const char *)sqlite3_column_text (stmt, 0);
+  parm->account_id = xtrystrdup (s? s : "");
+  sqlite3_reset (stmt);
+  if (!parm->account_id)
+    return gpg_error_from_syserror ();
+  /* We don't know the other values and thus only the hash is
+   * cached.  */
+  cache_put (parm->account_id, NULL, parm->cus_hash, parm->payer_hash);
+  return 0;
+}
+
+
+/* Find the account id for the Stripe customer id STRIPE_CUS or, if
+ * that is NULL, for the Paypal payer id PAYPAL_PAYER_ID.  The lookup
+ * is first done in the cache and then by the hash of the id in the
+ * database.  On success the account id is stored as a malloced string
+ * at R_ACCOUNT_ID; GPG_ERR_NOT_FOUND is returned if the id is not
+ * known.  */
 gpg_error_t
-account_update_record (keyvalue_t dict)
+account_find_id (const char *stripe_cus, const char *paypal_payer_id,
+                 char **r_account_id)
+{
+  gpg_error_t err;
+  struct find_parm_s parm;
+  char hexbuf[ACCOUNT_KEYHASH_SIZE];
+
+  *r_account_id = NULL;
+  if (stripe_cus? !*stripe_cus : (!paypal_payer_id || !*paypal_payer_id))
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  memset (&parm, 0, sizeof parm);
+  err = hash_account_key (hexbuf, stripe_cus? stripe_cus : paypal_payer_id);
+  if (err)
+    return err;
+  if (stripe_cus)
+    parm.cus_hash = hexbuf;
+  else
+    parm.payer_hash = hexbuf;
+
+  err = storage_run (find_account_id, &parm);
+  if (err)
+    xfree (parm.account_id);
+  else
+    *r_account_id = parm.account_id;
+  return err;
+}
+
+
+/* Write the pending timestamps of the account cache.  This is called
+ * by the housekeeping.  */
+void
+account_housekeeping (void)
 {
   gpg_error_t err;
 
+  err = storage_run (flush_account_touches, NULL);
+  if (err)
+    log_error ("error writing the account timestamps: %s\n",
+               gpg_strerror (err));
+}
+
+
+/* Storage function for account_cache_stats.  OPAQUE is an array for
+ * the number of entries, hits and misses.  */
+static gpg_error_t
+get_cache_stats (void *opaque)
+{
+  unsigned long *stats = opaque;
+
+  stats[0] = cache_entries;
+  stats[1] = cache_hits;
+  stats[2] = cache_misses;
+  return 0;
+}
+
+
+/* Store statistics of the account cache at the provided addresses.  */
+void
+account_cache_stats (unsigned int *r_entries,
+                     unsigned long *r_hits, unsigned long *r_misses)
+{
+  unsigned long stats[3];
+
+  memset (stats, 0, sizeof stats);
+  storage_run (get_cache_stats, stats);
+  *r_entries = stats[0];
+  *r_hits = stats[1];
+  *r_misses = stats[2];
+}
+
+
+/* Storage function to copy the next pages of the online backup.
+ * OPAQUE points to an int which is the START flag for db_backup_step
+ * on input and tells whether the backup is still running on
+ * output.  This is run after the commit of a batch because our own
+ * write transaction would block the backup.  */
+static gpg_error_t
+do_backup_step (void *opaque)
+{
+  gpg_error_t err;
+  int *flag = opaque;
+  char *fname;
+  time_t finished = account_backup.finished;
+
   err = open_account_db ();
   if (err)
     return err;
 
-  err = update_account_record (dict);
-  close_account_db (0);
+  fname = strconcat (opt.backup_dir, "/account.db", NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  err = db_backup_step (&account_backup, account_db, fname, *flag,
+                        DB_BACKUP_PAGES);
+  xfree (fname);
+  *flag = !!account_backup.backup;
 
+  /* The hashes in the snapshot are useless without their key.  */
+  if (!err && account_backup.finished != finished)
+    {
+      fname = strconcat (opt.backup_dir, "/account-hash.key", NULL);
+      if (!fname)
+        return gpg_error_from_syserror ();
+      err = load_account_hashkey (NULL);
+      if (!err)
+        err = write_account_hashkey (fname);
+      xfree (fname);
+    }
   return err;
 }
+
+
+/* Copy the next DB_BACKUP_PAGES pages of the account database to
+ * the snapshot in opt.backup_dir.  If START is set and no backup is
+ * running a new backup is started.  Returns true if the backup is
+ * still running.  */
+int
+account_backup_step (int start)
+{
+  int flag = start;
+
+  if (!opt.backup_dir || storage_run_unbatched (do_backup_step, &flag))
+    return 0;
+  return flag;
+}
+
+
+/* Storage function for account_backup_status.  */
+static gpg_error_t
+do_backup_status (void *opaque)
+{
+  char **r_status = opaque;
+
+  *r_status = db_backup_status (&account_backup, "account");
+  return *r_status? 0 : gpg_error_from_syserror ();
+}
+
+
+/* Return a string describing the state of the online backup of the
+ * account database.  The caller must release it using es_free.
+ * Returns NULL on error.  */
+char *
+account_backup_status (void)
+{
+  char *status = NULL;
+
+  if (storage_run (do_backup_status, &status))
+    return NULL;
+  return status;
+}
@@ -22,6 +22,14 @@
 
 gpg_error_t account_new_record (char **r_account_id);
 gpg_error_t account_update_record (keyvalue_t dict);
+gpg_error_t account_find_id (const char *stripe_cus,
+                             const char *paypal_payer_id,
+                             char **r_account_id);
+void account_housekeeping (void);
+void account_cache_stats (unsigned int *r_entries,
+                          unsigned long *r_hits, unsigned long *r_misses);
+int account_backup_step (int start);
+char *account_backup_status (void);
 
 
 #endif /*ACCOUNT_H*/
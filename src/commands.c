@@ -33,6 +33,9 @@
 #include "session.h"
 #include "currency.h"
 #include "preorder.h"
+#include "account.h"
+#include "encrypt.h"
+#include "http.h"
 #include "protocol-io.h"
 #include "mbox-util.h"
 #include "commands.h"
@@ -530,9 +533,9 @@ cmd_chargecard (conn_t conn, char *args)
   keyvalue_t dict = conn->dataitems;
   keyvalue_t kv;
   const char *s;
-  unsigned int cents;
+  money_t cents;
   int decdigs;
-  char *buf = NULL;
+  char amountbuf[AMOUNTBUF_SIZE];
   int recur;
 
   (void)args;
@@ -558,12 +561,12 @@ cmd_chargecard (conn_t conn, char *args)
     }
 
   s = keyvalue_get_string (dict, "Amount");
-  if (!*s || !(cents = convert_amount (s, decdigs)))
+  if (parse_money (s, decdigs, &cents) || cents <= 0)
     {
       set_error (MISSING_VALUE, "Amount missing or invalid");
       goto leave;
     }
-  err = keyvalue_putf (&conn->dataitems, "_amount", "%u", cents);
+  err = keyvalue_putf (&conn->dataitems, "_amount", "%lld", cents);
   dict = conn->dataitems;
   if (err)
     goto leave;
@@ -616,15 +619,16 @@ cmd_chargecard (conn_t conn, char *args)
         goto leave;
     }
 
-  buf = reconvert_amount (keyvalue_get_int (conn->dataitems, "_amount"),
-                          decdigs);
-  if (!buf)
+  /* Stripe returns the charged amount which we convert back.  */
+  if (parse_money (keyvalue_get_string (conn->dataitems, "_amount"), 0,
+                   &cents))
     {
-      err = gpg_error_from_syserror ();
-      conn->errdesc = "error converting _amount";
+      set_error (INV_VALUE, "error converting _amount");
       goto leave;
     }
-  err = keyvalue_put (&conn->dataitems, "Amount", buf);
+  err = keyvalue_put (&conn->dataitems, "Amount",
+                      format_money (amountbuf, sizeof amountbuf,
+                                    cents, decdigs));
   if (err)
     goto leave;
 
@@ -648,7 +652,6 @@ cmd_chargecard (conn_t conn, char *args)
   if (!err)
     write_data_line (keyvalue_find (conn->dataitems, "_timestamp"),
                      conn->stream);
-  es_free (buf);
   return err;
 }
 
@@ -722,6 +725,7 @@ cmd_ppcheckout (conn_t conn, char *args)
   if ((options = has_leading_keyword (args, "prepare")))
     {
       int recur;
+      money_t cents;
 
       /* Get Recurrence value or replace by default.  */
       s = keyvalue_get_string (dict, "Recur");
@@ -744,7 +748,7 @@ cmd_ppcheckout (conn_t conn, char *args)
         }
 
       s = keyvalue_get_string (dict, "Amount");
-      if (!*s || !convert_amount (s, decdigs))
+      if (parse_money (s, decdigs, &cents) || cents <= 0)
         {
           set_error (MISSING_VALUE, "Amount missing or invalid");
           goto leave;
@@ -889,8 +893,8 @@ cmd_sepapreorder (conn_t conn, char *args)
   keyvalue_t dict = conn->dataitems;
   keyvalue_t kv;
   const char *s;
-  unsigned int cents;
-  char *buf = NULL;
+  money_t cents;
+  char amountbuf[AMOUNTBUF_SIZE];
 
   (void)args;
 
@@ -910,23 +914,17 @@ cmd_sepapreorder (conn_t conn, char *args)
     }
 
   s = keyvalue_get_string (dict, "Amount");
-  if (!*s || !(cents = convert_amount (s, 2)))
+  if (parse_money (s, 2, &cents) || cents <= 0)
     {
       set_error (MISSING_VALUE, "Amount missing or invalid");
       goto leave;
     }
-  err = keyvalue_putf (&conn->dataitems, "_amount", "%u", cents);
+  err = keyvalue_putf (&conn->dataitems, "_amount", "%lld", cents);
   dict = conn->dataitems;
   if (err)
     goto leave;
-  buf = reconvert_amount (keyvalue_get_int (conn->dataitems, "_amount"), 2);
-  if (!buf)
-    {
-      err = gpg_error_from_syserror ();
-      conn->errdesc = "error converting _amount";
-      goto leave;
-    }
-  err = keyvalue_put (&conn->dataitems, "Amount", buf);
+  err = keyvalue_put (&conn->dataitems, "Amount",
+                      format_money (amountbuf, sizeof amountbuf, cents, 2));
   if (err)
     goto leave;
 
@@ -950,95 +948,94 @@ cmd_sepapreorder (conn_t conn, char *args)
     if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
       write_data_line (kv, conn->stream);
 
-  es_free (buf);
   return err;
 }
 
 
-/* The COMMITPREORDER command updates a preorder record and logs the data.
-
-   Sepa-Ref:   The key referencing the preorder
-   Amount:     The actual amount of the payment.
-   Currency:   If given its value must be EUR.
-   Recur:      Optional: '*' indicates that the SEPA data indicates
-               a recurring donation of any kind.  Any other valid value
-               forces the use of that value.
-
-   On success these items are returned:
-
-   Sepa-Ref:   The Sepa-Ref string
-   XXX:        FIXME:
-
- */
+/* Check and normalize the Sepa-Ref, Recur, Currency, and Amount items
+   at DICTP as used by COMMITPREORDER.  On error a description is
+   stored at R_ERRDESC.  */
 static gpg_error_t
-cmd_commitpreorder (conn_t conn, char *args)
+check_commit_data (keyvalue_t *dictp, const char **r_errdesc)
 {
   gpg_error_t err;
-  keyvalue_t dict = conn->dataitems;
-  unsigned int cents;
-  keyvalue_t kv;
+  money_t cents;
   const char *s;
-  char *buf = NULL;
+  char amountbuf[AMOUNTBUF_SIZE];
   int recur = 0;
 
-  (void)args;
-
-  s = keyvalue_get_string (dict, "Sepa-Ref");
+  s = keyvalue_get_string (*dictp, "Sepa-Ref");
   if (!*s)
     {
-      set_error (MISSING_VALUE, "Key 'Sepa-Ref' not given");
-      goto leave;
+      *r_errdesc = "Key 'Sepa-Ref' not given";
+      return gpg_error (GPG_ERR_MISSING_VALUE);
     }
 
   /* Check recurrance parameter  */
-  s = keyvalue_get_string (dict, "Recur");
+  s = keyvalue_get_string (*dictp, "Recur");
   if (!*s || !strcmp (s, "*"))
     ; /* None or 'any kind'.  */
   else if (!valid_recur_p (s, &recur))
     {
-      set_error (MISSING_VALUE, "Invalid value for 'Recur'");
-      goto leave;
+      *r_errdesc = "Invalid value for 'Recur'";
+      return gpg_error (GPG_ERR_MISSING_VALUE);
     }
 
   /* Get currency and amount.  */
-  s = keyvalue_get (dict, "Currency");
+  s = keyvalue_get (*dictp, "Currency");
   if (!s)
     {
-      err = keyvalue_put (&conn->dataitems, "Currency", "EUR");
+      err = keyvalue_put (dictp, "Currency", "EUR");
       if (err)
-        goto leave;
-      dict = conn->dataitems;
+        return err;
     }
   else if (strcasecmp (s, "EUR"))
     {
-      set_error (INV_VALUE, "Currency must be \"EUR\" if given");
-      goto leave;
+      *r_errdesc = "Currency must be \"EUR\" if given";
+      return gpg_error (GPG_ERR_INV_VALUE);
     }
 
-  s = keyvalue_get_string (dict, "Amount");
-  if (!*s || !(cents = convert_amount (s, 2)))
+  s = keyvalue_get_string (*dictp, "Amount");
+  if (parse_money (s, 2, &cents) || cents <= 0)
     {
-      set_error (MISSING_VALUE, "Amount missing or invalid");
-      goto leave;
+      *r_errdesc = "Amount missing or invalid";
+      return gpg_error (GPG_ERR_MISSING_VALUE);
     }
-  err = keyvalue_putf (&conn->dataitems, "_amount", "%u", cents);
-  dict = conn->dataitems;
-  if (err)
-    goto leave;
-  buf = reconvert_amount (keyvalue_get_int (conn->dataitems, "_amount"), 2);
-  if (!buf)
-    {
-      err = gpg_error_from_syserror ();
-      conn->errdesc = "error converting _amount";
-      goto leave;
-    }
-  err = keyvalue_put (&conn->dataitems, "Amount", buf);
+  err = keyvalue_putf (dictp, "_amount", "%lld", cents);
   if (err)
-    goto leave;
+    return err;
+  return keyvalue_put (dictp, "Amount",
+                       format_money (amountbuf, sizeof amountbuf, cents, 2));
+}
 
-  err = preorder_update_record (&conn->dataitems);
 
- leave:
+/* The COMMITPREORDER command updates a preorder record and logs the data.
+
+   Sepa-Ref:   The key referencing the preorder
+   Amount:     The actual amount of the payment.
+   Currency:   If given its value must be EUR.
+   Recur:      Optional: '*' indicates that the SEPA data indicates
+               a recurring donation of any kind.  Any other valid value
+               forces the use of that value.
+
+   On success these items are returned:
+
+   Sepa-Ref:   The Sepa-Ref string
+   XXX:        FIXME:
+
+ */
+static gpg_error_t
+cmd_commitpreorder (conn_t conn, char *args)
+{
+  gpg_error_t err;
+  keyvalue_t kv;
+
+  (void)args;
+
+  err = check_commit_data (&conn->dataitems, &conn->errdesc);
+  if (!err)
+    err = preorder_update_record (&conn->dataitems);
+
   if (err)
     {
       write_err_line (err, conn->errdesc, conn->stream);
@@ -1055,7 +1052,113 @@ cmd_commitpreorder (conn_t conn, char *args)
           write_data_line (kv, conn->stream);
     }
 
-  es_free (buf);
+  return err;
+}
+
+
+/* The COMMITPREORDERS command updates several preorder records in a
+   single transaction and logs the data.  It is used to reconcile a
+   bank statement.
+
+   Count:       The number of records.
+   Sepa-Ref[n]: The key referencing the preorder.  N starts at 0.
+   Amount[n]:   The actual amount of the payment.
+   Currency[n]: If given its value must be EUR.
+   Recur[n]:    Optional; see COMMITPREORDER.
+
+   On success these items are returned:
+
+   Count:       The number of records.
+   Committed:   The number of committed records.
+   Failure[n]:  A message for each record which has not been committed.
+
+ */
+static gpg_error_t
+cmd_commitpreorders (conn_t conn, char *args)
+{
+  static const char *names[] = { "Sepa-Ref", "Amount", "Currency", "Recur" };
+  gpg_error_t err = 0;
+  keyvalue_t *items = NULL;
+  gpg_error_t *errs = NULL;
+  const char *errdesc;
+  unsigned int n, count, committed;
+  keyvalue_t kv;
+  char key[40];
+  const char *s;
+  int j;
+
+  (void)args;
+
+  count = keyvalue_get_uint (conn->dataitems, "Count");
+  for (n=0, kv = conn->dataitems; kv; kv = kv->next)
+    n++;
+  if (!count || count > n)
+    {
+      set_error (MISSING_VALUE, "Key 'Count' not given or invalid");
+      goto leave;
+    }
+  items = xtrycalloc (count, sizeof *items);
+  errs = xtrycalloc (count, sizeof *errs);
+  if (!items || !errs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  /* Split the request into one dictionary per record.  */
+  for (n=0; n < count && !err; n++)
+    {
+      for (j=0; j < DIM (names) && !err; j++)
+        {
+          snprintf (key, sizeof key, "%s[%u]", names[j], n);
+          s = keyvalue_get (conn->dataitems, key);
+          if (s)
+            err = keyvalue_put (items + n, names[j], s);
+        }
+      if (!err)
+        {
+          errdesc = NULL;
+          errs[n] = check_commit_data (items + n, &errdesc);
+          if (errs[n] && errdesc)
+            err = keyvalue_put (items + n, "failure-mesg", errdesc);
+        }
+    }
+  if (err)
+    goto leave;
+
+  /* Records which failed the check are skipped.  */
+  err = preorder_update_records (items, errs, count);
+
+ leave:
+  if (err)
+    write_err_line (err, conn->errdesc, conn->stream);
+  else
+    {
+      write_ok_line (conn->stream);
+      snprintf (key, sizeof key, "%u", count);
+      write_data_line_direct ("Count", key, conn->stream);
+      for (committed=n=0; n < count; n++)
+        if (!errs[n])
+          committed++;
+      snprintf (key, sizeof key, "%u", committed);
+      write_data_line_direct ("Committed", key, conn->stream);
+      for (n=0; n < count; n++)
+        if (errs[n])
+          {
+            snprintf (key, sizeof key, "Failure[%u]", n);
+            s = keyvalue_get (items[n], "failure-mesg");
+            write_data_line_direct (key, s? s : gpg_strerror (errs[n]),
+                                    conn->stream);
+          }
+    }
+
+  if (items)
+    {
+      for (n=0; n < count; n++)
+        keyvalue_release (items[n]);
+      xfree (items);
+    }
+  xfree (errs);
   return err;
 }
 
@@ -1112,10 +1215,17 @@ cmd_getpreorder (conn_t conn, char *args)
 }
 
 
-/* The LISTPREORDER command retrieves a record from the preorder table.
+/* The LISTPREORDER command retrieves records from the preorder table.
+
+   Refnn:      The reference suffix (-NN).
+   Unpaid:     If not 0 list only records which have not been paid.
+   Paid-Since: List only records last paid at or after this date.
+   Paid-Before:List only records last paid before this date.
+   Email:      List only records with this mail address.
 
-   Refnn:      The reference suffix (-NN).  If this is not given all
-               records are listed in reverse chronological order.
+   Only one of these items may be given.  If none is given all records
+   are listed in reverse chronological order.  Dates are given as
+   "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS".
 
    On success these items are returned:
 
@@ -1163,6 +1273,56 @@ cmd_listpreorder (conn_t conn, char *args)
 
 
 
+/* The FINDACCOUNT command looks up the account of a customer.
+
+   Stripe-Cus:   The Stripe customer id.
+   Paypal-Payer: The Paypal payer id.
+
+   Exactly one of these items must be given.
+
+   On success this item is returned:
+
+   Account-Id:   The account id.
+
+ */
+static gpg_error_t
+cmd_findaccount (conn_t conn, char *args)
+{
+  gpg_error_t err;
+  keyvalue_t dict = conn->dataitems;
+  const char *cus, *payer;
+  char *account_id = NULL;
+
+  (void)args;
+
+  cus = keyvalue_get_string (dict, "Stripe-Cus");
+  payer = keyvalue_get_string (dict, "Paypal-Payer");
+  if (!*cus == !*payer)
+    {
+      set_error (MISSING_VALUE,
+                 "Exactly one of 'Stripe-Cus' or 'Paypal-Payer' required");
+      goto leave;
+    }
+
+  err = account_find_id (*cus? cus : NULL, payer, &account_id);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    conn->errdesc = "No such account";
+
+ leave:
+  if (err)
+    write_err_line (err, conn->errdesc, conn->stream);
+  else
+    {
+      write_ok_line (conn->stream);
+      write_data_line_direct ("Account-Id", account_id, conn->stream);
+    }
+
+  xfree (account_id);
+  return err;
+}
+
+
+
 /* The CHECKAMOUNT command checks whether a given amount is within the
  * configured limits for payment.  It may eventually provide
  * additional options.  The following values are expected in the
@@ -1190,7 +1350,7 @@ cmd_checkamount (conn_t conn, char *args)
   keyvalue_t kv;
   const char *curr;
   const char *s;
-  unsigned int cents;
+  money_t cents;
   int decdigs;
   char amountbuf[AMOUNTBUF_SIZE];
   int recur;
@@ -1221,7 +1381,7 @@ cmd_checkamount (conn_t conn, char *args)
     }
 
   s = keyvalue_get_string (dict, "Amount");
-  if (!*s || !(cents = convert_amount (s, decdigs)))
+  if (parse_money (s, decdigs, &cents) || cents <= 0)
     {
       set_error (MISSING_VALUE, "Amount missing or invalid");
       goto leave;
@@ -1234,7 +1394,7 @@ cmd_checkamount (conn_t conn, char *args)
   if (err)
     goto leave;
 
-  err = keyvalue_putf (&conn->dataitems, "_amount", "%u", cents);
+  err = keyvalue_putf (&conn->dataitems, "_amount", "%lld", cents);
   dict = conn->dataitems;
   if (err)
     goto leave;
@@ -1309,6 +1469,74 @@ cmd_getinfo (conn_t conn, char *args)
       else
         write_err_line (179, "running in test mode", conn->stream);
     }
+  else if (has_leading_keyword (args, "preorder-refs"))
+    {
+      gpg_error_t err;
+      unsigned int used, total;
+
+      err = preorder_ref_usage (&used, &total);
+      if (err)
+        write_err_line (err, NULL, conn->stream);
+      else
+        write_ok_linef (conn->stream, "%u %u %u%%", used, total,
+                        (unsigned int)((unsigned long long)used * 100 / total));
+    }
+  else if (has_leading_keyword (args, "account-cache"))
+    {
+      unsigned int entries;
+      unsigned long hits, misses;
+
+      account_cache_stats (&entries, &hits, &misses);
+      write_ok_linef (conn->stream, "%u %lu %lu", entries, hits, misses);
+    }
+  else if (has_leading_keyword (args, "crypto-queue"))
+    {
+      unsigned int depth, max_depth, busy;
+      unsigned long jobs;
+
+      encrypt_queue_stats (&depth, &max_depth, &busy, &jobs);
+      write_ok_linef (conn->stream, "%u %u %u %lu",
+                      depth, max_depth, busy, jobs);
+    }
+  else if (has_leading_keyword (args, "http-pool"))
+    {
+      unsigned int idle;
+      unsigned long opened, reused;
+
+      http_pool_stats (&idle, &opened, &reused);
+      write_ok_linef (conn->stream, "%u %lu %lu", idle, opened, reused);
+    }
+  else if (has_leading_keyword (args, "tls-cache"))
+    {
+      unsigned int entries;
+      unsigned long handshakes, resumed;
+
+      http_tls_stats (&entries, &handshakes, &resumed);
+      write_ok_linef (conn->stream, "%u %lu %lu",
+                      entries, handshakes, resumed);
+    }
+  else if (has_leading_keyword (args, "dns-cache"))
+    {
+      unsigned int entries;
+      unsigned long hits, misses;
+
+      http_dns_stats (&entries, &hits, &misses);
+      write_ok_linef (conn->stream, "%u %lu %lu", entries, hits, misses);
+    }
+  else if (has_leading_keyword (args, "backup"))
+    {
+      char *status;
+
+      write_ok_line (conn->stream);
+      status = preorder_backup_status ();
+      if (status)
+        write_rem_line (status, conn->stream);
+      es_free (status);
+      status = account_backup_status ();
+      if (status)
+        write_rem_line (status, conn->stream);
+      es_free (status);
+    }
   else
     {
       write_err_line (1, "Unknown sub-command", conn->stream);
@@ -1321,6 +1549,20 @@ cmd_getinfo (conn_t conn, char *args)
                       conn->stream);
       write_rem_line ("  live               Returns OK if in live mode",
                       conn->stream);
+      write_rem_line ("  preorder-refs      Show the number of used Sepa-Refs",
+                      conn->stream);
+      write_rem_line ("  account-cache      Show entries, hits and misses"
+                      " of the account cache", conn->stream);
+      write_rem_line ("  backup             Show the state of the backups",
+                      conn->stream);
+      write_rem_line ("  crypto-queue       Show queued and max. queued jobs,"
+                      " busy workers and completed jobs", conn->stream);
+      write_rem_line ("  http-pool          Show idle, opened and reused"
+                      " provider connections", conn->stream);
+      write_rem_line ("  tls-cache          Show cached TLS sessions, TLS"
+                      " handshakes and resumed sessions", conn->stream);
+      write_rem_line ("  dns-cache          Show cached host names, cache"
+                      " hits and lookups", conn->stream);
     }
 
   return 0;
@@ -1370,8 +1612,10 @@ static struct
     { "GETINFO",        cmd_getinfo },
     { "PING",           cmd_ping },
     { "COMMITPREORDER", cmd_commitpreorder, 1 },
+    { "COMMITPREORDERS", cmd_commitpreorders, 1 },
     { "GETPREORDER",    cmd_getpreorder, 1 },
     { "LISTPREORDER",   cmd_listpreorder, 1 },
+    { "FINDACCOUNT",    cmd_findaccount, 1 },
     { "SHUTDOWN",       cmd_shutdown, 1 },
     { "HELP",           cmd_help },
     { NULL, NULL}
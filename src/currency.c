@@ -23,6 +23,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "payprocd.h"
 #include "util.h"
@@ -35,31 +36,377 @@
 static const char euroxref_fname[] = "/var/lib/payproc/euroxref.dat";
 
 
-/* The list of supported currencies  */
-static struct
+/* A supported currency.  */
+struct currency_s
 {
   const char *name;
   unsigned char decdigits;
   const char *desc;
-  double rate;     /* Exchange rate to Euro.  */
-} currency_table[] = {
-  { "EUR", 2, "Euro", 1.0 },  /* Must be the first entry! */
+};
+
+/* The default list of supported currencies.  */
+static struct currency_s default_currencies[] = {
+  { "EUR", 2, "Euro" },  /* Must be the first entry! */
   { "USD", 2, "US Dollar" },
   { "GBP", 2, "British Pound" },
   { "JPY", 0, "Yen" }
 };
 
+/* The maximum number of currencies.  */
+#define MAX_CURRENCIES 255
+
+/* The list of supported currencies.  This is either the default list
+ * or the list read by read_currency_file at startup.  It is not
+ * changed later.  */
+static struct currency_s *currency_table = default_currencies;
+static int currency_count = DIM (default_currencies);
+
+/* Map from a packed currency code to its index in currency_table plus
+ * one.  Built on first use.  */
+#define CODE_SPACE (26*26*26)
+static unsigned char currency_index[CODE_SPACE];
+static int currency_index_ready;
+
+
+/* Exchange rates are also stored as integers scaled by RATE_SCALE so
+ * that conversions are exact.  */
+#define RATE_DIGITS 6
+#define RATE_SCALE  1000000
+
+/* An exchange rate to Euro.  */
+struct rate_s
+{
+  double value;    /* For display.  */
+  money_t scaled;  /* VALUE * RATE_SCALE.  */
+};
+
+/* The exchange rates to Euro indexed like currency_table.  A table is
+ * never modified after it has been published by setting RATE_TABLE;
+ * readers just take the pointer and thus need no lock.  Pointer
+ * stores are atomic and under npth only one thread runs at a time
+ * anyway.  A replaced table is kept until the next replacement in
+ * case a reader was interrupted while using it.  Until the first
+ * table has been read only the rate for Euro is known.  */
+struct rate_table_s
+{
+  struct rate_table_s *prev;  /* The table replaced by this one.  */
+  time_t mtime;               /* The mtime and size of the file  */
+  off_t size;                 /* used for this table.            */
+  struct rate_s rate[1];      /* Actually CURRENCY_COUNT items.  */
+};
+static struct rate_table_s *rate_table;
+
+
+
+/* Return the currency code STRING packed into an integer below
+ * CODE_SPACE or -1 if STRING is not a 3 letter code.  Case is
+ * ignored.  */
+static int
+pack_code (const char *string)
+{
+  int i, c, code = 0;
+
+  for (i=0; i < 3; i++)
+    {
+      c = ((const unsigned char *)string)[i];
+      if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+      if (!(c >= 'A' && c <= 'Z'))
+        return -1;
+      code = code * 26 + (c - 'A');
+    }
+  if (string[3])
+    return -1;
+  return code;
+}
+
+
+/* Build the index for currency_table.  */
+static void
+build_currency_index (void)
+{
+  int i;
+
+  memset (currency_index, 0, sizeof currency_index);
+  for (i=0; i < currency_count; i++)
+    currency_index[pack_code (currency_table[i].name)] = i + 1;
+  currency_index_ready = 1;
+}
+
+
+/* Return the exchange rate for the currency with index IDX from the
+ * current table.  */
+static struct rate_s
+get_rate (int idx)
+{
+  static const struct rate_s euro = { 1.0, RATE_SCALE };
+  static const struct rate_s none = { 0.0, 0 };
+  struct rate_table_s *tbl = rate_table;
+
+  if (tbl)
+    return tbl->rate[idx];
+  return idx? none : euro;
+}
+
+
+/* Convert the amount VALUE given in minor units of a currency with
+ * DECDIGITS digits after the decimal point to Euro cents using the
+ * exchange rate SCALED_RATE and store the result at R_CENTS.  The
+ * result is exact and rounded half away from zero.  Returns an error
+ * if the result does not fit into a money_t.  */
+static gpg_error_t
+convert_money (money_t value, int decdigits, money_t scaled_rate,
+               money_t *r_cents)
+{
+  unsigned long long num, div, quot, rem;
+  int i, negative;
+
+  *r_cents = 0;
+  if (scaled_rate <= 0 || scaled_rate > 10000 * (money_t)RATE_SCALE
+      || decdigits < 0 || decdigits > 6)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  /* We need VALUE * 100 * RATE_SCALE / (SCALED_RATE * 10^DECDIGITS).
+   * The numerator may not fit into 64 bits; thus we do a long
+   * division in base 100 over the 4 factors of 100 in the numerator.
+   * With SCALED_RATE up to 10^10 the remainder times 100 fits.  */
+  negative = value < 0;
+  num = negative? -(unsigned long long)value : (unsigned long long)value;
+  div = scaled_rate;
+  for (i=0; i < decdigits; i++)
+    div *= 10;
+
+  quot = num / div;
+  rem  = num % div;
+  for (i=0; i < 4; i++)  /* 100 * RATE_SCALE == 100^4 */
+    {
+      if (quot > 92233720368547758ULL)
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      rem *= 100;
+      quot = quot * 100 + rem / div;
+      rem %= div;
+    }
+  if (rem >= div - rem)
+    quot++;  /* Round half away from zero.  */
+  if (quot > 9223372036854775807ULL)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  *r_cents = negative? -(money_t)quot : (money_t)quot;
+  return 0;
+}
+
+
+/* Return the index of CURRENCY in the currency table or -1 if it is
+   not known.  */
+static int
+find_currency (const char *currency)
+{
+  int code;
+
+  code = pack_code (currency);
+  if (code == -1)
+    return -1;
+  if (!currency_index_ready)
+    build_currency_index ();
+  return currency_index[code] - 1;
+}
+
+
+/* Read the list of supported currencies from FNAME.  Each line has
+ * the ISO 4217 code, the number of digits after the decimal point,
+ * and a description:
+ *
+ *   EUR 2 Euro
+ *   JPY 0 Yen
+ *
+ * Empty lines and lines starting with a '#' are ignored.  The Euro
+ * must be listed.  This function may only be called at startup.  On
+ * error the default list is kept and an error code returned.  */
+gpg_error_t
+read_currency_file (const char *fname)
+{
+  gpg_error_t err = 0;
+  estream_t fp;
+  struct currency_s *tbl;
+  int count = 0;
+  int lnr = 0;
+  int n, c, i, digits;
+  char line[256];
+  char *p, *pend, *name;
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error opening '%s': %s\n", fname, gpg_strerror (err));
+      return err;
+    }
+
+  tbl = xtrycalloc (MAX_CURRENCIES, sizeof *tbl);
+  if (!tbl)
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      return err;
+    }
+
+  while (!err && es_fgets (line, DIM(line)-1, fp))
+    {
+      lnr++;
+
+      n = strlen (line);
+      if (n && line[n-1] != '\n' && es_feof (fp))
+        ; /* The last line may lack the LF.  */
+      else if (!n || line[n-1] != '\n')
+        {
+          /* Eat until end of line. */
+          while ((c=es_getc (fp)) != EOF && c != '\n')
+            ;
+          err = gpg_error (*line? GPG_ERR_LINE_TOO_LONG
+                           : GPG_ERR_INCOMPLETE_LINE);
+          log_error ("error reading '%s', line %d: %s\n",
+                     fname, lnr, gpg_strerror (err));
+          break;
+        }
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+
+      /* Parse the code.  */
+      name = line;
+      for (p = name; *p && !spacep (p); p++)
+        ;
+      if (*p)
+        *p++ = 0;
+      if (pack_code (name) == -1)
+        {
+          log_error ("error parsing '%s', line %d: %s\n",
+                     fname, lnr, "invalid currency code");
+          err = gpg_error (GPG_ERR_INV_VALUE);
+          break;
+        }
+      ascii_strupr (name);
+      for (i=0; i < count; i++)
+        if (!strcmp (tbl[i].name, name))
+          break;
+      if (i < count)
+        {
+          log_error ("error parsing '%s', line %d: %s\n",
+                     fname, lnr, "duplicate currency code");
+          err = gpg_error (GPG_ERR_INV_VALUE);
+          break;
+        }
+      if (count == MAX_CURRENCIES)
+        {
+          log_error ("error parsing '%s', line %d: %s\n",
+                     fname, lnr, "too many currencies");
+          err = gpg_error (GPG_ERR_TOO_LARGE);
+          break;
+        }
+
+      /* Parse the number of digits.  */
+      while (spacep (p))
+        p++;
+      digits = strtol (p, &pend, 10);
+      if (pend == p || digits < 0 || digits > 4 || (*pend && !spacep (pend)))
+        {
+          log_error ("error parsing '%s', line %d: %s\n",
+                     fname, lnr, "invalid number of digits");
+          err = gpg_error (GPG_ERR_INV_VALUE);
+          break;
+        }
+      p = pend;
+      while (spacep (p))
+        p++;
 
+      tbl[count].name = xtrystrdup (name);
+      tbl[count].desc = xtrystrdup (*p? p : name);
+      if (!tbl[count].name || !tbl[count].desc)
+        {
+          err = gpg_error_from_syserror ();
+          xfree ((char *)tbl[count].name);
+          xfree ((char *)tbl[count].desc);
+          break;
+        }
+      tbl[count].decdigits = digits;
+      count++;
+    }
+  if (!err && es_ferror (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+    }
+  es_fclose (fp);
+
+  /* Move the Euro to the first entry.  */
+  if (!err)
+    {
+      for (i=0; i < count; i++)
+        if (!strcmp (tbl[i].name, "EUR"))
+          break;
+      if (i == count)
+        {
+          log_error ("error parsing '%s': %s\n", fname, "EUR missing");
+          err = gpg_error (GPG_ERR_MISSING_VALUE);
+        }
+      else if (i)
+        {
+          struct currency_s tmp = tbl[0];
+          tbl[0] = tbl[i];
+          tbl[i] = tmp;
+        }
+    }
+
+  if (err)
+    {
+      for (i=0; i < count; i++)
+        {
+          xfree ((char *)tbl[i].name);
+          xfree ((char *)tbl[i].desc);
+        }
+      xfree (tbl);
+      return err;
+    }
+
+  currency_table = tbl;
+  currency_count = count;
+  build_currency_index ();
+  return 0;
+}
+
+
+/* Read the exchange rates from the euroxref file if it has been
+ * changed since the last call and publish them.  */
 void
 read_exchange_rates (void)
 {
+  static int stat_failed;
   gpg_error_t err = 0;
   estream_t fp;
+  struct stat st;
+  struct rate_table_s *oldtbl, *newtbl;
   int lnr = 0;
   int n, c, idx;
   char line[256];
   char *p, *pend;
   double rate;
+  money_t scaled;
+
+  if (stat (euroxref_fname, &st))
+    {
+      /* We are called every few minutes; thus print the error only
+       * once.  */
+      err = gpg_error_from_syserror ();
+      if (!stat_failed)
+        log_error ("error accessing '%s': %s\n",
+                   euroxref_fname, gpg_strerror (err));
+      stat_failed = 1;
+      return;
+    }
+  stat_failed = 0;
+  oldtbl = rate_table;
+  if (oldtbl && oldtbl->mtime == st.st_mtime && oldtbl->size == st.st_size)
+    return;  /* Not changed.  */
 
   fp = es_fopen (euroxref_fname, "r");
   if (!fp)
@@ -70,6 +417,22 @@ read_exchange_rates (void)
       return;
     }
 
+  /* Rates not in the file keep their last known value.  */
+  newtbl = xtrycalloc (1, (sizeof *newtbl
+                           + (currency_count - 1) * sizeof newtbl->rate[0]));
+  if (!newtbl)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n",
+                 euroxref_fname, gpg_strerror (err));
+      es_fclose (fp);
+      return;
+    }
+  for (idx=0; idx < currency_count; idx++)
+    newtbl->rate[idx] = get_rate (idx);
+  newtbl->mtime = st.st_mtime;
+  newtbl->size = st.st_size;
+
   while (es_fgets (line, DIM(line)-1, fp))
     {
       lnr++;
@@ -113,16 +476,16 @@ read_exchange_rates (void)
           continue;
         }
 
-      /* Note that we start at 1 to skip the first entry which is
-         EUR.  */
-      for (idx=1; idx < DIM(currency_table); idx++)
-        if (!strcasecmp (currency_table[idx].name, p))
-          break;
-      if (!(idx < DIM(currency_table)))
+      /* Note that the first entry is EUR which has a fixed rate.  */
+      idx = find_currency (p);
+      if (idx < 1)
         continue; /* Currency not supported.  */
 
       /* Parse the rate. */
       p = pend;
+      trim_spaces (p);
+      if (parse_money (p, RATE_DIGITS, &scaled))
+        scaled = 0;  /* Fixed below.  */
       errno = 0;
       rate = strtod (p, &pend);
       if ((!rate && p == pend) || errno || rate <= 0.0 || rate > 10000.0)
@@ -131,44 +494,47 @@ read_exchange_rates (void)
                      euroxref_fname, lnr, "invalid exchange rate");
           continue;
         }
-      p = pend;
-      trim_spaces (p);
-      if (*p)
+      if (*pend)
         {
           log_error ("error parsing '%s', line %d: %s\n",
                      euroxref_fname, lnr, "garbage after exchange rate");
           continue;
         }
+      if (scaled <= 0)
+        scaled = (money_t)(rate * RATE_SCALE + 0.5);  /* Too many digits.  */
+      if (scaled <= 0)
+        {
+          log_error ("error parsing '%s', line %d: %s\n",
+                     euroxref_fname, lnr, "invalid exchange rate");
+          continue;
+        }
 
-      /* Update the tbale.  */
-      if (currency_table[idx].rate != rate)
+      /* Update the new table.  */
+      if (newtbl->rate[idx].scaled != scaled)
         {
-          if (!currency_table[idx].rate)
+          if (!newtbl->rate[idx].scaled)
             log_info ("setting exchange rate for %s to %.4f\n",
                       currency_table[idx].name, rate);
           else
             log_info ("changing exchange rate for %s from %.4f to %.4f\n",
-                      currency_table[idx].name, currency_table[idx].rate, rate);
+                      currency_table[idx].name, newtbl->rate[idx].value, rate);
 
-          currency_table[idx].rate = rate;
+          newtbl->rate[idx].value = rate;
+          newtbl->rate[idx].scaled = scaled;
           jrnl_store_exchange_rate_record (currency_table[idx].name, rate);
         }
     }
 
   es_fclose (fp);
-}
-
 
-/* Return the exchange rate for CURRENCY or 0.0 is not known.  */
-static double
-get_exchange_rate (const char *currency)
-{
-  int i;
-
-  for (i=0; i < DIM(currency_table); i++)
-    if (!strcasecmp (currency, currency_table[i].name))
-      return currency_table[i].rate;
-  return 0.0;
+  /* Publish the new table and release the one replaced last time.  */
+  newtbl->prev = oldtbl;
+  rate_table = newtbl;
+  if (oldtbl)
+    {
+      xfree (oldtbl->prev);
+      oldtbl->prev = NULL;
+    }
 }
 
 
@@ -178,15 +544,13 @@ get_exchange_rate (const char *currency)
 int
 valid_currency_p (const char *string, int *r_decdigits)
 {
-  int i;
+  int idx;
 
-  for (i=0; i < DIM(currency_table); i++)
-    if (!strcasecmp (string, currency_table[i].name))
-      {
-        *r_decdigits = currency_table[i].decdigits;
-        return 1;
-      }
-  return 0;
+  idx = find_currency (string);
+  if (idx < 0)
+    return 0;
+  *r_decdigits = currency_table[idx].decdigits;
+  return 1;
 }
 
 
@@ -197,62 +561,56 @@ valid_currency_p (const char *string, int *r_decdigits)
 const char *
 get_currency_info (int seq, char const **r_desc, double *r_rate)
 {
-  if (seq < 0 || seq >= DIM (currency_table))
+  if (seq < 0 || seq >= currency_count)
     return NULL;
   if (r_desc)
     *r_desc = currency_table[seq].desc;
   if (r_rate)
-    *r_rate = currency_table[seq].rate;
+    *r_rate = get_rate (seq).value;
   return currency_table[seq].name;
 }
 
 
 /* Convert (AMOUNT, CURRENCY) to an Euro amount and store it in BUFFER
    up to a length of BUFSIZE-1.  Returns BUFFER.  If a conversion is
-   not possible an empty string is returned. */
+   not possible an empty string is returned.  The amount is parsed
+   into minor units and converted using the integer exchange rate so
+   that the result is exact up to the rounding to the nearest cent.
+   This does not allocate memory.  */
 char *
 convert_currency (char *buffer, size_t bufsize,
                   const char *currency, const char *amount)
 {
-  double value, rate;
-  char *pend;
+  gpg_error_t err;
+  int idx, decdigits;
+  money_t value, scaled_rate;
 
-  if (!bufsize)
+  if (bufsize < AMOUNTBUF_SIZE)
     log_bug ("buffer too short in convert_currency\n");
 
   *buffer = 0;
-  errno = 0;
-  value = strtod (amount, &pend);
-  if ((!value && amount == pend) || errno)
-    {
-      log_error ("error converting %s %s to Euro: %s\n",
-                 amount, currency, strerror (errno));
-      return buffer;
-    }
-
-  rate = get_exchange_rate (currency);
-  if (!rate)
+  idx = find_currency (currency);
+  scaled_rate = idx < 0? 0 : get_rate (idx).scaled;
+  if (!scaled_rate)
     {
       if (opt.verbose)
         log_info ("error converting %s %s to Euro: %s\n",
                   amount, currency, "no exchange rate available");
       return buffer;
     }
-  if (rate != 1.0)
-    {
-      value /= rate;
-      value += 0.005; /* So that snprintf rounds the value. */
-    }
 
-  if (gpgrt_snprintf (buffer, bufsize, "%.2f", value) < 0)
+  decdigits = currency_table[idx].decdigits;
+  err = parse_money (amount, decdigits, &value);
+  if (!err && (scaled_rate != RATE_SCALE || decdigits != 2))
+    err = convert_money (value, decdigits, scaled_rate, &value);
+  if (err)
     {
       log_error ("error converting %s %s to Euro: %s\n",
-                 amount, currency, strerror (errno));
-      *buffer = 0;
+                 amount, currency, gpg_strerror (err));
       return buffer;
     }
 
-  return buffer;
+  return format_money (buffer, bufsize, value, 2);
 }
 
 
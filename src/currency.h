@@ -20,6 +20,7 @@
 #ifndef CURRENCY_H
 #define CURRENCY_H
 
+gpg_error_t read_currency_file (const char *fname);
 void read_exchange_rates (void);
 
 int valid_currency_p (const char *string, int *r_decdigits);
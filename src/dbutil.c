@@ -19,12 +19,22 @@
 
 #include <config.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <sqlite3.h>
 
+#ifdef WITHOUT_NPTH /* Give the Makefile a chance to build without Pth.  */
+# undef USE_NPTH
+#endif
+
+#ifdef USE_NPTH
+# include <npth.h>
+#endif
+
 #include "util.h"
 #include "logging.h"
 #include "payprocd.h"
@@ -61,3 +71,281 @@ db_datetime_now (char *buffer)
 
   return buffer;
 }
+
+
+/* Switch the database DB to the WAL journal mode.  In this mode
+   readers using their own connections do not block the writer and
+   vice versa.  The mode is persistent and thus only the connection
+   creating the database needs to do this.  DBNAME is used for
+   diagnostics.  */
+gpg_error_t
+db_enable_wal (sqlite3 *db, const char *dbname)
+{
+  int res;
+  sqlite3_stmt *stmt;
+  const char *mode;
+
+  res = sqlite3_prepare_v2 (db, "PRAGMA journal_mode=WAL", -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error enabling WAL mode for '%s' (prepare): %s\n",
+                 dbname, sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  res = sqlite3_step (stmt);
+  mode = res == SQLITE_ROW? (const char *)sqlite3_column_text (stmt, 0) : NULL;
+  if (!mode || strcmp (mode, "wal"))
+    {
+      log_error ("error enabling WAL mode for '%s': %s\n", dbname,
+                 mode? mode : sqlite3_errstr (res));
+      sqlite3_finalize (stmt);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  sqlite3_finalize (stmt);
+
+  return 0;
+}
+
+
+/* Release the snapshot of STATE.  If REMOVE_FNAME is not NULL that
+   file is removed.  */
+static void
+close_backup (db_backup_t state, const char *remove_fname)
+{
+  if (state->backup)
+    sqlite3_backup_finish (state->backup);
+  state->backup = NULL;
+  if (state->dest)
+    sqlite3_close (state->dest);
+  state->dest = NULL;
+  if (remove_fname)
+    remove (remove_fname);
+}
+
+
+/* Flush the file FNAME to disk.  If DIRONLY is set the directory
+   holding FNAME is flushed instead; this is required to make a
+   rename durable.  */
+gpg_error_t
+db_sync_file (const char *fname, int dironly)
+{
+  gpg_error_t err = 0;
+  char *dname = NULL;
+  char *p;
+  int fd;
+
+  if (dironly)
+    {
+      dname = xtrystrdup (fname);
+      if (!dname)
+        return gpg_error_from_syserror ();
+      p = strrchr (dname, '/');
+      if (!p)
+        strcpy (dname, ".");
+      else if (p == dname)
+        p[1] = 0;  /* The root directory.  */
+      else
+        *p = 0;
+      fname = dname;
+    }
+
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
+  fd = open (fname, O_RDONLY);
+  if (fd == -1 || fsync (fd))
+    err = gpg_error_from_syserror ();
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
+  if (err)
+    log_error ("error syncing '%s': %s\n", fname, gpg_strerror (err));
+  if (fd != -1)
+    close (fd);
+  xfree (dname);
+  return err;
+}
+
+
+/* Cancel a running backup of STATE.  This must be called before the
+   source database is closed.  */
+void
+db_backup_cancel (db_backup_t state)
+{
+  close_backup (state, NULL);
+}
+
+
+/* Copy up to NPAGES pages of the database DB to the snapshot file
+   FNAME.  The pages are first written to FNAME with the suffix
+   ".tmp" which is flushed to disk and renamed to FNAME after the
+   last page has been copied.  If no backup is running a new one is
+   started if START is set.  The backup is running as long as
+   STATE->BACKUP is not NULL.  Changes done to DB using the same
+   connection are also written to the snapshot; changes by other
+   connections restart the backup.  */
+gpg_error_t
+db_backup_step (db_backup_t state, sqlite3 *db, const char *fname,
+                int start, int npages)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  int res;
+
+  if (!state->backup && !start)
+    return 0;
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    return gpg_error_from_syserror ();
+
+  if (!state->backup)
+    {
+      remove (tmpfname);
+      res = sqlite3_open_v2 (tmpfname, &state->dest,
+                             (SQLITE_OPEN_READWRITE
+                              | SQLITE_OPEN_CREATE
+                              | SQLITE_OPEN_NOMUTEX),
+                             NULL);
+      if (res)
+        {
+          log_error ("error creating '%s': %s\n",
+                     tmpfname, sqlite3_errstr (res));
+          goto failure;
+        }
+      state->backup = sqlite3_backup_init (state->dest, "main", db, "main");
+      if (!state->backup)
+        {
+          log_error ("error starting backup to '%s': %s\n",
+                     tmpfname, sqlite3_errmsg (state->dest));
+          goto failure;
+        }
+      state->started = time (NULL);
+      state->busy = 0;
+    }
+
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
+  res = sqlite3_backup_step (state->backup, npages);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
+  state->remaining = sqlite3_backup_remaining (state->backup);
+  state->pagecount = sqlite3_backup_pagecount (state->backup);
+  if (res == SQLITE_OK)
+    {
+      /* Not yet finished.  */
+      state->busy = 0;
+      xfree (tmpfname);
+      return 0;
+    }
+  if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+    {
+      /* The database is in use; retry later but don't wait forever.  */
+      state->skipped++;
+      if (++state->busy < DB_BACKUP_MAX_BUSY)
+        {
+          if (opt.verbose)
+            log_info ("backup '%s' step skipped: %s (%u)\n",
+                      fname, sqlite3_errstr (res), state->busy);
+          xfree (tmpfname);
+          return 0;
+        }
+      log_error ("backup '%s' given up after %u busy steps\n",
+                 fname, state->busy);
+      goto failure;
+    }
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error writing backup '%s': %s\n",
+                 tmpfname, sqlite3_errstr (res));
+      goto failure;
+    }
+
+  /* Make sure that the snapshot is on disk before it replaces the
+     previous one and that the rename itself is on disk before we
+     report the backup as finished.  */
+  close_backup (state, NULL);
+  err = db_sync_file (tmpfname, 0);
+  if (err)
+    {
+      remove (tmpfname);
+      xfree (tmpfname);
+      return err;
+    }
+  if (rename (tmpfname, fname))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error renaming '%s' to '%s': %s\n",
+                 tmpfname, fname, gpg_strerror (err));
+      remove (tmpfname);
+      xfree (tmpfname);
+      return err;
+    }
+  err = db_sync_file (fname, 1);
+  if (err)
+    {
+      xfree (tmpfname);
+      return err;
+    }
+  state->finished = time (NULL);
+  state->duration = (unsigned int)(state->finished - state->started);
+  state->pages = state->pagecount;
+  if (opt.verbose)
+    log_info ("backup '%s' written (%d pages, %u s)\n",
+              fname, state->pages, state->duration);
+  xfree (tmpfname);
+  return 0;
+
+ failure:
+  close_backup (state, tmpfname);
+  xfree (tmpfname);
+  return gpg_error (GPG_ERR_GENERAL);
+}
+
+
+/* Return a string describing the backup STATE of the database NAME.
+   The caller must release it using es_free.  Returns NULL on
+   error.  */
+char *
+db_backup_status (db_backup_t state, const char *name)
+{
+  char *running, *last, *result;
+  char timebuf[DB_DATETIME_SIZE];
+  struct tm *tp;
+
+  if (state->backup)
+    running = es_bsprintf ("running for %u s, %d of %d pages copied,"
+                           " %u steps skipped",
+                           (unsigned int)(time (NULL) - state->started),
+                           state->pagecount - state->remaining,
+                           state->pagecount, state->busy);
+  else
+    running = es_bsprintf ("idle");
+  if (!running)
+    return NULL;
+
+  if (state->finished && (tp = gmtime (&state->finished)))
+    {
+      strftime (timebuf, sizeof timebuf, "%Y-%m-%d %H:%M:%S", tp);
+      last = es_bsprintf ("; last backup %s took %u s for %d pages"
+                          "; %lu steps skipped in total",
+                          timebuf, state->duration, state->pages,
+                          state->skipped);
+    }
+  else
+    last = es_bsprintf ("; no backup yet; %lu steps skipped in total",
+                        state->skipped);
+  if (!last)
+    {
+      es_free (running);
+      return NULL;
+    }
+
+  result = es_bsprintf ("%s: %s%s", name, running, last);
+  es_free (running);
+  es_free (last);
+  return result;
+}
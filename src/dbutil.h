@@ -22,7 +22,40 @@
 
 #define DB_DATETIME_SIZE 20 /* "1970-01-01 12:00:00" */
 
+/* The time in milliseconds sqlite waits for a lock held by another
+   connection.  */
+#define DB_BUSY_TIMEOUT 5000
+
+/* The number of pages copied by one online backup step.  */
+#define DB_BACKUP_PAGES 100
+
+/* The number of consecutive online backup steps which may be skipped
+   because the database is in use before the backup is given up.  */
+#define DB_BACKUP_MAX_BUSY 250
+
+/* The state of an online backup of a database.  */
+struct db_backup_s
+{
+  sqlite3 *dest;           /* The snapshot being written or NULL.  */
+  sqlite3_backup *backup;  /* The running backup or NULL.  */
+  time_t started;          /* Start time of the running backup.  */
+  int remaining;           /* Pages still to be copied.  */
+  int pagecount;           /* Total number of pages.  */
+  unsigned int busy;       /* Consecutive steps skipped due to locks.  */
+  unsigned long skipped;   /* All steps skipped due to locks.  */
+  time_t finished;         /* End time of the last completed backup.  */
+  unsigned int duration;   /* Its duration in seconds.  */
+  int pages;               /* Its number of pages.  */
+};
+typedef struct db_backup_s *db_backup_t;
+
 char *db_datetime_now (char *buffer);
+gpg_error_t db_enable_wal (sqlite3 *db, const char *dbname);
+gpg_error_t db_sync_file (const char *fname, int dironly);
+gpg_error_t db_backup_step (db_backup_t state, sqlite3 *db,
+                            const char *fname, int start, int npages);
+void db_backup_cancel (db_backup_t state);
+char *db_backup_status (db_backup_t state, const char *name);
 
 
 #endif /*DBUTIL_H*/
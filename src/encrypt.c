@@ -21,11 +21,17 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <npth.h>
 #include <gpgme.h>
+#include <gcrypt.h>
 
 #include "util.h"
 #include "logging.h"
 #include "payprocd.h"
+#include "membuf.h"
+#include "http.h"
 #include "encrypt.h"
 
 
@@ -36,6 +42,75 @@ static gpgme_key_t database_key;
  * public key is required.  NULL if not set. */
 static gpgme_key_t backoffice_key;
 
+/* A lazily decrypted set of fields.  */
+struct encrypted_fields_s
+{
+  keyvalue_t dict;  /* The decrypted fields or NULL.  */
+  int decrypted;    /* DICT is valid.  */
+  const char *context; /* The context; stored after STRING.  */
+  char string[1];   /* The encrypted fields.  */
+};
+
+/* The number of worker threads for asynchronous jobs.  Each running
+ * OpenPGP job has its own gpg process.  */
+#define ENCRYPT_WORKERS 4
+
+/* An asynchronous encryption or decryption job.  */
+struct encrypt_job_s
+{
+  struct encrypt_job_s *next;
+  int encrypt_to;   /* The recipients or 0 to decrypt.  */
+  char *result;     /* The result of the job.  */
+  gpg_error_t err;  /* The error code of the job.  */
+  int done;         /* The job has been completed.  */
+  const char *context; /* The context; stored after STRING.  */
+  char string[1];   /* A copy of the input.  */
+};
+
+/* The queue of jobs for the worker threads and some statistics.  All
+ * this and the DONE flags of the jobs are protected by queue_lock.
+ * queue_cond is signaled when a job has been queued and queue_done
+ * when a job has been completed.  */
+static npth_mutex_t queue_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t queue_cond = NPTH_COND_INITIALIZER;
+static npth_cond_t queue_done = NPTH_COND_INITIALIZER;
+static encrypt_job_t queue_head;
+static encrypt_job_t queue_tail;
+static int queue_workers;         /* Number of started workers.  */
+static unsigned int queue_depth;  /* Number of queued jobs.  */
+static unsigned int queue_max_depth;
+static unsigned int queue_busy;   /* Number of busy workers.  */
+static unsigned long queue_jobs;  /* Number of completed jobs.  */
+
+/* The parameters of the data keys used for envelope encryption.  A
+ * data key is replaced after DATA_KEY_LIFETIME seconds or
+ * DATA_KEY_MAX_USES seals, whatever comes first.  The latter keeps
+ * the probability of a nonce collision with AES-GCM negligible.  */
+#define DATA_KEY_LEN      32   /* AES-256 */
+#define DATA_KEY_ID_LEN   16   /* Length of the hex encoded id.  */
+#define DATA_NONCE_LEN    12
+#define DATA_TAG_LEN      16
+#define DATA_KEY_LIFETIME (24*60*60)
+#define DATA_KEY_MAX_USES (1u << 24)
+
+/* A data key.  */
+struct data_key_s
+{
+  struct data_key_s *next;
+  char id[DATA_KEY_ID_LEN+1];
+  time_t created;       /* Only set for keys created by us.  */
+  unsigned int uses;    /* Number of strings sealed with this key.  */
+  unsigned char key[DATA_KEY_LEN];
+};
+typedef struct data_key_s *data_key_t;
+
+/* All data keys used by this process and the key currently used for
+ * sealing for each combination of the ENCRYPT_TO flags.  Protected
+ * by data_key_lock.  */
+static data_key_t data_keys;
+static data_key_t current_data_key[4];
+static npth_mutex_t data_key_lock = NPTH_MUTEX_INITIALIZER;
+
 
 
 /* Create a new GPGME context for OpenPGP or print and return an
@@ -77,6 +152,48 @@ create_context (gpgme_ctx_t *r_ctx, gpgme_pinentry_mode_t pinmode)
 }
 
 
+static void
+lock_data_keys (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&data_key_lock);
+  if (res)
+    log_fatal ("failed to acquire data key lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_data_keys (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&data_key_lock);
+  if (res)
+    log_fatal ("failed to release data key lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Forget all data keys.  */
+static void
+release_data_keys (void)
+{
+  data_key_t dk;
+
+  lock_data_keys ();
+  memset (current_data_key, 0, sizeof current_data_key);
+  while ((dk = data_keys))
+    {
+      data_keys = dk->next;
+      wipememory (dk, sizeof *dk);
+      xfree (dk);
+    }
+  unlock_data_keys ();
+}
+
+
 
 /* Setup the required OpenPGP keys.  Returnc NULL on success and an
  * error code on failure.  Also uses log_error on error.  Can be used
@@ -159,6 +276,12 @@ encrypt_setup_keys (void)
     err = firsterr;
   gpgme_key_unref (key);
   gpgme_release (ctx);
+
+  /* The recipients may have changed; thus start new data keys.  */
+  lock_data_keys ();
+  memset (current_data_key, 0, sizeof current_data_key);
+  unlock_data_keys ();
+
   return err;
 }
 
@@ -176,6 +299,8 @@ encrypt_release_keys (void)
   tmpkey = backoffice_key;
   backoffice_key = NULL;
   gpgme_key_unref (tmpkey);
+
+  release_data_keys ();
 }
 
 
@@ -203,11 +328,12 @@ encrypt_show_keys (void)
 }
 
 
-/* Encrypt STRING to the keys specified by the bitflags in ENCRYPT_TO
- * and return an allocated, base64 encoded string at RESULT.  On error
- * NULL is stored at RESULT and an error code returned.  */
-gpg_error_t
-encrypt_string (char **result, const char *string, int encrypt_to)
+/* Encrypt STRING using OpenPGP to the keys specified by the bitflags
+ * in ENCRYPT_TO and return an allocated, base64 encoded string at
+ * RESULT.  STRING must not be empty.  On error NULL is stored at
+ * RESULT and an error code returned.  */
+static gpg_error_t
+encrypt_openpgp (char **result, const char *string, int encrypt_to)
 {
   gpg_error_t err;
   gpgme_ctx_t ctx;
@@ -223,18 +349,6 @@ encrypt_string (char **result, const char *string, int encrypt_to)
 
   *result = NULL;
 
-  /* Check that a key is specified and allflags are known.  */
-  if (!encrypt_to
-      || (encrypt_to & ~(ENCRYPT_TO_DATABASE|ENCRYPT_TO_BACKOFFICE)))
-    return gpg_error (GPG_ERR_INV_FLAG);
-
-  /* No need to encrypt an empty string.  Use shortcut. */
-  if (!string || !*string)
-    {
-      *result = xtrystrdup ("");
-      return *result? 0 : gpg_error_from_syserror ();
-    }
-
   /* No prepare the encryption.  */
   err = create_context (&ctx, GPGME_PINENTRY_MODE_CANCEL);
   if (err)
@@ -263,12 +377,15 @@ encrypt_string (char **result, const char *string, int encrypt_to)
   keys[keycount] = NULL;
 
   /* NB. The data items are in general small and thus it does not make
-   * sense to use compression.  */
+   * sense to use compression.  We release the npth lock because
+   * gpgme blocks while talking to gpg.  */
+  npth_unprotect ();
   err = gpgme_op_encrypt (ctx, keys,
                           (GPGME_ENCRYPT_ALWAYS_TRUST
                            | GPGME_ENCRYPT_NO_ENCRYPT_TO
                            | GPGME_ENCRYPT_NO_COMPRESS),
                           input, output);
+  npth_protect ();
   if (err)
     goto leave;
   encres = gpgme_op_encrypt_result (ctx);
@@ -314,15 +431,16 @@ encrypt_string (char **result, const char *string, int encrypt_to)
 
 /* Decrypt an OpenPGP encrypted and Base64 encoded STRING and return
  * the plaintext as an allocated string at RESULT.  If the reult
- * contains embedded Nuls an error is returned.  On error NULL is
- * stored at RESULT and an error code returned.  Note that RESULT is
- * better freed using gpgme_free in case that on Windows the GPGME DLL
- * uses a different runtime than than payprocd.  */
-gpg_error_t
-decrypt_string (char **result, const char *string)
+ * contains embedded Nuls an error is returned.  STRING must not be
+ * empty.  On error NULL is stored at RESULT and an error code
+ * returned.  Note that RESULT is better freed using gpgme_free in
+ * case that on Windows the GPGME DLL uses a different runtime than
+ * than payprocd.  */
+static gpg_error_t
+decrypt_openpgp (char **result, const char *string)
 {
   gpg_error_t err;
-  gpgme_ctx_t ctx;
+  gpgme_ctx_t ctx = NULL;
   gpgme_data_t input = NULL;
   gpgme_data_t output = NULL;
   char *outbuffer = NULL;
@@ -330,13 +448,6 @@ decrypt_string (char **result, const char *string)
 
   *result = NULL;
 
-  /* No need to decrypt an empty string.  Use shortcut. */
-  if (!string || !*string)
-    {
-      *result = xtrystrdup ("");
-      return *result? 0 : gpg_error_from_syserror ();
-    }
-
   /* Put STRING into a GPGME data object.  */
   {
     void *tmpdata;
@@ -363,7 +474,9 @@ decrypt_string (char **result, const char *string)
     goto leave;
 
   /* Decrypt.  */
+  npth_unprotect ();
   err = gpgme_op_decrypt (ctx, input, output);
+  npth_protect ();
   if (err)
     goto leave;
 
@@ -390,3 +503,920 @@ decrypt_string (char **result, const char *string)
   gpgme_release (ctx);
   return err;
 }
+
+
+
+/*
+ * Envelope encryption.
+ *
+ * If a data key file has been configured, strings are not encrypted
+ * using OpenPGP but sealed with AES-256-GCM using a data key.  The
+ * data key is encrypted once using OpenPGP to the same keys and
+ * appended to the data key file along with an id.  A sealed string
+ * looks like
+ *
+ *   "@" KEYID ":" BASE64(NONCE || CIPHERTEXT || TAG)
+ *
+ * Base64 never yields an '@' and thus decrypt_string can tell both
+ * formats apart.  The key id and the context given by the caller,
+ * which names the field and the record, are used as additional
+ * authenticated data.  The data key file is required to decrypt the
+ * sealed strings and thus needs to be backed up along with the
+ * databases.
+ */
+
+
+/* Store the hex encoding of the LENGTH bytes at BUFFER at OUT which
+ * must have space for 2*LENGTH+1 bytes.  */
+static void
+hexify (char *out, const unsigned char *buffer, size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t n;
+
+  for (n=0; n < length; n++)
+    {
+      *out++ = digits[buffer[n] >> 4];
+      *out++ = digits[buffer[n] & 15];
+    }
+  *out = 0;
+}
+
+
+/* Create a new data key for the recipients ENCRYPT_TO, append it to
+ * the data key file, and store it at R_DK.  The caller must not hold
+ * the data key lock because this may take a while; the new key is
+ * not yet put into DATA_KEYS.  */
+static gpg_error_t
+new_data_key (data_key_t *r_dk, int encrypt_to)
+{
+  gpg_error_t err;
+  data_key_t dk;
+  unsigned char nonce[DATA_KEY_ID_LEN/2];
+  char hexkey[2*DATA_KEY_LEN+1];
+  char *wrapped = NULL;
+  estream_t fp = NULL;
+
+  *r_dk = NULL;
+
+  dk = xtrycalloc (1, sizeof *dk);
+  if (!dk)
+    return gpg_error_from_syserror ();
+  gcry_create_nonce (nonce, sizeof nonce);
+  hexify (dk->id, nonce, sizeof nonce);
+  gcry_randomize (dk->key, DATA_KEY_LEN, GCRY_STRONG_RANDOM);
+  dk->created = time (NULL);
+
+  /* Wrap the key.  */
+  hexify (hexkey, dk->key, DATA_KEY_LEN);
+  err = encrypt_openpgp (&wrapped, hexkey, encrypt_to);
+  wipememory (hexkey, sizeof hexkey);
+  if (err)
+    {
+      log_error ("error wrapping a data key: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+
+  /* Store the wrapped key.  We need to make sure that it is on disk
+   * before we use it.  The file is opened in append mode and thus
+   * concurrent writers don't clobber their lines.  */
+  npth_unprotect ();
+  fp = es_fopen (opt.data_key_file, "a");
+  if (fp)
+    {
+      es_fprintf (fp, "%s %d %lu %s\n",
+                  dk->id, encrypt_to, (unsigned long)dk->created, wrapped);
+      if (es_fflush (fp) || fsync (es_fileno (fp)))
+        err = gpg_error_from_syserror ();
+      if (es_fclose (fp) && !err)
+        err = gpg_error_from_syserror ();
+    }
+  else
+    err = gpg_error_from_syserror ();
+  npth_protect ();
+  if (err)
+    {
+      log_error ("error writing '%s': %s\n",
+                 opt.data_key_file, gpg_strerror (err));
+      goto leave;
+    }
+
+  if (opt.verbose)
+    log_info ("new data key %s created\n", dk->id);
+  *r_dk = dk;
+  dk = NULL;
+
+ leave:
+  if (dk)
+    {
+      wipememory (dk, sizeof *dk);
+      xfree (dk);
+    }
+  xfree (wrapped);
+  return err;
+}
+
+
+/* Return the data key with ID or NULL if it has not yet been loaded.
+ * The caller must hold the data key lock.  */
+static data_key_t
+find_data_key (const char *id)
+{
+  data_key_t dk;
+
+  for (dk = data_keys; dk; dk = dk->next)
+    if (!strcmp (dk->id, id))
+      break;
+  return dk;
+}
+
+
+/* Read the data key with ID from the data key file, unwrap it, and
+ * store it at R_DK.  The caller must not hold the data key lock; the
+ * key is not yet put into DATA_KEYS.  */
+static gpg_error_t
+load_data_key (data_key_t *r_dk, const char *id)
+{
+  gpg_error_t err;
+  estream_t fp;
+  char *line = NULL;
+  size_t linesize = 0;
+  size_t maxlen;
+  ssize_t len;
+  char *wrapped = NULL;
+  char *hexkey = NULL;
+  data_key_t dk;
+  int i;
+
+  *r_dk = NULL;
+
+  npth_unprotect ();
+  fp = es_fopen (opt.data_key_file, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      npth_protect ();
+      log_error ("error opening '%s': %s\n",
+                 opt.data_key_file, gpg_strerror (err));
+      return err;
+    }
+
+  /* Find the line "ID FLAGS CREATED WRAPPED".  */
+  err = 0;
+  for (;;)
+    {
+      maxlen = 16384;
+      len = es_read_line (fp, &line, &linesize, &maxlen);
+      if (len < 0)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      if (!len)
+        {
+          err = gpg_error (GPG_ERR_NO_SECKEY);
+          break;
+        }
+      if (!maxlen)
+        continue;  /* Line too long - skip.  */
+      if (!strncmp (line, id, DATA_KEY_ID_LEN) && line[DATA_KEY_ID_LEN] == ' ')
+        break;
+    }
+  npth_protect ();
+  if (gpg_err_code (err) == GPG_ERR_NO_SECKEY)
+    {
+      log_error ("data key %s not found\n", id);
+      goto leave;
+    }
+  else if (err)
+    {
+      log_error ("error reading '%s': %s\n",
+                 opt.data_key_file, gpg_strerror (err));
+      goto leave;
+    }
+
+  trim_spaces (line);
+  wrapped = strrchr (line, ' ');
+  if (!wrapped)
+    {
+      err = gpg_error (GPG_ERR_INV_DATA);
+      log_error ("invalid data key %s\n", id);
+      goto leave;
+    }
+  wrapped++;
+
+  err = decrypt_openpgp (&hexkey, wrapped);
+  if (err)
+    {
+      log_error ("error unwrapping data key %s: %s\n", id, gpg_strerror (err));
+      goto leave;
+    }
+  for (i=0; hexdigitp (hexkey+i); i++)
+    ;
+  if (i != 2*DATA_KEY_LEN || hexkey[i])
+    {
+      err = gpg_error (GPG_ERR_INV_DATA);
+      log_error ("invalid data key %s\n", id);
+      goto leave;
+    }
+
+  dk = xtrycalloc (1, sizeof *dk);
+  if (!dk)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  strcpy (dk->id, id);
+  for (i=0; i < DATA_KEY_LEN; i++)
+    dk->key[i] = xtoi_2 (hexkey + 2*i);
+  *r_dk = dk;
+
+ leave:
+  if (hexkey)
+    {
+      wipememory (hexkey, strlen (hexkey));
+      gpgme_free (hexkey);
+    }
+  xfree (line);
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Run the AES-GCM operation on the LENGTH bytes at BUFFER in place
+ * using KEY.  The key id ID and the string CONTEXT are authenticated
+ * so that a sealed value can't be moved to another field or record.
+ * BUFFER starts with the nonce and is followed by the tag.  If
+ * DECRYPT is set the tag is checked, otherwise it is created.  */
+static gpg_error_t
+aead_crypt (const unsigned char *key, const char *id, const char *context,
+            unsigned char *buffer, size_t length, int decrypt)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd;
+  unsigned char *data = buffer + DATA_NONCE_LEN;
+  size_t datalen = length - DATA_NONCE_LEN - DATA_TAG_LEN;
+  char *aad;
+
+  /* The id has a fixed length and thus the concatenation is
+   * unambiguous.  */
+  aad = strconcat (id, context? context : "", NULL);
+  if (!aad)
+    return gpg_error_from_syserror ();
+
+  err = gcry_cipher_open (&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 0);
+  if (err)
+    {
+      xfree (aad);
+      return err;
+    }
+  err = gcry_cipher_setkey (hd, key, DATA_KEY_LEN);
+  if (!err)
+    err = gcry_cipher_setiv (hd, buffer, DATA_NONCE_LEN);
+  if (!err)
+    err = gcry_cipher_authenticate (hd, aad, strlen (aad));
+  if (!err)
+    err = gcry_cipher_final (hd);
+  if (!err && decrypt)
+    err = gcry_cipher_decrypt (hd, data, datalen, NULL, 0);
+  else if (!err)
+    err = gcry_cipher_encrypt (hd, data, datalen, NULL, 0);
+  if (!err && decrypt)
+    err = gcry_cipher_checktag (hd, data + datalen, DATA_TAG_LEN);
+  else if (!err)
+    err = gcry_cipher_gettag (hd, data + datalen, DATA_TAG_LEN);
+  gcry_cipher_close (hd);
+  xfree (aad);
+  return err;
+}
+
+
+/* Seal the non-empty STRING for CONTEXT with the current data key for
+ * ENCRYPT_TO and store the result at RESULT.  */
+static gpg_error_t
+seal_string (char **result, const char *string, const char *context,
+             int encrypt_to)
+{
+  gpg_error_t err;
+  data_key_t dk;
+  unsigned char key[DATA_KEY_LEN];
+  char id[DATA_KEY_ID_LEN+1];
+  unsigned char *buffer;
+  size_t length, n;
+  char *b64;
+
+  *result = NULL;
+
+  lock_data_keys ();
+  dk = current_data_key[encrypt_to];
+  if (!dk || dk->uses >= DATA_KEY_MAX_USES
+      || time (NULL) - dk->created >= DATA_KEY_LIFETIME)
+    {
+      /* Wrapping and storing the key must not block the other
+       * threads; thus we release the lock meanwhile.  If another
+       * thread also created a key we simply use ours.  */
+      unlock_data_keys ();
+      err = new_data_key (&dk, encrypt_to);
+      if (err)
+        return err;
+      lock_data_keys ();
+      dk->next = data_keys;
+      data_keys = dk;
+      current_data_key[encrypt_to] = dk;
+    }
+  dk->uses++;
+  memcpy (key, dk->key, DATA_KEY_LEN);
+  strcpy (id, dk->id);
+  unlock_data_keys ();
+
+  n = strlen (string);
+  length = DATA_NONCE_LEN + n + DATA_TAG_LEN;
+  buffer = xtrymalloc (length);
+  if (!buffer)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  gcry_create_nonce (buffer, DATA_NONCE_LEN);
+  memcpy (buffer + DATA_NONCE_LEN, string, n);
+
+  err = aead_crypt (key, id, context, buffer, length, 0);
+  if (err)
+    {
+      log_error ("error sealing a string: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+
+  b64 = base64_encode (buffer, length);
+  if (!b64)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  *result = strconcat ("@", id, ":", b64, NULL);
+  if (!*result)
+    err = gpg_error_from_syserror ();
+  xfree (b64);
+
+ leave:
+  wipememory (key, sizeof key);
+  if (buffer)
+    {
+      wipememory (buffer, length);
+      xfree (buffer);
+    }
+  return err;
+}
+
+
+/* Open the STRING sealed for CONTEXT and store the plaintext at
+ * RESULT.  */
+static gpg_error_t
+open_string (char **result, const char *string, const char *context)
+{
+  gpg_error_t err;
+  data_key_t dk, newdk;
+  unsigned char key[DATA_KEY_LEN];
+  char id[DATA_KEY_ID_LEN+1];
+  void *buffer = NULL;
+  size_t length, n;
+
+  *result = NULL;
+
+  if (strlen (string) < 2 + DATA_KEY_ID_LEN || string[1+DATA_KEY_ID_LEN] != ':')
+    return gpg_error (GPG_ERR_INV_DATA);
+  memcpy (id, string+1, DATA_KEY_ID_LEN);
+  id[DATA_KEY_ID_LEN] = 0;
+
+  err = base64_decode (string + 2 + DATA_KEY_ID_LEN, &buffer, &length);
+  if (err)
+    return err;
+  if (length < DATA_NONCE_LEN + DATA_TAG_LEN)
+    {
+      err = gpg_error (GPG_ERR_INV_DATA);
+      goto leave;
+    }
+
+  lock_data_keys ();
+  dk = find_data_key (id);
+  if (dk)
+    memcpy (key, dk->key, DATA_KEY_LEN);
+  unlock_data_keys ();
+  if (!dk)
+    {
+      /* Read the key without holding the lock.  If another thread
+       * loaded it meanwhile ours is dropped.  */
+      err = load_data_key (&newdk, id);
+      if (err)
+        goto leave;
+      memcpy (key, newdk->key, DATA_KEY_LEN);
+      lock_data_keys ();
+      if (!find_data_key (id))
+        {
+          newdk->next = data_keys;
+          data_keys = newdk;
+          newdk = NULL;
+        }
+      unlock_data_keys ();
+      if (newdk)
+        {
+          wipememory (newdk, sizeof *newdk);
+          xfree (newdk);
+        }
+    }
+
+  err = aead_crypt (key, id, context, buffer, length, 1);
+  wipememory (key, sizeof key);
+  if (err)
+    {
+      log_error ("error opening a sealed string: %s\n", gpg_strerror (err));
+      goto leave;
+    }
+
+  n = length - DATA_NONCE_LEN - DATA_TAG_LEN;
+  if (memchr ((char*)buffer + DATA_NONCE_LEN, 0, n))
+    {
+      err = gpg_error (GPG_ERR_BOGUS_STRING);
+      goto leave;
+    }
+  *result = xtrymalloc (n + 1);
+  if (!*result)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  memcpy (*result, (char*)buffer + DATA_NONCE_LEN, n);
+  (*result)[n] = 0;
+
+ leave:
+  if (buffer)
+    {
+      wipememory (buffer, length);
+      xfree (buffer);
+    }
+  return err;
+}
+
+
+
+/* Encrypt STRING to the keys specified by the bitflags in ENCRYPT_TO
+ * and return an allocated string at RESULT.  If a data key file has
+ * been configured STRING is sealed with a data key; otherwise it is
+ * encrypted using OpenPGP and base64 encoded.  CONTEXT names the place
+ * where the result is stored, for example the table, the column, and
+ * the row; a sealed string can only be opened with the same CONTEXT.
+ * CONTEXT may be NULL and is not used with OpenPGP.  On error NULL is
+ * stored at RESULT and an error code returned.  */
+gpg_error_t
+encrypt_string (char **result, const char *string, const char *context,
+                int encrypt_to)
+{
+  *result = NULL;
+
+  /* Check that a key is specified and allflags are known.  */
+  if (!encrypt_to
+      || (encrypt_to & ~(ENCRYPT_TO_DATABASE|ENCRYPT_TO_BACKOFFICE)))
+    return gpg_error (GPG_ERR_INV_FLAG);
+
+  /* No need to encrypt an empty string.  Use shortcut. */
+  if (!string || !*string)
+    {
+      *result = xtrystrdup ("");
+      return *result? 0 : gpg_error_from_syserror ();
+    }
+
+  if (opt.data_key_file)
+    return seal_string (result, string, context, encrypt_to);
+  return encrypt_openpgp (result, string, encrypt_to);
+}
+
+
+/* Decrypt STRING as returned by encrypt_string for CONTEXT and return
+ * the plaintext as an allocated string at RESULT.  If the result
+ * contains embedded Nuls an error is returned.  On error NULL is
+ * stored at RESULT and an error code returned.  */
+gpg_error_t
+decrypt_string (char **result, const char *string, const char *context)
+{
+  *result = NULL;
+
+  /* No need to decrypt an empty string.  Use shortcut. */
+  if (!string || !*string)
+    {
+      *result = xtrystrdup ("");
+      return *result? 0 : gpg_error_from_syserror ();
+    }
+
+  if (*string == '@')
+    {
+      if (!opt.data_key_file)
+        return gpg_error (GPG_ERR_NO_SECKEY);
+      return open_string (result, string, context);
+    }
+  return decrypt_openpgp (result, string);
+}
+
+
+
+/*
+ * Asynchronous jobs.
+ *
+ * A connection thread may submit several strings at once and wait
+ * for the results later.  The jobs are run by a few worker threads;
+ * their GPGME operations are done without the npth lock and thus run
+ * in parallel to each other and to the other threads.
+ */
+
+
+static void
+lock_queue (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&queue_lock);
+  if (res)
+    log_fatal ("failed to acquire encryption queue lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_queue (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&queue_lock);
+  if (res)
+    log_fatal ("failed to release encryption queue lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* A worker thread.  */
+static void *
+encrypt_worker (void *arg)
+{
+  encrypt_job_t job;
+  int res;
+
+  (void)arg;
+
+  for (;;)
+    {
+      lock_queue ();
+      while (!queue_head)
+        {
+          res = npth_cond_wait (&queue_cond, &queue_lock);
+          if (res)
+            log_fatal ("failed to wait for encryption jobs: %s\n",
+                       gpg_strerror (gpg_error_from_errno (res)));
+        }
+      job = queue_head;
+      queue_head = job->next;
+      if (!queue_head)
+        queue_tail = NULL;
+      queue_depth--;
+      queue_busy++;
+      unlock_queue ();
+
+      if (job->encrypt_to)
+        job->err = encrypt_string (&job->result, job->string, job->context,
+                                   job->encrypt_to);
+      else
+        job->err = decrypt_string (&job->result, job->string, job->context);
+
+      lock_queue ();
+      job->done = 1;
+      queue_busy--;
+      queue_jobs++;
+      res = npth_cond_broadcast (&queue_done);
+      if (res)
+        log_fatal ("failed to signal encryption jobs: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      unlock_queue ();
+    }
+
+  return NULL;
+}
+
+
+/* Start the worker threads.  The caller must hold the queue lock.  */
+static gpg_error_t
+start_workers (void)
+{
+  gpg_error_t err = 0;
+  npth_attr_t tattr;
+  npth_t thread;
+  int res;
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    err = gpg_error_from_errno (res);
+  else
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      for (; queue_workers < ENCRYPT_WORKERS; queue_workers++)
+        {
+          res = npth_create (&thread, &tattr, encrypt_worker, NULL);
+          if (res)
+            {
+              err = gpg_error_from_errno (res);
+              break;
+            }
+        }
+      npth_attr_destroy (&tattr);
+    }
+  if (err && !queue_workers)
+    log_error ("error starting the encryption workers: %s\n",
+               gpg_strerror (err));
+  else
+    err = 0;  /* Run with fewer workers.  */
+  return err;
+}
+
+
+/* Queue the NSTRINGS strings from STRINGS for encryption to the keys
+ * specified by the bitflags in ENCRYPT_TO or for decryption if
+ * ENCRYPT_TO is 0.  CONTEXTS is NULL or an array with the context of
+ * each string; see encrypt_string.  The jobs are stored at R_JOBS
+ * which must have space for NSTRINGS items.  The caller must pass
+ * each job to encrypt_wait to get its result.  On error no job has
+ * been queued.  */
+gpg_error_t
+encrypt_submit_batch (encrypt_job_t *r_jobs, const char **strings,
+                      const char **contexts, int nstrings, int encrypt_to)
+{
+  gpg_error_t err;
+  encrypt_job_t job;
+  const char *s, *c;
+  int i, res;
+
+  if (encrypt_to & ~(ENCRYPT_TO_DATABASE|ENCRYPT_TO_BACKOFFICE))
+    return gpg_error (GPG_ERR_INV_FLAG);
+
+  for (i=0; i < nstrings; i++)
+    {
+      s = strings[i]? strings[i] : "";
+      c = contexts && contexts[i]? contexts[i] : "";
+      job = xtrycalloc (1, sizeof *job + strlen (s) + 1 + strlen (c));
+      if (!job)
+        {
+          err = gpg_error_from_syserror ();
+          while (i--)
+            xfree (r_jobs[i]);
+          return err;
+        }
+      job->encrypt_to = encrypt_to;
+      strcpy (job->string, s);
+      job->context = strcpy (job->string + strlen (s) + 1, c);
+      r_jobs[i] = job;
+    }
+  if (!nstrings)
+    return 0;
+
+  lock_queue ();
+  if (!queue_workers && (err = start_workers ()))
+    {
+      unlock_queue ();
+      for (i=0; i < nstrings; i++)
+        xfree (r_jobs[i]);
+      return err;
+    }
+  for (i=0; i < nstrings; i++)
+    {
+      if (queue_tail)
+        queue_tail->next = r_jobs[i];
+      else
+        queue_head = r_jobs[i];
+      queue_tail = r_jobs[i];
+    }
+  queue_depth += nstrings;
+  if (queue_depth > queue_max_depth)
+    queue_max_depth = queue_depth;
+  res = npth_cond_broadcast (&queue_cond);
+  if (res)
+    log_fatal ("failed to signal the encryption workers: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  unlock_queue ();
+
+  return 0;
+}
+
+
+/* Queue STRING for encryption for CONTEXT to the keys specified by
+ * the bitflags in ENCRYPT_TO and store the job at R_JOB.  */
+gpg_error_t
+encrypt_submit (encrypt_job_t *r_job, const char *string,
+                const char *context, int encrypt_to)
+{
+  if (!encrypt_to)
+    return gpg_error (GPG_ERR_INV_FLAG);
+  return encrypt_submit_batch (r_job, &string, &context, 1, encrypt_to);
+}
+
+
+/* Queue STRING for decryption for CONTEXT and store the job at
+ * R_JOB.  */
+gpg_error_t
+decrypt_submit (encrypt_job_t *r_job, const char *string,
+                const char *context)
+{
+  return encrypt_submit_batch (r_job, &string, &context, 1, 0);
+}
+
+
+/* Wait until JOB has been completed, store its result at RESULT, and
+ * release JOB.  The return value and RESULT are the same as with
+ * encrypt_string or decrypt_string.  */
+gpg_error_t
+encrypt_wait (encrypt_job_t job, char **result)
+{
+  gpg_error_t err;
+  int res;
+
+  lock_queue ();
+  while (!job->done)
+    {
+      res = npth_cond_wait (&queue_done, &queue_lock);
+      if (res)
+        log_fatal ("failed to wait for an encryption job: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+    }
+  unlock_queue ();
+
+  err = job->err;
+  *result = job->result;
+  xfree (job);
+  return err;
+}
+
+
+/* Return statistics about the job queue: the number of queued jobs,
+ * the maximum number of queued jobs, the number of busy workers, and
+ * the number of completed jobs.  */
+void
+encrypt_queue_stats (unsigned int *r_depth, unsigned int *r_max_depth,
+                     unsigned int *r_busy, unsigned long *r_jobs)
+{
+  lock_queue ();
+  *r_depth = queue_depth;
+  *r_max_depth = queue_max_depth;
+  *r_busy = queue_busy;
+  *r_jobs = queue_jobs;
+  unlock_queue ();
+}
+
+
+
+/*
+ * Encryption of several fields.
+ *
+ * Encrypting each field of a record with encrypt_string creates one
+ * OpenPGP message per field.  The functions below put the fields in
+ * the form encoding into one message.  The message is only decrypted
+ * when a field is first requested.
+ */
+
+
+/* Encrypt the fields from DICT whose names are given by the NULL
+ * terminated array NAMES to the keys specified by the bitflags in
+ * ENCRYPT_TO.  If NAMES is NULL all fields are encrypted.  Fields
+ * which are missing or empty are skipped.  The result is stored at
+ * RESULT the same way as with encrypt_string for CONTEXT.  */
+gpg_error_t
+encrypt_fields (char **result, keyvalue_t dict, const char **names,
+                const char *context, int encrypt_to)
+{
+  gpg_error_t err;
+  membuf_t mb;
+  keyvalue_t kv;
+  char *escaped;
+  char *plain;
+  size_t plainlen;
+  int i, any = 0;
+
+  *result = NULL;
+
+  /* Use the form encoding but also escape the '+' so that
+   * parse_www_form_urlencoded restores the values exactly.  */
+  init_membuf (&mb, 256);
+  for (kv = dict; kv; kv = kv->next)
+    {
+      if (!kv->value || !*kv->value)
+        continue;
+      if (names)
+        {
+          for (i=0; names[i]; i++)
+            if (!strcmp (names[i], kv->name))
+              break;
+          if (!names[i])
+            continue;
+        }
+      if (any++)
+        put_membuf_chr (&mb, '&');
+      escaped = http_escape_string (kv->name, "%;?&=+");
+      if (escaped)
+        {
+          put_membuf_str (&mb, escaped);
+          xfree (escaped);
+          put_membuf_chr (&mb, '=');
+          escaped = http_escape_string (kv->value, "%;?&=+");
+        }
+      if (!escaped)
+        {
+          err = gpg_error_from_syserror ();
+          plain = get_membuf (&mb, &plainlen);
+          goto leave;
+        }
+      put_membuf_str (&mb, escaped);
+      wipememory (escaped, strlen (escaped));
+      xfree (escaped);
+    }
+  put_membuf (&mb, "", 1);
+  plain = get_membuf (&mb, &plainlen);
+  if (!plain)
+    return gpg_error_from_syserror ();
+
+  err = encrypt_string (result, plain, context, encrypt_to);
+
+ leave:
+  if (plain)
+    {
+      wipememory (plain, plainlen);
+      xfree (plain);
+    }
+  return err;
+}
+
+
+/* Create an object for the fields encrypted by encrypt_fields for
+ * CONTEXT in STRING and store it at R_EF.  This does not yet decrypt
+ * STRING.  */
+gpg_error_t
+decrypt_fields_new (encrypted_fields_t *r_ef, const char *string,
+                    const char *context)
+{
+  encrypted_fields_t ef;
+
+  if (!string)
+    string = "";
+  if (!context)
+    context = "";
+  ef = xtrycalloc (1, sizeof *ef + strlen (string) + 1 + strlen (context));
+  if (!ef)
+    {
+      *r_ef = NULL;
+      return gpg_error_from_syserror ();
+    }
+  strcpy (ef->string, string);
+  ef->context = strcpy (ef->string + strlen (string) + 1, context);
+  *r_ef = ef;
+  return 0;
+}
+
+
+/* Store the value of the field NAME from EF at R_VALUE.  The fields
+ * are decrypted on the first call.  If there is no such field NULL is
+ * stored at R_VALUE.  The value is valid as long as EF.  */
+gpg_error_t
+decrypt_fields_get (encrypted_fields_t ef, const char *name,
+                    const char **r_value)
+{
+  gpg_error_t err;
+  char *plain;
+
+  *r_value = NULL;
+
+  if (!ef->decrypted)
+    {
+      err = decrypt_string (&plain, ef->string, ef->context);
+      if (err)
+        return err;
+      if (*plain)
+        err = parse_www_form_urlencoded (&ef->dict, plain);
+      wipememory (plain, strlen (plain));
+      xfree (plain);
+      if (err)
+        return err;
+      ef->decrypted = 1;
+    }
+
+  *r_value = keyvalue_get (ef->dict, name);
+  return 0;
+}
+
+
+/* Release EF.  */
+void
+decrypt_fields_release (encrypted_fields_t ef)
+{
+  keyvalue_t kv;
+
+  if (!ef)
+    return;
+  for (kv = ef->dict; kv; kv = kv->next)
+    if (kv->value)
+      wipememory (kv->value, strlen (kv->value));
+  keyvalue_release (ef->dict);
+  xfree (ef);
+}
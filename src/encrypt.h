@@ -20,6 +20,12 @@
 #ifndef ENCRYPT_H
 #define ENCRYPT_H
 
+/* An asynchronous encryption or decryption job.  */
+typedef struct encrypt_job_s *encrypt_job_t;
+
+/* A set of fields encrypted by encrypt_fields.  */
+typedef struct encrypted_fields_s *encrypted_fields_t;
+
 /* Bit flags to specify which encrytpion key to use.  */
 #define ENCRYPT_TO_DATABASE    1 /* Encrypt to the database.  */
 #define ENCRYPT_TO_BACKOFFICE  2 /* Encrypt to the backoffice.  */
@@ -27,7 +33,29 @@
 gpg_error_t encrypt_setup_keys (void);
 void encrypt_release_keys (void);
 void encrypt_show_keys (void);
-gpg_error_t encrypt_string (char **result, const char *string, int encrypt_to);
+gpg_error_t encrypt_string (char **result, const char *string,
+                            const char *context, int encrypt_to);
+gpg_error_t decrypt_string (char **result, const char *string,
+                            const char *context);
+
+gpg_error_t encrypt_submit_batch (encrypt_job_t *r_jobs, const char **strings,
+                                  const char **contexts, int nstrings,
+                                  int encrypt_to);
+gpg_error_t encrypt_submit (encrypt_job_t *r_job, const char *string,
+                            const char *context, int encrypt_to);
+gpg_error_t decrypt_submit (encrypt_job_t *r_job, const char *string,
+                            const char *context);
+gpg_error_t encrypt_wait (encrypt_job_t job, char **result);
+void encrypt_queue_stats (unsigned int *r_depth, unsigned int *r_max_depth,
+                          unsigned int *r_busy, unsigned long *r_jobs);
+
+gpg_error_t encrypt_fields (char **result, keyvalue_t dict, const char **names,
+                            const char *context, int encrypt_to);
+gpg_error_t decrypt_fields_new (encrypted_fields_t *r_ef, const char *string,
+                                const char *context);
+gpg_error_t decrypt_fields_get (encrypted_fields_t ef, const char *name,
+                                const char **r_value);
+void decrypt_fields_release (encrypted_fields_t ef);
 
 
 #endif /*ENCRYPT_H*/
@@ -69,8 +69,10 @@
 # include <sys/time.h>
 # include <time.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <poll.h>
 #endif /*!HAVE_W32_SYSTEM*/
 
 #ifdef WITHOUT_NPTH /* Give the Makefile a chance to build without Pth.  */
@@ -140,6 +142,17 @@ struct srventry
 #endif /*INADDR_NONE*/
 
 #define HTTP_PROXY_ENV           "http_proxy"
+#define POOL_MAX_IDLE          16  /* Max. number of idle connections.  */
+#define POOL_MAX_IDLE_PER_HOST  4  /* Ditto, per host.  */
+#define POOL_IDLE_TIMEOUT      30  /* Seconds an idle connection is kept. */
+#define POOL_MAX_REQUESTS     100  /* Max. requests over one connection.  */
+#define TLS_CACHE_MAX          32  /* Max. number of cached TLS sessions.  */
+#define TLS_CACHE_LIFETIME   3600  /* Seconds a TLS session is resumed.  */
+#define DNS_CACHE_MAX          64  /* Max. number of cached host names.  */
+#define DNS_CACHE_TTL         300  /* Seconds the addresses are used.  */
+#define DNS_CACHE_NEG_TTL      30  /* Ditto for an unknown host.  */
+#define DNS_CACHE_IDLE       3600  /* Seconds an unused entry is kept.  */
+#define DNS_FAIL_PENALTY       60  /* Seconds to try a failed address last.  */
 #define MAX_LINELEN 20000  /* Max. length of a HTTP header line. */
 #define VALID_URI_CHARS "abcdefghijklmnopqrstuvwxyz"   \
                         "ABCDEFGHIJKLMNOPQRSTUVWXYZ"   \
@@ -216,6 +229,9 @@ struct cookie_s
      the content length.  */
   longcounter_t content_length;
   unsigned int content_length_valid:1;
+
+  /* The total number of bytes read.  */
+  longcounter_t total_read;
 };
 typedef struct cookie_s *cookie_t;
 
@@ -267,7 +283,61 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  unsigned int keep_alive:1; /* The connection may be put into the pool. */
+  unsigned int chunked:1;    /* The body uses the chunked encoding.  */
+  unsigned int body_done:1;  /* The chunked body has been read.  */
+  unsigned int nrequests;    /* Number of requests sent over SOCK.  */
+  longcounter_t body_length; /* The Content-Length or 0.  */
+};
+
+
+/* An idle connection in the pool.  */
+struct pool_conn_s
+{
+  struct pool_conn_s *next;
+  my_socket_t sock;
+  http_session_t session;  /* The session with the TLS state or NULL.  */
+  unsigned int use_tls:1;
+  unsigned short port;
+  unsigned int nrequests;  /* Number of requests sent over SOCK.  */
+  time_t last_used;
+  char host[1];
+};
+typedef struct pool_conn_s *pool_conn_t;
+
+/* The pool of idle connections with the most recently used first.
+   Note that we rely on npth to serialize the access; the list is
+   never accessed across a blocking call.  */
+static pool_conn_t conn_pool;
+static unsigned int conn_pool_size;
+
+/* Counters for http_pool_stats.  */
+static unsigned long conn_pool_opened;
+static unsigned long conn_pool_reused;
+
+
+#ifdef HTTP_USE_GNUTLS
+/* The data to resume a TLS session with a server.  */
+struct tls_cache_s
+{
+  struct tls_cache_s *next;
+  unsigned short port;
+  time_t stored;
+  void *data;      /* The malloced session data.  */
+  size_t datalen;
+  char host[1];
 };
+typedef struct tls_cache_s *tls_cache_t;
+
+/* The cached TLS sessions with the most recently stored first.  As
+   with the pool we rely on npth to serialize the access.  */
+static tls_cache_t tls_cache;
+static unsigned int tls_cache_size;
+#endif /*HTTP_USE_GNUTLS*/
+
+/* Counters for http_tls_stats.  */
+static unsigned long tls_handshakes;
+static unsigned long tls_resumed;
 
 
 /* The global callback for the verification fucntion.  */
@@ -657,10 +727,13 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
 }
 
 
-/* Increment the reference count for session SESS.  */
+/* Increment the reference count for session SESS.  SESS may be
+   NULL.  */
 http_session_t
 http_session_ref (http_session_t sess)
 {
+  if (!sess)
+    return NULL;
   sess->refcount++;
   /* log_debug ("http.c:session_ref: sess %p ref now %d\n", sess, sess->refcount); */
   return sess;
@@ -678,11 +751,347 @@ http_session_set_log_cb (http_session_t sess,
 
 
 
+
+/* Close the pooled connection CONN and release it.  */
+static void
+pool_close_conn (pool_conn_t conn)
+{
+#ifdef HTTP_USE_GNUTLS
+  if (conn->session && conn->session->tls_session)
+    {
+      int rc;
+
+      /* Don't wait for the server's close_notify; it may be gone.  */
+      do
+        rc = gnutls_bye (conn->session->tls_session, GNUTLS_SHUT_WR);
+      while (rc == GNUTLS_E_INTERRUPTED);
+    }
+#endif /*HTTP_USE_GNUTLS*/
+  my_socket_unref (conn->sock, NULL, NULL);
+  http_session_unref (conn->session);
+  xfree (conn);
+}
+
+
+/* Tell the server of HD that we won't send any more data over its
+   connection.  */
+static void
+shutdown_write_side (http_t hd)
+{
+#ifdef HTTP_USE_GNUTLS
+  if (hd->uri->use_tls && hd->session && hd->session->tls_session)
+    {
+      int rc;
+
+      do
+        rc = gnutls_bye (hd->session->tls_session, GNUTLS_SHUT_WR);
+      while (rc == GNUTLS_E_INTERRUPTED);
+    }
+#endif /*HTTP_USE_GNUTLS*/
+  shutdown (hd->sock->fd, 1);
+}
+
+
+/* Return true if the idle connection CONN can be used for another
+   request at time NOW.  */
+static int
+pool_conn_usable_p (pool_conn_t conn, time_t now)
+{
+  if (conn->last_used + POOL_IDLE_TIMEOUT <= now || conn->last_used > now)
+    return 0;
+
+#ifdef HTTP_USE_GNUTLS
+  if (conn->session && conn->session->tls_session
+      && gnutls_record_check_pending (conn->session->tls_session))
+    return 0;
+#endif /*HTTP_USE_GNUTLS*/
+
+#ifndef HAVE_W32_SYSTEM
+  {
+    struct pollfd pfd;
+
+    /* An idle connection is readable only if the server closed it or
+       sent something unexpected; we can't use it in either case.  */
+    pfd.fd = conn->sock->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, 0))
+      return 0;
+  }
+#endif /*!HAVE_W32_SYSTEM*/
+
+  return 1;
+}
+
+
+/* Take an idle connection to SERVER and PORT from the pool and store
+   its socket and session in HD.  Returns true on success.  */
+static int
+pool_get (http_t hd, const char *server, unsigned short port)
+{
+  pool_conn_t conn, *connp;
+  time_t now = time (NULL);
+
+ again:
+  for (connp = &conn_pool; (conn = *connp); connp = &conn->next)
+    if (conn->use_tls == hd->uri->use_tls && conn->port == port
+        && !strcmp (conn->host, server))
+      break;
+  if (!conn)
+    return 0;
+  *connp = conn->next;
+  conn_pool_size--;
+
+  if (!pool_conn_usable_p (conn, now))
+    {
+      pool_close_conn (conn);
+      goto again;
+    }
+
+  hd->sock = conn->sock;
+  if (conn->session)
+    {
+      http_session_unref (hd->session);
+      hd->session = conn->session;
+    }
+  hd->nrequests = conn->nrequests;
+  xfree (conn);
+  conn_pool_reused++;
+  return 1;
+}
+
+
+/* Put the connection of HD into the pool.  The caller must have made
+   sure that the response has been read completely.  */
+static void
+pool_put (http_t hd)
+{
+  pool_conn_t conn, *connp, victims;
+  const char *server;
+  unsigned int total, perhost;
+  int samehost;
+
+  if (hd->nrequests >= POOL_MAX_REQUESTS)
+    return;
+
+  server = *hd->uri->host ? hd->uri->host : "localhost";
+  conn = xtrymalloc (sizeof *conn + strlen (server));
+  if (!conn)
+    return;  /* Not pooling the connection is not an error.  */
+  strcpy (conn->host, server);
+  conn->port = hd->uri->port ? hd->uri->port : 80;
+  conn->use_tls = hd->uri->use_tls;
+  conn->sock = my_socket_ref (hd->sock);
+  conn->session = conn->use_tls? http_session_ref (hd->session) : NULL;
+  conn->nrequests = hd->nrequests;
+  conn->last_used = time (NULL);
+  conn->next = conn_pool;
+  conn_pool = conn;
+  conn_pool_size++;
+
+  /* Drop the least recently used connections beyond the limits.  */
+  victims = NULL;
+  total = perhost = 0;
+  for (connp = &conn_pool; (conn = *connp); )
+    {
+      samehost = (conn->use_tls == conn_pool->use_tls
+                  && conn->port == conn_pool->port
+                  && !strcmp (conn->host, conn_pool->host));
+      if (total >= POOL_MAX_IDLE
+          || (samehost && perhost >= POOL_MAX_IDLE_PER_HOST))
+        {
+          *connp = conn->next;
+          conn_pool_size--;
+          conn->next = victims;
+          victims = conn;
+        }
+      else
+        {
+          total++;
+          if (samehost)
+            perhost++;
+          connp = &conn->next;
+        }
+    }
+
+  while ((conn = victims))
+    {
+      victims = conn->next;
+      pool_close_conn (conn);
+    }
+}
+
+
+/* Close all idle connections which have timed out.  This should be
+   called from time to time.  */
+void
+http_pool_housekeeping (void)
+{
+  pool_conn_t conn, *connp, victims;
+  time_t now = time (NULL);
+
+  victims = NULL;
+  for (connp = &conn_pool; (conn = *connp); )
+    {
+      if (!pool_conn_usable_p (conn, now))
+        {
+          *connp = conn->next;
+          conn_pool_size--;
+          conn->next = victims;
+          victims = conn;
+        }
+      else
+        connp = &conn->next;
+    }
+
+  while ((conn = victims))
+    {
+      victims = conn->next;
+      pool_close_conn (conn);
+    }
+}
+
+
+/* Return the number of idle connections in the pool, the number of
+   connections opened and the number of reused connections.  */
+void
+http_pool_stats (unsigned int *r_idle,
+                 unsigned long *r_opened, unsigned long *r_reused)
+{
+  *r_idle = conn_pool_size;
+  *r_opened = conn_pool_opened;
+  *r_reused = conn_pool_reused;
+}
+
+
+
+
+#ifdef HTTP_USE_GNUTLS
+/* Return the cache entry for SERVER and PORT or NULL.  If R_PREV is
+   not NULL the address of the link to the entry is stored there.  */
+static tls_cache_t
+tls_cache_find (const char *server, unsigned short port, tls_cache_t **r_prev)
+{
+  tls_cache_t tc, *tcp;
+
+  for (tcp = &tls_cache; (tc = *tcp); tcp = &tc->next)
+    if (tc->port == port && !strcmp (tc->host, server))
+      break;
+  if (r_prev)
+    *r_prev = tcp;
+  return tc;
+}
+
+
+/* Prepare the TLS session of HD to resume a former session with
+   SERVER and PORT.  */
+static void
+tls_cache_load (http_t hd, const char *server, unsigned short port)
+{
+  tls_cache_t tc;
+  time_t now = time (NULL);
+  int rc;
+
+  tc = tls_cache_find (server, port, NULL);
+  if (!tc || tc->stored + TLS_CACHE_LIFETIME <= now || tc->stored > now)
+    return;
+
+  rc = gnutls_session_set_data (hd->session->tls_session,
+                                tc->data, tc->datalen);
+  if (rc < 0)
+    log_info ("gnutls_session_set_data failed: %s\n", gnutls_strerror (rc));
+}
+
+
+/* Store the data to resume the TLS session of HD.  */
+static void
+tls_cache_store (http_t hd)
+{
+  tls_cache_t tc, *tcp;
+  gnutls_datum_t datum;
+  const char *server;
+  unsigned short port;
+  void *data;
+  int rc;
+
+  rc = gnutls_session_get_data2 (hd->session->tls_session, &datum);
+  if (rc < 0)
+    return;
+  data = xtrymalloc (datum.size);
+  if (!data)
+    {
+      gnutls_free (datum.data);
+      return;  /* Not caching is not an error.  */
+    }
+  memcpy (data, datum.data, datum.size);
+
+  server = *hd->uri->host ? hd->uri->host : "localhost";
+  port = hd->uri->port ? hd->uri->port : 80;
+  tc = tls_cache_find (server, port, &tcp);
+  if (tc)
+    *tcp = tc->next;
+  else if (!(tc = xtrycalloc (1, sizeof *tc + strlen (server))))
+    {
+      xfree (data);
+      gnutls_free (datum.data);
+      return;
+    }
+  else
+    {
+      strcpy (tc->host, server);
+      tc->port = port;
+      tls_cache_size++;
+    }
+  xfree (tc->data);
+  tc->data = data;
+  tc->datalen = datum.size;
+  tc->stored = time (NULL);
+  tc->next = tls_cache;
+  tls_cache = tc;
+  gnutls_free (datum.data);
+
+  /* Drop the oldest entry.  */
+  if (tls_cache_size > TLS_CACHE_MAX)
+    {
+      for (tcp = &tls_cache; (*tcp)->next; tcp = &(*tcp)->next)
+        ;
+      tc = *tcp;
+      *tcp = NULL;
+      tls_cache_size--;
+      xfree (tc->data);
+      xfree (tc);
+    }
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
+/* Return the number of cached TLS sessions, the number of TLS
+   handshakes and how many of them resumed a cached session.  */
+void
+http_tls_stats (unsigned int *r_entries,
+                unsigned long *r_handshakes, unsigned long *r_resumed)
+{
+#ifdef HTTP_USE_GNUTLS
+  *r_entries = tls_cache_size;
+#else
+  *r_entries = 0;
+#endif
+  *r_handshakes = tls_handshakes;
+  *r_resumed = tls_resumed;
+}
+
+
+
 
 /* Start a HTTP retrieval and on success store at R_HD a context
    pointer for completing the request and to wait for the response.
    If HTTPHOST is not NULL it is used hor the Host header instead of a
-   Host header derived from the URL. */
+   Host header derived from the URL.  With HTTP_FLAG_KEEP_ALIVE an
+   idle connection from the pool is used if available and the
+   connection is put back into the pool by http_close if the response
+   has been read completely; SESSION may then be NULL to create a new
+   session as needed.  The flag is ignored if HTTPHOST or a proxy is
+   used.  */
 gpg_error_t
 http_open (http_t *r_hd, http_req_t reqtype, const char *url,
            const char *httphost,
@@ -704,6 +1113,8 @@ http_open (http_t *r_hd, http_req_t reqtype, const char *url,
   if (!hd)
     return gpg_error_from_syserror ();
   hd->req_type = reqtype;
+  if (httphost || (proxy && *proxy) || (flags & HTTP_FLAG_TRY_PROXY))
+    flags &= ~HTTP_FLAG_KEEP_ALIVE;
   hd->flags = flags;
   hd->session = http_session_ref (session);
 
@@ -927,6 +1338,21 @@ http_close (http_t hd, int keep_read_stream)
   if (!hd)
     return;
 
+#ifdef HTTP_USE_GNUTLS
+  /* Cache the TLS session after the first response; with TLS 1.3 the
+     server sends the session ticket only after the handshake.  */
+  if (hd->nrequests == 1 && hd->uri && hd->uri->use_tls
+      && hd->session && hd->session->tls_session)
+    tls_cache_store (hd);
+#endif /*HTTP_USE_GNUTLS*/
+
+  /* Put the connection into the pool if the response has been read
+     completely.  */
+  if (hd->keep_alive && !keep_read_stream && hd->fp_read && !hd->fp_write
+      && (hd->chunked? hd->body_done
+          /**/       : !((cookie_t)hd->read_cookie)->content_length))
+    pool_put (hd);
+
   /* First remove the close notifications for the streams.  */
   if (hd->fp_read)
     es_onclose (hd->fp_read, 0, fp_onclose_notification, hd);
@@ -953,6 +1379,205 @@ http_close (http_t hd, int keep_read_stream)
 }
 
 
+/* Make sure that the buffer *R_BUFFER of size *R_SIZE has room for
+   NEEDED more bytes after the first LENGTH bytes and a Nul.  */
+static gpg_error_t
+grow_body_buffer (char **r_buffer, size_t *r_size, size_t length,
+                  size_t needed)
+{
+  size_t newsize;
+  char *p;
+
+  if (length + needed + 1 <= length)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  if (length + needed + 1 <= *r_size)
+    return 0;
+
+  newsize = *r_size * 2;
+  if (newsize < length + needed + 1)
+    newsize = length + needed + 1;
+  p = xtryrealloc (*r_buffer, newsize);
+  if (!p)
+    return gpg_error_from_syserror ();
+  *r_buffer = p;
+  *r_size = newsize;
+  return 0;
+}
+
+
+/* Read NBYTES from FP into BUFFER.  Returns the number of bytes read
+   which is less than NBYTES only at EOF or on error.  */
+static size_t
+read_body_bytes (estream_t fp, char *buffer, size_t nbytes)
+{
+  size_t nread, total = 0;
+
+  while (total < nbytes)
+    {
+      if (es_read (fp, buffer + total, nbytes - total, &nread) || !nread)
+        break;
+      total += nread;
+    }
+  return total;
+}
+
+
+/* Read an empty line from the response to HD.  */
+static gpg_error_t
+read_empty_line (http_t hd)
+{
+  size_t maxlen = 256;
+
+  if (!es_read_line (hd->fp_read, &hd->buffer, &hd->buffer_size, &maxlen))
+    return hd->buffer? gpg_error (GPG_ERR_TRUNCATED)
+      /**/           : gpg_error_from_syserror ();
+  if (!maxlen || !(*hd->buffer == '\n' || !strcmp (hd->buffer, "\r\n")))
+    return gpg_error (GPG_ERR_INV_RESPONSE);
+  return 0;
+}
+
+
+/* Read the body of the response to HD into a malloced buffer which
+   is stored at R_BUFFER and terminated by a Nul.  The length of the
+   body is stored at R_LENGTH unless it is NULL.  A body with the
+   chunked encoding is decoded; with a Content-Length the buffer is
+   allocated in one go.  If MAXLEN is not 0, a longer body yields
+   GPG_ERR_TOO_LARGE.  This function must be used with
+   HTTP_FLAG_KEEP_ALIVE because the server does not close the
+   connection after a chunked body.  */
+gpg_error_t
+http_read_body (http_t hd, char **r_buffer, size_t *r_length, size_t maxlen)
+{
+  gpg_error_t err;
+  char *buffer = NULL;
+  size_t size = 0;
+  size_t length = 0;
+  size_t n, nread, maxlinelen;
+  unsigned long chunklen;
+  char *endp;
+  int c;
+
+  *r_buffer = NULL;
+  if (r_length)
+    *r_length = 0;
+
+  if (!hd->fp_read)
+    return gpg_err_make (default_errsource, GPG_ERR_INTERNAL);
+
+  if (hd->chunked)
+    {
+      for (;;)
+        {
+          maxlinelen = 256;
+          if (!es_read_line (hd->fp_read, &hd->buffer, &hd->buffer_size,
+                             &maxlinelen))
+            {
+              err = hd->buffer? gpg_error (GPG_ERR_TRUNCATED)
+                /**/          : gpg_error_from_syserror ();
+              goto leave;
+            }
+          chunklen = strtoul (hd->buffer, &endp, 16);
+          if (!maxlinelen || endp == hd->buffer
+              || !(*endp == ';' || *endp == '\r' || *endp == '\n'
+                   || *endp == ' ' || *endp == '\t'))
+            {
+              err = gpg_error (GPG_ERR_INV_RESPONSE);
+              goto leave;
+            }
+          if (!chunklen)
+            break;
+
+          if (maxlen && chunklen > maxlen - length)
+            {
+              err = gpg_error (GPG_ERR_TOO_LARGE);
+              goto leave;
+            }
+          err = grow_body_buffer (&buffer, &size, length, chunklen);
+          if (err)
+            goto leave;
+          if (read_body_bytes (hd->fp_read, buffer + length, chunklen)
+              != chunklen)
+            {
+              err = gpg_error (GPG_ERR_TRUNCATED);
+              goto leave;
+            }
+          length += chunklen;
+
+          err = read_empty_line (hd);  /* The CRLF after the data.  */
+          if (err)
+            goto leave;
+        }
+
+      /* Skip the trailer.  */
+      while ((err = read_empty_line (hd)))
+        if (gpg_err_code (err) != GPG_ERR_INV_RESPONSE)
+          goto leave;
+      hd->body_done = 1;
+    }
+  else
+    {
+      /* Start with a buffer for the entire body.  We nevertheless read
+         up to EOF.  */
+      n = hd->body_length;
+      if (!n || n != hd->body_length)
+        n = 4096;
+      for (;;)
+        {
+          if (maxlen && n > maxlen - length)
+            n = maxlen - length;
+          err = grow_body_buffer (&buffer, &size, length, n);
+          if (err)
+            goto leave;
+          n = size - length - 1;
+          if (maxlen && n > maxlen - length)
+            n = maxlen - length;
+          nread = read_body_bytes (hd->fp_read, buffer + length, n);
+          length += nread;
+          if (nread < n)
+            break;  /* EOF.  */
+
+          /* The buffer is full; check whether there is more.  */
+          c = es_getc (hd->fp_read);
+          if (c == EOF)
+            break;
+          if (maxlen && length >= maxlen)
+            {
+              err = gpg_error (GPG_ERR_TOO_LARGE);
+              goto leave;
+            }
+          err = grow_body_buffer (&buffer, &size, length, 1);
+          if (err)
+            goto leave;
+          buffer[length++] = c;
+          n = size;
+        }
+    }
+
+  if (es_ferror (hd->fp_read))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if (!buffer)
+    {
+      err = grow_body_buffer (&buffer, &size, 0, 0);
+      if (err)
+        goto leave;
+    }
+  buffer[length] = 0;
+  *r_buffer = buffer;
+  buffer = NULL;
+  if (r_length)
+    *r_length = length;
+  err = 0;
+
+ leave:
+  xfree (buffer);
+  return err;
+}
+
+
 estream_t
 http_get_read_ptr (http_t hd)
 {
@@ -1405,6 +2030,21 @@ send_request (http_t hd, const char *httphost, const char *auth,
   char *authstr = NULL;
   int sock;
   int hnf;
+  int reused = 0;
+
+  server = *hd->uri->host ? hd->uri->host : "localhost";
+  port = hd->uri->port ? hd->uri->port : 80;
+
+  if ((hd->flags & HTTP_FLAG_KEEP_ALIVE))
+    {
+      reused = pool_get (hd, server, port);
+      if (!reused && hd->uri->use_tls && !hd->session)
+        {
+          err = http_session_new (&hd->session, NULL);
+          if (err)
+            return err;
+        }
+    }
 
   if (hd->uri->use_tls && !hd->session)
     {
@@ -1419,8 +2059,8 @@ send_request (http_t hd, const char *httphost, const char *auth,
     }
 #endif /*HTTP_USE_GNUTLS*/
 
-  server = *hd->uri->host ? hd->uri->host : "localhost";
-  port = hd->uri->port ? hd->uri->port : 80;
+  if (reused)
+    goto connected;
 
   /* Try to use SNI.  */
 #ifdef HTTP_USE_GNUTLS
@@ -1506,8 +2146,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
       xfree (proxy_authstr);
       return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
     }
-
-
+  conn_pool_opened++;
 
 #ifdef HTTP_USE_GNUTLS
   if (hd->uri->use_tls)
@@ -1522,6 +2161,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
       gnutls_transport_set_push_function (hd->session->tls_session,
                                           my_npth_write);
 #endif
+      tls_cache_load (hd, server, port);
     handshake_again:
       do
         {
@@ -1553,6 +2193,9 @@ send_request (http_t hd, const char *httphost, const char *auth,
           xfree (proxy_authstr);
           return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
         }
+      tls_handshakes++;
+      if (gnutls_session_is_resumed (hd->session->tls_session))
+        tls_resumed++;
 
       hd->session->verify.done = 0;
       if (tls_callback)
@@ -1569,6 +2212,9 @@ send_request (http_t hd, const char *httphost, const char *auth,
     }
 #endif /*HTTP_USE_GNUTLS*/
 
+ connected:
+  hd->nrequests++;
+
   if (auth || hd->uri->auth)
     {
       char *myauth;
@@ -1634,7 +2280,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.1\r\nHost: %s%s\r\nConnection: close\r\n%s",
+        ("%s %s%s HTTP/1.1\r\nHost: %s%s\r\nConnection: %s\r\n%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" :
@@ -1642,6 +2288,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
+         (hd->flags & HTTP_FLAG_KEEP_ALIVE)? "keep-alive" : "close",
          authstr? authstr:"");
     }
   xfree (p);
@@ -1915,6 +2562,13 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  longcounter_t hdrlen = 0;  /* Length of the status and header lines.  */
+  int is_http_1_1, truncated = 0;
+
+  hd->keep_alive = 0;
+  hd->chunked = 0;
+  hd->body_done = 0;
+  hd->body_length = 0;
 
   /* Delete old header lines.  */
   while (hd->headers)
@@ -1937,6 +2591,7 @@ parse_response (http_t hd)
 	return GPG_ERR_TRUNCATED; /* Line has been truncated. */
       if (!len)
 	return GPG_ERR_EOF;
+      hdrlen += len;
 
       if ((hd->flags & HTTP_FLAG_LOG_RESP))
         log_info ("RESP: '%.*s'\n",
@@ -1956,6 +2611,7 @@ parse_response (http_t hd)
     }
   if (!p2)
     return 0; /* Also assume http 0.9. */
+  is_http_1_1 = !strcmp (p, "1.1");
   p = p2;
   /* TODO: Add HTTP version number check. */
   if ((p2 = strpbrk (p, " \t")))
@@ -1981,6 +2637,9 @@ parse_response (http_t hd)
       /* Note, that we can silently ignore truncated lines. */
       if (!len)
 	return GPG_ERR_EOF;
+      hdrlen += len;
+      if (!maxlen)
+        truncated = 1;
       /* Trim line endings of empty lines. */
       if ((*line == '\r' && line[1] == '\n') || *line == '\n')
 	*line = 0;
@@ -1996,17 +2655,53 @@ parse_response (http_t hd)
     }
   while (len && *line);
 
+  s = http_get_header (hd, "Transfer-Encoding");
+  hd->chunked = (s && !strcasecmp (s, "chunked"));
+
   cookie->content_length_valid = 0;
-  if (!(hd->flags & HTTP_FLAG_IGNORE_CL))
+  if (!(hd->flags & HTTP_FLAG_IGNORE_CL) && !hd->chunked)
     {
       s = http_get_header (hd, "Content-Length");
-      if (s)
+      if (s || hd->status_code == 204 || hd->status_code == 304)
         {
           cookie->content_length_valid = 1;
-          cookie->content_length = counter_strtoul (s);
+          cookie->content_length = s? counter_strtoul (s) : 0;
+          hd->body_length = cookie->content_length;
+
+          /* The start of the body may already be in the buffer of
+             FP_READ and thus we need to subtract that.  */
+          if (truncated
+              || cookie->total_read - hdrlen > cookie->content_length)
+            {
+              cookie->content_length = 0;
+              truncated = 1;  /* Don't reuse the connection.  */
+            }
+          else
+            cookie->content_length -= cookie->total_read - hdrlen;
+        }
+    }
+
+  if ((hd->flags & HTTP_FLAG_KEEP_ALIVE) && is_http_1_1 && !truncated
+      && (hd->chunked || (cookie->content_length_valid
+                          && !http_get_header (hd, "Transfer-Encoding"))))
+    {
+      hd->keep_alive = 1;
+      for (s = http_get_header (hd, "Connection"); s && *s; s += len)
+        {
+          s += strspn (s, " \t,");
+          len = strcspn (s, " \t,");
+          if (len == 5 && !strncasecmp (s, "close", 5))
+            hd->keep_alive = 0;
         }
     }
 
+  /* Without a Content-Length the body ends only when the server
+     closes the connection, which it won't do after a keep-alive
+     request.  Thus tell it that no other request will follow.  */
+  if ((hd->flags & HTTP_FLAG_KEEP_ALIVE) && !hd->keep_alive
+      && !cookie->content_length_valid)
+    shutdown_write_side (hd);
+
   return 0;
 }
 
@@ -2087,6 +2782,299 @@ start_server ()
 }
 #endif
 
+#ifdef HAVE_GETADDRINFO
+/* A resolved address of a host.  */
+struct dns_addr_s
+{
+  int family;
+  int socktype;
+  int protocol;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+  time_t failed;        /* Time of the last failed connect or 0.  */
+};
+typedef struct dns_addr_s *dns_addr_t;
+
+/* The cached addresses of a host.  */
+struct dns_cache_s
+{
+  struct dns_cache_s *next;
+  unsigned short port;
+  time_t expires;       /* Time to look up the host again.  */
+  time_t used;          /* Time of the last use.  */
+  unsigned int not_found:1;  /* The host is not known.  */
+  unsigned int naddrs;
+  dns_addr_t addrs;     /* Malloced array with NADDRS addresses.  */
+  char name[1];
+};
+typedef struct dns_cache_s *dns_cache_t;
+
+/* The DNS cache.  As with the pool we rely on npth to serialize the
+   access; the cache is not accessed while the lookup runs
+   unprotected.  */
+static dns_cache_t dns_cache;
+static unsigned int dns_cache_size;
+#endif /*HAVE_GETADDRINFO*/
+
+/* Counters for http_dns_stats.  */
+static unsigned long dns_cache_hits;
+static unsigned long dns_cache_misses;
+
+
+#ifdef HAVE_GETADDRINFO
+/* Return the cache entry for NAME and PORT or NULL.  */
+static dns_cache_t
+dns_cache_find (const char *name, unsigned short port)
+{
+  dns_cache_t dc;
+
+  for (dc = dns_cache; dc; dc = dc->next)
+    if (dc->port == port && !strcmp (dc->name, name))
+      break;
+  return dc;
+}
+
+
+/* Resolve NAME and PORT and store a malloced array with the addresses
+   at R_ADDRS and their number at R_NADDRS.  Returns 0 or a getaddrinfo
+   error code.  Other threads may run during the lookup.  */
+static int
+dns_resolve (const char *name, unsigned short port,
+             dns_addr_t *r_addrs, unsigned int *r_naddrs)
+{
+  struct addrinfo hints, *res, *ai;
+  char portstr[35];
+  unsigned int n;
+  int rc;
+
+  *r_addrs = NULL;
+  *r_naddrs = 0;
+
+  snprintf (portstr, sizeof portstr, "%hu", port);
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
+  rc = getaddrinfo (name, portstr, &hints, &res);
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
+  if (rc)
+    return rc;
+
+  for (n=0, ai = res; ai; ai = ai->ai_next)
+    if (ai->ai_addrlen <= sizeof (struct sockaddr_storage))
+      n++;
+  *r_addrs = xtrycalloc (n? n : 1, sizeof **r_addrs);
+  if (!*r_addrs)
+    {
+      freeaddrinfo (res);
+      return EAI_MEMORY;
+    }
+  for (n=0, ai = res; ai; ai = ai->ai_next)
+    if (ai->ai_addrlen <= sizeof (struct sockaddr_storage))
+      {
+        (*r_addrs)[n].family = ai->ai_family;
+        (*r_addrs)[n].socktype = ai->ai_socktype;
+        (*r_addrs)[n].protocol = ai->ai_protocol;
+        (*r_addrs)[n].addrlen = ai->ai_addrlen;
+        memcpy (&(*r_addrs)[n].addr, ai->ai_addr, ai->ai_addrlen);
+        n++;
+      }
+  *r_naddrs = n;
+  freeaddrinfo (res);
+  return 0;
+}
+
+
+/* Resolve NAME and PORT and update the cache.  If the lookup fails
+   the host is cached as not found; on a temporary error the former
+   addresses are kept instead if there are any.  Returns the cache
+   entry or NULL.  */
+static dns_cache_t
+dns_cache_update (const char *name, unsigned short port)
+{
+  dns_cache_t dc, *dcp;
+  dns_addr_t addrs;
+  unsigned int naddrs;
+  int rc;
+
+  rc = dns_resolve (name, port, &addrs, &naddrs);
+  if (rc && rc != EAI_NONAME)
+    log_info ("error resolving '%s': %s\n", name, gai_strerror (rc));
+
+  /* The cache may have been changed during the lookup.  */
+  dc = dns_cache_find (name, port);
+  if (rc && rc != EAI_NONAME && dc && dc->naddrs)
+    {
+      log_info ("using the former addresses of '%s'\n", name);
+      dc->expires = time (NULL) + DNS_CACHE_NEG_TTL;
+      return dc;
+    }
+  if (!dc)
+    {
+      dc = xtrycalloc (1, sizeof *dc + strlen (name));
+      if (!dc)
+        {
+          xfree (addrs);
+          return NULL;
+        }
+      strcpy (dc->name, name);
+      dc->port = port;
+      dc->used = time (NULL);
+      dc->next = dns_cache;
+      dns_cache = dc;
+      dns_cache_size++;
+
+      /* Drop the least recently used entry.  */
+      if (dns_cache_size > DNS_CACHE_MAX)
+        {
+          dns_cache_t lru = NULL, *lrup = NULL;
+
+          for (dcp = &dns_cache->next; *dcp; dcp = &(*dcp)->next)
+            if (!lru || (*dcp)->used < lru->used)
+              {
+                lru = *dcp;
+                lrup = dcp;
+              }
+          *lrup = lru->next;
+          dns_cache_size--;
+          xfree (lru->addrs);
+          xfree (lru);
+        }
+    }
+
+  xfree (dc->addrs);
+  dc->addrs = addrs;
+  dc->naddrs = naddrs;
+  dc->not_found = !!rc;
+  dc->expires = time (NULL) + (rc? DNS_CACHE_NEG_TTL : DNS_CACHE_TTL);
+  return dc;
+}
+
+
+/* Look up the addresses for NAME and PORT and store a malloced array
+   with them at R_ADDRS and their number at R_NADDRS.  Addresses which
+   failed recently are put last.  Returns 0 on success or -1 if the
+   host is not known.  */
+static int
+dns_lookup (const char *name, unsigned short port,
+            dns_addr_t *r_addrs, unsigned int *r_naddrs)
+{
+  dns_cache_t dc;
+  dns_addr_t addrs;
+  time_t now = time (NULL);
+  unsigned int i, n;
+  int pass, good;
+
+  *r_addrs = NULL;
+  *r_naddrs = 0;
+
+  dc = dns_cache_find (name, port);
+  if (dc && dc->expires > now && dc->expires <= now + DNS_CACHE_TTL)
+    dns_cache_hits++;
+  else
+    {
+      dns_cache_misses++;
+      dc = dns_cache_update (name, port);
+    }
+  if (!dc || dc->not_found || !dc->naddrs)
+    return -1;
+  dc->used = now;
+
+  addrs = xtrymalloc (dc->naddrs * sizeof *addrs);
+  if (!addrs)
+    return -1;
+  for (n=0, pass=0; pass < 2; pass++)
+    for (i=0; i < dc->naddrs; i++)
+      {
+        good = (!dc->addrs[i].failed
+                || dc->addrs[i].failed + DNS_FAIL_PENALTY <= now);
+        if (pass? !good : good)
+          addrs[n++] = dc->addrs[i];
+      }
+  *r_addrs = addrs;
+  *r_naddrs = n;
+  return 0;
+}
+
+
+/* Record whether connecting to ADDR of NAME and PORT failed.  */
+static void
+dns_mark (const char *name, unsigned short port, dns_addr_t addr, int failed)
+{
+  dns_cache_t dc;
+  unsigned int i;
+
+  dc = dns_cache_find (name, port);
+  if (!dc)
+    return;
+  for (i=0; i < dc->naddrs; i++)
+    if (dc->addrs[i].addrlen == addr->addrlen
+        && !memcmp (&dc->addrs[i].addr, &addr->addr, addr->addrlen))
+      dc->addrs[i].failed = failed? time (NULL) : 0;
+}
+#endif /*HAVE_GETADDRINFO*/
+
+
+/* Refresh the cached addresses which are in use before they expire
+   and remove the others.  This should be called every few minutes
+   so that the lookups are not done by the requests.  */
+void
+http_dns_housekeeping (void)
+{
+#ifdef HAVE_GETADDRINFO
+  dns_cache_t dc, *dcp;
+  strlist_t names = NULL;
+  strlist_t sl;
+  time_t now = time (NULL);
+
+  for (dcp = &dns_cache; (dc = *dcp); )
+    {
+      if (dc->used + DNS_CACHE_IDLE <= now || dc->used > now
+          || (dc->not_found && dc->expires <= now))
+        {
+          *dcp = dc->next;
+          dns_cache_size--;
+          xfree (dc->addrs);
+          xfree (dc);
+          continue;
+        }
+      if (!dc->not_found && dc->expires <= now + DNS_CACHE_TTL / 2)
+        {
+          sl = add_to_strlist_try (&names, dc->name);
+          if (sl)
+            sl->flags = dc->port;
+        }
+      dcp = &dc->next;
+    }
+
+  /* The cache may change during the lookups and thus we use a copy of
+     the names.  */
+  for (sl = names; sl; sl = sl->next)
+    dns_cache_update (sl->d, sl->flags);
+  free_strlist (names);
+#endif /*HAVE_GETADDRINFO*/
+}
+
+
+/* Return the number of cached host names and the number of lookups
+   answered from the cache and not.  */
+void
+http_dns_stats (unsigned int *r_entries,
+                unsigned long *r_hits, unsigned long *r_misses)
+{
+#ifdef HAVE_GETADDRINFO
+  *r_entries = dns_cache_size;
+#else
+  *r_entries = 0;
+#endif
+  *r_hits = dns_cache_hits;
+  *r_misses = dns_cache_misses;
+}
+
+
 /* Actually connect to a server.  Returns the file descriptor or -1 on
    error.  ERRNO is set on error. */
 static int
@@ -2172,42 +3160,46 @@ connect_server (const char *server, unsigned short port,
   connected = 0;
   for (srv=0; srv < srvcount && !connected; srv++)
     {
-      struct addrinfo hints, *res, *ai;
-      char portstr[35];
+      dns_addr_t addrs, ai;
+      unsigned int naddrs, i;
 
-      snprintf (portstr, sizeof portstr, "%hu", port);
-      memset (&hints, 0, sizeof (hints));
-      hints.ai_socktype = SOCK_STREAM;
-      if (getaddrinfo (serverlist[srv].target, portstr, &hints, &res))
+      if (dns_lookup (serverlist[srv].target, port, &addrs, &naddrs))
         continue; /* Not found - try next one. */
       hostfound = 1;
 
-      for (ai = res; ai && !connected; ai = ai->ai_next)
+      for (i=0; i < naddrs && !connected; i++)
         {
-          if (ai->ai_family == AF_INET && (flags & HTTP_FLAG_IGNORE_IPv4))
+          ai = addrs + i;
+          if (ai->family == AF_INET && (flags & HTTP_FLAG_IGNORE_IPv4))
             continue;
-          if (ai->ai_family == AF_INET6 && (flags & HTTP_FLAG_IGNORE_IPv6))
+          if (ai->family == AF_INET6 && (flags & HTTP_FLAG_IGNORE_IPv6))
             continue;
 
           if (sock != -1)
             sock_close (sock);
-          sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+          sock = socket (ai->family, ai->socktype, ai->protocol);
           if (sock == -1)
             {
               int save_errno = errno;
               log_error ("error creating socket: %s\n", strerror (errno));
-              freeaddrinfo (res);
+              xfree (addrs);
               xfree (serverlist);
               errno = save_errno;
               return -1;
             }
 
-          if (my_connect (sock, ai->ai_addr, ai->ai_addrlen))
-            last_errno = errno;
+          if (my_connect (sock, (struct sockaddr *)&ai->addr, ai->addrlen))
+            {
+              last_errno = errno;
+              dns_mark (serverlist[srv].target, port, ai, 1);
+            }
           else
-            connected = 1;
+            {
+              connected = 1;
+              dns_mark (serverlist[srv].target, port, ai, 0);
+            }
         }
-      freeaddrinfo (res);
+      xfree (addrs);
     }
 #else /* !HAVE_GETADDRINFO */
   connected = 0;
@@ -2288,6 +3280,17 @@ connect_server (const char *server, unsigned short port,
       gpg_err_set_errno (last_errno);
       return -1;
     }
+
+#ifdef TCP_NODELAY
+  {
+    int on = 1;
+
+    /* The request is written in several small parts.  Don't let them
+       wait for the ACK of the previous part.  */
+    if (setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on))
+      log_info ("setsockopt(TCP_NODELAY) failed: %s\n", strerror (errno));
+  }
+#endif /*TCP_NODELAY*/
   return sock;
 }
 
@@ -2402,6 +3405,9 @@ cookie_read (void *cookie, void *buffer, size_t size)
       while (nread == -1 && errno == EINTR);
     }
 
+  if (nread > 0)
+    c->total_read += nread;
+
   if (c->content_length_valid && nread > 0)
     {
       if (nread < c->content_length)
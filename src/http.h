@@ -82,6 +82,7 @@ enum
     HTTP_FLAG_IGNORE_CL = 32,    /* Ignore content-length.  */
     HTTP_FLAG_IGNORE_IPv4 = 64,  /* Do not use IPv4.  */
     HTTP_FLAG_IGNORE_IPv6 = 128, /* Do not use IPv6.  */
+    HTTP_FLAG_KEEP_ALIVE = 256,  /* Reuse pooled connections.  */
     HTTP_FLAG_AUTH_BEARER = 512  /* Use Bearer authtype instead of Basic.  */
   };
 
@@ -129,6 +130,9 @@ void http_start_data (http_t hd);
 
 gpg_error_t http_wait_response (http_t hd);
 
+gpg_error_t http_read_body (http_t hd, char **r_buffer, size_t *r_length,
+                            size_t maxlen);
+
 void http_close (http_t hd, int keep_read_stream);
 
 gpg_error_t http_open_document (http_t *r_hd,
@@ -148,6 +152,15 @@ const char *http_get_header (http_t hd, const char *name);
 const char **http_get_header_names (http_t hd);
 gpg_error_t http_verify_server_credentials (http_session_t sess);
 
+void http_pool_housekeeping (void);
+void http_pool_stats (unsigned int *r_idle,
+                      unsigned long *r_opened, unsigned long *r_reused);
+void http_tls_stats (unsigned int *r_entries,
+                     unsigned long *r_handshakes, unsigned long *r_resumed);
+void http_dns_housekeeping (void);
+void http_dns_stats (unsigned int *r_entries,
+                     unsigned long *r_hits, unsigned long *r_misses);
+
 char *http_escape_string (const char *string, const char *specials);
 char *http_escape_data (const void *data, size_t datalen, const char *specials);
 
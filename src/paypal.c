@@ -28,7 +28,6 @@
 #include "util.h"
 #include "logging.h"
 #include "http.h"
-#include "membuf.h"
 #include "cJSON.h"
 #include "payprocd.h"
 #include "form.h"
@@ -75,7 +74,6 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
   gpg_error_t err;
   const char *urlprefix;
   char *url = NULL;
-  http_session_t session = NULL;
   http_t http = NULL;
   unsigned int status;
   estream_t fp;
@@ -100,10 +98,6 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
   if (!url)
     return gpg_error_from_syserror ();
 
-  err = http_session_new (&session, NULL);
-  if (err)
-    goto leave;
-
   if (opt.debug_paypal)
     {
       keyvalue_t kv;
@@ -125,10 +119,10 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
                    NULL,
                    authstring,
                    ((bearer? HTTP_FLAG_AUTH_BEARER : 0)
-                    | (opt.debug_paypal > 1? HTTP_FLAG_LOG_RESP : 0))
-                   ,
+                    | (opt.debug_paypal > 1? HTTP_FLAG_LOG_RESP : 0)
+                    | HTTP_FLAG_KEEP_ALIVE),
+                   NULL,
                    NULL,
-                   session,
                    NULL,
                    NULL);
   if (err)
@@ -186,18 +180,10 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
 
   if ((status / 100) == 2 || (status / 100) == 4 || (status / 100) == 5)
     {
-      int c;
-      membuf_t mb;
       char *jsonstr;
 
-      init_membuf (&mb, 1024);
-      while ((c = es_getc (http_get_read_ptr (http))) != EOF)
-        put_membuf_chr (&mb, c);
-      put_membuf_chr (&mb, 0);
-      jsonstr = get_membuf (&mb, NULL);
-      if (!jsonstr)
-        err = gpg_error_from_syserror ();
-      else
+      err = http_read_body (http, &jsonstr, NULL, 0);
+      if (!err)
         {
           cjson_t root;
 
@@ -233,7 +219,6 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
 
  leave:
   http_close (http, 0);
-  http_session_release (session);
   xfree (url);
   return err;
 }
@@ -21,6 +21,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/select.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 #include <gpg-error.h>
 
 #include "util.h"
@@ -42,6 +48,9 @@ enum opt_values
 
     oHTML,
     oSeparator,
+    oGroupBy,
+    oSum,
+    oFollow,
 
     oLast
   };
@@ -62,6 +71,9 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oSeparator, "separator", "|CHAR|use CHAR as output separator"),
   ARGPARSE_s_s (oField,  "field",    "|NAME|output field NAME"),
   ARGPARSE_s_s (oSelect, "select",   "|EXPR|output records matching EXPR"),
+  ARGPARSE_s_s (oGroupBy, "group-by", "|FIELDS|aggregate records by FIELDS"),
+  ARGPARSE_s_s (oSum,    "sum",      "|NAME|sum up field NAME (amount, euro)"),
+  ARGPARSE_s_n (oFollow, "follow",   "print records as they are appended"),
 
   ARGPARSE_end ()
 };
@@ -130,6 +142,64 @@ typedef struct outfield_s
 } *outfield_t;
 
 
+/* Definition for a group-by field.  */
+typedef struct groupfield_s
+{
+  struct groupfield_s *next;
+  unsigned int fnr;
+  unsigned int prefixlen;  /* If not 0 only this many bytes are used.  */
+  char name[1];
+} *groupfield_t;
+
+
+/* Pseudo fields which may be used with --group-by.  They map to a
+   prefix of the date field.  */
+static struct
+{
+  const char *name;
+  unsigned int prefixlen;
+} date_pseudo_fields[] =
+  {
+    { "_year",  4 },
+    { "_month", 6 },
+    { "_day",   8 }
+  };
+
+
+/* The fields which may be used with --sum.  */
+#define SUM_AMOUNT  1
+#define SUM_EURO    2
+
+/* The amounts are summed with this many post decimal digits, which is
+   the maximum a currency may have.  */
+#define AMOUNT_DIGITS 4
+
+
+/* An aggregation group.  AMOUNT is stored with AMOUNT_DIGITS post
+   decimal digits and AMOUNT_PREC is the largest number of such digits
+   of the summed amounts.  EURO is stored in cents.  */
+typedef struct group_s
+{
+  struct hashitem_s hi;   /* Keyed by the group-by field values.  */
+  unsigned long count;
+  money_t amount;
+  int amount_prec;
+  money_t euro;
+} *group_t;
+
+
+/* State of a journal file in follow mode.  */
+typedef struct followfile_s
+{
+  estream_t fp;
+  char *fname;
+  char suffix[8+1];    /* The date part of the file name.  */
+  unsigned int lnr;
+  char *buffer;
+  size_t buflen;
+} *followfile_t;
+
+
 /* Command line options.  */
 static struct
 {
@@ -139,6 +209,9 @@ static struct
   int ignorecase;
   outfield_t outfields;
   selectexpr_t selectexpr;
+  groupfield_t groupfields;
+  unsigned int sumfields;   /* Bit vector with SUM_ values.  */
+  int follow;
 } opt;
 
 
@@ -148,12 +221,19 @@ static int command;
 /* Total number of selected records so far.  */
 static unsigned int recordcount;
 
+/* The hash table with the aggregation groups.  */
+static struct hashtbl_s grouptbl;
+
 
 /* Local prototypes.  */
 static const char *get_fieldname (int fnr);
 static int parse_fieldname (char *name, int *r_meta, unsigned int *r_fnr);
 static selectexpr_t parse_selectexpr (const char *expr);
+static int parse_groupby (const char *string);
+static int parse_sumfield (const char *name);
 static void one_file (const char *fname);
+static void follow_journal (const char *name);
+static void print_groups (void);
 
 
 
@@ -247,6 +327,15 @@ main (int argc, char **argv)
 	    }
 	  break;
 
+        case oGroupBy:
+          parse_groupby (pargs.r.ret_str);
+          break;
+
+        case oSum:
+          parse_sumfield (pargs.r.ret_str);
+          break;
+
+        case oFollow: opt.follow = 1; break;
 
         default: pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
@@ -254,11 +343,32 @@ main (int argc, char **argv)
 
   if (log_get_errorcount (0))
     exit (2);
-  if (!command)
+  if (opt.follow)
+    {
+      if ((command && command != aPrint) || opt.groupfields || opt.sumfields)
+        {
+          log_error ("--follow can only be used with --print\n");
+          exit (2);
+        }
+      if (argc != 1)
+        {
+          log_error ("--follow requires exactly one journal name\n");
+          exit (2);
+        }
+      command = aPrint;
+    }
+  else if (!command && opt.sumfields)
+    ; /* Aggregation mode without counting.  */
+  else if (!command)
     {
       log_info ("no command given - assuming '--count'\n");
       command = aCount;
     }
+  if (command == aPrint && (opt.groupfields || opt.sumfields))
+    {
+      log_error ("--print can't be used with --group-by or --sum\n");
+      exit (2);
+    }
 
   /* Debug output.  */
   if (opt.outfields && opt.verbose > 1)
@@ -296,13 +406,18 @@ main (int argc, char **argv)
     }
 
   /* Process all files.  */
-  for (; argc; argc--, argv++)
+  if (opt.follow)
+    follow_journal (*argv);
+  else
     {
-      one_file (*argv);
+      for (; argc; argc--, argv++)
+        one_file (*argv);
     }
 
   /* Print totals.  */
-  if (command == aCount)
+  if (opt.groupfields || opt.sumfields)
+    print_groups ();
+  else if (command == aCount)
     es_printf ("%u\n", recordcount);
 
   return !!log_get_errorcount (0);
@@ -545,6 +660,90 @@ parse_selectexpr (const char *expr)
 }
 
 
+/* Parse the comma delimited list of field names in STRING and append
+   them to the list of group-by fields.  Besides the regular field
+   names the pseudo fields "_year", "_month", and "_day" may be used
+   to group by a part of the date.  Returns 0 on success.  */
+static int
+parse_groupby (const char *string)
+{
+  char **tokens;
+  groupfield_t gf, gf2;
+  int meta;
+  int i, j;
+  int rc = 0;
+
+  tokens = strtokenize (string, ",");
+  if (!tokens)
+    log_fatal ("strtokenize failed: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+
+  for (i=0; tokens[i] && !rc; i++)
+    {
+      if (!*tokens[i])
+        {
+          log_error ("empty field name in --group-by\n");
+          rc = -1;
+          break;
+        }
+
+      gf = xmalloc (sizeof *gf + strlen (tokens[i]));
+      strcpy (gf->name, tokens[i]);
+      gf->next = NULL;
+      gf->fnr = 0;
+      gf->prefixlen = 0;
+
+      for (j=0; j < DIM (date_pseudo_fields); j++)
+        if (!strcmp (gf->name, date_pseudo_fields[j].name))
+          break;
+      if (j < DIM (date_pseudo_fields))
+        {
+          gf->fnr = JRNL_FIELD_DATE + 1;
+          gf->prefixlen = date_pseudo_fields[j].prefixlen;
+        }
+      else if (parse_fieldname (gf->name, &meta, &gf->fnr))
+        rc = -1;
+      else if (meta || !gf->fnr)
+        {
+          log_error ("field '%s' can't be used with --group-by\n",
+                     tokens[i]);
+          rc = -1;
+        }
+
+      if (rc)
+        xfree (gf);
+      else if (!(gf2 = opt.groupfields))
+        opt.groupfields = gf;
+      else
+        {
+          for (; gf2->next; gf2 = gf2->next)
+            ;
+          gf2->next = gf;
+        }
+    }
+
+  xfree (tokens);
+  return rc;
+}
+
+
+/* Parse the --sum argument NAME.  Returns 0 on success.  */
+static int
+parse_sumfield (const char *name)
+{
+  if (!strcmp (name, JRNL_FIELD_NAME_AMOUNT))
+    opt.sumfields |= SUM_AMOUNT;
+  else if (!strcmp (name, JRNL_FIELD_NAME_EURO))
+    opt.sumfields |= SUM_EURO;
+  else
+    {
+      log_error ("field '%s' can't be used with --sum\n", name);
+      return -1;
+    }
+  return 0;
+}
+
+
 /* Return true if the record RECORD has been selected.  Note that
    selection on meta fields is not yet functional.  */
 static int
@@ -753,6 +952,163 @@ print_meta (char *buffer, const char *name)
 }
 
 
+/* Add the record given by FIELD and NFIELDS to its group.  Returns 0
+   on success.  */
+static int
+aggregate_record (const char *fname, unsigned int lnr,
+                  char **field, int nfields)
+{
+  char keybuf[256];
+  char *key = keybuf;
+  size_t keysize = sizeof keybuf;
+  size_t keylen = 0;
+  size_t n;
+  groupfield_t gf;
+  const char *value;
+  group_t grp;
+  money_t cents;
+  const char *s;
+  int prec;
+
+  /* Build the key by concatenating the values of the group-by fields
+     delimited by a colon.  Journal fields never contain a colon.  */
+  for (gf = opt.groupfields; gf; gf = gf->next)
+    {
+      value = gf->fnr-1 < nfields? field[gf->fnr-1] : "";
+      n = strlen (value);
+      if (gf->prefixlen && n > gf->prefixlen)
+        n = gf->prefixlen;
+      if (keylen + n + 2 > keysize)
+        {
+          keysize = 2 * (keylen + n + 2);
+          if (key == keybuf)
+            {
+              key = xmalloc (keysize);
+              memcpy (key, keybuf, keylen);
+            }
+          else
+            key = xrealloc (key, keysize);
+        }
+      if (gf != opt.groupfields)
+        key[keylen++] = ':';
+      memcpy (key + keylen, value, n);
+      keylen += n;
+    }
+  key[keylen] = 0;
+
+  grp = hashtbl_find_create (&grouptbl, key, keylen, sizeof *grp);
+  if (key != keybuf)
+    xfree (key);
+
+  grp->count++;
+  if ((opt.sumfields & SUM_AMOUNT) && nfields > JRNL_FIELD_AMOUNT
+      && *field[JRNL_FIELD_AMOUNT])
+    {
+      /* The amount has as many post decimal digits as its currency;
+         thus we can take them from the string.  */
+      s = strchr (field[JRNL_FIELD_AMOUNT], '.');
+      prec = s? strlen (s+1) : 0;
+      if (parse_money (field[JRNL_FIELD_AMOUNT], AMOUNT_DIGITS, &cents))
+        {
+          log_error ("%s:%u: invalid value in field '%s'\n",
+                     fname, lnr, JRNL_FIELD_NAME_AMOUNT);
+          return -1;
+        }
+      grp->amount += cents;
+      if (prec > grp->amount_prec)
+        grp->amount_prec = prec;
+    }
+  if ((opt.sumfields & SUM_EURO) && nfields > JRNL_FIELD_EURO
+      && *field[JRNL_FIELD_EURO])
+    {
+      if (parse_money (field[JRNL_FIELD_EURO], 2, &cents))
+        {
+          log_error ("%s:%u: invalid value in field '%s'\n",
+                     fname, lnr, JRNL_FIELD_NAME_EURO);
+          return -1;
+        }
+      grp->euro += cents;
+    }
+
+  return 0;
+}
+
+
+/* Sort function for print_groups.  */
+static int
+sort_groups_cmp (const void *xa, const void *xb)
+{
+  const group_t *a = xa;
+  const group_t *b = xb;
+
+  return strcmp ((*a)->hi.key, (*b)->hi.key);
+}
+
+
+/* Print all groups sorted by their key.  Each line has the values of
+   the group-by fields followed by the count and the sums.  */
+static void
+print_groups (void)
+{
+  group_t *array;
+  group_t grp;
+  unsigned int i, n;
+  char *p, *pend;
+  char amountbuf[AMOUNTBUF_SIZE];
+  money_t scale;
+  int prec, ncols, k;
+
+  array = hashtbl_items (&grouptbl);
+  n = grouptbl.count;
+  qsort (array, n, sizeof *array, sort_groups_cmp);
+
+  for (i=0; i < n; i++)
+    {
+      grp = array[i];
+      ncols = 0;
+      for (p = grp->hi.key; opt.groupfields; p = pend + 1)
+        {
+          pend = strchr (p, ':');
+          if (pend)
+            *pend = 0;
+          if (ncols++)
+            es_putc (opt.separator, es_stdout);
+          print_string (p);
+          if (!pend)
+            break;
+          *pend = ':';
+        }
+      if (command == aCount)
+        {
+          if (ncols++)
+            es_putc (opt.separator, es_stdout);
+          es_printf ("%lu", grp->count);
+        }
+      if ((opt.sumfields & SUM_AMOUNT))
+        {
+          /* Print at least 2 digits as done for the Euro.  */
+          prec = grp->amount_prec < 2? 2 : grp->amount_prec;
+          for (scale = 1, k = prec; k < AMOUNT_DIGITS; k++)
+            scale *= 10;
+          if (ncols++)
+            es_putc (opt.separator, es_stdout);
+          es_fputs (format_money (amountbuf, sizeof amountbuf,
+                                  grp->amount / scale, prec), es_stdout);
+        }
+      if ((opt.sumfields & SUM_EURO))
+        {
+          if (ncols++)
+            es_putc (opt.separator, es_stdout);
+          es_fputs (format_money (amountbuf, sizeof amountbuf,
+                                  grp->euro, 2), es_stdout);
+        }
+      es_putc ('\n', es_stdout);
+    }
+
+  xfree (array);
+}
+
+
 /* Process one journal line.  LINE has no trailing LF.  The function
    may change LINE.  */
 static int
@@ -783,7 +1139,9 @@ one_line (const char *fname, unsigned int lnr, char *line)
   recordcount++;
 
   /* Process.  */
-  if (command == aCount)
+  if (opt.groupfields || opt.sumfields)
+    return aggregate_record (fname, lnr, field, nfields);
+  else if (command == aCount)
     ;
   else if (command == aPrint)
     {
@@ -864,3 +1222,213 @@ one_file (const char *fname)
   es_free (buffer);
   es_fclose (fp);
 }
+
+
+
+/* Return the base name of the journal given by NAME as a malloced
+   string.  NAME may either be the name as used with the --journal
+   option of payprocd or the name of a journal file; i.e. the base
+   name suffixed with "-YYYYMMDD.log".  */
+static char *
+journal_basename (const char *name)
+{
+  char *base;
+  size_t n;
+  int i;
+
+  base = xstrdup (name);
+  n = strlen (base);
+  if (n > 13 && !strcmp (base + n - 4, ".log") && base[n-13] == '-')
+    {
+      for (i=n-12; i < n-4 && digitp (base+i); i++)
+        ;
+      if (i == n-4)
+        base[n-13] = 0;
+    }
+  return base;
+}
+
+
+/* Close the journal file described by FF.  */
+static void
+follow_close (followfile_t ff)
+{
+  es_fclose (ff->fp);
+  ff->fp = NULL;
+  xfree (ff->fname);
+  ff->fname = NULL;
+  es_free (ff->buffer);
+  ff->buffer = NULL;
+  ff->buflen = 0;
+  ff->lnr = 0;
+  *ff->suffix = 0;
+}
+
+
+/* Process all complete lines which have been appended to the journal
+   file described by FF.  An incomplete last line is left for the
+   next call.  If SKIP is set the lines are only counted.  */
+static void
+follow_read_lines (followfile_t ff, int skip)
+{
+  gpg_error_t err;
+  ssize_t nread;
+  off_t offset;
+
+  for (;;)
+    {
+      offset = es_ftello (ff->fp);
+      nread = es_read_line (ff->fp, &ff->buffer, &ff->buflen, NULL);
+      if (nread < 0)
+        {
+          err = gpg_error_from_syserror ();
+          log_error ("error reading '%s': %s\n", ff->fname, gpg_strerror (err));
+          break;
+        }
+      if (!nread)
+        break;  /* EOF.  */
+      if (ff->buffer[nread-1] != '\n')
+        {
+          /* The writer has not yet finished the line.  Rewind so that
+             we read it again after the next change.  */
+          if (offset == (off_t)(-1) || es_fseeko (ff->fp, offset, SEEK_SET))
+            log_error ("error seeking in '%s': %s\n", ff->fname,
+                       gpg_strerror (gpg_error_from_syserror ()));
+          break;
+        }
+      ff->lnr++;
+      ff->buffer[--nread] = 0;
+      if (nread && ff->buffer[nread-1] == '\r')
+        ff->buffer[--nread] = 0;
+      if (nread && !skip)
+        one_line (ff->fname, ff->lnr, ff->buffer);
+    }
+  es_clearerr (ff->fp);
+}
+
+
+/* Wait until the journal directory has changed or a timeout
+   occurred.  INFD is the inotify descriptor or -1 to poll.  */
+static void
+follow_wait (int infd)
+{
+  fd_set rfds;
+  struct timeval tv;
+  char buffer[4096];
+
+  if (infd == -1)
+    {
+      usleep (500 * 1000);
+      return;
+    }
+
+  FD_ZERO (&rfds);
+  FD_SET (infd, &rfds);
+  /* The timeout is a safeguard for a missed day switch.  */
+  tv.tv_sec = 10;
+  tv.tv_usec = 0;
+  if (select (infd+1, &rfds, NULL, NULL, &tv) > 0)
+    {
+      /* We only need to know that something happened; thus we
+         discard the events.  */
+      if (read (infd, buffer, sizeof buffer) < 0 && errno != EINTR)
+        log_error ("error reading inotify events: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+    }
+}
+
+
+/* Follow the journal NAME and process new records as they are
+   appended.  Like payprocd's write_log this switches to the file of
+   the next day as soon as that file appears; the file of the
+   previous day is still watched for late records until the next
+   switch.  Records already in the file at startup are skipped.  This
+   function does not return.  */
+static void
+follow_journal (const char *name)
+{
+  gpg_error_t err;
+  char *basename, *dirname, *p;
+  char *fname;
+  char today[TIMESTAMP_SIZE];
+  struct followfile_s cur = { NULL };
+  struct followfile_s prev = { NULL };
+  estream_t fp;
+  int infd = -1;
+  int skip = 1;
+
+  basename = journal_basename (name);
+
+#ifdef HAVE_SYS_INOTIFY_H
+  dirname = xstrdup (basename);
+  p = strrchr (dirname, '/');
+  if (p)
+    p[p == dirname? 1 : 0] = 0;
+  else
+    strcpy (dirname, ".");
+  infd = inotify_init ();
+  if (infd == -1)
+    log_info ("inotify not available: %s - polling\n",
+              gpg_strerror (gpg_error_from_syserror ()));
+  else if (inotify_add_watch (infd, dirname,
+                              (IN_CREATE | IN_MODIFY | IN_MOVED_TO)) == -1)
+    {
+      log_info ("error watching '%s': %s - polling\n",
+                dirname, gpg_strerror (gpg_error_from_syserror ()));
+      close (infd);
+      infd = -1;
+    }
+  xfree (dirname);
+#else
+  (void)dirname;
+  (void)p;
+#endif
+
+  for (;;)
+    {
+      get_current_time (today);
+      if (!cur.fp || strncmp (cur.suffix, today, 8))
+        {
+          today[8] = 0;
+          fname = strconcat (basename, "-", today, ".log", NULL);
+          if (!fname)
+            log_fatal ("strconcat failed: %s\n",
+                       gpg_strerror (gpg_error_from_syserror ()));
+          fp = es_fopen (fname, "r");
+          if (!fp)
+            {
+              err = gpg_error_from_syserror ();
+              if (gpg_err_code (err) != GPG_ERR_ENOENT)
+                log_error ("error opening '%s': %s\n",
+                           fname, gpg_strerror (err));
+              xfree (fname);
+            }
+          else
+            {
+              if (opt.verbose)
+                log_info ("following '%s'\n", fname);
+              if (cur.fp)
+                {
+                  follow_read_lines (&cur, 0);
+                  follow_close (&prev);
+                  prev = cur;
+                }
+              memset (&cur, 0, sizeof cur);
+              cur.fp = fp;
+              cur.fname = fname;
+              strcpy (cur.suffix, today);
+            }
+        }
+
+      if (prev.fp)
+        follow_read_lines (&prev, 0);
+      if (cur.fp)
+        follow_read_lines (&cur, skip);
+      skip = 0;
+      if (es_fflush (es_stdout))
+        log_fatal ("error writing to stdout: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+
+      follow_wait (infd);
+    }
+}
@@ -40,6 +40,7 @@
 #include "util.h"
 #include "logging.h"
 #include "argparse.h"
+#include "membuf.h"
 #include "protocol-io.h"
 
 
@@ -56,6 +57,7 @@ enum opt_values
     aSepaPreorder,
     aGetPreorder,
     aListPreorder,
+    aBulkSepa,
 
     oLive,
     oTest,
@@ -73,6 +75,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_c (aSepaPreorder, "sepa-preorder",  "Insert a SEPA preorder"),
   ARGPARSE_c (aGetPreorder,  "get-preorder",   "Read one preorder"),
   ARGPARSE_c (aListPreorder,  "list-preorder",  "List preorders"),
+  ARGPARSE_c (aBulkSepa, "bulk-sepa",
+              "Post the SEPA transactions of a bank statement"),
 
   ARGPARSE_group (301, "@\nOptions:\n "),
   ARGPARSE_s_n (oVerbose, "verbose",  "verbose diagnostics"),
@@ -92,12 +96,25 @@ static struct
 
 
 
+/* An entry of a bank statement.  */
+struct bulk_item_s
+{
+  unsigned int lnr;   /* Line or entry number in the statement.  */
+  char ref[9];        /* The Sepa-Ref or empty if not found.  */
+  char *amount;       /* The amount or NULL if not valid.  */
+  char *recur;        /* The optional recur value or NULL.  */
+  int reqidx;         /* Index in the request or -1 if not sent.  */
+};
+typedef struct bulk_item_s *bulk_item_t;
+
+
 /* Local prototypes.  */
 static gpg_error_t send_request (const char *command,
                                  keyvalue_t indata, keyvalue_t *outdata);
 static void post_sepa (const char *refstring, const char *amountstr);
 static void getpreorder (const char *refstring);
 static void listpreorder (const char *refstring);
+static void bulk_sepa (estream_t fp);
 static void sepapreorder (const char *amountstr, const char *name,
                           const char *email, const char *desc);
 
@@ -120,6 +137,7 @@ my_strusage( int level )
     case 41:
       p = ("Syntax: payproc-post [options] [--sepa] REF AMOUNT\n"
            "        payproc-post [options] --sepa-preorder AMOUNT\n"
+           "        payproc-post [options] --bulk-sepa < STATEMENT\n"
            "Enter a posting to the payproc journal\n");
       break;
     default: p = NULL; break;
@@ -164,6 +182,7 @@ main (int argc, char **argv)
         case aSepaPreorder:
         case aGetPreorder:
         case aListPreorder:
+        case aBulkSepa:
           if (cmd && cmd != pargs.r_opt)
             {
               log_error ("conflicting commands\n");
@@ -225,6 +244,12 @@ main (int argc, char **argv)
         wrong_args ("--list-preorder [NN]");
       listpreorder (argc? argv[0] : NULL);
     }
+  else if (cmd == aBulkSepa)
+    {
+      if (argc)
+        wrong_args ("--bulk-sepa < STATEMENT");
+      bulk_sepa (es_stdin);
+    }
   else if (cmd == aSepaPreorder)
     {
       if (!argc || argc > 4)
@@ -354,6 +379,7 @@ post_sepa (const char *refstring, const char *amountstr_arg)
   keyvalue_t output = NULL;
   keyvalue_t kv;
   char *amountstr;
+  money_t cents;
   int recur = 0;
   int force_single = 0;
   char *p;
@@ -372,7 +398,7 @@ post_sepa (const char *refstring, const char *amountstr_arg)
         force_single = 1;
     }
 
-  if (!*amountstr || !convert_amount (amountstr, 2))
+  if (parse_money (amountstr, 2, &cents) || cents <= 0)
     {
       log_error ("Syntax error in amount or value is not positive\n");
       xfree (amountstr);
@@ -526,6 +552,7 @@ sepapreorder (const char *amountstr_arg, const char *name,
   keyvalue_t output = NULL;
   keyvalue_t kv;
   char *amountstr;
+  money_t cents;
   char *p;
   int recur = 0;
 
@@ -539,7 +566,7 @@ sepapreorder (const char *amountstr_arg, const char *name,
       recur = atoi (p);
     }
 
-  if (!*amountstr || !convert_amount (amountstr, 2))
+  if (parse_money (amountstr, 2, &cents) || cents <= 0)
     {
       log_error ("Syntax error in amount or value is not positive\n");
       xfree (amountstr);
@@ -578,3 +605,307 @@ sepapreorder (const char *amountstr_arg, const char *name,
   keyvalue_release (output);
   xfree (amountstr);
 }
+
+
+/* Search for a Sepa-Ref in the LEN bytes at TEXT and store it in
+   uppercase at BUFFER which must have a size of 9.  Returns true if
+   one was found.  See make_sepa_ref in preorder.c for the format.  */
+static int
+find_sepa_ref (const char *text, size_t len, char *buffer)
+{
+  static const char codes[] = "ABCDEGHJKLNRSTWXYZ0123456789";
+  size_t i;
+  int j, c;
+
+  for (i=0; i + 8 <= len; i++)
+    {
+      if (i && isalnum (((const unsigned char *)text)[i-1]))
+        continue;
+      for (j=0; j < 5; j++)
+        {
+          c = text[i+j];
+          if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+          if (!c || !strchr (codes, c) || (!j && digitp (text + i)))
+            break;
+          buffer[j] = c;
+        }
+      if (j < 5 || text[i+5] != '-'
+          || !digitp (text + i + 6) || !digitp (text + i + 7)
+          || text[i+6] == '0'
+          || (i + 8 < len && isalnum (((const unsigned char *)text)[i+8])))
+        continue;
+      buffer[5] = '-';
+      buffer[6] = text[i+6];
+      buffer[7] = text[i+7];
+      buffer[8] = 0;
+      return 1;
+    }
+  return 0;
+}
+
+
+/* Return the content of the first element NAME in the range from
+   START to END of an XML document.  The length of the content is
+   stored at R_LEN.  Returns NULL if no such element was found.  */
+static const char *
+find_xml_element (const char *start, const char *end, const char *name,
+                  size_t *r_len)
+{
+  size_t n = strlen (name);
+  const char *s, *p;
+
+  for (s = start; s + n + 2 < end; s++)
+    {
+      if (*s != '<' || strncmp (s+1, name, n)
+          || (s[n+1] != '>' && s[n+1] != ' '))
+        continue;
+      p = memchr (s, '>', end - s);
+      if (!p || p[-1] == '/')
+        return NULL;
+      p++;
+      for (s = p; s + n + 3 <= end; s++)
+        if (s[0] == '<' && s[1] == '/' && !strncmp (s+2, name, n)
+            && s[n+2] == '>')
+          {
+            *r_len = s - p;
+            return p;
+          }
+      return NULL;
+    }
+  return NULL;
+}
+
+
+/* Append an item for line LNR with the remittance text TEXT of length
+   TEXTLEN, the amount AMOUNT, and the optional recur value RECUR to
+   the array at ITEMSP which has *NITEMSP items.  */
+static void
+add_bulk_item (bulk_item_t *itemsp, unsigned int *nitemsp,
+               unsigned int lnr, const char *text, size_t textlen,
+               const char *amount, const char *recur)
+{
+  bulk_item_t item;
+  money_t cents;
+  char *p;
+
+  if (!(*nitemsp % 256))
+    *itemsp = xrealloc (*itemsp, (*nitemsp + 256) * sizeof **itemsp);
+  item = *itemsp + (*nitemsp)++;
+  memset (item, 0, sizeof *item);
+  item->lnr = lnr;
+  item->reqidx = -1;
+  if (!find_sepa_ref (text, textlen, item->ref))
+    *item->ref = 0;
+
+  /* Allow for a decimal comma as used by some banks.  */
+  item->amount = xstrdup (*amount == '+'? amount+1 : amount);
+  if (!strchr (item->amount, '.') && (p = strchr (item->amount, ',')))
+    *p = '.';
+  if (parse_money (item->amount, 2, &cents) || cents <= 0)
+    {
+      xfree (item->amount);
+      item->amount = NULL;
+    }
+  item->recur = recur && *recur? xstrdup (recur) : NULL;
+}
+
+
+/* Parse a CSV bank statement in the string TEXT.  Each line has the
+   fields TEXT, AMOUNT, and optionally RECUR separated by a semicolon
+   or, if there is no semicolon in the line, by a comma.  TEXT is
+   searched for the Sepa-Ref.  Empty lines, comment lines, a header
+   line, and debit entries are skipped.  */
+static void
+parse_csv_statement (char *text, bulk_item_t *itemsp, unsigned int *nitemsp)
+{
+  char *line, *p;
+  char **fields;
+  unsigned int lnr = 0;
+  int i;
+
+  for (line = text; line && *line; line = p)
+    {
+      lnr++;
+      p = strchr (line, '\n');
+      if (p)
+        *p++ = 0;
+      trim_spaces (line);
+      if (!*line || *line == '#')
+        continue;
+
+      fields = strtokenize (line, strchr (line, ';')? ";" : ",");
+      if (!fields)
+        log_fatal ("strtokenize failed: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+      for (i=0; fields[i]; i++)
+        {
+          /* Remove quotes.  */
+          size_t n = strlen (fields[i]);
+          if (n > 1 && fields[i][0] == '"' && fields[i][n-1] == '"')
+            {
+              fields[i][n-1] = 0;
+              fields[i]++;
+            }
+        }
+
+      if (!fields[0] || !fields[1])
+        log_error ("line %u: %s\n", lnr, "not enough fields");
+      else if (*fields[1] == '-')
+        {
+          if (opt.verbose)
+            log_info ("line %u: %s\n", lnr, "skipping debit entry");
+        }
+      else if (lnr == 1 && !digitp (fields[1]) && *fields[1] != '+')
+        ; /* Header line.  */
+      else
+        add_bulk_item (itemsp, nitemsp, lnr, fields[0], strlen (fields[0]),
+                       fields[1], fields[2]);
+      xfree (fields);
+    }
+}
+
+
+/* Parse a CAMT (ISO 20022 camt.053 or camt.054) bank statement in the
+   string TEXT.  Only the credit entries are used.  The Sepa-Ref is
+   searched in the unstructured remittance information of an entry.
+   This is not a full XML parser; namespace prefixes are not
+   supported.  */
+static void
+parse_camt_statement (const char *text, bulk_item_t *itemsp,
+                      unsigned int *nitemsp)
+{
+  const char *ntry, *end, *s, *ustrd;
+  size_t len, ustrdlen;
+  unsigned int entry = 0;
+  char amount[40];
+
+  for (ntry = text; (ntry = strstr (ntry, "<Ntry>")); ntry = end)
+    {
+      entry++;
+      end = strstr (ntry, "</Ntry>");
+      if (!end)
+        {
+          log_error ("entry %u: %s\n", entry, "not terminated");
+          break;
+        }
+
+      s = find_xml_element (ntry, end, "CdtDbtInd", &len);
+      if (!s || len != 4 || strncmp (s, "CRDT", 4))
+        {
+          if (opt.verbose)
+            log_info ("entry %u: %s\n", entry, "skipping debit entry");
+          continue;
+        }
+      s = find_xml_element (ntry, end, "Amt", &len);
+      if (!s || len >= sizeof amount)
+        {
+          log_error ("entry %u: %s\n", entry, "amount missing");
+          continue;
+        }
+      memcpy (amount, s, len);
+      amount[len] = 0;
+      ustrd = find_xml_element (ntry, end, "Ustrd", &ustrdlen);
+      add_bulk_item (itemsp, nitemsp, entry,
+                     ustrd? ustrd : "", ustrd? ustrdlen : 0, amount, NULL);
+    }
+}
+
+
+/* Read a bank statement from FP, commit all payments for Sepa-Refs
+   in one transaction, and report those which do not match a preorder.
+   The statement may be in CSV or in CAMT format.  */
+static void
+bulk_sepa (estream_t fp)
+{
+  gpg_error_t err = 0;
+  membuf_t mb;
+  char buffer[4096];
+  size_t nread;
+  char *text;
+  const char *s;
+  bulk_item_t items = NULL;
+  unsigned int nitems = 0;
+  unsigned int i, count;
+  keyvalue_t input = NULL;
+  keyvalue_t output = NULL;
+  char key[40];
+
+  init_membuf (&mb, 65536);
+  while (!es_read (fp, buffer, sizeof buffer, &nread) && nread)
+    put_membuf (&mb, buffer, nread);
+  if (es_ferror (fp))
+    log_fatal ("error reading the statement: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+  put_membuf_chr (&mb, 0);
+  text = get_membuf (&mb, NULL);
+  if (!text)
+    log_fatal ("error reading the statement: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+
+  for (s = text; ascii_isspace (*s); s++)
+    ;
+  if (*s == '<')
+    parse_camt_statement (text, &items, &nitems);
+  else
+    parse_csv_statement (text, &items, &nitems);
+
+  /* Report the entries we can't use and send the others.  */
+  for (count=i=0; i < nitems; i++)
+    {
+      if (!*items[i].ref)
+        log_error ("item %u: %s\n", items[i].lnr, "no Sepa-Ref found");
+      else if (!items[i].amount)
+        log_error ("item %u: %s: %s\n", items[i].lnr, items[i].ref,
+                   "invalid amount");
+      else
+        {
+          snprintf (key, sizeof key, "Sepa-Ref[%u]", count);
+          err = keyvalue_put (&input, key, items[i].ref);
+          snprintf (key, sizeof key, "Amount[%u]", count);
+          if (!err)
+            err = keyvalue_put (&input, key, items[i].amount);
+          snprintf (key, sizeof key, "Recur[%u]", count);
+          if (!err && items[i].recur)
+            err = keyvalue_put (&input, key, items[i].recur);
+          if (err)
+            log_fatal ("keyvalue_put failed: %s\n", gpg_strerror (err));
+          items[i].reqidx = count++;
+        }
+    }
+
+  if (count)
+    {
+      snprintf (key, sizeof key, "%u", count);
+      err = keyvalue_put (&input, "Count", key);
+      if (err)
+        log_fatal ("keyvalue_put failed: %s\n", gpg_strerror (err));
+      if (!send_request ("COMMITPREORDERS", input, &output))
+        {
+          for (i=0; i < nitems; i++)
+            {
+              if (items[i].reqidx < 0)
+                continue;
+              snprintf (key, sizeof key, "Failure[%d]", items[i].reqidx);
+              if ((s = keyvalue_get (output, key)))
+                log_error ("item %u: %s %s: %s\n", items[i].lnr,
+                           items[i].ref, items[i].amount, s);
+            }
+          es_printf ("Number of records: %u\n", nitems);
+          es_printf ("Committed records: %u\n",
+                     keyvalue_get_uint (output, "Committed"));
+        }
+    }
+  else
+    es_printf ("Number of records: %u\n", nitems);
+
+  for (i=0; i < nitems; i++)
+    {
+      xfree (items[i].amount);
+      xfree (items[i].recur);
+    }
+  xfree (items);
+  xfree (text);
+  keyvalue_release (input);
+  keyvalue_release (output);
+}
@@ -42,6 +42,39 @@
   SUBS  - The pledged Euro amount projected to a year in that month.
   SYR   - The number of subscription records in that year
   SUBSYR- The pledged Euro amount projected to a year in that year.
+
+  With the option --checkpoint a second file is maintained which
+  records how far each journal file has been processed.  Each line
+  describes one journal file:
+
+    OFFSET:RECORDS:FILE
+
+  OFFSET - The byte offset after the last processed line.
+  RECORDS- The number of lines (records) up to OFFSET.
+  FILE   - The name of the journal file as given on the command line.
+
+  On the next run with --update and the same checkpoint file only the
+  bytes appended after OFFSET are read.  The stat file given to
+  --update must be the output of the run which wrote the checkpoint.
+
+  With the option --rollup DIMS a different output is created.  The
+  journals are read once into a table keyed by day, currency,
+  service and recurrence; for each --rollup option this table is then
+  summarized by the comma delimited dimensions DIMS:
+
+    year     - the year (YYYY)
+    month    - the month (YYYYMM)
+    week     - the ISO 8601 week (YYYYWww)
+    day      - the day (YYYYMMDD)
+    currency - the currency of the record
+    service  - the payment service number
+    recur    - the recurrence (0 for charges)
+
+  Each line has the values of the dimensions in the given order
+  followed by N:EURO:S:SUBS with the same meaning as in the monthly
+  statistics.  The lines are sorted by the dimension values.  If
+  several --rollup options are given their blocks are separated by an
+  empty line.
  */
 
 
@@ -53,6 +86,8 @@
 #include <gpg-error.h>
 #include <assert.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <npth.h>
 
 #include "util.h"
 #include "logging.h"
@@ -67,8 +102,11 @@ enum opt_values
     oIgnoreCase = 'i',
     oSelect     = 'S',
     oUpdate     = 'u',
+    oJobs       = 'j',
 
     oSeparator  = 500,
+    oCheckpoint,
+    oRollup,
 
     oLast
   };
@@ -83,6 +121,10 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oSeparator, "separator", "|CHAR|use CHAR as output separator"),
   ARGPARSE_s_s (oSelect, "select",   "|EXPR|output records matching EXPR"),
   ARGPARSE_s_s (oUpdate, "update",   "|FILE|update FILE and print to stdout"),
+  ARGPARSE_s_i (oJobs,   "jobs",     "|N|use N threads to read the journals"),
+  ARGPARSE_s_s (oCheckpoint, "checkpoint",
+                "|FILE|resume reading the journals as recorded in FILE"),
+  ARGPARSE_s_s (oRollup, "rollup", "|DIMS|print statistics by DIMS"),
 
   ARGPARSE_end ()
 };
@@ -142,6 +184,42 @@ typedef struct selectexpr_s
 } *selectexpr_t;
 
 
+/* The dimensions for --rollup.  */
+typedef enum
+  {
+    ROLLUP_YEAR,
+    ROLLUP_MONTH,
+    ROLLUP_WEEK,
+    ROLLUP_DAY,
+    ROLLUP_CURRENCY,
+    ROLLUP_SERVICE,
+    ROLLUP_RECUR
+  } rollup_dim_t;
+
+static struct
+{
+  const char *name;
+  rollup_dim_t dim;
+} rollup_dim_names[] =
+  {
+    { "year",     ROLLUP_YEAR },
+    { "month",    ROLLUP_MONTH },
+    { "week",     ROLLUP_WEEK },
+    { "day",      ROLLUP_DAY },
+    { "currency", ROLLUP_CURRENCY },
+    { "service",  ROLLUP_SERVICE },
+    { "recur",    ROLLUP_RECUR }
+  };
+
+/* Definition of a roll-up.  */
+typedef struct rollup_s
+{
+  struct rollup_s *next;
+  unsigned int ndims;
+  rollup_dim_t dims[DIM (rollup_dim_names)];
+} *rollup_t;
+
+
 /* Command line options.  */
 static struct
 {
@@ -150,6 +228,9 @@ static struct
   int ignorecase;
   selectexpr_t selectexpr;
   const char *updatefile;
+  const char *checkpointfile;
+  rollup_t rollups;
+  int jobs;
 } opt;
 
 
@@ -162,17 +243,13 @@ struct stat_record_s
   int year;
   int month;
   unsigned int n;
-  unsigned long euro;
-  unsigned long cent;
+  money_t euro;           /* The amounts are all in cents.  */
   unsigned int nyr;
-  unsigned long euroyr;
-  unsigned long centyr;
+  money_t euroyr;
   unsigned int subs_n;
-  unsigned long subs_euro;
-  unsigned long subs_cent;
+  money_t subs_euro;
   unsigned int subs_nyr;
-  unsigned long subs_euroyr;
-  unsigned long subs_centyr;
+  money_t subs_euroyr;
   char tag[MAX_TAGLEN+1];
   unsigned int taglnr;
   int update;      /* Set if initialized by read_stat_file.  */
@@ -184,6 +261,83 @@ typedef const struct stat_record_s *const_stat_record_t;
 static struct stat_record_s statrecords[100*12];
 
 
+/* Checkpoint information for one journal file.  */
+struct checkpoint_s
+{
+  struct checkpoint_s *next;
+  off_t offset;         /* Offset after the last processed line.  */
+  unsigned int lnr;     /* Number of lines up to OFFSET.  */
+  char fname[1];
+};
+typedef struct checkpoint_s *checkpoint_t;
+
+/* The list of checkpoints read from or to be written to the
+   checkpoint file.  */
+static checkpoint_t checkpoints;
+
+
+/* A cell of the statistics cube.  The key is made up from the
+   colon delimited values of the base dimensions or of the dimensions
+   of a roll-up.  */
+struct cell_s
+{
+  struct hashitem_s hi;
+  unsigned int n;
+  money_t euro;           /* The amounts are all in cents.  */
+  unsigned int subs_n;
+  money_t subs_euro;
+};
+typedef struct cell_s *cell_t;
+
+/* The base cube with the values from all input files.  It is keyed
+   by "DAY:CURRENCY:SERVICE:RECUR".  */
+static struct hashtbl_s basecube;
+
+
+/* The maximum number of worker threads.  */
+#define MAX_JOBS 64
+
+/* Partial statistics for one month computed from one input file.  */
+struct partial_s
+{
+  int year;
+  int month;
+  const_stat_record_t upd;  /* The record from the stat file or NULL.  */
+  unsigned int n;
+  money_t euro;             /* In cents.  */
+  unsigned int subs_n;
+  money_t subs_euro;        /* In cents.  */
+  unsigned int taglnr;      /* Line number of the last counted record.  */
+};
+typedef struct partial_s *partial_t;
+
+/* Description of an input file.  */
+struct infile_s
+{
+  const char *fname;
+  char tag[MAX_TAGLEN+1];
+  int seqno;       /* Position on the command line.  */
+  int serial;      /* Process serially in the merge phase.  */
+  int failed;      /* An error occurred for this file.  */
+  checkpoint_t cp; /* The checkpoint for this file or NULL.  */
+  off_t endoff;    /* Offset after the last processed line.  */
+  unsigned int endlnr; /* Number of lines up to ENDOFF.  */
+  unsigned int recordcount;
+  unsigned int npartials;
+  unsigned int partialsize;
+  partial_t partials;
+  struct hashtbl_s cube;  /* Used instead of PARTIALS with --rollup.  */
+};
+typedef struct infile_s *infile_t;
+
+/* The list of input files and the index of the next file to be
+   taken by a worker.  NEXT_INFILE is protected by INFILES_LOCK.  */
+static struct infile_s *infiles;
+static int ninfiles;
+static int next_infile;
+static npth_mutex_t infiles_lock = NPTH_MUTEX_INITIALIZER;
+
+
 /* Total number of selected records so far.  */
 static unsigned int recordcount;
 
@@ -191,10 +345,14 @@ static unsigned int recordcount;
 /* Local prototypes.  */
 static int parse_fieldname (char *name, int *r_meta, unsigned int *r_fnr);
 static selectexpr_t parse_selectexpr (const char *expr);
-static void one_file (const char *fname);
+static rollup_t parse_rollup (const char *string);
+static void process_files (int argc, char **argv);
 static void read_stat_file (const char *fname);
+static void read_checkpoint_file (const char *fname);
+static void write_checkpoint_file (const char *fname);
 static void postprocess_statrecords (void);
 static void print_output (void);
+static void print_rollups (void);
 
 
 
@@ -223,6 +381,7 @@ main (int argc, char **argv)
 {
   ARGPARSE_ARGS pargs;
   selectexpr_t se, se2;
+  rollup_t ru, ru2;
 
   opt.separator = ':';
 
@@ -232,6 +391,9 @@ main (int argc, char **argv)
 
   /* Make sure that our subsystems are ready.  */
   gpgrt_init ();
+  npth_init ();
+
+  opt.jobs = sysconf (_SC_NPROCESSORS_ONLN);
 
   /* Parse the command line. */
   pargs.argc  = &argc;
@@ -268,31 +430,74 @@ main (int argc, char **argv)
           opt.updatefile = pargs.r.ret_str;
           break;
 
+        case oJobs:
+          opt.jobs = pargs.r.ret_int;
+          break;
+
+        case oCheckpoint:
+          opt.checkpointfile = pargs.r.ret_str;
+          break;
+
+        case oRollup:
+          ru = parse_rollup (pargs.r.ret_str);
+          if (!ru)
+            ;
+          else if (!(ru2 = opt.rollups))
+            opt.rollups = ru;
+          else
+            {
+              for (; ru2->next; ru2 = ru2->next)
+                ;
+              ru2->next = ru;
+            }
+          break;
+
         default: pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
     }
 
   if (log_get_errorcount (0))
     exit (2);
+  if (opt.rollups && (opt.updatefile || opt.checkpointfile))
+    {
+      log_error ("--rollup can't be used with --update or --checkpoint\n");
+      exit (2);
+    }
+
+  if (opt.jobs < 1)
+    opt.jobs = 1;
+  else if (opt.jobs > MAX_JOBS)
+    opt.jobs = MAX_JOBS;
 
   if (opt.updatefile)
     read_stat_file (opt.updatefile);
 
+  if (opt.checkpointfile)
+    {
+      read_checkpoint_file (opt.checkpointfile);
+      if (checkpoints && !opt.updatefile)
+        log_error ("a non-empty checkpoint file requires --update\n");
+    }
+
   if (log_get_errorcount (0))
     exit (1);
 
   /* Process all files.  */
-  for (; argc; argc--, argv++)
-    {
-      one_file (*argv);
-    }
+  process_files (argc, argv);
 
-  if (!log_get_errorcount (0))
+  if (log_get_errorcount (0))
+    ;
+  else if (opt.rollups)
+    print_rollups ();
+  else
     {
       postprocess_statrecords ();
       print_output ();
     }
 
+  if (opt.checkpointfile && !log_get_errorcount (0))
+    write_checkpoint_file (opt.checkpointfile);
+
   return !!log_get_errorcount (0);
 }
 
@@ -514,6 +719,51 @@ parse_selectexpr (const char *expr)
 }
 
 
+/* Parse the comma delimited list of roll-up dimensions in STRING.
+   Returns NULL on error.  */
+static rollup_t
+parse_rollup (const char *string)
+{
+  char **tokens;
+  rollup_t ru;
+  int i, j, k;
+
+  tokens = strtokenize (string, ",");
+  if (!tokens)
+    log_fatal ("strtokenize failed: %s\n",
+               gpg_strerror (gpg_error_from_syserror ()));
+
+  ru = xcalloc (1, sizeof *ru);
+  for (i=0; tokens[i]; i++)
+    {
+      for (j=0; j < DIM (rollup_dim_names); j++)
+        if (!strcmp (tokens[i], rollup_dim_names[j].name))
+          break;
+      if (!(j < DIM (rollup_dim_names)))
+        {
+          log_error ("invalid dimension '%s' in --rollup\n", tokens[i]);
+          goto leave;
+        }
+      for (k=0; k < ru->ndims; k++)
+        if (ru->dims[k] == rollup_dim_names[j].dim)
+          break;
+      if (k < ru->ndims)
+        {
+          log_error ("dimension '%s' given twice in --rollup\n", tokens[i]);
+          goto leave;
+        }
+      ru->dims[ru->ndims++] = rollup_dim_names[j].dim;
+    }
+  xfree (tokens);
+  return ru;
+
+ leave:
+  xfree (tokens);
+  xfree (ru);
+  return NULL;
+}
+
+
 /* Return true if the record RECORD has been selected.  Note that
    selection on meta fields is not yet functional.  */
 static int
@@ -656,22 +906,40 @@ find_stat_record (int year, int month)
 }
 
 
-/* Process one journal line.  LINE has no trailing LF.  The function
-   may change LINE.  */
+/* Return the stat record for the given year and month or NULL if
+   there is none.  This function does not change the table and may
+   thus be used by the worker threads.  */
+static const_stat_record_t
+lookup_stat_record (int year, int month)
+{
+  int i;
+
+  for (i=0; i < DIM (statrecords); i++)
+    if (statrecords[i].year == year && statrecords[i].month == month)
+      return statrecords + i;
+  return NULL;
+}
+
+
+/* Parse one journal line.  LINE has no trailing LF.  The function
+   may change LINE.  FIELD is an array of NO_OF_JRNL_FIELDS which
+   receives the fields of the line.  On success the values of the
+   record are stored at the provided addresses and 0 is returned; the
+   amount is stored in cents.  If the record shall be ignored 1 is
+   returned; on error -1.  */
 static int
-one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
+parse_line (const char *fname, unsigned int lnr, char *line,
+            char **field, int *r_year, int *r_month, int *r_is_subs,
+            money_t *r_euro)
 {
-  char *field[NO_OF_JRNL_FIELDS];
+  static char dummyfield[1];
   int nfields = 0;
-  char dummyfield[1] = { 0 };
   int year, month;
-  const char *s;
-  unsigned long euro, cent;
-  stat_record_t rec;
+  money_t euro;
   int is_subs;
 
   /* Parse into fields.  */
-  while (line && nfields < DIM(field))
+  while (line && nfields < NO_OF_JRNL_FIELDS)
     {
       field[nfields++] = line;
       line = strchr (line, ':');
@@ -685,7 +953,7 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
       return -1;
     }
   /* Set remaining field slots to the empty string.  */
-  while (nfields < DIM(field))
+  while (nfields < NO_OF_JRNL_FIELDS)
     field[nfields++] = dummyfield;
 
 
@@ -694,7 +962,7 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
   else if (!strcmp (field[JRNL_FIELD_TYPE], "S"))
     is_subs = 1;
   else
-    return 0;  /* Ignore other records.  */
+    return 1;  /* Ignore other records.  */
 
   if (nfields <= JRNL_FIELD_EURO)
     {
@@ -712,12 +980,16 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
     }
 
   if (opt.selectexpr && !select_record_p (field, nfields, lnr))
-    return 0;  /* Not selected.  */
+    return 1;  /* Not selected.  */
 
-  s = field[JRNL_FIELD_EURO];
-  euro = strtoul (s, NULL, 10);
-  s = strchr (s, '.');
-  cent = s? strtoul (s+1, NULL, 10) : 0;
+  /* The Euro field is empty if no exchange rate was available.  */
+  euro = 0;
+  if (*field[JRNL_FIELD_EURO]
+      && parse_money (field[JRNL_FIELD_EURO], 2, &euro))
+    {
+      log_error ("%s:%u: invalid \"euro\" field in record\n", fname, lnr);
+      return -1;
+    }
 
   if (is_subs)
     {
@@ -726,14 +998,39 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
         {
           log_info ("%s:%u: bad 'Recur' in subscription record - skipped\n",
                     fname, lnr);
-          return 0;
+          return 1;
         }
       euro *= recur;
-      cent *= recur;
-      euro += cent / 100;
-      cent %= 100;
     }
 
+  *r_year = year;
+  *r_month = month;
+  *r_is_subs = is_subs;
+  *r_euro = euro;
+  return 0;
+}
+
+
+/* Process one journal line and update the stat records directly.
+   This is used for input files which can't be processed by the
+   workers.  LINE has no trailing LF.  The function may change
+   LINE.  */
+static int
+one_line (infile_t infile, unsigned int lnr, char *line)
+{
+  const char *fname = infile->fname;
+  const char *tag = infile->tag;
+  char *field[NO_OF_JRNL_FIELDS];
+  int year, month;
+  money_t euro;
+  stat_record_t rec;
+  int is_subs;
+  int rc;
+
+  rc = parse_line (fname, lnr, line, field, &year, &month, &is_subs, &euro);
+  if (rc)
+    return rc < 0? rc : 0;
+
   rec = find_stat_record (year, month);
   if (rec->update)
     {
@@ -749,13 +1046,11 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
             {
               rec->subs_n++;
               rec->subs_euro += euro;
-              rec->subs_cent += cent;
             }
           else
             {
               rec->n++;
               rec->euro += euro;
-              rec->cent += cent;
             }
         }
     }
@@ -783,93 +1078,504 @@ one_line (const char *fname, unsigned int lnr, const char *tag, char *line)
         {
           rec->subs_n++;
           rec->subs_euro += euro;
-          rec->subs_cent += cent;
         }
       else
         {
           rec->n++;
           rec->euro += euro;
-          rec->cent += cent;
         }
     }
 
-  recordcount++;
+  infile->recordcount++;
 
   return 0;
 }
 
 
+/* Process one journal line and update the partial statistics of
+   INFILE.  This is the worker variant of one_line; it must not
+   change the stat records.  LINE has no trailing LF.  The function
+   may change LINE.  */
+static int
+one_line_partial (infile_t infile, unsigned int lnr, char *line)
+{
+  char *field[NO_OF_JRNL_FIELDS];
+  int year, month;
+  money_t euro;
+  partial_t part;
+  int is_subs;
+  int i;
+  int rc;
+
+  rc = parse_line (infile->fname, lnr, line, field,
+                   &year, &month, &is_subs, &euro);
+  if (rc)
+    return rc < 0? rc : 0;
+
+  for (i=0; i < infile->npartials; i++)
+    if (infile->partials[i].year == year && infile->partials[i].month == month)
+      break;
+  if (!(i < infile->npartials))
+    {
+      if (infile->npartials == infile->partialsize)
+        {
+          infile->partialsize += 4;
+          infile->partials = xrealloc (infile->partials,
+                                       (infile->partialsize
+                                        * sizeof *infile->partials));
+        }
+      part = infile->partials + infile->npartials++;
+      memset (part, 0, sizeof *part);
+      part->year = year;
+      part->month = month;
+      part->upd = lookup_stat_record (year, month);
+      if (part->upd && !part->upd->update)
+        part->upd = NULL;
+    }
+  part = infile->partials + i;
+
+  /* In update mode skip records which are already accounted for in
+     the stat file.  Because the input files are merged in tag order,
+     comparing against the stat file's tag gives the same result as
+     the serial processing.  */
+  if (part->upd
+      && !((!strcmp (infile->tag, part->upd->tag) && lnr > part->upd->taglnr)
+           || (strcmp (infile->tag, part->upd->tag) > 0)))
+    return 0;
+
+  part->taglnr = lnr;
+  if (is_subs)
+    {
+      part->subs_n++;
+      part->subs_euro += euro;
+    }
+  else
+    {
+      part->n++;
+      part->euro += euro;
+    }
+
+  infile->recordcount++;
+
+  return 0;
+}
+
+
+/* Add the values of cell SRC to the cell with KEY in CUBE.  */
 static void
-one_file (const char *fname)
+add_to_cube (hashtbl_t cube, const char *key, size_t keylen, const cell_t src)
 {
-  gpg_error_t err;
-  estream_t fp;
-  char *buffer = NULL;
-  size_t buflen = 0;
-  ssize_t nread;
-  unsigned int lnr = 0;
-  char tagbuf[MAX_TAGLEN+1];
+  cell_t cell;
+
+  cell = hashtbl_find_create (cube, key, keylen, sizeof *cell);
+  cell->n += src->n;
+  cell->euro += src->euro;
+  cell->subs_n += src->subs_n;
+  cell->subs_euro += src->subs_euro;
+}
+
+
+/* Process one journal line and add it to the cube of INFILE.  LINE
+   has no trailing LF.  The function may change LINE.  */
+static int
+one_line_cube (infile_t infile, unsigned int lnr, char *line)
+{
+  char *field[NO_OF_JRNL_FIELDS];
+  int year, month, day;
+  money_t euro;
+  int is_subs;
+  int rc, n;
+  char keybuf[64];
+  char *key;
+  const char *recur;
+  cell_t cell;
+
+  rc = parse_line (infile->fname, lnr, line, field,
+                   &year, &month, &is_subs, &euro);
+  if (rc)
+    return rc < 0? rc : 0;
+
+  day = atoi_2 (field[JRNL_FIELD_DATE] + 6);
+  if (day < 1 || day > 31)
+    {
+      log_error ("%s:%u: invalid date field - not a Payproc journal?\n",
+                 infile->fname, lnr);
+      return -1;
+    }
+
+  /* The key is "DAY:CURRENCY:SERVICE:RECUR".  Only if the fields are
+     unexpectedly long we need to allocate it.  */
+  recur = *field[JRNL_FIELD_RECUR]? field[JRNL_FIELD_RECUR] : "0";
+  key = keybuf;
+  n = snprintf (keybuf, sizeof keybuf, "%.8s:%s:%s:%s",
+                field[JRNL_FIELD_DATE], field[JRNL_FIELD_CURRENCY],
+                field[JRNL_FIELD_SERVICE], recur);
+  if (n < 0 || n >= sizeof keybuf)
+    {
+      key = es_bsprintf ("%.8s:%s:%s:%s",
+                         field[JRNL_FIELD_DATE], field[JRNL_FIELD_CURRENCY],
+                         field[JRNL_FIELD_SERVICE], recur);
+      if (!key)
+        log_fatal ("error building key: %s\n",
+                   gpg_strerror (gpg_error_from_syserror ()));
+      n = strlen (key);
+    }
+  cell = hashtbl_find_create (&infile->cube, key, n, sizeof *cell);
+  if (key != keybuf)
+    es_free (key);
+
+  if (is_subs)
+    {
+      cell->subs_n++;
+      cell->subs_euro += euro;
+    }
+  else
+    {
+      cell->n++;
+      cell->euro += euro;
+    }
+
+  infile->recordcount++;
+
+  return 0;
+}
+
+
+/* Merge the partial statistics of INFILE into the stat records.  */
+static void
+merge_partials (infile_t infile)
+{
+  partial_t part;
+  stat_record_t rec;
   int i;
-  const char *s0, *s;
 
+  for (i=0; i < infile->npartials; i++)
+    {
+      part = infile->partials + i;
+      if (!part->n && !part->subs_n)
+        continue;  /* Nothing new for this month.  */
 
-  /* Fixme: We should process the files in the order of the tags.  */
+      rec = find_stat_record (part->year, part->month);
+      if (!rec->update && !strcmp (rec->tag, infile->tag))
+        {
+          if (part->taglnr > rec->taglnr)
+            rec->taglnr = part->taglnr;
+        }
+      else
+        {
+          strcpy (rec->tag, infile->tag);
+          rec->taglnr = part->taglnr;
+        }
+
+      rec->n += part->n;
+      rec->euro += part->euro;
+      rec->subs_n += part->subs_n;
+      rec->subs_euro += part->subs_euro;
+    }
+}
+
+
+/* Merge the cube of INFILE into the base cube.  */
+static void
+merge_cube (infile_t infile)
+{
+  hashitem_t item;
+  unsigned int i;
+
+  for (i=0; i < infile->cube.size; i++)
+    for (item = infile->cube.tbl[i]; item; item = item->next)
+      add_to_cube (&basecube, item->key, strlen (item->key), (cell_t)item);
+}
+
+
+/* Get the tag from the name of the journal file FNAME and store it
+   at TAGBUF which must have a size of MAX_TAGLEN+1.  Returns 0 on
+   success.  */
+static int
+get_file_tag (const char *fname, char *tagbuf)
+{
+  int i;
+  const char *s0, *s;
 
   s0 = strrchr (fname, '/');
   if (!s0)
     s0 = fname;
   s0 = strchr (s0, '-');
   i = 0;
+  s = "";
   if (s0)
     {
-      for (s=s0+1; *s && *s != '.' && i < sizeof tagbuf -1 ; s++)
+      for (s=s0+1; *s && *s != '.' && i < MAX_TAGLEN; s++)
         {
           if (!(*s & 0x80) && isdigit (*s))
             tagbuf[i++] = *s;
           else
             break;
         }
-      tagbuf[i] = 0;
     }
+  tagbuf[i] = 0;
   if (i < 4 || (*s && *s != '.'))
     {
       log_error ("error processing file '%s': Invalid name\n", fname);
-      return;
+      return -1;
+    }
+  return 0;
+}
+
+
+/* Seek FP to the position recorded in the checkpoint of INFILE.
+   Returns the number of lines before that position or 0 if the file
+   needs to be read from the start.  */
+static unsigned int
+seek_to_checkpoint (infile_t infile, estream_t fp, off_t *r_offset)
+{
+  checkpoint_t cp = infile->cp;
+
+  *r_offset = 0;
+  if (!cp || !cp->offset)
+    return 0;
+
+  /* The checkpoint is only valid if the file has not been truncated
+     or replaced; as a quick check we require that the last processed
+     line is still terminated at the recorded offset.  */
+  if (es_fseeko (fp, cp->offset - 1, SEEK_SET)
+      || es_getc (fp) != '\n')
+    {
+      log_info ("'%s' does not match the checkpoint - reading all\n",
+                infile->fname);
+      es_clearerr (fp);
+      es_rewind (fp);
+      return 0;
     }
 
+  if (opt.verbose)
+    log_info ("'%s': resuming at offset %lld (line %u)\n",
+              infile->fname, (long long)cp->offset, cp->lnr);
+  *r_offset = cp->offset;
+  return cp->lnr;
+}
+
+
+/* Process the journal file described by INFILE.  If PARTIAL is set
+   only the partial statistics of INFILE are updated.  */
+static void
+one_file (infile_t infile, int partial)
+{
+  gpg_error_t err;
+  const char *fname = infile->fname;
+  estream_t fp;
+  char *buffer = NULL;
+  size_t buflen = 0;
+  ssize_t nread;
+  unsigned int lnr;
+  off_t offset;
+  int rc;
 
   fp = es_fopen (fname, "r");
   if (!fp)
     {
       err = gpg_error_from_syserror ();
       log_error ("error opening '%s': %s\n", fname, gpg_strerror (err));
+      infile->failed = 1;
       return;
     }
   if (opt.verbose)
     log_info ("processing '%s'\n", fname);
 
+  lnr = seek_to_checkpoint (infile, fp, &offset);
+
   while ((nread = es_read_line (fp, &buffer, &buflen, NULL)) > 0)
     {
+      /* With a checkpoint we must not process a line which is still
+         being written; it will be taken up by the next run.  */
+      if (opt.checkpointfile && buffer[nread-1] != '\n')
+        {
+          if (opt.verbose)
+            log_info ("%s:%u: incomplete line - skipped\n", fname, lnr+1);
+          break;
+        }
+      offset += nread;
       lnr++;
       if (buffer[nread-1] == '\n')
         buffer[--nread] = 0;
       if (nread && buffer[nread-1] == '\r')
         buffer[--nread] = 0;
-      if (nread && one_line (fname, lnr, tagbuf, buffer))
-        goto leave;
+      if (!nread)
+        continue;
+      if (opt.rollups)
+        rc = one_line_cube (infile, lnr, buffer);
+      else if (partial)
+        rc = one_line_partial (infile, lnr, buffer);
+      else
+        rc = one_line (infile, lnr, buffer);
+      if (rc)
+        {
+          infile->failed = 1;
+          goto leave;
+        }
     }
   if (nread < 0)
     {
       err = gpg_error_from_syserror ();
       log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+      infile->failed = 1;
     }
 
+  infile->endoff = offset;
+  infile->endlnr = lnr;
+
  leave:
   es_free (buffer);
   es_fclose (fp);
 }
 
 
+/* The worker thread to compute the partial statistics.  ARG is not
+   used; the files are taken from the global list.  The actual
+   processing runs outside of the npth lock so that the workers run
+   in parallel.  */
+static void *
+worker_thread (void *arg)
+{
+  int res;
+  int idx;
+
+  (void)arg;
+
+  for (;;)
+    {
+      res = npth_mutex_lock (&infiles_lock);
+      if (res)
+        log_fatal ("failed to acquire infiles lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      while (next_infile < ninfiles
+             && (infiles[next_infile].serial || infiles[next_infile].failed))
+        next_infile++;
+      idx = next_infile < ninfiles? next_infile++ : -1;
+      res = npth_mutex_unlock (&infiles_lock);
+      if (res)
+        log_fatal ("failed to release infiles lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      if (idx == -1)
+        break;
+
+      npth_unprotect ();
+      one_file (infiles + idx, 1);
+      npth_protect ();
+    }
+
+  return NULL;
+}
+
+
+/* Sort the input files by tag and keep the command line order for
+   identical tags.  */
+static int
+sort_infiles_cmp (const void *xa, const void *xb)
+{
+  const struct infile_s *a = xa;
+  const struct infile_s *b = xb;
+  int cmp;
+
+  cmp = strcmp (a->tag, b->tag);
+  if (!cmp)
+    cmp = a->seqno - b->seqno;
+  return cmp;
+}
+
+
+/* Return the checkpoint for FNAME.  A new one is created if it does
+   not yet exist.  */
+static checkpoint_t
+get_checkpoint (const char *fname)
+{
+  checkpoint_t cp;
+
+  for (cp = checkpoints; cp; cp = cp->next)
+    if (!strcmp (cp->fname, fname))
+      return cp;
+
+  cp = xcalloc (1, sizeof *cp + strlen (fname));
+  strcpy (cp->fname, fname);
+  cp->next = checkpoints;
+  checkpoints = cp;
+  return cp;
+}
+
+
+/* Process all input files.  The partial statistics of each file are
+   computed by up to opt.jobs worker threads; they are then merged
+   into the stat records in the order of the tags.  Files sharing a
+   tag with another input file are processed serially in the merge
+   phase to keep the line number based update logic exact.  */
+static void
+process_files (int argc, char **argv)
+{
+  npth_t threads[MAX_JOBS];
+  int nthreads, i, res;
+
+  infiles = xcalloc (argc? argc : 1, sizeof *infiles);
+  for (ninfiles=0; ninfiles < argc; ninfiles++)
+    {
+      infiles[ninfiles].fname = argv[ninfiles];
+      infiles[ninfiles].seqno = ninfiles;
+      if (get_file_tag (argv[ninfiles], infiles[ninfiles].tag))
+        infiles[ninfiles].failed = 1;
+      if (opt.checkpointfile)
+        infiles[ninfiles].cp = get_checkpoint (argv[ninfiles]);
+    }
+  qsort (infiles, ninfiles, sizeof *infiles, sort_infiles_cmp);
+  for (i=1; i < ninfiles && !opt.rollups; i++)
+    if (!strcmp (infiles[i-1].tag, infiles[i].tag))
+      infiles[i-1].serial = infiles[i].serial = 1;
+
+  nthreads = opt.jobs;
+  if (nthreads > ninfiles)
+    nthreads = ninfiles;
+  if (nthreads <= 1)
+    worker_thread (NULL);
+  else
+    {
+      for (i=0; i < nthreads; i++)
+        {
+          res = npth_create (&threads[i], NULL, worker_thread, NULL);
+          if (res)
+            log_fatal ("error spawning worker thread: %s\n",
+                       gpg_strerror (gpg_error_from_errno (res)));
+        }
+      for (i=0; i < nthreads; i++)
+        npth_join (threads[i], NULL);
+    }
+
+  for (i=0; i < ninfiles; i++)
+    {
+      if (infiles[i].failed)
+        continue;
+      if (infiles[i].serial)
+        one_file (infiles + i, 0);
+      else if (opt.rollups)
+        merge_cube (infiles + i);
+      else
+        merge_partials (infiles + i);
+      recordcount += infiles[i].recordcount;
+      if (infiles[i].cp && !infiles[i].failed)
+        {
+          infiles[i].cp->offset = infiles[i].endoff;
+          infiles[i].cp->lnr = infiles[i].endlnr;
+        }
+    }
+
+  for (i=0; i < ninfiles; i++)
+    {
+      xfree (infiles[i].partials);
+      hashtbl_release (&infiles[i].cube);
+    }
+  xfree (infiles);
+  infiles = NULL;
+  ninfiles = 0;
+}
+
+
 /* Process one line from a stats file.  LINE has no trailing LF.  The
    function may change LINE.  */
 static int
@@ -879,11 +1585,9 @@ read_stat_line (const char *fname, unsigned int lnr, char *line)
   char dummyfield[1] = { 0 };
   int nfields = 0;
   int year, month;
-  const char *s;
   const char *tag;
   unsigned int taglnr;
-  unsigned long euro, cent, euroyr, centyr;
-  unsigned long subs_euro, subs_cent, subs_euroyr, subs_centyr;
+  money_t euro, euroyr, subs_euro, subs_euroyr;
   stat_record_t rec;
 
   /* Parse into fields.  */
@@ -922,25 +1626,15 @@ read_stat_line (const char *fname, unsigned int lnr, char *line)
     }
   taglnr = atoi (field[4]);
 
-  s = field[7];
-  euro = strtoul (s, NULL, 10);
-  s = strchr (s, '.');
-  cent = s? strtoul (s+1, NULL, 10) : 0;
-
-  s = field[9];
-  euroyr = strtoul (s, NULL, 10);
-  s = strchr (s, '.');
-  centyr = s? strtoul (s+1, NULL, 10) : 0;
-
-  s = field[11];
-  subs_euro = strtoul (s, NULL, 10);
-  s = strchr (s, '.');
-  subs_cent = s? strtoul (s+1, NULL, 10) : 0;
-
-  s = field[13];
-  subs_euroyr = strtoul (s, NULL, 10);
-  s = strchr (s, '.');
-  subs_centyr = s? strtoul (s+1, NULL, 10) : 0;
+  if (parse_money (field[7], 2, &euro)
+      || parse_money (field[9], 2, &euroyr)
+      || parse_money (field[11], 2, &subs_euro)
+      || parse_money (field[13], 2, &subs_euroyr))
+    {
+      log_error ("%s:%u: invalid amount - not a Payproc stat file?\n",
+                 fname, lnr);
+      return -1;
+    }
 
   rec = find_stat_record (year, month);
   /* We always expect a new clean record - if not the input file has a
@@ -955,16 +1649,12 @@ read_stat_line (const char *fname, unsigned int lnr, char *line)
 
   rec->n = strtoul (field[6], NULL, 10);
   rec->euro = euro;
-  rec->cent = cent;
   rec->nyr = strtoul (field[8], NULL, 10);
   rec->euroyr = euroyr;
-  rec->centyr = centyr;
   rec->subs_n = strtoul (field[10], NULL, 10);
   rec->subs_euro = subs_euro;
-  rec->subs_cent = subs_cent;
   rec->subs_nyr = strtoul (field[12], NULL, 10);
   rec->subs_euroyr = subs_euroyr;
-  rec->subs_centyr = subs_centyr;
   rec->update = 1;
 
   return 0;
@@ -1015,6 +1705,132 @@ read_stat_file (const char *fname)
 }
 
 
+/* Read the checkpoint file FNAME into the list of checkpoints.  It
+   is not an error if the file does not exist.  */
+static void
+read_checkpoint_file (const char *fname)
+{
+  gpg_error_t err;
+  estream_t fp;
+  char *buffer = NULL;
+  size_t buflen = 0;
+  ssize_t nread;
+  unsigned int lnr = 0;
+  char *p, *endp;
+  long long offset;
+  unsigned long reclnr;
+  checkpoint_t cp;
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        {
+          if (opt.verbose)
+            log_info ("no checkpoint file '%s' - reading all\n", fname);
+        }
+      else
+        log_error ("error opening '%s': %s\n", fname, gpg_strerror (err));
+      return;
+    }
+  if (opt.verbose)
+    log_info ("reading '%s'\n", fname);
+
+  while ((nread = es_read_line (fp, &buffer, &buflen, NULL)) > 0)
+    {
+      lnr++;
+      if (buffer[nread-1] == '\n')
+        buffer[--nread] = 0;
+      if (nread && buffer[nread-1] == '\r')
+        buffer[--nread] = 0;
+      if (!nread)
+        continue;
+
+      p = buffer;
+      offset = strtoll (p, &endp, 10);
+      if (endp == p || *endp != ':' || offset < 0)
+        goto invalid;
+      p = endp + 1;
+      reclnr = strtoul (p, &endp, 10);
+      if (endp == p || *endp != ':' || !endp[1])
+        goto invalid;
+      p = endp + 1;
+
+      cp = get_checkpoint (p);
+      if (cp->offset)
+        {
+          log_error ("%s:%u: duplicated entry\n", fname, lnr);
+          goto leave;
+        }
+      cp->offset = offset;
+      cp->lnr = reclnr;
+    }
+  if (nread < 0)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error reading '%s': %s\n", fname, gpg_strerror (err));
+    }
+  goto leave;
+
+ invalid:
+  log_error ("%s:%u: invalid line - not a Payproc checkpoint file?\n",
+             fname, lnr);
+ leave:
+  es_free (buffer);
+  es_fclose (fp);
+}
+
+
+/* Write the list of checkpoints to FNAME.  The file is replaced
+   atomically so that an interrupted run keeps the old checkpoint.  */
+static void
+write_checkpoint_file (const char *fname)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  estream_t fp;
+  checkpoint_t cp;
+
+  tmpfname = strconcat (fname, ".tmp", NULL);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", fname, gpg_strerror (err));
+      return;
+    }
+
+  fp = es_fopen (tmpfname, "w");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error creating '%s': %s\n", tmpfname, gpg_strerror (err));
+      xfree (tmpfname);
+      return;
+    }
+
+  for (cp = checkpoints; cp; cp = cp->next)
+    if (cp->offset)
+      es_fprintf (fp, "%lld:%u:%s\n",
+                  (long long)cp->offset, cp->lnr, cp->fname);
+
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      remove (tmpfname);
+    }
+  else if (rename (tmpfname, fname))
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error renaming '%s' to '%s': %s\n",
+                 tmpfname, fname, gpg_strerror (err));
+      remove (tmpfname);
+    }
+  xfree (tmpfname);
+}
+
+
 /* Sort the records.  */
 static int
 sort_statrecords_cmp (const void *xa, const void *xb)
@@ -1053,16 +1869,16 @@ postprocess_statrecords (void)
   stat_record_t rec;
   int year;
   unsigned int nyr;
-  unsigned long euroyr, centyr;
+  money_t euroyr;
   unsigned int subs_nyr;
-  unsigned long subs_euroyr, subs_centyr;
+  money_t subs_euroyr;
 
   qsort (statrecords, DIM(statrecords),
          sizeof *statrecords, sort_statrecords_cmp);
 
   /* Insert the totals per year.  */
   nyr = subs_nyr = 0;
-  euroyr = centyr = subs_euroyr = subs_centyr = 0;
+  euroyr = subs_euroyr = 0;
   year = 0;
   for (i=0; i < DIM (statrecords); i++)
     if ((rec = statrecords + i), rec->year)
@@ -1070,22 +1886,18 @@ postprocess_statrecords (void)
         if (rec->year != year)
           {
             nyr = subs_nyr = 0;
-            euroyr = centyr = subs_euroyr = subs_centyr = 0;
+            euroyr = subs_euroyr = 0;
             year = rec->year;
           }
         nyr += rec->n;
         euroyr += rec->euro;
-        centyr += rec->cent;
         subs_nyr += rec->subs_n;
         subs_euroyr += rec->subs_euro;
-        subs_centyr += rec->subs_cent;
 
         rec->nyr = nyr;
         rec->euroyr = euroyr;
-        rec->centyr = centyr;
         rec->subs_nyr = subs_nyr;
         rec->subs_euroyr = subs_euroyr;
-        rec->subs_centyr = subs_centyr;
       }
 
   /* The output shall be in reverse chronological order.  */
@@ -1099,39 +1911,251 @@ print_output (void)
 {
   int i;
   stat_record_t rec;
-  unsigned long euro, cent, euroyr, centyr;
-  unsigned long subs_euro, subs_cent, subs_euroyr, subs_centyr;
+  char euro[AMOUNTBUF_SIZE], euroyr[AMOUNTBUF_SIZE];
+  char subs_euro[AMOUNTBUF_SIZE], subs_euroyr[AMOUNTBUF_SIZE];
 
   for (i=0; i < DIM (statrecords); i++)
     if ((rec = statrecords + i), rec->year)
       {
-        euro = rec->euro;
-        cent = rec->cent;
-        euro += cent / 100;
-        cent %= 100;
-        euroyr = rec->euroyr;
-        centyr = rec->centyr;
-        euroyr += centyr / 100;
-        centyr %= 100;
-        subs_euro = rec->subs_euro;
-        subs_cent = rec->subs_cent;
-        subs_euro += subs_cent / 100;
-        subs_cent %= 100;
-        subs_euroyr = rec->subs_euroyr;
-        subs_centyr = rec->subs_centyr;
-        subs_euroyr += subs_centyr / 100;
-        subs_centyr %= 100;
+        format_money (euro, sizeof euro, rec->euro, 2);
+        format_money (euroyr, sizeof euroyr, rec->euroyr, 2);
+        format_money (subs_euro, sizeof subs_euro, rec->subs_euro, 2);
+        format_money (subs_euroyr, sizeof subs_euroyr, rec->subs_euroyr, 2);
         printf ("%d:%02d::%s:%u::"
-                "%u:%lu.%02lu:%u:%lu.%02lu:"
-                "%u:%lu.%02lu:%u:%lu.%02lu:"
+                "%u:%s:%u:%s:"
+                "%u:%s:%u:%s:"
                 "\n",
                 rec->year, rec->month, rec->tag, rec->taglnr,
-                rec->n, euro, cent,
-                rec->nyr, euroyr, centyr,
-                rec->subs_n, subs_euro, subs_cent,
-                rec->subs_nyr, subs_euroyr, subs_centyr);
+                rec->n, euro, rec->nyr, euroyr,
+                rec->subs_n, subs_euro, rec->subs_nyr, subs_euroyr);
+      }
+
+  if (fflush (stdout) == EOF)
+    log_error ("error writing to stdout: %s\n",
+               gpg_strerror (gpg_error_from_syserror()));
+}
+
+
+/* Return the weekday for the given date with 1 for Monday up to 7
+   for Sunday.  */
+static int
+day_of_week (int year, int month, int day)
+{
+  static const int t[12] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+  int wday;
+
+  if (month < 3)
+    year--;
+  wday = (year + year/4 - year/100 + year/400 + t[month-1] + day) % 7;
+  return wday? wday : 7;
+}
+
+
+/* Return the number of ISO 8601 weeks in YEAR.  */
+static int
+weeks_in_year (int year)
+{
+  /* A year has 53 weeks if it starts on a Thursday or if it is a leap
+     year starting on a Wednesday; i.e. if the year ends on a
+     Thursday or the previous year ends on a Wednesday.  */
+  if (day_of_week (year, 12, 31) == 4 || day_of_week (year - 1, 12, 31) == 3)
+    return 53;
+  return 52;
+}
+
+
+/* Compute the ISO 8601 week for the given date and store the year of
+   that week at R_YEAR and the week number at R_WEEK.  */
+static void
+iso_week (int year, int month, int day, int *r_year, int *r_week)
+{
+  static const int cumdays[12] =
+    { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+  int yday, week;
+
+  yday = cumdays[month-1] + day;
+  if (month > 2 && ((!(year % 4) && (year % 100)) || !(year % 400)))
+    yday++;
+
+  week = (yday - day_of_week (year, month, day) + 10) / 7;
+  if (week < 1)
+    {
+      year--;
+      week = weeks_in_year (year);
+    }
+  else if (week > weeks_in_year (year))
+    {
+      year++;
+      week = 1;
+    }
+  *r_year = year;
+  *r_week = week;
+}
+
+
+/* Build the key for the roll-up RU from the key BASEKEY of a cell of
+   the base cube.  The returned string must be released by the
+   caller.  */
+static char *
+make_rollup_key (rollup_t ru, const char *basekey)
+{
+  char *basevalues[4];
+  char *tmp, *p, *result;
+  int year, month, day, wyear, week;
+  unsigned int i, n;
+
+  /* Split "DAY:CURRENCY:SERVICE:RECUR" into its parts.  */
+  tmp = xstrdup (basekey);
+  for (p = tmp, n=0; n < DIM (basevalues); n++)
+    {
+      basevalues[n] = p;
+      p = strchr (p, ':');
+      if (p)
+        *p++ = 0;
+      else
+        p = "";
+    }
+
+  year  = atoi_4 (basevalues[0]);
+  month = atoi_2 (basevalues[0] + 4);
+  day   = atoi_2 (basevalues[0] + 6);
+
+  /* The dimension values are never longer than the base key.  */
+  result = xmalloc (strlen (basekey) + ru->ndims * 10 + 1);
+  for (p = result, i=0; i < ru->ndims; i++)
+    {
+      if (i)
+        *p++ = ':';
+      switch (ru->dims[i])
+        {
+        case ROLLUP_YEAR:
+          p += sprintf (p, "%04d", year);
+          break;
+        case ROLLUP_MONTH:
+          p += sprintf (p, "%04d%02d", year, month);
+          break;
+        case ROLLUP_WEEK:
+          iso_week (year, month, day, &wyear, &week);
+          p += sprintf (p, "%04dW%02d", wyear, week);
+          break;
+        case ROLLUP_DAY:
+          p = stpcpy (p, basevalues[0]);
+          break;
+        case ROLLUP_CURRENCY:
+          p = stpcpy (p, basevalues[1]);
+          break;
+        case ROLLUP_SERVICE:
+          p = stpcpy (p, basevalues[2]);
+          break;
+        case ROLLUP_RECUR:
+          p = stpcpy (p, basevalues[3]);
+          break;
+        }
+    }
+  *p = 0;
+
+  xfree (tmp);
+  return result;
+}
+
+
+/* The roll-up sorted by print_rollup.  */
+static rollup_t sort_rollup;
+
+/* Sort function for print_rollup.  The values of numeric dimensions
+   are compared numerically, all others as strings.  */
+static int
+sort_cells_cmp (const void *xa, const void *xb)
+{
+  const char *a = (*(const cell_t *)xa)->hi.key;
+  const char *b = (*(const cell_t *)xb)->hi.key;
+  unsigned long na, nb;
+  size_t alen, blen;
+  unsigned int i;
+  int cmp;
+
+  for (i=0; i < sort_rollup->ndims; i++)
+    {
+      alen = strcspn (a, ":");
+      blen = strcspn (b, ":");
+      if (sort_rollup->dims[i] == ROLLUP_RECUR)
+        {
+          na = strtoul (a, NULL, 10);
+          nb = strtoul (b, NULL, 10);
+          cmp = na < nb? -1 : na > nb;
+        }
+      else
+        {
+          cmp = memcmp (a, b, alen < blen? alen : blen);
+          if (!cmp)
+            cmp = alen < blen? -1 : alen > blen;
+        }
+      if (cmp)
+        return cmp;
+      a += alen + !!a[alen];
+      b += blen + !!b[blen];
+    }
+
+  return 0;
+}
+
+
+/* Print the roll-up RU computed from the base cube.  */
+static void
+print_rollup (rollup_t ru)
+{
+  struct hashtbl_s cube = { NULL, 0, 0 };
+  hashitem_t item;
+  cell_t *array;
+  cell_t cell;
+  unsigned int i, n;
+  char *key, *p;
+  char euro[AMOUNTBUF_SIZE], subs_euro[AMOUNTBUF_SIZE];
+
+  for (i=0; i < basecube.size; i++)
+    for (item = basecube.tbl[i]; item; item = item->next)
+      {
+        key = make_rollup_key (ru, item->key);
+        add_to_cube (&cube, key, strlen (key), (cell_t)item);
+        xfree (key);
       }
 
+  array = hashtbl_items (&cube);
+  n = cube.count;
+  sort_rollup = ru;
+  qsort (array, n, sizeof *array, sort_cells_cmp);
+
+  for (i=0; i < n; i++)
+    {
+      cell = array[i];
+      for (p = cell->hi.key; *p; p++)
+        putchar (*p == ':'? opt.separator : *p);
+      format_money (euro, sizeof euro, cell->euro, 2);
+      format_money (subs_euro, sizeof subs_euro, cell->subs_euro, 2);
+      printf ("%c%u%c%s%c%u%c%s%c\n",
+              opt.separator, cell->n, opt.separator, euro,
+              opt.separator, cell->subs_n, opt.separator, subs_euro,
+              opt.separator);
+    }
+
+  xfree (array);
+  hashtbl_release (&cube);
+}
+
+
+/* Print all requested roll-ups.  */
+static void
+print_rollups (void)
+{
+  rollup_t ru;
+
+  for (ru = opt.rollups; ru; ru = ru->next)
+    {
+      if (ru != opt.rollups)
+        putchar ('\n');
+      print_rollup (ru);
+    }
+
   if (fflush (stdout) == EOF)
     log_error ("error writing to stdout: %s\n",
                gpg_strerror (gpg_error_from_syserror()));
@@ -40,11 +40,14 @@
 #include "argparse.h"
 #include "commands.h"
 #include "tlssupport.h"
+#include "http.h"
 #include "cred.h"
 #include "journal.h"
 #include "session.h"
 #include "currency.h"
 #include "encrypt.h"
+#include "preorder.h"
+#include "account.h"
 #include "payprocd.h"
 
 
@@ -54,6 +57,10 @@
 /* The interval in seconds to run the housekeeping thread.  */
 #define HOUSEKEEPING_INTERVAL  (120)
 
+/* The maximum number of backup steps done by one housekeeping run.
+   Each step copies DB_BACKUP_PAGES pages of each database.  */
+#define BACKUP_STEPS  50
+
 /* Flag indicating that the socket shall shall be removed by
    cleanup.  */
 static int remove_socket_flag;
@@ -94,6 +101,10 @@ enum opt_values
     oAdminGID,
     oDatabaseKey,
     oBackofficeKey,
+    oArchiveDays,
+    oBackupDir,
+    oDataKeyFile,
+    oCurrencyFile,
     oDebugClient,
     oDebugStripe,
     oDebugPaypal,
@@ -127,6 +138,14 @@ static ARGPARSE_OPTS opts[] = {
                 "database-key", "|FPR|secret key for the database"),
   ARGPARSE_s_s (oBackofficeKey,
                 "backoffice-key", "|FPR|public key for the backoffice"),
+  ARGPARSE_s_i (oArchiveDays,
+                "archive-days", "|N|archive preorders settled N days ago"),
+  ARGPARSE_s_s (oBackupDir,
+                "backup-dir", "|DIR|write database backups to DIR"),
+  ARGPARSE_s_s (oDataKeyFile,
+                "data-key-file", "|FILE|seal data items with keys from FILE"),
+  ARGPARSE_s_s (oCurrencyFile,
+                "currency-file", "|FILE|read the currencies from FILE"),
 
   ARGPARSE_s_n (oDebugClient, "debug-client", "debug I/O with the client"),
   ARGPARSE_s_n (oDebugStripe, "debug-stripe", "debug the Stripe REST"),
@@ -382,6 +401,19 @@ parse_options (int argc, char **argv)
           xfree (opt.backoffice_key_fpr);
           opt.backoffice_key_fpr = xstrdup (pargs.r.ret_str);
           break;
+        case oArchiveDays: opt.archive_days = pargs.r.ret_int; break;
+        case oBackupDir:
+          xfree (opt.backup_dir);
+          opt.backup_dir = xstrdup (pargs.r.ret_str);
+          break;
+        case oDataKeyFile:
+          xfree (opt.data_key_file);
+          opt.data_key_file = xstrdup (pargs.r.ret_str);
+          break;
+        case oCurrencyFile:
+          xfree (opt.currency_file);
+          opt.currency_file = xstrdup (pargs.r.ret_str);
+          break;
 
         case oConfig:
           if (!configfp)
@@ -481,6 +513,9 @@ main (int argc, char **argv)
 
   encrypt_setup_keys ();
 
+  if (opt.currency_file)
+    read_currency_file (opt.currency_file);
+
   if (log_get_errorcount (0))
     exit (2);
 
@@ -936,6 +971,28 @@ time_for_housekeeping_p (time_t now)
 #endif
 
 
+/* Continue the online backups of the databases.  If START is set new
+   backups are started.  Other requests are processed between the
+   steps.  */
+static void
+backup_databases (int start)
+{
+  int i, running;
+
+  if (!opt.backup_dir)
+    return;
+
+  for (i=0; i < BACKUP_STEPS; i++)
+    {
+      running = preorder_backup_step (start);
+      running |= account_backup_step (start);
+      start = 0;
+      if (!running)
+        break;
+    }
+}
+
+
 /* Thread to do the housekeeping.  */
 static void *
 housekeeping_thread (void *arg)
@@ -957,13 +1014,20 @@ housekeeping_thread (void *arg)
     log_info ("starting housekeeping\n");
 
   session_housekeeping ();
+  preorder_housekeeping ();
+  account_housekeeping ();
+  read_exchange_rates ();  /* Only if the file has been changed.  */
+  http_pool_housekeeping ();
+  http_dns_housekeeping ();
 
   /* Stuff we do only every hour:  */
   if (count >= 3600 / HOUSEKEEPING_INTERVAL)
     {
       count = 0;
-      read_exchange_rates ();
+      backup_databases (1);
     }
+  else
+    backup_databases (0);
 
   if (opt.verbose > 1)
     log_info ("finished with housekeeping\n");
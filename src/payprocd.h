@@ -36,6 +36,14 @@ struct
   char *stripe_secret_key;  /* The secret key for stripe.com */
   char *paypal_secret_key;  /* The secret key for PayPal */
 
+  /* Settled preorders older than this number of days are moved to
+   * the archive.  0 disables archiving.  */
+  int archive_days;
+
+  /* If not NULL online backups of the databases are written to this
+   * directory.  */
+  char *backup_dir;
+
   /* The fingerprint of the OpenPGP key used to encrypt items in the
    * database.  A secret and a public key is required.  */
   char *database_key_fpr;
@@ -43,6 +51,13 @@ struct
    * by the backoffice.  Only the public key is required.  */
   char *backoffice_key_fpr;
 
+  /* If not NULL data items are sealed with data keys which are
+   * wrapped to the above keys and stored in this file.  */
+  char *data_key_file;
+
+  /* If not NULL the supported currencies are read from this file.  */
+  char *currency_file;
+
   /* The count and the list of clients allowed to use the service.  */
   int n_allowed_uids;
   uid_t allowed_uids[20];
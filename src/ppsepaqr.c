@@ -152,8 +152,8 @@ format_data (const char *iban, const char *name, const char *amount,
 {
   char *string;
   int anyerr = 0;
-  unsigned int cents;
-  char *xamount;
+  money_t cents;
+  char xamount[AMOUNTBUF_SIZE];
   char *xtext;
   char *p;
 
@@ -173,19 +173,12 @@ format_data (const char *iban, const char *name, const char *amount,
       anyerr++;
     }
 
-  cents = convert_amount (amount, 2);
-  if (!cents)
+  if (parse_money (amount, 2, &cents) || cents <= 0)
     {
       log_error ("invalid AMOUNT given\n");
       anyerr++;
     }
-  xamount = reconvert_amount (cents, 2);
-  if (!xamount)
-    {
-      log_error ("error formatting amount: %s\n",
-                 gpg_strerror (gpg_error_from_syserror ()));
-      return NULL;
-    }
+  format_money (xamount, sizeof xamount, cents, 2);
 
   xtext = xstrdup (text);
   for (p=xtext; *p; p++)
@@ -226,7 +219,6 @@ format_data (const char *iban, const char *name, const char *amount,
                    gpg_strerror (gpg_error_from_syserror ()));
     }
 
-  es_free (xamount);
   xfree (xtext);
   return string;
 }
@@ -29,20 +29,27 @@
      currency TEXT NOT NULL,
      desc TEXT,   -- Description of the order
      email TEXT,  -- Optional mail address.
-     meta TEXT    -- Using the format from the journal.
+     meta TEXT,   -- Using the format from the journal.
+     recur INTEGER,    -- The recurrence value.
+     email_hash TEXT   -- Hash of the mail address; see email_hash_func.
    )
 
+  Indexes are created on refnn and created for the listing, on paid,
+  and on email_hash.  Columns and indexes added later are created by
+  open_preorder_db when an older database is opened.
 
-  Expiring entries can be done using
 
-     DELETE from preorder
-     WHERE julianday(created) < julianday('now', '-30 days')
-           AND paid IS NULL;
+  Preorders which have been paid or created but not paid more than
+  --archive-days ago are moved by preorder_housekeeping to the table
+  preorder_archive which has the same columns.  Note that 'paid'
+  tracks actual payments using this ref.  We do not delete it from the
+  DB so that the ref can be used for recurring payments: GETPREORDER
+  falls back to the archive and a new payment moves the record back.
 
-  this has not been implemented here but should be done at startup and
-  once a day.  Note that 'paid' tracks actual payments using this ref.
-  We do not delete it from the DB so that the ref can be used for
-  recurring payments.
+  The database is used in WAL mode with one connection for all
+  writes and a small pool of read-only connections.  Thus a long
+  listing does not block the insertion of new preorders.  The writer
+  connection is only used by the storage thread; see storage.c.
 
  */
 
@@ -63,44 +70,152 @@
 #include "membuf.h"
 #include "dbutil.h"
 #include "currency.h"
+#include "storage.h"
 #include "preorder.h"
 
 
 
-/* The name of the preorder database file.  */
+/* The name of the preorder database file.  The name of the test
+   database may be changed by the regression test.  */
 static const char preorder_db_fname[] = "/var/lib/payproc/preorder.db";
-static const char preorder_test_db_fname[] = "/var/lib/payproc-test/preorder.db";
-
-/* The database handle used for the preorder database.  This handle
-   may only used after a successful open_preorder_db call and not
-   after a close_preorder_db call.  The lock variable is maintained by
-   the mentioned open and close functions. */
+static const char *preorder_test_db_fname
+  = "/var/lib/payproc-test/preorder.db";
+
+/* The database handle used for the preorder database.  This is the
+   only connection used for writing.  This handle may only used after
+   a successful open_preorder_db call and not after a
+   close_preorder_db call.  The handle and the statements below are
+   only used by the storage thread.  */
 static sqlite3 *preorder_db;
-static npth_mutex_t preorder_db_lock = NPTH_MUTEX_INITIALIZER;
 
-/* This is a prepared statement for the INSERT operation.  It is
-   protected by preorder_db_lock.  */
+/* This is a prepared statement for the INSERT operation.  */
 static sqlite3_stmt *preorder_insert_stmt;
 
-/* This is a prepared statement for the UPDATE operation.  It is
-   protected by preorder_db_lock.  */
+/* This is a prepared statement for the UPDATE operation.  */
 static sqlite3_stmt *preorder_update_stmt;
 
 /* This is a prepared statement for the SELECT by REF operation.  It
-   is protected by preorder_db_lock.  */
+   is used to read the record which is to be updated.  */
 static sqlite3_stmt *preorder_select_stmt;
 
-/* This is a prepared statement for the SELECT by REFNN operation.  It
-   is protected by preorder_db_lock.  */
-static sqlite3_stmt *preorder_selectrefnn_stmt;
+/* The state of the online backup.  */
+static struct db_backup_s preorder_backup;
+
 
-/* This is a prepared statement for the SELECT all operation.  It
-   is protected by preorder_db_lock.  */
-static sqlite3_stmt *preorder_selectlist_stmt;
+/* The number of read-only connections to the preorder database.  */
+#define PREORDER_READERS 4
+
+/* A read-only connection to the preorder database with its own
+   prepared statements.  */
+struct preorder_reader_s
+{
+  sqlite3 *db;
+  int busy;                          /* The connection is in use.  */
+  sqlite3_stmt *select_stmt;         /* SELECT by REF.  */
+  sqlite3_stmt *selectarchive_stmt;  /* SELECT by REF from the archive.  */
+  sqlite3_stmt *selectrefnn_stmt;    /* SELECT by REFNN.  */
+  sqlite3_stmt *selectlist_stmt;     /* SELECT all.  */
+  sqlite3_stmt *selectunpaid_stmt;   /* SELECT all not yet paid.  */
+  sqlite3_stmt *selectpaid_stmt;     /* SELECT by range of PAID.  */
+  sqlite3_stmt *selectemail_stmt;    /* SELECT by EMAIL_HASH.  */
+};
+typedef struct preorder_reader_s *preorder_reader_t;
+
+/* The pool of read-only connections.  A connection is taken by
+   acquire_preorder_reader and given back by release_preorder_reader.
+   The BUSY flags are protected by preorder_readers_lock; the
+   condition is signaled when a connection is given back.  */
+static struct preorder_reader_s preorder_readers[PREORDER_READERS];
+static npth_mutex_t preorder_readers_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t preorder_readers_cond = NPTH_COND_INITIALIZER;
+
+/* The definition of the columns of the preorder table and of the
+   archive table.  */
+#define PREORDER_COLUMN_DEFS                    \
+  "ref      TEXT NOT NULL PRIMARY KEY,"         \
+  "refnn    INTEGER NOT NULL,"                  \
+  "created  TEXT NOT NULL,"                     \
+  "paid TEXT,"                                  \
+  "npaid INTEGER NOT NULL,"                     \
+  "amount   TEXT NOT NULL,"                     \
+  "currency TEXT NOT NULL,"                     \
+  "desc     TEXT,"                              \
+  "email    TEXT,"                              \
+  "meta     TEXT,"                              \
+  "recur    INTEGER,"                           \
+  "email_hash TEXT"
+
+/* The names of the columns in the order used by "SELECT *".  */
+#define PREORDER_COLUMNS                                        \
+  "ref, refnn, created, paid, npaid, amount, currency,"         \
+  " \"desc\", email, meta, recur, email_hash"
+
+/* The number of records moved to the archive in one transaction and
+   the maximum number of such batches per housekeeping run.  */
+#define ARCHIVE_BATCH_SIZE  100
+#define ARCHIVE_MAX_BATCHES 10
+
+/* The statement to select the records to be archived.  The unpaid
+   and the paid records are selected separately so that each part can
+   use its partial index.  */
+static const char archive_select_sql[] =
+  "SELECT ref FROM preorder"
+  " WHERE paid IS NULL AND created < datetime('now',?1)"
+  " UNION ALL "
+  "SELECT ref FROM preorder"
+  " WHERE paid < datetime('now',?1)"
+  " LIMIT ?2";
+
+/* The indexes of the preorder table.  They are created by
+   open_preorder_db if they do not yet exist.  */
+static const char *preorder_indexes[] = {
+  "CREATE INDEX IF NOT EXISTS preorder_refnn"
+  " ON preorder (refnn, ref)",
+  "CREATE INDEX IF NOT EXISTS preorder_created"
+  " ON preorder (created DESC, refnn ASC)",
+  "CREATE INDEX IF NOT EXISTS preorder_unpaid"
+  " ON preorder (created DESC, refnn ASC) WHERE paid IS NULL",
+  "CREATE INDEX IF NOT EXISTS preorder_paid"
+  " ON preorder (paid) WHERE paid IS NOT NULL",
+  "CREATE INDEX IF NOT EXISTS preorder_email_hash"
+  " ON preorder (email_hash) WHERE email_hash IS NOT NULL",
+  NULL
+};
+
+
+/* Local prototypes.  */
+static void release_preorder_reader (preorder_reader_t reader);
 
 
 
 
+/* The alphabet used for the "ABCDE" part of a Sepa-Ref.  The first
+   18 codes are letters.  */
+static const char sepa_ref_codes[28] = { 'A', 'B', 'C', 'D', 'E', 'G',
+                                         'H', 'J', 'K', 'L', 'N', 'R',
+                                         'S', 'T', 'W', 'X', 'Y', 'Z',
+                                         '0', '1', '2', '3', '4', '5',
+                                         '6', '7', '8', '9' };
+
+/* The number of different values for the "ABCDE" part.  */
+#define SEPA_REF_SPACE (18*28*28*28*28)
+
+/* Warn if more than this percentage of the values are in use.  */
+#define SEPA_REF_WARN_PERCENT 80
+
+/* The number of random Sepa-Refs tried before giving up.  Even with
+   SEPA_REF_WARN_PERCENT of the values in use all tries fail only
+   with a probability of 0.8^100.  */
+#define SEPA_REF_TRIES 100
+
+/* A bitmap with one bit per "ABCDE" value which is set if that value
+   is used in the preorder table.  The map is loaded when the
+   database is opened and only used by the storage thread.  */
+static unsigned char *sepa_ref_map;
+static unsigned int sepa_ref_used;
+static unsigned int sepa_ref_warned;  /* Last percentage warned about.  */
+
+
 /* Create a Sepa-Ref field and store it in BUFFER.  The format is:
 
      AAAAA-NN
@@ -114,10 +229,6 @@ static sqlite3_stmt *preorder_selectlist_stmt;
 static void
 make_sepa_ref (char *buffer, size_t bufsize)
 {
-  static char codes[28] = { 'A', 'B', 'C', 'D', 'E', 'G', 'H', 'J',
-                            'K', 'L', 'N', 'R', 'S', 'T', 'W', 'X',
-                            'Y', 'Z', '0', '1', '2', '3', '4', '5',
-                            '6', '7', '8', '9' };
   unsigned char nonce[5];
   int i;
   unsigned int n;
@@ -126,9 +237,9 @@ make_sepa_ref (char *buffer, size_t bufsize)
     BUG ();
 
   gcry_create_nonce (nonce, sizeof nonce);
-  buffer[0] = codes[nonce[0] % 18];
+  buffer[0] = sepa_ref_codes[nonce[0] % 18];
   for (i=1; i < 5; i++)
-    buffer[i] = codes[nonce[i] % 28];
+    buffer[i] = sepa_ref_codes[nonce[i] % 28];
   buffer[5] = '-';
   n = (((unsigned int)nonce[0] << 24) | (nonce[1] << 16)
        | (nonce[2] << 8) | nonce[3]);
@@ -139,16 +250,237 @@ make_sepa_ref (char *buffer, size_t bufsize)
 }
 
 
-/* Relinquishes the lock on the database handle and if DO_CLOSE is
-   true also close the database handle.  Note that we usually keep the
-   database open for the lifetime of the process.  */
+/* Return the index into the Sepa-Ref bitmap for the "ABCDE" part of
+   the Sepa-Ref REF or -1 if REF is not valid.  */
+static int
+sepa_ref_to_index (const char *ref)
+{
+  const char *p;
+  int i, idx;
+
+  for (idx=i=0; i < 5; i++)
+    {
+      p = ref[i]? memchr (sepa_ref_codes, ref[i], i? 28 : 18) : NULL;
+      if (!p)
+        return -1;
+      idx = idx * 28 + (p - sepa_ref_codes);
+    }
+  return idx;
+}
+
+
+/* Mark the Sepa-Ref with index IDX as used.  */
+static void
+mark_sepa_ref (unsigned int idx)
+{
+  unsigned int percent;
+
+  if (!sepa_ref_map || (sepa_ref_map[idx / 8] & (1 << (idx % 8))))
+    return;
+  sepa_ref_map[idx / 8] |= 1 << (idx % 8);
+  sepa_ref_used++;
+
+  percent = (unsigned int)((unsigned long long)sepa_ref_used * 100
+                           / SEPA_REF_SPACE);
+  if (percent >= SEPA_REF_WARN_PERCENT && percent > sepa_ref_warned)
+    {
+      log_info ("warning: %u%% of the Sepa-Ref values are in use\n",
+                percent);
+      sepa_ref_warned = percent;
+    }
+}
+
+
+/* Load the bitmap of used Sepa-Refs from the preorder table and the
+   archive table.  This must be called by the storage thread.  */
+static gpg_error_t
+load_sepa_ref_map (void)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt;
+  const char *s;
+  int res, idx;
+
+  sepa_ref_map = xtrycalloc (1, (SEPA_REF_SPACE + 7) / 8);
+  if (!sepa_ref_map)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error allocating the Sepa-Ref map: %s\n",
+                 gpg_strerror (err));
+      return err;
+    }
+  sepa_ref_used = 0;
+  sepa_ref_warned = 0;
+
+  res = sqlite3_prepare_v2 (preorder_db,
+                            "SELECT ref FROM preorder UNION ALL "
+                            "SELECT ref FROM preorder_archive",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing select statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+  while ((res = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      s = (const char *)sqlite3_column_text (stmt, 0);
+      if (s && (idx = sepa_ref_to_index (s)) >= 0)
+        mark_sepa_ref (idx);
+    }
+  sqlite3_finalize (stmt);
+  if (res == SQLITE_DONE)
+    res = 0;
+  else
+    log_error ("error reading the used Sepa-Refs: %s\n", sqlite3_errstr (res));
+
+ leave:
+  if (res)
+    {
+      xfree (sepa_ref_map);
+      sepa_ref_map = NULL;
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  if (opt.verbose)
+    log_info ("%u of %u Sepa-Ref values are in use\n",
+              sepa_ref_used, SEPA_REF_SPACE);
+  return 0;
+}
+
+
+/* Create a new Sepa-Ref which is not yet used and store it in BUFFER.
+   This is like make_sepa_ref but a new random value is drawn as long
+   as the bitmap has the value marked as used.  Taking the next free
+   value instead would make the Sepa-Refs predictable.  Returns an
+   error if all values are used or no free value was found after
+   SEPA_REF_TRIES tries.  This must be called by the storage
+   thread.  */
+static gpg_error_t
+alloc_sepa_ref (char *buffer, size_t bufsize)
+{
+  unsigned int idx, n;
+
+  make_sepa_ref (buffer, bufsize);
+  if (!sepa_ref_map)
+    return 0;
+  if (sepa_ref_used >= SEPA_REF_SPACE)
+    {
+      log_error ("all Sepa-Ref values are in use\n");
+      return gpg_error (GPG_ERR_LIMIT_REACHED);
+    }
+
+  for (n=0; n < SEPA_REF_TRIES; n++)
+    {
+      if (n)
+        make_sepa_ref (buffer, bufsize);
+      idx = sepa_ref_to_index (buffer);
+      if (!(sepa_ref_map[idx / 8] & (1 << (idx % 8))))
+        return 0;
+    }
+
+  log_error ("no free Sepa-Ref value found after %d tries\n",
+             SEPA_REF_TRIES);
+  return gpg_error (GPG_ERR_LIMIT_REACHED);
+}
+
+
+/* The SQL function email_hash(ADDR).  It returns the SHA-256 hash of
+   the mail address ADDR as a lowercase hex string.  Spaces around the
+   address are ignored and the address is lowercased so that a lookup
+   by hash is case-insensitive.  NULL or an empty address yield
+   NULL.  */
+static void
+email_hash_func (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const char *s;
+  char *addr;
+  unsigned char digest[32];
+  char hexdigest[2*32+1];
+  int i;
+
+  (void)argc;
+
+  s = (const char *)sqlite3_value_text (argv[0]);
+  if (!s)
+    {
+      sqlite3_result_null (ctx);
+      return;
+    }
+  addr = xtrystrdup (s);
+  if (!addr)
+    {
+      sqlite3_result_error_nomem (ctx);
+      return;
+    }
+  trim_spaces (addr);
+  ascii_strlwr (addr);
+  if (!*addr)
+    {
+      xfree (addr);
+      sqlite3_result_null (ctx);
+      return;
+    }
+
+  gcry_md_hash_buffer (GCRY_MD_SHA256, digest, addr, strlen (addr));
+  xfree (addr);
+  for (i=0; i < sizeof digest; i++)
+    snprintf (hexdigest + 2*i, 3, "%02x", digest[i]);
+  sqlite3_result_text (ctx, hexdigest, 2*32, SQLITE_TRANSIENT);
+}
+
+
+/* Register our SQL functions with the connection DB.  */
+static int
+register_preorder_functions (sqlite3 *db)
+{
+  return sqlite3_create_function (db, "email_hash", 1,
+                                  SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                  NULL, email_hash_func, NULL, NULL);
+}
+
+
+/* Run sqlite3_step on STMT without holding the npth lock so that
+   other threads may run while sqlite waits for I/O.  The caller must
+   own the connection of STMT.  */
+static int
+step_unprotected (sqlite3_stmt *stmt)
+{
+  int res;
+
+  npth_unprotect ();
+  res = sqlite3_step (stmt);
+  npth_protect ();
+  return res;
+}
+
+
+/* Run the single SQL statement SQL on the connection DB.  Returns an
+   sqlite error code.  */
+static int
+run_preorder_sql (sqlite3 *db, const char *sql)
+{
+  int res;
+  sqlite3_stmt *stmt;
+
+  res = sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL);
+  if (res)
+    return res;
+  res = step_unprotected (stmt);
+  sqlite3_finalize (stmt);
+  return res == SQLITE_DONE? SQLITE_OK : res;
+}
+
+
+/* Close the database handle.  Note that we usually keep the database
+   open for the lifetime of the process.  */
 static void
-close_preorder_db (int do_close)
+close_preorder_db (void)
 {
   int res;
 
-  if (do_close && preorder_db)
+  if (preorder_db)
     {
+      db_backup_cancel (&preorder_backup);
       res = sqlite3_close (preorder_db);
       if (res == SQLITE_BUSY)
         {
@@ -158,45 +490,35 @@ close_preorder_db (int do_close)
           preorder_update_stmt = NULL;
           sqlite3_finalize (preorder_select_stmt);
           preorder_select_stmt = NULL;
-          sqlite3_finalize (preorder_selectrefnn_stmt);
-          preorder_selectrefnn_stmt = NULL;
-          sqlite3_finalize (preorder_selectlist_stmt);
-          preorder_selectlist_stmt = NULL;
           res = sqlite3_close (preorder_db);
         }
       if (res)
         log_error ("failed to close the preorder db: %s\n",
                    sqlite3_errstr (res));
       preorder_db = NULL;
+      xfree (sepa_ref_map);
+      sepa_ref_map = NULL;
     }
-
-  res = npth_mutex_unlock (&preorder_db_lock);
-  if (res)
-    log_fatal ("failed to release preorder db lock: %s\n",
-               gpg_strerror (gpg_error_from_errno (res)));
 }
 
 
 /* This function opens or creates the preorder database.  If the
-   database is already open it merly takes a lock ion the handle. */
+   database is already open it does nothing.  This must only be called
+   by the storage thread.  */
 static gpg_error_t
 open_preorder_db (void)
 {
-  int res;
+  int res, i;
   sqlite3_stmt *stmt;
   const char *db_fname = opt.livemode? preorder_db_fname:preorder_test_db_fname;
 
-  res = npth_mutex_lock (&preorder_db_lock);
-  if (res)
-    log_fatal ("failed to acquire preorder db lock: %s\n",
-               gpg_strerror (gpg_error_from_errno (res)));
   if (preorder_db)
     return 0; /* Good: Already open.  */
 
   /* Database has not yet been opened.  Open or create it, make sure
-     the tables exist, and prepare the required statements.  We use
-     our own locking instead of the more complex serialization sqlite
-     would have to do. */
+     the tables exist, and prepare the required statements.  All
+     writes are serialized by the storage thread and thus we don't
+     need the more complex serialization sqlite would have to do. */
 
   res = sqlite3_open_v2 (db_fname,
                          &preorder_db,
@@ -208,33 +530,30 @@ open_preorder_db (void)
     {
       log_error ("error opening '%s': %s\n",
                  db_fname, sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   sqlite3_extended_result_codes (preorder_db, 1);
+  sqlite3_busy_timeout (preorder_db, DB_BUSY_TIMEOUT);
+
+  if (db_enable_wal (preorder_db, db_fname))
+    {
+      close_preorder_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
 
 
   /* Create the tables if needed.  */
   res = sqlite3_prepare_v2 (preorder_db,
                             "CREATE TABLE IF NOT EXISTS preorder ("
-                            "ref      TEXT NOT NULL PRIMARY KEY,"
-                            "refnn    INTEGER NOT NULL,"
-                            "created  TEXT NOT NULL,"
-                            "paid TEXT,"
-                            "npaid INTEGER NOT NULL,"
-                            "amount   TEXT NOT NULL,"
-                            "currency TEXT NOT NULL,"
-                            "desc     TEXT,"
-                            "email    TEXT,"
-                            "meta     TEXT,"
-                            "recur    INTEGER"
+                            PREORDER_COLUMN_DEFS
                             ")",
                             -1, &stmt, NULL);
   if (res)
     {
       log_error ("error creating preorder table (prepare): %s\n",
                  sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
 
@@ -243,7 +562,7 @@ open_preorder_db (void)
   if (res != SQLITE_DONE)
     {
       log_error ("error creating preorder table: %s\n", sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
 
@@ -260,23 +579,88 @@ open_preorder_db (void)
         {
           log_error ("error adding column to preorder table: %s\n",
                      sqlite3_errstr (res));
-          close_preorder_db (1);
+          close_preorder_db ();
+          return gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
+  res = register_preorder_functions (preorder_db);
+  if (res)
+    {
+      log_error ("error registering preorder db functions: %s\n",
+                 sqlite3_errstr (res));
+      close_preorder_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  /* Add the new column email_hash to the table and fill it in for the
+     existing records.  */
+  res = sqlite3_prepare_v2 (preorder_db,
+                            "ALTER TABLE preorder ADD COLUMN \n"
+                            "email_hash TEXT",
+                            -1, &stmt, NULL);
+  if (!res)
+    {
+      res = sqlite3_step (stmt);
+      sqlite3_finalize (stmt);
+      if (res == SQLITE_DONE)
+        res = run_preorder_sql (preorder_db,
+                                "UPDATE preorder"
+                                " SET email_hash = email_hash(email)"
+                                " WHERE email IS NOT NULL");
+      if (res)
+        {
+          log_error ("error adding column to preorder table: %s\n",
+                     sqlite3_errstr (res));
+          close_preorder_db ();
+          return gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
+  /* Create the indexes if needed.  */
+  for (i=0; preorder_indexes[i]; i++)
+    {
+      res = run_preorder_sql (preorder_db, preorder_indexes[i]);
+      if (res)
+        {
+          log_error ("error creating preorder index: %s\n",
+                     sqlite3_errstr (res));
+          close_preorder_db ();
           return gpg_error (GPG_ERR_GENERAL);
         }
     }
 
+  /* Create the archive table if needed.  */
+  res = run_preorder_sql (preorder_db,
+                          "CREATE TABLE IF NOT EXISTS preorder_archive ("
+                          PREORDER_COLUMN_DEFS
+                          ")");
+  if (res)
+    {
+      log_error ("error creating preorder archive table: %s\n",
+                 sqlite3_errstr (res));
+      close_preorder_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  if (load_sepa_ref_map ())
+    {
+      close_preorder_db ();
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
 
   /* Prepare an insert statement.  */
   res = sqlite3_prepare_v2 (preorder_db,
-                            "INSERT INTO preorder VALUES ("
-                            "?1,?2,?3,NULL,0,?4,?5,?6,?7,?8,?9"
-                            ")",
+                            "INSERT INTO preorder (" PREORDER_COLUMNS ")"
+                            " VALUES (?1,?2,?3,NULL,0,?4,?5,?6,?7,?8,?9,"
+                            " email_hash(?7))",
                             -1, &stmt, NULL);
   if (res)
     {
       log_error ("error preparing insert statement: %s\n",
                  sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   preorder_insert_stmt = stmt;
@@ -292,7 +676,7 @@ open_preorder_db (void)
     {
       log_error ("error preparing update statement: %s\n",
                  sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   preorder_update_stmt = stmt;
@@ -305,118 +689,333 @@ open_preorder_db (void)
     {
       log_error ("error preparing select statement: %s\n",
                  sqlite3_errstr (res));
-      close_preorder_db (1);
+      close_preorder_db ();
       return gpg_error (GPG_ERR_GENERAL);
     }
   preorder_select_stmt = stmt;
 
-  /* Prepare a select-refnn statement.  */
-  res = sqlite3_prepare_v2 (preorder_db,
-                            "SELECT * FROM preorder "
-                            "WHERE refnn=?1 ORDER BY ref",
-                            -1, &stmt, NULL);
-  if (res)
-    {
-      log_error ("error preparing selectrefnn statement: %s\n",
-                 sqlite3_errstr (res));
-      close_preorder_db (1);
-      return gpg_error (GPG_ERR_GENERAL);
-    }
-  preorder_selectrefnn_stmt = stmt;
+  return 0;
+}
 
-  /* Prepare a select-list statement.  */
-  res = sqlite3_prepare_v2 (preorder_db,
-                            "SELECT * FROM preorder "
-                            "ORDER BY created DESC, refnn ASC",
-                            -1, &stmt, NULL);
-  if (res)
+
+/* Storage function to open the preorder database.  */
+static gpg_error_t
+do_open_preorder_db (void *opaque)
+{
+  (void)opaque;
+  return open_preorder_db ();
+}
+
+
+/* Close the read-only connection READER.  */
+static void
+close_preorder_reader (preorder_reader_t reader)
+{
+  int res;
+
+  sqlite3_finalize (reader->select_stmt);
+  reader->select_stmt = NULL;
+  sqlite3_finalize (reader->selectarchive_stmt);
+  reader->selectarchive_stmt = NULL;
+  sqlite3_finalize (reader->selectrefnn_stmt);
+  reader->selectrefnn_stmt = NULL;
+  sqlite3_finalize (reader->selectlist_stmt);
+  reader->selectlist_stmt = NULL;
+  sqlite3_finalize (reader->selectunpaid_stmt);
+  reader->selectunpaid_stmt = NULL;
+  sqlite3_finalize (reader->selectpaid_stmt);
+  reader->selectpaid_stmt = NULL;
+  sqlite3_finalize (reader->selectemail_stmt);
+  reader->selectemail_stmt = NULL;
+  if (reader->db)
     {
-      log_error ("error preparing select statement: %s\n",
-                 sqlite3_errstr (res));
-      close_preorder_db (1);
-      return gpg_error (GPG_ERR_GENERAL);
+      res = sqlite3_close (reader->db);
+      if (res)
+        log_error ("failed to close a preorder db reader: %s\n",
+                   sqlite3_errstr (res));
+      reader->db = NULL;
     }
-  preorder_selectlist_stmt = stmt;
-
-  return 0;
 }
 
 
-/* Insert a record into the preorder table.  The values are taken from
-   the dictionary at DICTP.  On return a Sepa-Ref value will have been
-   inserted into it; that may happen even on error.  */
+/* Open the read-only connection READER and prepare its statements.  */
 static gpg_error_t
-insert_preorder_record (keyvalue_t *dictp)
+open_preorder_reader (preorder_reader_t reader)
 {
   gpg_error_t err;
   int res;
-  keyvalue_t dict = *dictp;
-  char separef[9];
-  char *buf;
-  char datetime_buf [DB_DATETIME_SIZE];
-  int retrycount = 0;
+  const char *db_fname = opt.livemode? preorder_db_fname:preorder_test_db_fname;
 
- retry:
-  make_sepa_ref (separef, sizeof separef);
-  err = keyvalue_put (dictp, "Sepa-Ref", separef);
+  /* Make sure that the database has been created and is in WAL mode
+     by opening the writer connection.  */
+  err = storage_run (do_open_preorder_db, NULL);
   if (err)
     return err;
-  dict = *dictp;
-
-  sqlite3_reset (preorder_insert_stmt);
 
-  separef[5] = 0;
-  res = sqlite3_bind_text (preorder_insert_stmt,
-                           1, separef, -1, SQLITE_TRANSIENT);
-  if (!res)
-    res = sqlite3_bind_int (preorder_insert_stmt,
-                            2, atoi (separef + 6));
-  if (!res)
-    res = sqlite3_bind_text (preorder_insert_stmt,
-                             3, db_datetime_now (datetime_buf),
-                             -1, SQLITE_TRANSIENT);
-  if (!res)
-    res = sqlite3_bind_text (preorder_insert_stmt,
-                             4, keyvalue_get_string (dict, "Amount"),
-                             -1, SQLITE_TRANSIENT);
-  if (!res)
-    res = sqlite3_bind_text (preorder_insert_stmt,
-                             5, "EUR", -1, SQLITE_STATIC);
-  if (!res)
-    res = sqlite3_bind_text (preorder_insert_stmt,
-                             6, keyvalue_get (dict, "Desc"),
-                             -1, SQLITE_TRANSIENT);
-  if (!res)
-    res = sqlite3_bind_text (preorder_insert_stmt,
-                             7, keyvalue_get (dict, "Email"),
-                             -1, SQLITE_TRANSIENT);
-  if (!res)
+  res = sqlite3_open_v2 (db_fname,
+                         &reader->db,
+                         (SQLITE_OPEN_READONLY
+                          | SQLITE_OPEN_NOMUTEX),
+                         NULL);
+  if (res)
     {
-      buf = meta_field_to_string (dict);
-      if (!buf)
-        res = sqlite3_bind_null (preorder_insert_stmt, 8);
-      else
-        res = sqlite3_bind_text (preorder_insert_stmt, 8, buf, -1, es_free);
+      log_error ("error opening '%s' for reading: %s\n",
+                 db_fname, sqlite3_errstr (res));
+      goto leave;
     }
-  if (!res)
-    res = sqlite3_bind_int (preorder_insert_stmt,
-                            9, atoi (keyvalue_get_string (dict, "Recur")));
+  sqlite3_extended_result_codes (reader->db, 1);
+  sqlite3_busy_timeout (reader->db, DB_BUSY_TIMEOUT);
 
+  res = register_preorder_functions (reader->db);
   if (res)
     {
-      log_error ("error binding a value for the preorder table: %s\n",
+      log_error ("error registering preorder db functions: %s\n",
                  sqlite3_errstr (res));
-      return gpg_error (GPG_ERR_GENERAL);
+      goto leave;
     }
 
-  res = sqlite3_step (preorder_insert_stmt);
-  if (res == SQLITE_DONE)
-    return 0;
-
-  /* In case we hit the same primary key we need to retry.  This is
-     limited to 11000 retries (~0.1% of the primary key space).  */
-  if (res == SQLITE_CONSTRAINT_PRIMARYKEY && ++retrycount < 11000)
-    goto retry;
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder WHERE ref=?1",
+                            -1, &reader->select_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing select statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT " PREORDER_COLUMNS
+                            " FROM preorder_archive WHERE ref=?1",
+                            -1, &reader->selectarchive_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing selectarchive statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder "
+                            "WHERE refnn=?1 ORDER BY ref",
+                            -1, &reader->selectrefnn_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing selectrefnn statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder "
+                            "ORDER BY created DESC, refnn ASC",
+                            -1, &reader->selectlist_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing select statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder WHERE paid IS NULL "
+                            "ORDER BY created DESC, refnn ASC",
+                            -1, &reader->selectunpaid_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing selectunpaid statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder "
+                            "WHERE paid >= ?1 AND paid < ?2 "
+                            "ORDER BY paid DESC",
+                            -1, &reader->selectpaid_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing selectpaid statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+  res = sqlite3_prepare_v2 (reader->db,
+                            "SELECT * FROM preorder "
+                            "WHERE email_hash = email_hash(?1) "
+                            "ORDER BY created DESC",
+                            -1, &reader->selectemail_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing selectemail statement: %s\n",
+                 sqlite3_errstr (res));
+      goto leave;
+    }
+
+ leave:
+  if (res)
+    {
+      close_preorder_reader (reader);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  return 0;
+}
+
+
+/* Take a read-only connection from the pool and store it at
+   R_READER.  Waits until a connection is available.  The connection
+   must be given back using release_preorder_reader.  */
+static gpg_error_t
+acquire_preorder_reader (preorder_reader_t *r_reader)
+{
+  gpg_error_t err = 0;
+  preorder_reader_t reader;
+  int res, i;
+
+  *r_reader = NULL;
+
+  res = npth_mutex_lock (&preorder_readers_lock);
+  if (res)
+    log_fatal ("failed to acquire preorder readers lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  for (;;)
+    {
+      for (i=0; i < PREORDER_READERS; i++)
+        if (!preorder_readers[i].busy)
+          break;
+      if (i < PREORDER_READERS)
+        break;
+      res = npth_cond_wait (&preorder_readers_cond, &preorder_readers_lock);
+      if (res)
+        log_fatal ("failed to wait for a preorder reader: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+    }
+  reader = preorder_readers + i;
+  reader->busy = 1;
+  res = npth_mutex_unlock (&preorder_readers_lock);
+  if (res)
+    log_fatal ("failed to release preorder readers lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+
+  /* The connections are opened on first use.  We own READER now and
+     thus don't need to hold the lock while opening.  */
+  if (!reader->db)
+    err = open_preorder_reader (reader);
+
+  if (err)
+    release_preorder_reader (reader);
+  else
+    *r_reader = reader;
+  return err;
+}
+
+
+/* Give back the read-only connection READER to the pool.  */
+static void
+release_preorder_reader (preorder_reader_t reader)
+{
+  int res;
+
+  if (!reader)
+    return;
+
+  res = npth_mutex_lock (&preorder_readers_lock);
+  if (res)
+    log_fatal ("failed to acquire preorder readers lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  reader->busy = 0;
+  res = npth_cond_signal (&preorder_readers_cond);
+  if (res)
+    log_fatal ("failed to signal preorder readers: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  res = npth_mutex_unlock (&preorder_readers_lock);
+  if (res)
+    log_fatal ("failed to release preorder readers lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Insert a record into the preorder table.  The values are taken from
+   the dictionary at DICTP.  On return a Sepa-Ref value will have been
+   inserted into it; that may happen even on error.  */
+static gpg_error_t
+insert_preorder_record (keyvalue_t *dictp)
+{
+  gpg_error_t err;
+  int res;
+  keyvalue_t dict = *dictp;
+  char separef[9];
+  char *buf;
+  char datetime_buf [DB_DATETIME_SIZE];
+  int retrycount = 0;
+
+ retry:
+  err = alloc_sepa_ref (separef, sizeof separef);
+  if (err)
+    return err;
+  err = keyvalue_put (dictp, "Sepa-Ref", separef);
+  if (err)
+    return err;
+  dict = *dictp;
+
+  sqlite3_reset (preorder_insert_stmt);
+
+  separef[5] = 0;
+  res = sqlite3_bind_text (preorder_insert_stmt,
+                           1, separef, -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_int (preorder_insert_stmt,
+                            2, atoi (separef + 6));
+  if (!res)
+    res = sqlite3_bind_text (preorder_insert_stmt,
+                             3, db_datetime_now (datetime_buf),
+                             -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (preorder_insert_stmt,
+                             4, keyvalue_get_string (dict, "Amount"),
+                             -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (preorder_insert_stmt,
+                             5, "EUR", -1, SQLITE_STATIC);
+  if (!res)
+    res = sqlite3_bind_text (preorder_insert_stmt,
+                             6, keyvalue_get (dict, "Desc"),
+                             -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (preorder_insert_stmt,
+                             7, keyvalue_get (dict, "Email"),
+                             -1, SQLITE_TRANSIENT);
+  if (!res)
+    {
+      buf = meta_field_to_string (dict);
+      if (!buf)
+        res = sqlite3_bind_null (preorder_insert_stmt, 8);
+      else
+        res = sqlite3_bind_text (preorder_insert_stmt, 8, buf, -1, es_free);
+    }
+  if (!res)
+    res = sqlite3_bind_int (preorder_insert_stmt,
+                            9, atoi (keyvalue_get_string (dict, "Recur")));
+
+  if (res)
+    {
+      log_error ("error binding a value for the preorder table: %s\n",
+                 sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  res = step_unprotected (preorder_insert_stmt);
+  if (res == SQLITE_DONE || res == SQLITE_CONSTRAINT_PRIMARYKEY)
+    mark_sepa_ref (sepa_ref_to_index (separef));
+  if (res == SQLITE_DONE)
+    return 0;
+
+  /* The ref is taken from the bitmap and thus we should not hit an
+     existing primary key unless another process inserted it.  In
+     this case we need to retry.  This is limited to 11000 retries
+     (~0.1% of the primary key space).  */
+  if (res == SQLITE_CONSTRAINT_PRIMARYKEY && ++retrycount < 11000)
+    goto retry;
 
   log_error ("error inserting into preorder table: %s (%d)\n",
              sqlite3_errstr (res), res);
@@ -432,7 +1031,7 @@ get_text_column (sqlite3_stmt *stmt, int idx, int icol, const char *name,
   const char *s;
 
   s = sqlite3_column_text (stmt, icol);
-  if (!s && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+  if (!s && sqlite3_errcode (sqlite3_db_handle (stmt)) == SQLITE_NOMEM)
     err = gpg_error (GPG_ERR_ENOMEM);
   else if (!strcmp (name, "Meta"))
     err = s? keyvalue_put_meta (dictp, s) : 0;
@@ -453,13 +1052,13 @@ get_columns (sqlite3_stmt *stmt, int idx, keyvalue_t *dictp)
   int i;
 
   s = sqlite3_column_text (stmt, 0);
-  if (!s && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+  if (!s && sqlite3_errcode (sqlite3_db_handle (stmt)) == SQLITE_NOMEM)
     err = gpg_error (GPG_ERR_ENOMEM);
   else
     {
       strncpy (separef, s, 5);
       i = sqlite3_column_int (stmt, 1);
-      if (!i && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+      if (!i && sqlite3_errcode (sqlite3_db_handle (stmt)) == SQLITE_NOMEM)
         err = gpg_error (GPG_ERR_ENOMEM);
       else if (i < 0 || i > 99)
         err = gpg_error (GPG_ERR_INV_DATA);
@@ -500,20 +1099,21 @@ format_columns (sqlite3_stmt *stmt, int idx, keyvalue_t *dictp)
 {
   gpg_error_t err;
   membuf_t mb;
+  sqlite3 *db = sqlite3_db_handle (stmt);
   const char *s;
   int i;
 
   init_membuf (&mb, 512);
 
   s = sqlite3_column_text (stmt, 0);
-  if (!s && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+  if (!s && sqlite3_errcode (db) == SQLITE_NOMEM)
     {
       err = gpg_error (GPG_ERR_ENOMEM);
       goto leave;
     }
 
   i = sqlite3_column_int (stmt, 1);
-  if (!i && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+  if (!i && sqlite3_errcode (db) == SQLITE_NOMEM)
     {
       err = gpg_error (GPG_ERR_ENOMEM);
       goto leave;
@@ -524,7 +1124,7 @@ format_columns (sqlite3_stmt *stmt, int idx, keyvalue_t *dictp)
     {
       put_membuf_chr (&mb, '|');
       s = sqlite3_column_text (stmt, i);
-      if (!s && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+      if (!s && sqlite3_errcode (db) == SQLITE_NOMEM)
         {
           err = gpg_error (GPG_ERR_ENOMEM);
           goto leave;
@@ -544,7 +1144,7 @@ format_columns (sqlite3_stmt *stmt, int idx, keyvalue_t *dictp)
     }
 
   i = sqlite3_column_int (stmt, 10);
-  if (!i && sqlite3_errcode (preorder_db) == SQLITE_NOMEM)
+  if (!i && sqlite3_errcode (db) == SQLITE_NOMEM)
     {
       err = gpg_error (GPG_ERR_ENOMEM);
       goto leave;
@@ -574,10 +1174,11 @@ format_columns (sqlite3_stmt *stmt, int idx, keyvalue_t *dictp)
 }
 
 
-/* Get a record from the preorder table.  The values are stored at the
-   dictionary at DICTP.  */
+/* Get a record from the preorder table using the prepared select
+   statement STMT.  The values are stored at the dictionary at
+   DICTP.  */
 static gpg_error_t
-get_preorder_record (const char *ref, keyvalue_t *dictp)
+get_preorder_record (sqlite3_stmt *stmt, const char *ref, keyvalue_t *dictp)
 {
   gpg_error_t err;
   int res;
@@ -585,10 +1186,9 @@ get_preorder_record (const char *ref, keyvalue_t *dictp)
   if (strlen (ref) != 5)
     return gpg_error (GPG_ERR_INV_LENGTH);
 
-  sqlite3_reset (preorder_select_stmt);
+  sqlite3_reset (stmt);
 
-  res = sqlite3_bind_text (preorder_select_stmt,
-                           1, ref, 5, SQLITE_TRANSIENT);
+  res = sqlite3_bind_text (stmt, 1, ref, 5, SQLITE_TRANSIENT);
   if (res)
     {
       log_error ("error binding a value for the preorder table: %s\n",
@@ -596,11 +1196,11 @@ get_preorder_record (const char *ref, keyvalue_t *dictp)
       return gpg_error (GPG_ERR_GENERAL);
     }
 
-  res = sqlite3_step (preorder_select_stmt);
+  res = step_unprotected (stmt);
   if (res == SQLITE_ROW)
     {
       res = SQLITE_OK;
-      err = get_columns (preorder_select_stmt, -1, dictp);
+      err = get_columns (stmt, -1, dictp);
     }
   else if (res == SQLITE_DONE)
     {
@@ -610,7 +1210,13 @@ get_preorder_record (const char *ref, keyvalue_t *dictp)
   else
     err = gpg_error (GPG_ERR_GENERAL);
 
-  if (err)
+  /* Reset the statement so that it does not keep the read transaction
+     open.  */
+  sqlite3_reset (stmt);
+
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    ; /* The caller decides whether this is an error.  */
+  else if (err)
     {
       if (res == SQLITE_OK)
         log_error ("error selecting from preorder table: %s\n",
@@ -623,35 +1229,35 @@ get_preorder_record (const char *ref, keyvalue_t *dictp)
 }
 
 
-/* List records from the preorder table.  The values are stored at the
+/* List records from the preorder table using the prepared select
+   statement STMT.  If ARG1 or ARG2 are not NULL they are bound to the
+   first and second parameter of STMT.  The values are stored at the
    dictionary at DICTP with a D[n] key.  The number of records is
    stored at R_COUNT.  */
 static gpg_error_t
-list_preorder_records (const char *refnn,
+list_preorder_records (sqlite3_stmt *stmt,
+                       const char *arg1, const char *arg2,
                        keyvalue_t *dictp, unsigned int *r_count)
 {
   gpg_error_t err;
-  sqlite3_stmt *stmt;
   int count = 0;
-  int res;
-
-  stmt = *refnn? preorder_selectrefnn_stmt : preorder_selectlist_stmt;
+  int res = 0;
 
   sqlite3_reset (stmt);
 
-  if (*refnn)
+  if (arg1)
+    res = sqlite3_bind_text (stmt, 1, arg1, -1, SQLITE_TRANSIENT);
+  if (!res && arg2)
+    res = sqlite3_bind_text (stmt, 2, arg2, -1, SQLITE_TRANSIENT);
+  if (res)
     {
-      res = sqlite3_bind_text (stmt, 1, refnn, -1, SQLITE_TRANSIENT);
-      if (res)
-        {
-          log_error ("error binding a value for the preorder table: %s\n",
-                     sqlite3_errstr (res));
-          return gpg_error (GPG_ERR_GENERAL);
-        }
+      log_error ("error binding a value for the preorder table: %s\n",
+                 sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
     }
 
  next:
-  res = sqlite3_step (stmt);
+  res = step_unprotected (stmt);
   if (res == SQLITE_ROW)
     {
       res = SQLITE_OK;
@@ -671,6 +1277,8 @@ list_preorder_records (const char *refnn,
   else
     err = gpg_error (GPG_ERR_GENERAL);
 
+  sqlite3_reset (stmt);
+
   if (err)
     {
       if (res == SQLITE_OK)
@@ -714,7 +1322,7 @@ update_preorder_record (const char *ref, keyvalue_t *dictp)
       return gpg_error (GPG_ERR_GENERAL);
     }
 
-  res = sqlite3_step (preorder_update_stmt);
+  res = step_unprotected (preorder_update_stmt);
   if (res == SQLITE_DONE)
     {
       if (!sqlite3_changes (preorder_db))
@@ -731,120 +1339,392 @@ update_preorder_record (const char *ref, keyvalue_t *dictp)
   if (gpg_err_code (err) == GPG_ERR_GENERAL)
     log_error ("error updating preorder table: %s [%s (%d)]\n",
                gpg_strerror (err), sqlite3_errstr (res), res);
-  else
+  else if (err)
     log_error ("error updating preorder table: %s\n",
                gpg_strerror (err));
   return err;
 }
 
 
+/* Get the "ABCDE" part of the Sepa-Ref from DICT and store it in
+   SEPAREF which must have a size of 9.  */
+static gpg_error_t
+get_separef (keyvalue_t dict, char *separef)
+{
+  const char *s;
+  char *p;
+
+  s = keyvalue_get (dict, "Sepa-Ref");
+  if (!s || strlen (s) >= 9)
+    return gpg_error (GPG_ERR_INV_LENGTH);
+  strcpy (separef, s);
+  p = strchr (separef, '-');
+  if (p)
+    *p = 0;
+  return 0;
+}
+
+
+/* Storage function for preorder_store_record.  OPAQUE is the
+   dictionary pointer.  */
+static gpg_error_t
+do_store_record (void *opaque)
+{
+  gpg_error_t err;
+
+  err = open_preorder_db ();
+  if (!err)
+    err = storage_begin (preorder_db);
+  if (!err)
+    err = insert_preorder_record (opaque);
+  return err;
+}
+
+
 /* Create a new preorder record and store it.  Inserts a "Sepa-Ref"
    into DICT.  */
 gpg_error_t
 preorder_store_record (keyvalue_t *dictp)
+{
+  return storage_run (do_store_record, dictp);
+}
+
+
+/* Storage function for preorder_ref_usage.  OPAQUE is the array to
+   store the used and the total count.  */
+static gpg_error_t
+do_ref_usage (void *opaque)
 {
   gpg_error_t err;
+  unsigned int *counts = opaque;
 
   err = open_preorder_db ();
   if (err)
     return err;
+  counts[0] = sepa_ref_used;
+  counts[1] = SEPA_REF_SPACE;
+  return 0;
+}
 
-  err = insert_preorder_record (dictp);
-  close_preorder_db (0);
 
-  return err;
+/* Store the number of used Sepa-Ref values at R_USED and the number
+   of possible values at R_TOTAL.  */
+gpg_error_t
+preorder_ref_usage (unsigned int *r_used, unsigned int *r_total)
+{
+  gpg_error_t err;
+  unsigned int counts[2];
+
+  err = storage_run (do_ref_usage, counts);
+  if (err)
+    return err;
+  *r_used = counts[0];
+  *r_total = counts[1];
+  return 0;
 }
 
 
 /* Take the Sepa-Ref from DICTP, fetch the row, and update DICTP with
-   that data.  On error return an error code.  Note that DICTP may
-   even be changed on error.  */
+   that data.  If the record is not in the preorder table it is taken
+   from the archive.  On error return an error code.  Note that DICTP
+   may even be changed on error.  */
 gpg_error_t
 preorder_get_record (keyvalue_t *dictp)
 {
   gpg_error_t err;
+  preorder_reader_t reader;
   char separef[9];
-  const char *s;
-  char *p;
 
-  s = keyvalue_get (*dictp, "Sepa-Ref");
-  if (!s || strlen (s) >= sizeof separef)
-    return gpg_error (GPG_ERR_INV_LENGTH);
-  strcpy (separef, s);
-  p = strchr (separef, '-');
-  if (p)
-    *p = 0;
+  err = get_separef (*dictp, separef);
+  if (err)
+    return err;
 
-  err = open_preorder_db ();
+  err = acquire_preorder_reader (&reader);
   if (err)
     return err;
 
-  err = get_preorder_record (separef, dictp);
+  err = get_preorder_record (reader->select_stmt, separef, dictp);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = get_preorder_record (reader->selectarchive_stmt, separef, dictp);
 
-  close_preorder_db (0);
+  release_preorder_reader (reader);
 
   return err;
 }
 
 
-/* Take the number Sepa-Ref from DICTP, fetch the row, and update DICTP with
-   that data.  On error return an error code.  Note that DICTP may
-   even be changed on error.  */
+/* Check that STRING is a date or the start of a timestamp as used in
+   the preorder table ("YYYY-MM-DD HH:MM:SS").  */
+static int
+valid_paid_date_p (const char *string)
+{
+  return (strlen (string) >= 4
+          && strspn (string, "0123456789-: ") == strlen (string));
+}
+
+
+/* List preorder records and store them in DICTP.  The records to list
+   are selected by these optional items in DICTP, of which only one
+   kind may be given:
+
+   Refnn:       The records with this reference suffix (-NN).
+   Unpaid:      If not 0, the records which have not yet been paid.
+   Paid-Since:  The records last paid at or after this date.
+   Paid-Before: The records last paid before this date.
+   Email:       The records with this mail address.
+
+   Without one of these items all records are listed.  On error return
+   an error code.  Note that DICTP may even be changed on error.  */
 gpg_error_t
 preorder_list_records (keyvalue_t *dictp, unsigned int *r_count)
 {
   gpg_error_t err;
-  char refnn[3];
-  const char *s;
+  preorder_reader_t reader;
+  const char *refnn, *since, *before, *email;
+  int unpaid;
+  sqlite3_stmt *stmt;
 
   *r_count = 0;
-  s = keyvalue_get (*dictp, "Refnn");
-  if (s)
+  refnn = keyvalue_get (*dictp, "Refnn");
+  if (refnn && strlen (refnn) != 2)
+    return gpg_error (GPG_ERR_INV_LENGTH);
+  unpaid = keyvalue_get_int (*dictp, "Unpaid");
+  since = keyvalue_get (*dictp, "Paid-Since");
+  before = keyvalue_get (*dictp, "Paid-Before");
+  if ((since && !valid_paid_date_p (since))
+      || (before && !valid_paid_date_p (before)))
+    return gpg_error (GPG_ERR_INV_VALUE);
+  email = keyvalue_get (*dictp, "Email");
+  if (email && !*email)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  if ((!!refnn + !!unpaid + (since || before) + !!email) > 1)
+    return gpg_error (GPG_ERR_CONFLICT);
+
+  err = acquire_preorder_reader (&reader);
+  if (err)
+    return err;
+
+  if (refnn)
+    stmt = reader->selectrefnn_stmt;
+  else if (unpaid)
+    stmt = reader->selectunpaid_stmt;
+  else if (since || before)
     {
-      if (strlen (s) != 2)
-        return gpg_error (GPG_ERR_INV_LENGTH);
-      strcpy (refnn, s);
+      stmt = reader->selectpaid_stmt;
+      if (!since)
+        since = "";
+      if (!before)
+        before = "9999";
     }
+  else if (email)
+    stmt = reader->selectemail_stmt;
   else
-    *refnn = 0;
+    stmt = reader->selectlist_stmt;
+
+  err = list_preorder_records (stmt,
+                               refnn? refnn : email? email : since,
+                               before, dictp, r_count);
+
+  release_preorder_reader (reader);
+
+  return err;
+}
+
+
+/* Prepare the statements to copy a record from the table FROM to the
+   table TO and to delete it from FROM.  This must be called by the
+   storage thread.  Returns an sqlite error code.  */
+static int
+prepare_move_stmts (const char *from, const char *to,
+                    sqlite3_stmt **r_copy, sqlite3_stmt **r_delete)
+{
+  char *sql;
+  int res;
+
+  *r_copy = *r_delete = NULL;
+
+  sql = es_bsprintf ("INSERT INTO %s (" PREORDER_COLUMNS ")"
+                     " SELECT " PREORDER_COLUMNS " FROM %s WHERE ref=?1",
+                     to, from);
+  if (!sql)
+    return SQLITE_NOMEM;
+  res = sqlite3_prepare_v2 (preorder_db, sql, -1, r_copy, NULL);
+  es_free (sql);
+  if (res)
+    return res;
+
+  sql = es_bsprintf ("DELETE FROM %s WHERE ref=?1", from);
+  if (!sql)
+    res = SQLITE_NOMEM;
+  else
+    {
+      res = sqlite3_prepare_v2 (preorder_db, sql, -1, r_delete, NULL);
+      es_free (sql);
+    }
+  if (res)
+    {
+      sqlite3_finalize (*r_copy);
+      *r_copy = NULL;
+    }
+  return res;
+}
+
+
+/* Move the record REF using the statements from prepare_move_stmts.
+   Returns an sqlite error code; SQLITE_NOTFOUND is returned if there
+   is no such record.  */
+static int
+move_preorder_record (sqlite3_stmt *copy, sqlite3_stmt *del, const char *ref)
+{
+  int res;
+
+  sqlite3_reset (copy);
+  res = sqlite3_bind_text (copy, 1, ref, -1, SQLITE_TRANSIENT);
+  if (res)
+    return res;
+  res = step_unprotected (copy);
+  if (res != SQLITE_DONE)
+    return res;
+  if (!sqlite3_changes (preorder_db))
+    return SQLITE_NOTFOUND;
+
+  sqlite3_reset (del);
+  res = sqlite3_bind_text (del, 1, ref, -1, SQLITE_TRANSIENT);
+  if (res)
+    return res;
+  res = step_unprotected (del);
+  return res == SQLITE_DONE? SQLITE_OK : res;
+}
+
+
+/* Move the record SEPAREF back from the archive to the preorder
+   table.  This must be called by a storage function.  */
+static gpg_error_t
+restore_preorder_record (const char *separef)
+{
+  sqlite3_stmt *copy, *del;
+  int res;
+
+  res = run_preorder_sql (preorder_db, "SAVEPOINT restore");
+  if (res)
+    goto leave;
+  res = prepare_move_stmts ("preorder_archive", "preorder", &copy, &del);
+  if (!res)
+    {
+      res = move_preorder_record (copy, del, separef);
+      sqlite3_finalize (copy);
+      sqlite3_finalize (del);
+    }
+  if (res)
+    run_preorder_sql (preorder_db, "ROLLBACK TO restore");
+  run_preorder_sql (preorder_db, "RELEASE restore");
+
+ leave:
+  if (res == SQLITE_NOTFOUND)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  if (res)
+    {
+      log_error ("error restoring preorder '%s' from the archive: %s\n",
+                 separef, sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  log_info ("preorder '%s' restored from the archive\n", separef);
+  return 0;
+}
+
+
+/* Storage function to move up to ARCHIVE_BATCH_SIZE paid or expired
+   preorders which have not been touched for opt.archive_days to the
+   archive table.  OPAQUE is a pointer to an unsigned int to store the
+   number of moved records.  */
+static gpg_error_t
+do_archive_batch (void *opaque)
+{
+  gpg_error_t err;
+  unsigned int *r_count = opaque;
+  sqlite3_stmt *stmt, *copy, *del;
+  char refs[ARCHIVE_BATCH_SIZE][6];
+  char modifier[30];
+  const char *s;
+  unsigned int n, i;
+  int res;
+
+  *r_count = 0;
 
   err = open_preorder_db ();
   if (err)
     return err;
 
-  err = list_preorder_records (refnn, dictp, r_count);
+  snprintf (modifier, sizeof modifier, "-%d days", opt.archive_days);
+  res = sqlite3_prepare_v2 (preorder_db, archive_select_sql, -1, &stmt, NULL);
+  if (res)
+    goto leave;
+  res = sqlite3_bind_text (stmt, 1, modifier, -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_int (stmt, 2, ARCHIVE_BATCH_SIZE);
+  for (n=0; !res && (res = step_unprotected (stmt)) == SQLITE_ROW; )
+    {
+      s = (const char *)sqlite3_column_text (stmt, 0);
+      if (s && strlen (s) == 5 && n < ARCHIVE_BATCH_SIZE)
+        strcpy (refs[n++], s);
+      res = 0;
+    }
+  sqlite3_finalize (stmt);
+  if (res != SQLITE_DONE)
+    goto leave;
+  res = 0;
+  if (!n)
+    goto leave;
 
-  close_preorder_db (0);
+  err = storage_begin (preorder_db);
+  if (err)
+    return err;
+  res = prepare_move_stmts ("preorder", "preorder_archive", &copy, &del);
+  for (i=0; !res && i < n; i++)
+    res = move_preorder_record (copy, del, refs[i]);
+  sqlite3_finalize (copy);
+  sqlite3_finalize (del);
+  if (!res)
+    *r_count = n;
 
-  return err;
+ leave:
+  if (res)
+    {
+      log_error ("error archiving preorders: %s\n", sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  return 0;
 }
 
 
-/* Take the Sepa-Ref from NEWDATA and update the corresponding row with
-   the other data from NEWDATA.  On error return an error code.  */
-gpg_error_t
-preorder_update_record (keyvalue_t *newdata)
+/* Check the data from NEWDATA against the preorder record SEPAREF and
+   update that record.  This must be called by a storage function
+   after storage_begin.  On success the record with the actual amount
+   is stored at R_OLDDATA and the recurrence value at R_RECUR; both
+   are needed for the journal.  On error all changes done for the
+   record, including its restore from the archive, are rolled back.  */
+static gpg_error_t
+commit_preorder_record (const char *separef, keyvalue_t *newdata,
+                        keyvalue_t *r_olddata, int *r_recur)
 {
   gpg_error_t err;
-  char separef[9];
   const char *s;
-  char *p;
   keyvalue_t olddata = NULL;
   int recur;
+  int res;
 
-  s = keyvalue_get (*newdata, "Sepa-Ref");
-  if (!s || strlen (s) >= sizeof separef)
-    return gpg_error (GPG_ERR_INV_LENGTH);
-  strcpy (separef, s);
-  p = strchr (separef, '-');
-  if (p)
-    *p = 0;
-
-  err = open_preorder_db ();
-  if (err)
-    return err;
+  res = run_preorder_sql (preorder_db, "SAVEPOINT commitrec");
+  if (res)
+    {
+      log_error ("error starting a savepoint: %s\n", sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
 
-  err = get_preorder_record (separef, &olddata);
+  err = get_preorder_record (preorder_select_stmt, separef, &olddata);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND
+      && !restore_preorder_record (separef))
+    err = get_preorder_record (preorder_select_stmt, separef, &olddata);
   if (err)
     goto leave;
 
@@ -900,17 +1780,242 @@ preorder_update_record (keyvalue_t *newdata)
 
   /* We pass OLDDATA so that _timestamp will be set.  */
   err = update_preorder_record (separef, &olddata);
+
+ leave:
   if (err)
-    goto leave;
+    run_preorder_sql (preorder_db, "ROLLBACK TO commitrec");
+  res = run_preorder_sql (preorder_db, "RELEASE commitrec");
+  if (res && !err)
+    {
+      log_error ("error releasing a savepoint: %s\n", sqlite3_errstr (res));
+      err = gpg_error (GPG_ERR_GENERAL);
+    }
+  if (err)
+    keyvalue_release (olddata);
+  else
+    {
+      *r_olddata = olddata;
+      *r_recur = recur;
+    }
+  return err;
+}
+
+
+/* The arguments for do_update_records.  */
+struct update_records_parm_s
+{
+  keyvalue_t *newdata;
+  gpg_error_t *errs;
+  unsigned int n;
+  keyvalue_t *olddata;
+  int *recur;
+};
+
+
+/* Storage function for preorder_update_record and
+   preorder_update_records.  OPAQUE is a pointer to struct
+   update_records_parm_s.  An error is returned if the records can't
+   be written at all.  */
+static gpg_error_t
+do_update_records (void *opaque)
+{
+  struct update_records_parm_s *parm = opaque;
+  gpg_error_t err;
+  char separef[9];
+  unsigned int i;
+
+  err = open_preorder_db ();
+  if (!err)
+    err = storage_begin (preorder_db);
+  if (err)
+    return err;
+
+  for (i=0; i < parm->n; i++)
+    {
+      if (parm->errs[i])
+        continue;
+      parm->errs[i] = get_separef (parm->newdata[i], separef);
+      if (!parm->errs[i])
+        parm->errs[i] = commit_preorder_record (separef, parm->newdata + i,
+                                                parm->olddata + i,
+                                                parm->recur + i);
+      if (gpg_err_code (parm->errs[i]) == GPG_ERR_GENERAL)
+        return parm->errs[i];
+    }
+  return 0;
+}
+
+
+/* Take the Sepa-Ref from NEWDATA and update the corresponding row with
+   the other data from NEWDATA.  On error return an error code.  */
+gpg_error_t
+preorder_update_record (keyvalue_t *newdata)
+{
+  gpg_error_t err;
+  gpg_error_t itemerr = 0;
+  keyvalue_t olddata = NULL;
+  int recur;
+  struct update_records_parm_s parm;
+
+  parm.newdata = newdata;
+  parm.errs = &itemerr;
+  parm.n = 1;
+  parm.olddata = &olddata;
+  parm.recur = &recur;
+  err = storage_run (do_update_records, &parm);
+  if (!err)
+    err = itemerr;
+  if (err)
+    {
+      keyvalue_release (olddata);
+      return err;
+    }
 
   /* FIXME: Unfortunately the journal function creates its own
      timestamp.  */
   jrnl_store_charge_record (&olddata, PAYMENT_SERVICE_SEPA, recur);
+  keyvalue_release (olddata);
+
+  return 0;
+}
 
 
- leave:
-  close_preorder_db (0);
-  keyvalue_release (olddata);
+/* Update the preorder records for the N dictionaries at NEWDATA in a
+   single transaction.  This is the bulk version of
+   preorder_update_record.  ERRS is an array with the result for each
+   record; records with an error already set are skipped.  A record
+   which can't be updated gets its error set and its dictionary may
+   have a "failure-mesg" item.  An error is only returned if the
+   transaction failed; no record has then been updated.  */
+gpg_error_t
+preorder_update_records (keyvalue_t *newdata, gpg_error_t *errs,
+                         unsigned int n)
+{
+  gpg_error_t err;
+  keyvalue_t *olddata;
+  int *recur;
+  unsigned int i;
+  struct update_records_parm_s parm;
+
+  olddata = xtrycalloc (n? n : 1, sizeof *olddata);
+  if (!olddata)
+    return gpg_error_from_syserror ();
+  recur = xtrycalloc (n? n : 1, sizeof *recur);
+  if (!recur)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (olddata);
+      return err;
+    }
 
+  parm.newdata = newdata;
+  parm.errs = errs;
+  parm.n = n;
+  parm.olddata = olddata;
+  parm.recur = recur;
+  err = storage_run (do_update_records, &parm);
+
+  /* Write the journal only after the commit.  */
+  for (i=0; !err && i < n; i++)
+    if (!errs[i])
+      jrnl_store_charge_record (olddata + i, PAYMENT_SERVICE_SEPA, recur[i]);
+
+  for (i=0; i < n; i++)
+    keyvalue_release (olddata[i]);
+  xfree (olddata);
+  xfree (recur);
   return err;
 }
+
+
+/* Housekeeping for the preorder database.  Preorders settled more
+   than opt.archive_days ago are moved to the archive table in small
+   batches.  Each batch is a separate storage function so that new
+   preorders are not blocked for long.  */
+void
+preorder_housekeeping (void)
+{
+  unsigned int count, total = 0;
+  int i;
+
+  if (opt.archive_days <= 0)
+    return;
+
+  for (i=0; i < ARCHIVE_MAX_BATCHES; i++)
+    {
+      if (storage_run (do_archive_batch, &count))
+        break;
+      total += count;
+      if (count < ARCHIVE_BATCH_SIZE)
+        break;
+    }
+  if (total)
+    log_info ("moved %u preorders to the archive\n", total);
+}
+
+
+/* Storage function to copy the next pages of the online backup.
+   OPAQUE points to an int which is the START flag for db_backup_step
+   on input and tells whether the backup is still running on
+   output.  This is run after the commit of a batch because our own
+   write transaction would block the backup.  */
+static gpg_error_t
+do_backup_step (void *opaque)
+{
+  gpg_error_t err;
+  int *flag = opaque;
+  char *fname;
+
+  err = open_preorder_db ();
+  if (err)
+    return err;
+
+  fname = strconcat (opt.backup_dir, "/preorder.db", NULL);
+  if (!fname)
+    return gpg_error_from_syserror ();
+  err = db_backup_step (&preorder_backup, preorder_db, fname, *flag,
+                        DB_BACKUP_PAGES);
+  xfree (fname);
+  *flag = !!preorder_backup.backup;
+  return err;
+}
+
+
+/* Copy the next DB_BACKUP_PAGES pages of the preorder database to
+   the snapshot in opt.backup_dir.  If START is set and no backup is
+   running a new backup is started.  Returns true if the backup is
+   still running.  */
+int
+preorder_backup_step (int start)
+{
+  int flag = start;
+
+  if (!opt.backup_dir || storage_run_unbatched (do_backup_step, &flag))
+    return 0;
+  return flag;
+}
+
+
+/* Storage function for preorder_backup_status.  */
+static gpg_error_t
+do_backup_status (void *opaque)
+{
+  char **r_status = opaque;
+
+  *r_status = db_backup_status (&preorder_backup, "preorder");
+  return *r_status? 0 : gpg_error_from_syserror ();
+}
+
+
+/* Return a string describing the state of the online backup of the
+   preorder database.  The caller must release it using es_free.
+   Returns NULL on error.  */
+char *
+preorder_backup_status (void)
+{
+  char *status = NULL;
+
+  if (storage_run (do_backup_status, &status))
+    return NULL;
+  return status;
+}
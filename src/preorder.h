@@ -22,8 +22,14 @@
 
 gpg_error_t preorder_store_record (keyvalue_t *dictp);
 gpg_error_t preorder_update_record (keyvalue_t *dict);
+gpg_error_t preorder_update_records (keyvalue_t *newdata, gpg_error_t *errs,
+                                     unsigned int n);
 gpg_error_t preorder_get_record (keyvalue_t *dictp);
 gpg_error_t preorder_list_records (keyvalue_t *dictp, unsigned int *r_count);
+gpg_error_t preorder_ref_usage (unsigned int *r_used, unsigned int *r_total);
+void preorder_housekeeping (void);
+int preorder_backup_step (int start);
+char *preorder_backup_status (void);
 
 
 #endif /*PREORDER_H*/
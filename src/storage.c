@@ -0,0 +1,407 @@
+/* storage.c - The thread doing all database writes
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* All write access to the databases is done by a single thread.
+ * Other threads queue a function using storage_run and wait until
+ * the storage thread has run it and committed its changes.  The
+ * storage thread takes all queued functions at once and runs them in
+ * one transaction per database.  Thus under load several requests
+ * share one commit (and its fsync).
+ *
+ * A function which is going to write to a database must call
+ * storage_begin with the database handle first.  This starts the
+ * transaction of the batch if needed and sets a savepoint for the
+ * function.  If the function returns an error its changes are rolled
+ * back to that savepoint without affecting the other functions of the
+ * batch.  If the final commit fails, all functions which wrote to
+ * that database get an error.
+ *
+ * A function queued with storage_run_unbatched is run after the
+ * commit of its batch.  It must not write to a database but it can
+ * use the handles without an open transaction of the batch; this is
+ * for example required for an online backup.
+ *
+ * The database handles are only used by the storage thread and thus
+ * the modules don't need their own locks for them.  A storage
+ * function must not call storage_run itself.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+#include <sqlite3.h>
+
+#include "util.h"
+#include "logging.h"
+#include "storage.h"
+
+
+/* The maximum number of functions run in one batch.  */
+#define STORAGE_MAX_BATCH 64
+
+/* The maximum number of databases.  */
+#define STORAGE_MAX_DBS 4
+
+
+/* A queued function.  The object is allocated on the stack of the
+   thread calling storage_run.  */
+struct storage_job_s
+{
+  struct storage_job_s *next;
+  storage_func_t func;
+  void *opaque;
+  sqlite3 *dbs[STORAGE_MAX_DBS];  /* The databases with a savepoint.  */
+  int ndbs;
+  gpg_error_t err;                /* The result.  */
+  int unbatched;                  /* Run after the commit.  */
+  int done;                       /* The job has been completed.  */
+};
+typedef struct storage_job_s *storage_job_t;
+
+
+/* The queue of functions to run.  The queue, the DONE flags of the
+   jobs and the running flag are protected by storage_lock.
+   storage_cond is signaled when a job has been queued, storage_done
+   when a batch has been completed.  */
+static npth_mutex_t storage_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t storage_cond = NPTH_COND_INITIALIZER;
+static npth_cond_t storage_done = NPTH_COND_INITIALIZER;
+static storage_job_t storage_queue;
+static storage_job_t storage_queue_tail;
+static int storage_running;
+
+/* The state of the current batch.  These variables are only used by
+   the storage thread.  */
+static storage_job_t current_job;
+static sqlite3 *batch_dbs[STORAGE_MAX_DBS];
+static int batch_failed[STORAGE_MAX_DBS];
+static int batch_ndbs;
+
+
+
+
+static void
+lock_storage (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&storage_lock);
+  if (res)
+    log_fatal ("failed to acquire storage lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_storage (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&storage_lock);
+  if (res)
+    log_fatal ("failed to release storage lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Run SQL on DB without holding the npth lock.  Returns an sqlite
+   error code.  */
+static int
+storage_exec (sqlite3 *db, const char *sql)
+{
+  int res;
+
+  npth_unprotect ();
+  res = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  npth_protect ();
+  return res;
+}
+
+
+/* Return the index of DB in the list of databases of the current
+   batch or -1.  */
+static int
+batch_db_index (sqlite3 *db)
+{
+  int i;
+
+  for (i=0; i < batch_ndbs; i++)
+    if (batch_dbs[i] == db)
+      return i;
+  return -1;
+}
+
+
+/* Release the savepoints of JOB or roll back to them if the job
+   failed.  */
+static void
+finish_job (storage_job_t job)
+{
+  int i, res;
+
+  for (i=0; i < job->ndbs; i++)
+    {
+      res = 0;
+      if (job->err)
+        res = storage_exec (job->dbs[i], "ROLLBACK TO storage_job");
+      if (!res)
+        res = storage_exec (job->dbs[i], "RELEASE storage_job");
+      if (res)
+        {
+          /* We can't be sure about the state of the transaction and
+             thus the entire batch needs to be rolled back.  */
+          log_error ("error finishing a storage job: %s\n",
+                     sqlite3_errstr (res));
+          batch_failed[batch_db_index (job->dbs[i])] = 1;
+        }
+    }
+}
+
+
+/* Run the functions of the list JOBS and commit their changes.  */
+static void
+run_batch (storage_job_t jobs)
+{
+  storage_job_t job;
+  int i, k, res;
+
+  batch_ndbs = 0;
+  for (job = jobs; job; job = job->next)
+    {
+      if (job->unbatched)
+        continue;
+      current_job = job;
+      job->err = job->func (job->opaque);
+      current_job = NULL;
+      finish_job (job);
+    }
+
+  for (i=0; i < batch_ndbs; i++)
+    {
+      res = batch_failed[i]? SQLITE_ABORT : storage_exec (batch_dbs[i],
+                                                          "COMMIT");
+      if (!res)
+        continue;
+      log_error ("error committing a storage batch: %s\n",
+                 sqlite3_errstr (res));
+      storage_exec (batch_dbs[i], "ROLLBACK");
+      for (job = jobs; job; job = job->next)
+        for (k=0; k < job->ndbs; k++)
+          if (job->dbs[k] == batch_dbs[i] && !job->err)
+            job->err = gpg_error (GPG_ERR_GENERAL);
+    }
+  batch_ndbs = 0;
+
+  /* Now run the functions which must not be part of a transaction.
+   * CURRENT_JOB is not set so that storage_begin catches a write.  */
+  for (job = jobs; job; job = job->next)
+    if (job->unbatched)
+      job->err = job->func (job->opaque);
+}
+
+
+/* The storage thread.  */
+static void *
+storage_thread (void *arg)
+{
+  storage_job_t jobs, job;
+  int n, res;
+
+  (void)arg;
+
+  for (;;)
+    {
+      lock_storage ();
+      while (!storage_queue)
+        {
+          res = npth_cond_wait (&storage_cond, &storage_lock);
+          if (res)
+            log_fatal ("failed to wait for storage jobs: %s\n",
+                       gpg_strerror (gpg_error_from_errno (res)));
+        }
+
+      /* Take up to STORAGE_MAX_BATCH jobs from the queue.  */
+      jobs = storage_queue;
+      for (job = jobs, n = 1; job->next && n < STORAGE_MAX_BATCH; n++)
+        job = job->next;
+      storage_queue = job->next;
+      if (!storage_queue)
+        storage_queue_tail = NULL;
+      job->next = NULL;
+      unlock_storage ();
+
+      run_batch (jobs);
+
+      lock_storage ();
+      for (job = jobs; job; job = job->next)
+        job->done = 1;
+      res = npth_cond_broadcast (&storage_done);
+      if (res)
+        log_fatal ("failed to signal storage jobs: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      unlock_storage ();
+    }
+
+  return NULL;
+}
+
+
+/* Start the storage thread.  The caller must hold the storage
+   lock.  */
+static gpg_error_t
+start_storage_thread (void)
+{
+  gpg_error_t err = 0;
+  npth_attr_t tattr;
+  npth_t thread;
+  int res;
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    err = gpg_error_from_errno (res);
+  else
+    {
+      npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+      res = npth_create (&thread, &tattr, storage_thread, NULL);
+      if (res)
+        err = gpg_error_from_errno (res);
+      npth_attr_destroy (&tattr);
+    }
+  if (err)
+    log_error ("error starting the storage thread: %s\n", gpg_strerror (err));
+  else
+    storage_running = 1;
+  return err;
+}
+
+
+
+/*
+ *   Public API
+ */
+
+
+/* Queue FUNC with argument OPAQUE and wait until it has been run.
+ * See storage_run and storage_run_unbatched.  */
+static gpg_error_t
+queue_job (storage_func_t func, void *opaque, int unbatched)
+{
+  gpg_error_t err;
+  struct storage_job_s job;
+  int res;
+
+  memset (&job, 0, sizeof job);
+  job.func = func;
+  job.opaque = opaque;
+  job.unbatched = unbatched;
+
+  lock_storage ();
+  if (!storage_running && (err = start_storage_thread ()))
+    {
+      unlock_storage ();
+      return err;
+    }
+
+  if (storage_queue_tail)
+    storage_queue_tail->next = &job;
+  else
+    storage_queue = &job;
+  storage_queue_tail = &job;
+  res = npth_cond_signal (&storage_cond);
+  if (res)
+    log_fatal ("failed to signal the storage thread: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+
+  while (!job.done)
+    {
+      res = npth_cond_wait (&storage_done, &storage_lock);
+      if (res)
+        log_fatal ("failed to wait for the storage thread: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+    }
+  unlock_storage ();
+
+  return job.err;
+}
+
+
+/* Run FUNC with argument OPAQUE in the storage thread and wait until
+ * its changes have been committed.  Returns the error code of FUNC or
+ * an error if the commit failed.  */
+gpg_error_t
+storage_run (storage_func_t func, void *opaque)
+{
+  return queue_job (func, opaque, 0);
+}
+
+
+/* Run FUNC with argument OPAQUE in the storage thread after the
+ * transactions of the current batch have been committed.  FUNC must
+ * not write to a database.  Returns the error code of FUNC.  */
+gpg_error_t
+storage_run_unbatched (storage_func_t func, void *opaque)
+{
+  return queue_job (func, opaque, 1);
+}
+
+
+/* Prepare the database DB for writing by the current storage
+ * function.  This must be called before any change to DB.  */
+gpg_error_t
+storage_begin (sqlite3 *db)
+{
+  int i, res;
+
+  if (!current_job)
+    BUG ();
+
+  for (i=0; i < current_job->ndbs; i++)
+    if (current_job->dbs[i] == db)
+      return 0;  /* Already prepared.  */
+  if (current_job->ndbs == STORAGE_MAX_DBS)
+    BUG ();
+
+  if (batch_db_index (db) == -1)
+    {
+      if (batch_ndbs == STORAGE_MAX_DBS)
+        BUG ();
+      res = storage_exec (db, "BEGIN IMMEDIATE");
+      if (res)
+        {
+          log_error ("error starting a storage transaction: %s\n",
+                     sqlite3_errstr (res));
+          return gpg_error (GPG_ERR_GENERAL);
+        }
+      batch_failed[batch_ndbs] = 0;
+      batch_dbs[batch_ndbs++] = db;
+    }
+
+  res = storage_exec (db, "SAVEPOINT storage_job");
+  if (res)
+    {
+      log_error ("error setting a storage savepoint: %s\n",
+                 sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  current_job->dbs[current_job->ndbs++] = db;
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+/* storage.h - Definition for the storage thread
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+/* The type of a function run by the storage thread.  */
+typedef gpg_error_t (*storage_func_t) (void *opaque);
+
+gpg_error_t storage_run (storage_func_t func, void *opaque);
+gpg_error_t storage_run_unbatched (storage_func_t func, void *opaque);
+gpg_error_t storage_begin (sqlite3 *db);
+
+
+#endif /*STORAGE_H*/
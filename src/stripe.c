@@ -27,7 +27,6 @@
 #include "util.h"
 #include "logging.h"
 #include "http.h"
-#include "membuf.h"
 #include "cJSON.h"
 #include "payprocd.h"
 #include "form.h"
@@ -51,7 +50,6 @@ call_stripe (const char *keystring, const char *method, const char *data,
 {
   gpg_error_t err;
   char *url = NULL;
-  http_session_t session = NULL;
   http_t http = NULL;
   unsigned int status;
 
@@ -62,10 +60,6 @@ call_stripe (const char *keystring, const char *method, const char *data,
   if (!url)
     return gpg_error_from_syserror ();
 
-  err = http_session_new (&session, NULL);
-  if (err)
-    goto leave;
-
   if (opt.debug_stripe)
     log_debug ("stripe-req: %s %s\n", formdata? "POST" : "GET", url);
 
@@ -74,9 +68,9 @@ call_stripe (const char *keystring, const char *method, const char *data,
                    url,
                    NULL,
                    keystring,
-                   0,
+                   HTTP_FLAG_KEEP_ALIVE,
+                   NULL,
                    NULL,
-                   session,
                    NULL,
                    NULL);
   if (err)
@@ -114,18 +108,10 @@ call_stripe (const char *keystring, const char *method, const char *data,
   *r_status = status;
   if ((status / 100) == 2 || (status / 100) == 4)
     {
-      int c;
-      membuf_t mb;
       char *jsonstr;
 
-      init_membuf (&mb, 1024);
-      while ((c = es_getc (http_get_read_ptr (http))) != EOF)
-        put_membuf_chr (&mb, c);
-      put_membuf_chr (&mb, 0);
-      jsonstr = get_membuf (&mb, NULL);
-      if (!jsonstr)
-        err = gpg_error_from_syserror ();
-      else
+      err = http_read_body (http, &jsonstr, NULL, 0);
+      if (!err)
         {
           cjson_t root;
 
@@ -158,7 +144,6 @@ call_stripe (const char *keystring, const char *method, const char *data,
 
  leave:
   http_close (http, 0);
-  http_session_release (session);
   xfree (url);
   return err;
 }
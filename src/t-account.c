@@ -0,0 +1,385 @@
+/* t-account.c - Regression test for the account cache
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <npth.h>
+
+#include "t-common.h"
+
+#include "account.c" /* The module under test.  */
+
+
+static void
+test_cache_lru (void)
+{
+  unsigned char digest[ACCOUNT_CACHE_DIGESTLEN];
+  char id[16];
+  unsigned int i;
+
+  cache_flush ();
+  cache_digest (digest, NULL, NULL, NULL);
+  for (i=0; i < ACCOUNT_CACHE_SIZE; i++)
+    {
+      snprintf (id, sizeof id, "T%05u", i);
+      cache_put (id, digest, NULL, NULL);
+    }
+  if (cache_entries != ACCOUNT_CACHE_SIZE)
+    fail (0);
+
+  /* The first entry is now the least recently used; touch it so
+     that the second one is evicted by the next put.  */
+  if (!cache_find ("T00000"))
+    fail (1);
+  cache_put ("T99999", digest, NULL, NULL);
+  if (cache_entries != ACCOUNT_CACHE_SIZE)
+    fail (2);
+  if (!cache_find ("T00000") || !cache_find ("T99999"))
+    fail (3);
+  if (cache_find ("T00001"))
+    fail (4);
+  if (!cache_find ("T00002"))
+    fail (5);
+
+  cache_flush ();
+  if (cache_entries || cache_lru_head || cache_lru_tail)
+    fail (6);
+}
+
+
+/* Storage function to delete the account row with the id at
+   OPAQUE.  */
+static gpg_error_t
+delete_row (void *opaque)
+{
+  char *sql;
+  int res;
+
+  sql = sqlite3_mprintf ("DELETE FROM account WHERE account_id=%Q",
+                         (const char *)opaque);
+  res = sqlite3_exec (account_db, sql, NULL, NULL, NULL);
+  sqlite3_free (sql);
+  return res? gpg_error (GPG_ERR_GENERAL) : 0;
+}
+
+
+/* Delete the account row with the id ACCOUNT_ID using a second
+   connection so that the storage thread does not notice it.  */
+static int
+delete_row_behind (const char *fname, const char *account_id)
+{
+  sqlite3 *db;
+  char *sql;
+  int res;
+
+  if (sqlite3_open (fname, &db))
+    return -1;
+  sql = sqlite3_mprintf ("DELETE FROM account WHERE account_id=%Q",
+                         account_id);
+  res = sqlite3_exec (db, sql, NULL, NULL, NULL);
+  sqlite3_free (sql);
+  sqlite3_close (db);
+  return res;
+}
+
+
+/* Storage function to release all cache entries.  */
+static gpg_error_t
+flush_cache (void *opaque)
+{
+  (void)opaque;
+  cache_flush ();
+  return 0;
+}
+
+
+/* Storage function to make the commit of a batch fail if an account
+   gets the mail address "fail@example.org".  */
+static gpg_error_t
+setup_failing_commit (void *opaque)
+{
+  (void)opaque;
+  if (sqlite3_exec (account_db,
+                    "PRAGMA foreign_keys = ON;"
+                    "CREATE TABLE t_parent (y PRIMARY KEY);"
+                    "CREATE TABLE t_child (x REFERENCES t_parent(y)"
+                    "  DEFERRABLE INITIALLY DEFERRED);"
+                    "CREATE TRIGGER t_fail AFTER UPDATE ON account"
+                    "  WHEN new.email = 'fail@example.org'"
+                    "  BEGIN INSERT INTO t_child VALUES (1); END;",
+                    NULL, NULL, NULL))
+    return gpg_error (GPG_ERR_GENERAL);
+  return 0;
+}
+
+
+/* Update the account ID with the Stripe customer id CUS.  The
+   encryption is skipped; the database gets a dummy value.  */
+static gpg_error_t
+update_cus (const char *id, const char *cus)
+{
+  struct update_parm_s parm;
+
+  memset (&parm, 0, sizeof parm);
+  parm.account_id = id;
+  parm.stripe_cus = cus;
+  parm.paypal_payer_id = "";
+  parm.enc_stripe_cus = (char *)"[encrypted]";
+  cache_digest (parm.digest, NULL, parm.stripe_cus, parm.paypal_payer_id);
+  if (hash_account_key (parm.cus_hash, parm.stripe_cus))
+    return gpg_error (GPG_ERR_GENERAL);
+  return storage_run (update_account_record, &parm);
+}
+
+
+/* Update the account ID with the mail address EMAIL.  */
+static gpg_error_t
+update_email (const char *id, const char *email)
+{
+  gpg_error_t err;
+  keyvalue_t dict = NULL;
+
+  err = keyvalue_put (&dict, "account-id", id);
+  if (!err)
+    err = keyvalue_put (&dict, "Email", email);
+  if (!err)
+    err = account_update_record (dict);
+  keyvalue_release (dict);
+  return err;
+}
+
+
+static void
+test_cache_update (void)
+{
+  static char fname[] = "t-account.db";
+  char *id = NULL;
+  char *id2 = NULL;
+  char *id3 = NULL;
+  unsigned int entries;
+  unsigned long hits, misses;
+  char buf[50];
+
+  remove (fname);
+  account_test_db_fname = fname;
+
+  if (account_new_record (&id) || account_new_record (&id2)
+      || account_new_record (&id3))
+    {
+      fail (0);
+      goto leave;
+    }
+  account_cache_stats (&entries, &hits, &misses);
+  if (entries != 3 || hits || misses)
+    fail (1);
+
+  /* A changed value is written.  */
+  if (update_email (id, "foo@example.org"))
+    fail (2);
+  account_cache_stats (&entries, &hits, &misses);
+  if (hits != 0 || misses != 1)
+    fail (3);
+
+  /* Writing the same value again is a cache hit.  */
+  if (update_email (id, "foo@example.org"))
+    fail (4);
+  account_cache_stats (&entries, &hits, &misses);
+  if (hits != 1 || misses != 1)
+    fail (5);
+
+  /* The timestamp of a cache hit is written later.  A row deleted
+     behind our back is noticed then and dropped from the cache.  */
+  if (cache_touches != 1)
+    fail (6);
+  if (delete_row_behind (fname, id))
+    fail (6);
+  if (update_email (id, "foo@example.org"))
+    fail (7);
+  if (storage_run (flush_account_touches, NULL) || cache_touches)
+    fail (7);
+  if (cache_find (id))
+    fail (8);
+  if (gpg_err_code (update_email (id, "foo@example.org"))
+      != GPG_ERR_NOT_FOUND)
+    fail (8);
+
+  /* A row deleted using our connection is dropped from the cache
+     right away.  */
+  if (update_email (id3, "baz@example.org"))
+    fail (9);
+  if (storage_run (delete_row, id3))
+    fail (10);
+  if (cache_find (id3))
+    fail (11);
+  if (gpg_err_code (update_email (id3, "baz@example.org"))
+      != GPG_ERR_NOT_FOUND)
+    fail (12);
+
+  /* If the commit fails the entry must be dropped from the cache
+     even though the update itself succeeded.  */
+  if (storage_run (setup_failing_commit, NULL))
+    fail (13);
+  if (gpg_err_code (update_email (id2, "fail@example.org"))
+      != GPG_ERR_GENERAL)
+    fail (14);
+  if (cache_find (id2))
+    fail (15);
+
+ leave:
+  xfree (id);
+  xfree (id2);
+  xfree (id3);
+  close_account_db ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+}
+
+
+static void
+test_find_account (void)
+{
+  static char fname[] = "t-account-find.db";
+  char *id = NULL;
+  char *found = NULL;
+  unsigned int entries;
+  unsigned long hits, misses, hits0, misses0;
+  char buf[50];
+
+  remove (fname);
+  account_test_db_fname = fname;
+
+  if (account_new_record (&id) || update_cus (id, "cus_4711"))
+    {
+      fail (0);
+      goto leave;
+    }
+  account_cache_stats (&entries, &hits0, &misses0);
+
+  /* Found in the cache.  */
+  if (account_find_id ("cus_4711", NULL, &found))
+    fail (1);
+  else if (strcmp (found, id))
+    fail (2);
+  xfree (found);
+  found = NULL;
+  account_cache_stats (&entries, &hits, &misses);
+  if (hits != hits0 + 1 || misses != misses0)
+    fail (3);
+
+  /* Found in the database and then again in the cache.  */
+  storage_run (flush_cache, NULL);
+  if (account_find_id ("cus_4711", NULL, &found))
+    fail (4);
+  else if (strcmp (found, id))
+    fail (5);
+  xfree (found);
+  found = NULL;
+  if (account_find_id ("cus_4711", NULL, &found))
+    fail (6);
+  xfree (found);
+  found = NULL;
+  account_cache_stats (&entries, &hits, &misses);
+  if (hits != hits0 + 2 || misses != misses0 + 1)
+    fail (7);
+
+  /* Unknown ids.  */
+  if (gpg_err_code (account_find_id ("cus_0815", NULL, &found))
+      != GPG_ERR_NOT_FOUND)
+    fail (8);
+  if (gpg_err_code (account_find_id (NULL, "cus_4711", &found))
+      != GPG_ERR_NOT_FOUND)
+    fail (9);
+  if (gpg_err_code (account_find_id (NULL, NULL, &found))
+      != GPG_ERR_INV_ARG)
+    fail (10);
+
+  /* A deleted account is not found anymore.  */
+  if (storage_run (delete_row, id))
+    fail (11);
+  if (gpg_err_code (account_find_id ("cus_4711", NULL, &found))
+      != GPG_ERR_NOT_FOUND)
+    fail (12);
+
+ leave:
+  xfree (found);
+  xfree (id);
+  close_account_db ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+}
+
+
+/* Check that the hashes of the ids are keyed and that the key is
+   read back from its file.  */
+static void
+test_hash_key (void)
+{
+  char hexbuf[ACCOUNT_KEYHASH_SIZE];
+  char hexbuf2[ACCOUNT_KEYHASH_SIZE];
+  unsigned char digest[32];
+  int i;
+
+  if (hash_account_key (hexbuf, "cus_4711"))
+    {
+      fail (0);
+      return;
+    }
+  gcry_md_hash_buffer (GCRY_MD_SHA256, digest, "cus_4711", 8);
+  for (i=0; i < sizeof digest; i++)
+    snprintf (hexbuf2 + 2*i, 3, "%02x", digest[i]);
+  if (!strcmp (hexbuf, hexbuf2))
+    fail (1);
+
+  account_hashkey_loaded = 0;
+  memset (account_hashkey, 0, sizeof account_hashkey);
+  if (hash_account_key (hexbuf2, "cus_4711"))
+    fail (2);
+  else if (strcmp (hexbuf, hexbuf2))
+    fail (3);
+
+  if (hash_account_key (hexbuf, "") || *hexbuf)
+    fail (4);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  static char hashkey_fname[] = "t-account-hash.key";
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  npth_init ();
+  remove (hashkey_fname);
+  account_test_hashkey_fname = hashkey_fname;
+  test_hash_key ();
+  test_cache_lru ();
+  test_cache_update ();
+  test_find_account ();
+  remove (hashkey_fname);
+
+  return !!errorcount;
+}
@@ -21,6 +21,9 @@
 #define T_COMMON_H
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /* Commonly used global variables.  */
 static int verbose;
@@ -43,4 +46,35 @@ static int errorcount;
 # define DIMof(type,member)   DIM(((type *)0)->member)
 #endif
 
+
+
+/* Parse the options common to all tests.  "--verbose" sets VERBOSE.
+   "--bench [N]" requests a benchmark with N iterations, which is not
+   run by "make check".  Returns N, DEFAULT_COUNT if N is not given,
+   or 0 if no benchmark is requested.  */
+static inline unsigned long
+parse_test_args (int argc, char **argv, unsigned long default_count)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+  else if (argc > 1 && !strcmp (argv[1], "--bench"))
+    return argc > 2? strtoul (argv[2], NULL, 10) : default_count;
+  return 0;
+}
+
+
+/* Return the time in milliseconds since START and update START.  */
+static inline double
+elapsed_ms (struct timespec *start)
+{
+  struct timespec now;
+  double ms;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  ms = ((now.tv_sec - start->tv_sec) * 1000.0
+        + (now.tv_nsec - start->tv_nsec) / 1000000.0);
+  *start = now;
+  return ms;
+}
+
 #endif /* T_COMMON */
@@ -0,0 +1,397 @@
+/* t-currency.c - Regression tests for currency.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "t-common.h"
+#include "membuf.h"
+
+#include "currency.c" /* The module under test.  */
+
+
+/* The name of the currency file used by the tests.  */
+static const char currency_fname[] = "t-currency.tmp";
+
+
+/* Write STRING to the currency file and read it.  */
+static gpg_error_t
+read_currencies (const char *string)
+{
+  FILE *fp;
+
+  fp = fopen (currency_fname, "w");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  fputs (string, fp);
+  if (fclose (fp))
+    return gpg_error_from_syserror ();
+  return read_currency_file (currency_fname);
+}
+
+
+/* Switch back to the default list of currencies.  */
+static void
+reset_currencies (void)
+{
+  int i;
+
+  if (currency_table != default_currencies)
+    {
+      for (i=0; i < currency_count; i++)
+        {
+          xfree ((char *)currency_table[i].name);
+          xfree ((char *)currency_table[i].desc);
+        }
+      xfree (currency_table);
+    }
+  currency_table = default_currencies;
+  currency_count = DIM (default_currencies);
+  currency_index_ready = 0;
+}
+
+
+/* Return a currency file with the Euro and COUNT other currencies.
+ * The generated codes start at "AAB" and thus never hit "EUR".  */
+static char *
+make_currency_list (int count)
+{
+  membuf_t mb;
+  char line[10];
+  int i;
+
+  init_membuf (&mb, 2048);
+  put_membuf_str (&mb, "EUR 2 Euro\n");
+  for (i=1; i <= count; i++)
+    {
+      snprintf (line, sizeof line, "%c%c%c 2\n",
+                'A' + i / (26*26), 'A' + i / 26 % 26, 'A' + i % 26);
+      put_membuf_str (&mb, line);
+    }
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
+static void
+test_currency_file (void)
+{
+  static struct
+  {
+    const char *string;
+    gpg_err_code_t ec;
+  } tv[] = {
+    { "EUR 2 Euro\nUSD 5 US Dollar\n",       GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSD -1 US Dollar\n",      GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSD US Dollar\n",         GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSD 2x US Dollar\n",      GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSD 2\nGBP 2\nUSD 2\n",   GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSD 2\nusd 2\n",          GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUS 2\n",                  GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nUSDX 2\n",                GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nU$D 2\n",                 GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nU\xe4" "D 2\n",           GPG_ERR_INV_VALUE },
+    { "USD 2 US Dollar\n",                   GPG_ERR_MISSING_VALUE },
+    { "EUR 2 Euro\nUSD 5 US Dollar",         GPG_ERR_INV_VALUE },
+    { "EUR 2 Euro\nJPY 0\nUSD 2 US Dollar",  GPG_ERR_NO_ERROR }
+  };
+  gpg_error_t err;
+  char *string;
+  int tidx, n;
+
+  /* A valid file.  Lower case codes are accepted and the Euro is
+   * moved to the front.  */
+  err = read_currencies ("# Supported currencies\n"
+                         "\n"
+                         "usd 2 US Dollar\n"
+                         "  JPY   0  \n"
+                         "EUR 2 Euro\n");
+  if (err)
+    fail (0);
+  else if (currency_count != 3
+           || strcmp (currency_table[0].name, "EUR")
+           || strcmp (currency_table[0].desc, "Euro")
+           || strcmp (currency_table[1].name, "JPY")
+           || strcmp (currency_table[1].desc, "JPY")
+           || strcmp (currency_table[2].name, "USD")
+           || strcmp (currency_table[2].desc, "US Dollar"))
+    fail (0);
+  else if (find_currency ("EUR") != 0 || find_currency ("jpy") != 1
+           || find_currency ("USD") != 2 || find_currency ("GBP") != -1)
+    fail (0);
+  else if (!valid_currency_p ("JPY", &n) || n != 0
+           || valid_currency_p ("GBP", &n))
+    fail (0);
+  else
+    pass ();
+
+  /* Invalid files do not change the current list.  The last line
+   * may lack the LF; the valid file has the same list.  */
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      if (!tv[tidx].ec)
+        reset_currencies ();  /* Don't leak the current list.  */
+      err = read_currencies (tv[tidx].string);
+      if (gpg_err_code (err) != tv[tidx].ec)
+        {
+          if (verbose)
+            printf ("test %d: %s\n", tidx, gpg_strerror (err));
+          fail (tidx);
+        }
+      else if (currency_count != 3 || find_currency ("USD") != 2)
+        fail (tidx);
+      else
+        pass ();
+    }
+  reset_currencies ();
+
+  /* Up to MAX_CURRENCIES entries are accepted.  */
+  string = make_currency_list (MAX_CURRENCIES - 1);
+  if (!string)
+    fail (1);
+  else if (read_currencies (string) || currency_count != MAX_CURRENCIES
+           || find_currency ("AAB") != 1 || find_currency ("ABA") != 26
+           || find_currency (currency_table[MAX_CURRENCIES-1].name)
+              != MAX_CURRENCIES - 1)
+    fail (1);
+  else
+    pass ();
+  xfree (string);
+  reset_currencies ();
+
+  string = make_currency_list (MAX_CURRENCIES);
+  if (!string)
+    fail (2);
+  else if (gpg_err_code (read_currencies (string)) != GPG_ERR_TOO_LARGE)
+    fail (2);
+  else if (currency_table != default_currencies)
+    fail (2);
+  else
+    pass ();
+  xfree (string);
+
+  /* Unknown and malformed codes with the default list.  */
+  if (find_currency ("EUR") != 0 || find_currency ("JPY") != 3)
+    fail (3);
+  else if (find_currency ("CHF") != -1 || find_currency ("") != -1
+           || find_currency ("EU") != -1 || find_currency ("EURO") != -1
+           || find_currency ("E1R") != -1)
+    fail (3);
+  else
+    pass ();
+
+  remove (currency_fname);
+}
+
+
+/* The conversion as done before the integer rates were introduced.  */
+static money_t
+convert_money_double (money_t value, int decdigits, double rate)
+{
+  money_t scale;
+  int i;
+
+  for (scale=1, i=0; i < decdigits; i++)
+    scale *= 10;
+  return (money_t)((double)value * 100.0 / (rate * scale) + 0.5);
+}
+
+
+/* A simple deterministic random number generator.  */
+static unsigned long long
+next_random (void)
+{
+  static unsigned long long state = 42;
+
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return state >> 16;
+}
+
+
+/* Install a rate table with RATE (scaled) for all currencies.  */
+static void
+set_rates (money_t rate)
+{
+  struct rate_table_s *tbl;
+  int i;
+
+  tbl = xcalloc (1, sizeof *tbl + (currency_count - 1) * sizeof tbl->rate[0]);
+  for (i=0; i < currency_count; i++)
+    {
+      tbl->rate[i].scaled = i? rate : RATE_SCALE;
+      tbl->rate[i].value = (double)tbl->rate[i].scaled / RATE_SCALE;
+    }
+  xfree (rate_table);
+  rate_table = tbl;
+}
+
+
+static void
+test_convert_money (void)
+{
+  static struct
+  {
+    money_t value;
+    int decdigits;
+    money_t rate;
+    int valid;
+    money_t expected;
+  } tv[] = {
+    { 1000,  2, 1250000, 1, 800 },
+    { 1,     2, 2000000, 1, 1 },     /* 0.5 cents is rounded up.  */
+    { -1,    2, 2000000, 1, -1 },    /* ... and down.  */
+    { 1,     2, 2000001, 1, 0 },
+    { 3,     2, 2000000, 1, 2 },     /* 1.5 cents.  */
+    { 1305,  0, 130500000, 1, 1000 },
+    { 1,     0, 130500000, 1, 1 },   /* 0.766 cents.  */
+    { 12345, 3, 1000000, 1, 1235 },  /* 12.345 -> 12.35.  */
+    { 0,     2, 1000000, 1, 0 },
+    { 999999999999999999LL, 2, 1000000, 1, 999999999999999999LL },
+    { 999999999999999999LL, 2, 1, 0 },  /* Too large.  */
+    { 100,   2, 0, 0 },
+    { 100,   2, -1, 0 }
+  };
+  int tidx;
+  money_t value;
+
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      if (!convert_money (tv[tidx].value, tv[tidx].decdigits, tv[tidx].rate,
+                          &value) != !!tv[tidx].valid)
+        fail (tidx);
+      else if (tv[tidx].valid && value != tv[tidx].expected)
+        fail (tidx);
+      else
+        pass ();
+    }
+}
+
+
+/* Compare the integer conversion with an exact reference and with the
+ * old double based conversion.  */
+static void
+test_convert_property (int count)
+{
+  static const int digits[] = { 0, 2, 3 };
+  money_t value, rate, result, old;
+  int i, decdigits;
+
+  for (i=0; i < count; i++)
+    {
+      value = next_random () % 1000000000000ULL;
+      if (next_random () & 1)
+        value /= 1000000;
+      decdigits = digits[next_random () % DIM (digits)];
+      rate = 1000 + next_random () % (10000 * (money_t)RATE_SCALE - 1000);
+
+      if (convert_money (value, decdigits, rate, &result))
+        {
+          fail (i);
+          continue;
+        }
+
+#ifdef __SIZEOF_INT128__
+      {
+        unsigned __int128 num, div, exact;
+        int k;
+
+        num = (unsigned __int128)value * 100 * RATE_SCALE;
+        for (div = rate, k=0; k < decdigits; k++)
+          div *= 10;
+        exact = (2 * num + div) / (2 * div);
+        if (exact != (unsigned __int128)result)
+          fail (i);
+      }
+#endif /*__SIZEOF_INT128__*/
+
+      /* The double based conversion may be off by one due to
+       * rounding.  */
+      old = convert_money_double (value, decdigits,
+                                  (double)rate / RATE_SCALE);
+      if (old - result > 1 || result - old > 1)
+        {
+          if (verbose)
+            printf ("value=%lld digits=%d rate=%lld: %lld != %lld\n",
+                    value, decdigits, rate, result, old);
+          fail (i);
+        }
+    }
+}
+
+
+/* Run COUNT conversions with each method and print the operations per
+ * second.  */
+static void
+bench_convert (unsigned int count)
+{
+  char buffer[AMOUNTBUF_SIZE];
+  struct timespec start;
+  unsigned int n;
+  money_t value, sum = 0;
+  double ms;
+
+  set_rates (1123400);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (n=0; n < count; n++)
+    {
+      convert_money (n, 2, 1123400, &value);
+      sum += value;
+    }
+  ms = elapsed_ms (&start);
+  printf ("  %-16s %12.1f ops/s\n", "integer", n * 1000.0 / ms);
+
+  for (n=0; n < count; n++)
+    sum += convert_money_double (n, 2, 1.1234);
+  ms = elapsed_ms (&start);
+  printf ("  %-16s %12.1f ops/s\n", "double", n * 1000.0 / ms);
+
+  for (n=0; n < count; n++)
+    sum += *convert_currency (buffer, sizeof buffer, "USD", "12.34");
+  ms = elapsed_ms (&start);
+  printf ("  %-16s %12.1f ops/s\n", "convert_currency", n * 1000.0 / ms);
+
+  if (verbose)
+    printf ("  (checksum %lld)\n", sum);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned long bench;
+
+  bench = parse_test_args (argc, argv, 1000000);
+
+  if (bench)
+    bench_convert (bench);
+  else
+    {
+      test_currency_file ();
+      test_convert_money ();
+      test_convert_property (100000);
+    }
+
+  return !!errorcount;
+}
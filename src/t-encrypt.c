@@ -22,6 +22,7 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #include "t-common.h"
@@ -38,7 +39,7 @@ test_encrypt_string (void)
   char *ciphertext = NULL;
   char *plaintext = NULL;
 
-  err = encrypt_string (&ciphertext, fortune,
+  err = encrypt_string (&ciphertext, fortune, NULL,
                         (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
   if (err)
     {
@@ -50,7 +51,7 @@ test_encrypt_string (void)
   if (verbose)
     log_info ("encrypted: '%s'\n", ciphertext);
 
-  err = decrypt_string (&plaintext, ciphertext);
+  err = decrypt_string (&plaintext, ciphertext, NULL);
   if (err)
     {
       log_info ("test decryption failed: %s <%s>\n",
@@ -73,11 +74,275 @@ test_encrypt_string (void)
 }
 
 
+/* Check that a sealed string can be opened after the data keys have
+ * been read back from the data key file and that a modified string
+ * or a wrong context is rejected.  */
+static void
+test_envelope (void)
+{
+  static const char context[] = "account.stripe_cus:EnvelopeAccount";
+  gpg_error_t err;
+  char *ciphertext = NULL;
+  char *plaintext = NULL;
+  char *b64 = NULL;
+  char id[DATA_KEY_ID_LEN+1];
+  unsigned char *raw = NULL;
+  void *tmp;
+  size_t rawlen;
+
+  err = encrypt_string (&ciphertext, "cus_EnvelopeCustomer", context,
+                        (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    {
+      log_info ("test sealing failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      fail (0);
+      goto leave;
+    }
+  if (*ciphertext != '@')
+    fail (1);
+
+  release_data_keys ();
+  err = decrypt_string (&plaintext, ciphertext, context);
+  if (err)
+    {
+      log_info ("test opening failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      fail (2);
+      goto leave;
+    }
+  if (strcmp (plaintext, "cus_EnvelopeCustomer"))
+    fail (3);
+  xfree (plaintext);
+  plaintext = NULL;
+
+  /* The value must not be usable in another field or record.  */
+  err = decrypt_string (&plaintext, ciphertext,
+                        "account.stripe_cus:OtherAccount");
+  if (gpg_err_code (err) != GPG_ERR_CHECKSUM)
+    fail (4);
+  xfree (plaintext);
+  plaintext = NULL;
+
+  /* Flip a bit of the ciphertext and then of the tag.  Both must
+   * fail the authentication.  */
+  memcpy (id, ciphertext + 1, DATA_KEY_ID_LEN);
+  id[DATA_KEY_ID_LEN] = 0;
+  err = base64_decode (ciphertext + 2 + DATA_KEY_ID_LEN, &tmp, &rawlen);
+  if (err || rawlen <= DATA_NONCE_LEN + DATA_TAG_LEN)
+    {
+      fail (5);
+      goto leave;
+    }
+  raw = tmp;
+
+  raw[DATA_NONCE_LEN] ^= 1;
+  b64 = base64_encode (raw, rawlen);
+  xfree (ciphertext);
+  ciphertext = b64? strconcat ("@", id, ":", b64, NULL) : NULL;
+  if (!ciphertext)
+    {
+      fail (6);
+      goto leave;
+    }
+  err = decrypt_string (&plaintext, ciphertext, context);
+  if (gpg_err_code (err) != GPG_ERR_CHECKSUM)
+    fail (7);
+  xfree (plaintext);
+  plaintext = NULL;
+
+  raw[DATA_NONCE_LEN] ^= 1;
+  raw[rawlen - 1] ^= 0x80;
+  xfree (b64);
+  b64 = base64_encode (raw, rawlen);
+  xfree (ciphertext);
+  ciphertext = b64? strconcat ("@", id, ":", b64, NULL) : NULL;
+  if (!ciphertext)
+    {
+      fail (8);
+      goto leave;
+    }
+  err = decrypt_string (&plaintext, ciphertext, context);
+  if (gpg_err_code (err) != GPG_ERR_CHECKSUM)
+    fail (9);
+
+ leave:
+  xfree (raw);
+  xfree (b64);
+  xfree (ciphertext);
+  xfree (plaintext);
+}
+
+
+/* Encrypt and decrypt a batch of strings using the workers.  */
+static void
+test_queue (void)
+{
+  gpg_error_t err;
+  const char *strings[8];
+  const char *contexts[DIM (strings)];
+  char buffers[DIM (strings)][20];
+  char *ciphertexts[DIM (strings)];
+  char *plaintext;
+  encrypt_job_t jobs[DIM (strings)];
+  unsigned int depth, max_depth, busy;
+  unsigned long njobs;
+  int i;
+
+  for (i=0; i < DIM (strings); i++)
+    {
+      snprintf (buffers[i], sizeof buffers[i], "cus_Queue%d", i);
+      strings[i] = buffers[i];
+      contexts[i] = (i & 1)? "queue.odd" : NULL;
+    }
+  strings[3] = "";
+
+  err = encrypt_submit_batch (jobs, strings, contexts, DIM (strings),
+                              (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    {
+      fail (0);
+      return;
+    }
+  for (i=0; i < DIM (strings); i++)
+    if (encrypt_wait (jobs[i], ciphertexts + i))
+      fail (1);
+
+  err = encrypt_submit_batch (jobs, (const char **)ciphertexts, contexts,
+                              DIM (strings), 0);
+  if (err)
+    fail (2);
+  for (i=0; !err && i < DIM (strings); i++)
+    {
+      if (encrypt_wait (jobs[i], &plaintext))
+        fail (3);
+      else if (strcmp (plaintext, strings[i]))
+        fail (4);
+      xfree (plaintext);
+    }
+
+  encrypt_queue_stats (&depth, &max_depth, &busy, &njobs);
+  if (depth || busy || njobs != 2 * DIM (strings))
+    fail (5);
+
+  for (i=0; i < DIM (strings); i++)
+    xfree (ciphertexts[i]);
+}
+
+
+/* Encrypt some fields of a dictionary and decrypt them again.  */
+static void
+test_fields (void)
+{
+  static const char *names[] = { "_stripe_cus", "_paypal_payer_id",
+                                 "Note", "Missing", NULL };
+  gpg_error_t err;
+  keyvalue_t dict = NULL;
+  char *ciphertext = NULL;
+  encrypted_fields_t ef = NULL;
+  const char *value;
+
+  keyvalue_put (&dict, "_stripe_cus", "cus_FieldsCustomer");
+  keyvalue_put (&dict, "_paypal_payer_id", "PAYER&ID=1");
+  keyvalue_put (&dict, "Note", "50% off + free shipping");
+  keyvalue_put (&dict, "Email", "foo@example.org");
+
+  err = encrypt_fields (&ciphertext, dict, names, "test.fields:1",
+                        (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    {
+      log_info ("test field encryption failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      fail (0);
+      goto leave;
+    }
+
+  err = decrypt_fields_new (&ef, ciphertext, "test.fields:1");
+  if (err)
+    {
+      fail (1);
+      goto leave;
+    }
+  if (ef->decrypted)
+    fail (2);  /* Not lazy.  */
+
+  if (decrypt_fields_get (ef, "_paypal_payer_id", &value)
+      || !value || strcmp (value, "PAYER&ID=1"))
+    fail (3);
+  if (decrypt_fields_get (ef, "_stripe_cus", &value)
+      || !value || strcmp (value, "cus_FieldsCustomer"))
+    fail (4);
+  if (decrypt_fields_get (ef, "Note", &value)
+      || !value || strcmp (value, "50% off + free shipping"))
+    fail (5);
+  if (decrypt_fields_get (ef, "Email", &value) || value)
+    fail (6);
+  if (decrypt_fields_get (ef, "Missing", &value) || value)
+    fail (7);
+
+ leave:
+  decrypt_fields_release (ef);
+  xfree (ciphertext);
+  keyvalue_release (dict);
+}
+
+
+/* Run COUNT encryptions and decryptions and print the operations per
+   second.  */
+static void
+bench_encrypt (const char *name, unsigned int count)
+{
+  gpg_error_t err;
+  struct timespec start;
+  char **ciphertexts;
+  char *plaintext;
+  unsigned int n;
+  double ms;
+
+  ciphertexts = xcalloc (count, sizeof *ciphertexts);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (n=0; n < count; n++)
+    {
+      err = encrypt_string (ciphertexts + n, "cus_BenchmarkCustomer", NULL,
+                            (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+      if (err)
+        {
+          fail (n);
+          break;
+        }
+    }
+  ms = elapsed_ms (&start);
+  printf ("  %-12s encrypt %8.1f ops/s\n", name, n * 1000.0 / ms);
+
+  for (n=0; n < count && ciphertexts[n]; n++)
+    {
+      err = decrypt_string (&plaintext, ciphertexts[n], NULL);
+      if (err)
+        {
+          fail (n);
+          break;
+        }
+      xfree (plaintext);
+    }
+  ms = elapsed_ms (&start);
+  printf ("  %-12s decrypt %8.1f ops/s\n", name, n * 1000.0 / ms);
+
+  for (n=0; n < count; n++)
+    xfree (ciphertexts[n]);
+  xfree (ciphertexts);
+}
+
+
 int
 main (int argc, char **argv)
 {
-  if (argc > 1 && !strcmp (argv[1], "--verbose"))
-    verbose = 1;
+  static char data_key_file[] = "t-encrypt-keys.dat";
+  unsigned long bench;
+
+  bench = parse_test_args (argc, argv, 100);
+
+  npth_init ();
 
   if (!gpgme_check_version (NEED_GPGME_VERSION))
     log_fatal ("%s is too old (need %s, have %s)\n", "gpgme",
@@ -90,7 +355,24 @@ main (int argc, char **argv)
   if (verbose)
     encrypt_show_keys ();
 
-  test_encrypt_string ();
+  remove (data_key_file);
+  if (bench)
+    {
+      bench_encrypt ("openpgp", bench);
+      opt.data_key_file = data_key_file;
+      bench_encrypt ("envelope", bench);
+    }
+  else
+    {
+      test_encrypt_string ();
+      test_queue ();
+      test_fields ();
+      opt.data_key_file = data_key_file;
+      test_encrypt_string ();
+      test_envelope ();
+    }
+  opt.data_key_file = NULL;
+  remove (data_key_file);
 
   encrypt_release_keys ();
 
@@ -0,0 +1,235 @@
+/* t-http-body.c - Regression tests for http_read_body
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "http.c" /* The module under test.  */
+
+
+/* Create a handle which reads the response body from the LENGTH
+ * bytes at DATA.  CHUNKED and BODY_LENGTH are set as parse_response
+ * would do.  */
+static http_t
+new_handle (const char *data, size_t length, int chunked,
+            size_t body_length)
+{
+  http_t hd;
+
+  hd = xcalloc (1, sizeof *hd);
+  hd->fp_read = es_fopenmem_init (0, "r", data, length);
+  if (!hd->fp_read)
+    {
+      xfree (hd);
+      return NULL;
+    }
+  hd->chunked = !!chunked;
+  hd->body_length = body_length;
+  return hd;
+}
+
+
+/* Release HD.  If REST is not NULL the bytes not yet read are first
+ * copied to REST which has a size of RESTSIZE.  */
+static void
+release_handle (http_t hd, char *rest, size_t restsize)
+{
+  size_t n = 0;
+
+  if (!hd)
+    return;
+  if (rest)
+    {
+      es_read (hd->fp_read, rest, restsize - 1, &n);
+      rest[n] = 0;
+    }
+  es_fclose (hd->fp_read);
+  xfree (hd->buffer);
+  xfree (hd);
+}
+
+
+static void
+test_read_body (void)
+{
+  static struct
+  {
+    const char *data;
+    int chunked;
+    size_t body_length;
+    size_t maxlen;
+    gpg_err_code_t ec;
+    const char *body;
+    const char *rest;  /* The data after the body.  */
+  } tv[] = {
+    /* Chunked bodies with an extension and a trailer.  */
+    { "5\r\nHello\r\n7;foo=bar\r\n, World\r\n0\r\n"
+      "X-Trailer: foo\r\nX-Other: bar\r\n\r\nHTTP/1.1",
+      1, 0, 0, 0, "Hello, World", "HTTP/1.1" },
+    { "5\r\nHello\r\n7\r\n, World\r\n0\r\n\r\nHTTP/1.1",
+      1, 0, 12, 0, "Hello, World", "HTTP/1.1" },
+    { "5\nHello\nA \n, World!!!\n0\nX-Trailer: foo\n\nHTTP/1.1",
+      1, 0, 0, 0, "Hello, World!!!", "HTTP/1.1" },
+    { "0\r\n\r\n",
+      1, 0, 0, 0, "", "" },
+    /* Errors in chunked bodies.  */
+    { "5\r\nHello\r\n7\r\n, World\r\n0\r\n\r\n",
+      1, 0, 11, GPG_ERR_TOO_LARGE },
+    { "5\r\nHello\r\n7\r\n, World\r\n0\r\n\r\n",
+      1, 0, 4, GPG_ERR_TOO_LARGE },
+    { "x\r\nHello\r\n0\r\n\r\n",
+      1, 0, 0, GPG_ERR_INV_RESPONSE },
+    { "5x\r\nHello\r\n0\r\n\r\n",
+      1, 0, 0, GPG_ERR_INV_RESPONSE },
+    { "5\r\nHello!\r\n0\r\n\r\n",
+      1, 0, 0, GPG_ERR_INV_RESPONSE },
+    { "10\r\nHello\r\n",
+      1, 0, 0, GPG_ERR_TRUNCATED },
+    { "5\r\nHello\r\n",
+      1, 0, 0, GPG_ERR_TRUNCATED },
+    { "5\r\nHello\r\n0\r\nX-Trailer: foo\r\n",
+      1, 0, 0, GPG_ERR_TRUNCATED },
+    /* Bodies with and without a Content-Length.  */
+    { "Hello",
+      0, 5, 0, 0, "Hello", "" },
+    { "Hello",
+      0, 5, 5, 0, "Hello", "" },
+    { "Hello",
+      0, 0, 0, 0, "Hello", "" },
+    { "Hello",
+      0, 2, 0, 0, "Hello", "" },
+    { "",
+      0, 0, 0, 0, "", "" },
+    { "Hello",
+      0, 5, 4, GPG_ERR_TOO_LARGE },
+    { "Hello",
+      0, 0, 4, GPG_ERR_TOO_LARGE }
+  };
+  gpg_error_t err;
+  http_t hd;
+  char *body;
+  size_t length;
+  char rest[20];
+  int tidx;
+
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      hd = new_handle (tv[tidx].data, strlen (tv[tidx].data),
+                       tv[tidx].chunked, tv[tidx].body_length);
+      if (!hd)
+        {
+          fail (tidx);
+          continue;
+        }
+      err = http_read_body (hd, &body, &length, tv[tidx].maxlen);
+      if (gpg_err_code (err) != tv[tidx].ec)
+        {
+          if (verbose)
+            printf ("test %d: %s\n", tidx, gpg_strerror (err));
+          fail (tidx);
+        }
+      else if (err && body)
+        fail (tidx);
+      else if (err)
+        pass ();
+      else if (!body || length != strlen (tv[tidx].body)
+               || strcmp (body, tv[tidx].body))
+        fail (tidx);
+      else if (!!hd->body_done != tv[tidx].chunked)
+        fail (tidx);
+      else
+        {
+          release_handle (hd, rest, sizeof rest);
+          hd = NULL;
+          if (strcmp (rest, tv[tidx].rest))
+            fail (tidx);
+          else
+            pass ();
+        }
+      release_handle (hd, NULL, 0);
+      xfree (body);
+    }
+}
+
+
+/* Read a large body to check the growing of the buffer.  */
+static void
+test_read_large_body (void)
+{
+  static const size_t sizes[] = { 4095, 4096, 4097, 10000, 100000 };
+  char *data;
+  char *body;
+  size_t length, datalen;
+  http_t hd;
+  int i, withlen, maxlen;
+
+  for (i=0; i < DIM (sizes); i++)
+    for (withlen=0; withlen < 2; withlen++)
+      for (maxlen=0; maxlen < 3; maxlen++)
+        {
+          datalen = sizes[i];
+          data = xmalloc (datalen);
+          memset (data, 'x', datalen);
+          data[datalen-1] = 'y';
+          hd = new_handle (data, datalen, 0, withlen? datalen : 0);
+          if (!hd)
+            {
+              fail (i);
+              xfree (data);
+              continue;
+            }
+          /* MAXLEN is 0, the length of the body, or one less.  */
+          if (maxlen == 2)
+            {
+              if (gpg_err_code (http_read_body (hd, &body, &length,
+                                                datalen - 1))
+                  != GPG_ERR_TOO_LARGE)
+                fail (i);
+            }
+          else if (http_read_body (hd, &body, &length, maxlen? datalen : 0))
+            fail (i);
+          else if (length != datalen || body[datalen] || body[0] != 'x'
+                   || body[datalen-1] != 'y')
+            fail (i);
+          else
+            pass ();
+          xfree (body);
+          release_handle (hd, NULL, 0);
+          xfree (data);
+        }
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  test_read_body ();
+  test_read_large_body ();
+
+  return !!errorcount;
+}
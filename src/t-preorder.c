@@ -20,8 +20,12 @@
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "t-common.h"
 
@@ -32,24 +36,435 @@ static void
 test_make_sepa_ref (void)
 {
   char buffer[9];
-  int i;
+  int i, idx;
 
   for (i=0; i < 500; i++)
     {
       make_sepa_ref (buffer, sizeof buffer);
       if (verbose)
         printf ("%s\n", buffer);
+      idx = sepa_ref_to_index (buffer);
+      if (idx < 0 || idx >= SEPA_REF_SPACE)
+        fail (i);
+    }
+  if (sepa_ref_to_index ("AAAAA") != 0
+      || sepa_ref_to_index ("AAAAB") != 1
+      || sepa_ref_to_index ("AAABA") != 28)
+    fail (0);
+}
+
+
+static void
+test_alloc_sepa_ref (void)
+{
+  char buffer[9];
+  unsigned int idx;
+  int i;
+
+  sepa_ref_map = xcalloc (1, SEPA_REF_SPACE / 8);
+  memset (sepa_ref_map, 0xff, SEPA_REF_SPACE / 8);
+  sepa_ref_used = SEPA_REF_SPACE;
+  sepa_ref_warned = 100;
+  if (gpg_err_code (alloc_sepa_ref (buffer, sizeof buffer))
+      != GPG_ERR_LIMIT_REACHED)
+    fail (0);
+
+  /* With only one free value left we give up instead of searching
+     for it.  */
+  idx = SEPA_REF_SPACE / 7;
+  sepa_ref_map[idx / 8] &= ~(1 << (idx % 8));
+  sepa_ref_used--;
+  if (gpg_err_code (alloc_sepa_ref (buffer, sizeof buffer))
+      != GPG_ERR_LIMIT_REACHED)
+    fail (1);
+
+  /* With half of the values in use we must always get a free one.  */
+  memset (sepa_ref_map, 0x55, SEPA_REF_SPACE / 8);
+  sepa_ref_used = SEPA_REF_SPACE / 2;
+  for (i=0; i < 1000; i++)
+    {
+      if (alloc_sepa_ref (buffer, sizeof buffer))
+        {
+          fail (2);
+          break;
+        }
+      idx = sepa_ref_to_index (buffer);
+      if (sepa_ref_map[idx / 8] & (1 << (idx % 8)))
+        {
+          fail (3);
+          break;
+        }
+    }
+
+  xfree (sepa_ref_map);
+  sepa_ref_map = NULL;
+}
+
+
+/* Return the number of rows in TABLE with the Sepa-Ref REF.  */
+static int
+count_rows (const char *table, const char *ref)
+{
+  sqlite3_stmt *stmt;
+  char sql[80];
+  int n = -1;
+
+  snprintf (sql, sizeof sql, "SELECT count(*) FROM %s WHERE ref=?1", table);
+  if (sqlite3_prepare_v2 (preorder_db, sql, -1, &stmt, NULL))
+    return -1;
+  sqlite3_bind_text (stmt, 1, ref, -1, SQLITE_TRANSIENT);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    n = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+  return n;
+}
+
+
+/* Check that a rejected commit of an archived preorder leaves it in
+   the archive and that an accepted one restores it.  */
+static void
+test_commit_archived (void)
+{
+  static char fname[] = "t-preorder-commit.db";
+  keyvalue_t dict = NULL;
+  keyvalue_t newdata = NULL;
+  keyvalue_t olddata = NULL;
+  sqlite3_stmt *copy, *del;
+  char separef[9];
+  char buf[50];
+  gpg_error_t err;
+  int recur;
+
+  remove (fname);
+  preorder_test_db_fname = fname;
+  if (open_preorder_db ())
+    {
+      fail (0);
+      return;
+    }
+
+  keyvalue_put (&dict, "Amount", "10.00");
+  keyvalue_put (&dict, "Recur", "0");
+  if (insert_preorder_record (&dict) || get_separef (dict, separef))
+    fail (1);
+  if (prepare_move_stmts ("preorder", "preorder_archive", &copy, &del))
+    fail (2);
+  else
+    {
+      if (move_preorder_record (copy, del, separef))
+        fail (3);
+      sqlite3_finalize (copy);
+      sqlite3_finalize (del);
+    }
+
+  /* A recurring donation does not match the preorder.  */
+  keyvalue_put (&newdata, "Amount", "10.00");
+  keyvalue_put (&newdata, "Recur", "*");
+  run_preorder_sql (preorder_db, "BEGIN");
+  err = commit_preorder_record (separef, &newdata, &olddata, &recur);
+  run_preorder_sql (preorder_db, "COMMIT");
+  if (gpg_err_code (err) != GPG_ERR_CONFLICT)
+    fail (4);
+  if (count_rows ("preorder", separef) != 0
+      || count_rows ("preorder_archive", separef) != 1)
+    fail (5);
+
+  keyvalue_put (&newdata, "Recur", "");
+  run_preorder_sql (preorder_db, "BEGIN");
+  err = commit_preorder_record (separef, &newdata, &olddata, &recur);
+  run_preorder_sql (preorder_db, "COMMIT");
+  if (err)
+    fail (6);
+  if (count_rows ("preorder", separef) != 1
+      || count_rows ("preorder_archive", separef) != 0)
+    fail (7);
+
+  keyvalue_release (olddata);
+  keyvalue_release (newdata);
+  keyvalue_release (dict);
+  close_preorder_db ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+}
+
+
+/* Check that the query to select the records to be archived does not
+   scan the entire preorder table.  */
+static void
+test_archive_query (void)
+{
+  static char fname[] = "t-preorder-archive.db";
+  sqlite3_stmt *stmt;
+  char *sql;
+  const char *s;
+  char buf[50];
+  int n = 0;
+  int res;
+
+  remove (fname);
+  preorder_test_db_fname = fname;
+  if (open_preorder_db ())
+    {
+      fail (0);
+      return;
+    }
+
+  sql = sqlite3_mprintf ("EXPLAIN QUERY PLAN %s", archive_select_sql);
+  if (sqlite3_prepare_v2 (preorder_db, sql, -1, &stmt, NULL))
+    fail (1);
+  else
+    {
+      while ((res = sqlite3_step (stmt)) == SQLITE_ROW)
+        {
+          s = (const char *)sqlite3_column_text (stmt, 3);
+          if (verbose)
+            printf ("%s\n", s);
+          if (s && !strncmp (s, "SCAN", 4))
+            fail (2);
+          if (s && !strncmp (s, "SEARCH", 6))
+            n++;
+        }
+      if (res != SQLITE_DONE || n != 2)
+        fail (3);
+      sqlite3_finalize (stmt);
+    }
+  sqlite3_free (sql);
+
+  close_preorder_db ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+}
+
+
+/* Check that an online backup is started, stepped and finished and
+   that the snapshot has the records of the database.  */
+static void
+test_backup (void)
+{
+  static char fname[] = "t-preorder-backup.db";
+  static char dname[] = "t-preorder-backup.d";
+  static char bname[] = "t-preorder-backup.d/preorder.db";
+  keyvalue_t dict = NULL;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  char *status;
+  char buf[50];
+  int i, n;
+
+  remove (fname);
+  remove (bname);
+  rmdir (dname);
+  preorder_test_db_fname = fname;
+  if (mkdir (dname, 0700) || open_preorder_db ())
+    {
+      fail (0);
+      return;
+    }
+  opt.backup_dir = dname;
+
+  for (i=0; i < 3; i++)
+    {
+      keyvalue_put (&dict, "Amount", "10.00");
+      keyvalue_put (&dict, "Recur", "0");
+      if (insert_preorder_record (&dict))
+        fail (1);
+      keyvalue_release (dict);
+      dict = NULL;
+    }
+
+  /* Nothing happens without a start.  */
+  if (preorder_backup_step (0))
+    fail (2);
+  if (!access (bname, F_OK))
+    fail (3);
+
+  for (n=0, i = preorder_backup_step (1); i && n < 1000; n++)
+    i = preorder_backup_step (0);
+  if (i)
+    fail (4);
+  strcpy (buf, bname); strcat (buf, ".tmp");
+  if (access (bname, F_OK) || !access (buf, F_OK))
+    fail (5);
+
+  status = preorder_backup_status ();
+  if (!status || !strstr (status, "idle; last backup"))
+    fail (6);
+  es_free (status);
+
+  if (sqlite3_open (bname, &db))
+    fail (7);
+  else
+    {
+      if (sqlite3_prepare_v2 (db, "SELECT count(*) FROM preorder",
+                              -1, &stmt, NULL))
+        fail (8);
+      else
+        {
+          if (sqlite3_step (stmt) != SQLITE_ROW
+              || sqlite3_column_int (stmt, 0) != 3)
+            fail (9);
+          sqlite3_finalize (stmt);
+        }
+      sqlite3_close (db);
+    }
+
+  opt.backup_dir = NULL;
+  close_preorder_db ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+  remove (bname);
+  rmdir (dname);
+}
+
+
+/* Run the listing statement STMT with the parameters ARG1 and ARG2
+   and print the number of rows and the time taken.  */
+static void
+bench_query (const char *name, sqlite3_stmt *stmt,
+             const char *arg1, const char *arg2)
+{
+  struct timespec start;
+  unsigned int count = 0;
+  int res;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  sqlite3_reset (stmt);
+  if (arg1)
+    sqlite3_bind_text (stmt, 1, arg1, -1, SQLITE_TRANSIENT);
+  if (arg2)
+    sqlite3_bind_text (stmt, 2, arg2, -1, SQLITE_TRANSIENT);
+  while ((res = sqlite3_step (stmt)) == SQLITE_ROW)
+    count++;
+  if (res != SQLITE_DONE)
+    {
+      fprintf (stderr, "query '%s' failed: %s\n", name, sqlite3_errstr (res));
+      fail (0);
     }
+  printf ("  %-12s %8u rows %10.2f ms\n", name, count, elapsed_ms (&start));
+}
+
+
+static void
+bench_queries (void)
+{
+  preorder_reader_t reader;
+
+  if (acquire_preorder_reader (&reader))
+    {
+      fail (0);
+      return;
+    }
+  bench_query ("refnn",  reader->selectrefnn_stmt, "42", NULL);
+  bench_query ("unpaid", reader->selectunpaid_stmt, NULL, NULL);
+  bench_query ("paid",   reader->selectpaid_stmt, "2022-06-01", "2022-06-02");
+  bench_query ("email",  reader->selectemail_stmt, "User4711@example.org",
+               NULL);
+  bench_query ("all",    reader->selectlist_stmt, NULL, NULL);
+  release_preorder_reader (reader);
+}
+
+
+/* Benchmark the listing queries with and without the indexes on a
+   database with NRECORDS records.  The database is created in the
+   current directory.  */
+static void
+run_benchmark (unsigned int nrecords)
+{
+  static char fname[] = "t-preorder-bench.db";
+  keyvalue_t dict = NULL;
+  struct timespec start;
+  unsigned int n;
+  char buf[50];
+  int i;
+
+  npth_init ();
+  remove (fname);
+  strcpy (buf, fname); strcat (buf, "-wal"); remove (buf);
+  strcpy (buf, fname); strcat (buf, "-shm"); remove (buf);
+  preorder_test_db_fname = fname;
+
+  if (open_preorder_db ())
+    {
+      fail (0);
+      return;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  keyvalue_put (&dict, "Amount", "10.00");
+  keyvalue_put (&dict, "Desc", "Benchmark");
+  run_preorder_sql (preorder_db, "BEGIN");
+  for (n=0; n < nrecords; n++)
+    {
+      snprintf (buf, sizeof buf, "user%u@example.org", n);
+      keyvalue_put (&dict, "Email", buf);
+      keyvalue_put (&dict, "Recur", (n % 4)? "0" : "12");
+      if (insert_preorder_record (&dict))
+        {
+          fail (0);
+          break;
+        }
+    }
+  /* Spread the creation dates over 5 years and mark 90% as paid.  */
+  if (run_preorder_sql (preorder_db,
+                        "UPDATE preorder SET created = datetime('2020-01-01',"
+                        " '+' || (abs(random()) % 1800) || ' days',"
+                        " '+' || (abs(random()) % 86400) || ' seconds')")
+      || run_preorder_sql (preorder_db,
+                           "UPDATE preorder SET npaid = 1,"
+                           " paid = datetime(created,"
+                           " '+' || (abs(random()) % 30) || ' days')"
+                           " WHERE abs(random()) % 10 != 0")
+      || run_preorder_sql (preorder_db, "COMMIT"))
+    fail (0);
+  keyvalue_release (dict);
+  printf ("inserted %u records in %.0f ms\n", nrecords, elapsed_ms (&start));
+
+  printf ("with indexes:\n");
+  bench_queries ();
+
+  open_preorder_db ();
+  for (i=0; preorder_indexes[i]; i++)
+    {
+      const char *name = strstr (preorder_indexes[i], "EXISTS ") + 7;
+
+      snprintf (buf, sizeof buf, "DROP INDEX %.*s",
+                (int)strcspn (name, " "), name);
+      if (run_preorder_sql (preorder_db, buf))
+        fail (i);
+    }
+
+  printf ("without indexes:\n");
+  bench_queries ();
+
+  for (i=0; i < PREORDER_READERS; i++)
+    close_preorder_reader (preorder_readers + i);
+  open_preorder_db ();
+  close_preorder_db ();
+  remove (fname);
 }
 
 
 int
 main (int argc, char **argv)
 {
-  if (argc > 1 && !strcmp (argv[1], "--verbose"))
-    verbose = 1;
+  unsigned long bench;
+
+  bench = parse_test_args (argc, argv, 1000000);
+  if (bench)
+    {
+      run_benchmark (bench);
+      return !!errorcount;
+    }
 
+  npth_init ();
   test_make_sepa_ref ();
+  test_alloc_sepa_ref ();
+  test_commit_archived ();
+  test_archive_query ();
+  test_backup ();
 
   return !!errorcount;
 }
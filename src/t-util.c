@@ -118,76 +118,110 @@ test_base64_encoding (void)
 
 
 static void
-test_convert_amount (void)
+test_parse_money (void)
 {
   static struct
   {
     int digits;
     const char *string;
-    unsigned int expected;
+    int valid;
+    money_t expected;
+    const char *formatted;
   } tv[] = {
-    { 0, "", 0 },
-    { 0, " ", 0 },
-    { 0, "\t", 0 },
-    { 0, "-1", 0 },
-    { 2, "1.23", 123 },
-    { 2, "+1.23", 123 },
-    { 2, "-1.23", 0 },
-    { 2, "1.2", 120 },
-    { 2, "1.", 100 },
-    { 2, "1", 100 },
-    { 2, "20", 2000 },
-    { 2, "20.01", 2001 },
-    { 2, "20.09", 2009 },
-    { 2, "23.59", 2359 },
-    { 2, "23.50", 2350 },
-    { 2, "23.5",  2350 },
-    { 2, "23",    2300 },
-    { 2, "23+",   0 },
-    { 2, "451",    45100 },
-    { 2, "451.00", 45100 },
-    { 2, "451..00", 0 },
-    { 2, "45.1.00", 0 },
-    { 2, "4512.00", 451200 },
-    { 2, "451200000000000000000000000000000000000000000000.00", 0 },
-    { 3, "20", 20000 },
-    { 3, "20.01", 20010 },
-    { 3, "20.09", 20090 },
-    { 3, "23.59", 23590 },
-    { 3, "23.50", 23500 },
-    { 3, "23.507",23507 },
-    { 3, "23.5",  23500 },
-    { 1, "20",      200 },
-    { 1, "20.01",     0 },
-    { 1, "20.09",     0 },
-    { 1, "23.59",     0 },
-    { 1, "23.50",     0 },
-    { 1, "23.5",    235 },
-    { 1, "23",      230 },
-    { 0, "20",       20 },
-    { 0, "20.01",     0 },
-    { 0, "20.09",     0 },
-    { 0, "23.59",     0 },
-    { 0, "23.50",     0 },
-    { 0, "23.5",      0 },
-    { 0, "23",       23 },
-    { 0, "23\"",      0 },
-    { 0, "23\'",      0 },
-    { 0, "\"23",      0 },
-    { 0, "\'23",      0 }
+    { 2, "",       0, 0 },
+    { 2, ".",      0, 0 },
+    { 2, "-",      0, 0 },
+    { 2, " 1",     0, 0 },
+    { 2, "1 ",     0, 0 },
+    { 2, "1.2.3",  0, 0 },
+    { 2, "1.234",  0, 0 },
+    { 2, "23+",    0, 0 },
+    { 2, "451..00", 0, 0 },
+    { 2, "45.1.00", 0, 0 },
+    { 0, "\t",     0, 0 },
+    { 0, "23\"",   0, 0 },
+    { 0, "\'23",   0, 0 },
+    { 1, "20.01",  0, 0 },
+    { 2, "0",      1, 0,      "0.00" },
+    { 2, "1",      1, 100,    "1.00" },
+    { 2, "1.",     1, 100,    "1.00" },
+    { 2, ".5",     1, 50,     "0.50" },
+    { 2, "23.5",   1, 2350,   "23.50" },
+    { 2, "23.50",  1, 2350,   "23.50" },
+    { 2, "+23.05", 1, 2305,   "23.05" },
+    { 2, "-23.05", 1, -2305,  "-23.05" },
+    { 2, "-0.01",  1, -1,     "-0.01" },
+    { 0, "1000",   1, 1000,   "1000" },
+    { 0, "10.0",   0, 0 },
+    { 3, "1.5",    1, 1500,   "1.500" },
+    { 3, "23.507", 1, 23507,  "23.507" },
+    { 2, "4512.00", 1, 451200, "4512.00" },
+    { 2, "9999999999999999.99", 1, 999999999999999999LL,
+      "9999999999999999.99" },
+    { 2, "99999999999999999.99", 0, 0 },
+    { 2, "451200000000000000000000000000000000000000000000.00", 0, 0 }
   };
   int tidx;
+  money_t value;
+  char buffer[AMOUNTBUF_SIZE];
 
   for (tidx=0; tidx < DIM (tv); tidx++)
     {
-      unsigned int value;
-
-      value = convert_amount (tv[tidx].string, tv[tidx].digits);
-      if (value == tv[tidx].expected)
+      if (!parse_money (tv[tidx].string, tv[tidx].digits, &value)
+          != !!tv[tidx].valid)
+        fail (tidx);
+      else if (!tv[tidx].valid)
         pass ();
-      else
+      else if (value != tv[tidx].expected)
+        fail (tidx);
+      else if (strcmp (format_money (buffer, sizeof buffer,
+                                     value, tv[tidx].digits),
+                       tv[tidx].formatted))
         fail (tidx);
+      else
+        pass ();
+    }
+}
+
+
+static void
+test_hashtbl (void)
+{
+  struct hashtbl_s htbl = { NULL, 0, 0 };
+  static const char *keys[] = { "a", "ab", "abc", "b", "" };
+  hashitem_t items[DIM (keys)];
+  hashitem_t item;
+  char key[20];
+  int i, n;
+
+  for (i=0; i < DIM (keys); i++)
+    items[i] = hashtbl_find_create (&htbl, keys[i], strlen (keys[i]),
+                                    sizeof *item);
+  /* Prefixes of a key are different keys.  */
+  for (i=0; i < DIM (keys); i++)
+    {
+      item = hashtbl_find_create (&htbl, keys[i], strlen (keys[i]),
+                                  sizeof *item);
+      if (item != items[i] || item->keylen != strlen (keys[i])
+          || strcmp (item->key, keys[i]))
+        fail (i);
+    }
+  if (htbl.count != DIM (keys))
+    fail (0);
+
+  /* The items are kept when the table grows.  */
+  for (n=0; n < 1000; n++)
+    {
+      snprintf (key, sizeof key, "key%d", n);
+      hashtbl_find_create (&htbl, key, strlen (key), sizeof *item);
     }
+  if (htbl.count != DIM (keys) + 1000)
+    fail (1);
+  for (i=0; i < DIM (keys); i++)
+    if (hashtbl_find_create (&htbl, keys[i], strlen (keys[i]), sizeof *item)
+        != items[i])
+      fail (i);
+  hashtbl_release (&htbl);
 }
 
 
@@ -199,7 +233,8 @@ main (int argc, char **argv)
 
   test_keyvalue_put_meta ();
   test_base64_encoding ();
-  test_convert_amount ();
+  test_parse_money ();
+  test_hashtbl ();
 
   return !!errorcount;
 }
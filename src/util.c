@@ -996,75 +996,205 @@ get_full_isotime (int offset)
 
 
 
-/* Check the amount given in STRING and convert it to the smallest
-   currency unit.  DECDIGITS gives the number of allowed post decimal
-   positions.  Return 0 on error or the converted amount.  */
-unsigned int
-convert_amount (const char *string, int decdigits)
+/* Parse the amount in STRING into minor units with DECDIGITS post
+   decimal positions and store it at R_VALUE.  Fewer post decimal
+   digits than DECDIGITS are allowed; thus "1.5" and "1.50" yield the
+   same value.  An optional sign is allowed.  Returns an error for
+   empty strings, for garbage, for more than DECDIGITS post decimal
+   digits, and on overflow.  */
+gpg_error_t
+parse_money (const char *string, int decdigits, money_t *r_value)
 {
-  const char *s;
-  int ndots = 0;
+  static const unsigned long long tens[] =
+    { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL };
+  const unsigned char *s = (const unsigned char *)string;
+  unsigned long long value = 0;
+  unsigned int d;
+  int negative = 0;
+  int ndigits = 0;
   int nfrac = 0;
-  unsigned int value = 0;
-  unsigned int v;
 
-  if (*string == '+')
-    string++; /* Skip an optional leading plus sign.  */
-  for (s = string; *s; s++)
-    {
-      if (*s == '.')
-        {
-          if (!decdigits)
-            return 0; /* Post decimal digits are not allowed.  */
-          if (++ndots > 1)
-            return 0; /* Too many decimal points.  */
-        }
-      else if (!strchr ("0123456789", *s))
-        return 0;
-      else if (ndots && ++nfrac > decdigits)
-        return 0; /* Too many post decimal digits.  */
-      else
-        {
-          v = 10*value + (*s - '0');
-          if (v < value)
-            return 0; /* Overflow.  */
-          value = v;
-        }
-    }
+  *r_value = 0;
+  if (decdigits < 0 || decdigits >= DIM (tens))
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  negative = (*s == '-');
+  s += (*s == '-' || *s == '+');
 
-  for (; nfrac < decdigits; nfrac++)
+  /* Integer part.  Up to 18 digits in total can't overflow VALUE.  */
+  for (; (d = *s - '0') < 10; s++, ndigits++)
     {
-      v = 10*value;
-      if (v < value)
-        return 0; /* Overflow.  */
-      value = v;
+      if (ndigits >= 18)
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      value = 10 * value + d;
     }
 
-  return value;
+  /* Fractional part.  */
+  if (*s == '.')
+    for (s++; (d = *s - '0') < 10; s++, nfrac++)
+      {
+        if (nfrac >= decdigits)
+          return gpg_error (GPG_ERR_INV_VALUE);
+        if (ndigits + nfrac >= 18)
+          return gpg_error (GPG_ERR_TOO_LARGE);
+        value = 10 * value + d;
+      }
+
+  if (*s || !(ndigits + nfrac))
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  /* Scale to minor units.  The check keeps the result below 2^63.  */
+  if (value > 9223372036854775807ULL / tens[decdigits - nfrac])
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  value *= tens[decdigits - nfrac];
+
+  *r_value = negative? -(money_t)value : (money_t)value;
+  return 0;
 }
 
 
-/* Return a string with the amount computed from CENTS.  DECDIGITS
-   gives the number of post decimal positions in CENTS.  Return NULL
-   on error.  es_free must be used to release the return value.  */
+/* Format the amount VALUE given in minor units with DECDIGITS post
+   decimal positions into BUFFER of size BUFSIZE.  A buffer of size
+   AMOUNTBUF_SIZE is always sufficient.  Returns BUFFER.  */
 char *
-reconvert_amount (int cents, int decdigits)
+format_money (char *buffer, size_t bufsize, money_t value, int decdigits)
 {
-  unsigned int tens;
+  char tmp[AMOUNTBUF_SIZE];
+  char *p = tmp + sizeof tmp;
+  unsigned long long v;
   int i;
 
-  if (decdigits <= 0)
-    return es_bsprintf ("%d", cents);
-  else
+  if (decdigits < 0 || decdigits > 18)
+    log_bug ("invalid number of post decimal digits in format_money\n");
+
+  v = value < 0? -(unsigned long long)value : (unsigned long long)value;
+  *--p = 0;
+  for (i=0; i < decdigits; i++, v /= 10)
+    *--p = '0' + (v % 10);
+  if (decdigits)
+    *--p = '.';
+  do
+    *--p = '0' + (v % 10);
+  while ((v /= 10));
+  if (value < 0)
+    *--p = '-';
+
+  if (tmp + sizeof tmp - p > bufsize)
+    log_bug ("buffer too short in format_money\n");
+  memcpy (buffer, p, tmp + sizeof tmp - p);
+  return buffer;
+}
+
+
+
+/* Return a hash value for the string KEY of length KEYLEN.  This is
+   the FNV-1a function.  */
+static unsigned int
+hash_key (const char *key, size_t keylen)
+{
+  unsigned int hash = 2166136261u;
+
+  for (; keylen; key++, keylen--)
     {
-      for (tens=1, i=0; i < decdigits; i++)
-        tens *= 10;
-      return es_bsprintf ("%d.%0*d", cents / tens, decdigits, cents % tens);
+      hash ^= *(const unsigned char *)key;
+      hash *= 16777619;
     }
+  return hash;
 }
 
 
-
+/* Find the item for KEY of length KEYLEN in the hash table HTBL and
+   create it if it does not yet exist.  A new item has ITEMSIZE bytes
+   which are cleared except for the header; its key is stored right
+   after it.  */
+void *
+hashtbl_find_create (hashtbl_t htbl, const char *key, size_t keylen,
+                     size_t itemsize)
+{
+  unsigned int hash;
+  hashitem_t item, next;
+  hashitem_t *newtbl;
+  unsigned int newsize, i;
+  char *p;
+
+  hash = hash_key (key, keylen);
+  if (htbl->tbl)
+    {
+      for (item = htbl->tbl[hash % htbl->size]; item; item = item->next)
+        if (item->hash == hash && item->keylen == keylen
+            && !memcmp (item->key, key, keylen))
+          return item;
+    }
+
+  /* Not found - resize the table if needed.  We keep the load factor
+     below 1.  */
+  if (htbl->count >= htbl->size)
+    {
+      newsize = htbl->size? 2 * htbl->size : 64;
+      newtbl = xcalloc (newsize, sizeof *newtbl);
+      for (i=0; i < htbl->size; i++)
+        for (item = htbl->tbl[i]; item; item = next)
+          {
+            next = item->next;
+            item->next = newtbl[item->hash % newsize];
+            newtbl[item->hash % newsize] = item;
+          }
+      xfree (htbl->tbl);
+      htbl->tbl = newtbl;
+      htbl->size = newsize;
+    }
+
+  item = xcalloc (1, itemsize + keylen + 1);
+  p = (char *)item + itemsize;
+  memcpy (p, key, keylen);
+  item->key = p;
+  item->keylen = keylen;
+  item->hash = hash;
+  item->next = htbl->tbl[hash % htbl->size];
+  htbl->tbl[hash % htbl->size] = item;
+  htbl->count++;
+  return item;
+}
+
+
+/* Return a malloced array with all items of the hash table HTBL.
+   The array has HTBL->COUNT elements.  */
+void *
+hashtbl_items (hashtbl_t htbl)
+{
+  hashitem_t *array;
+  hashitem_t item;
+  unsigned int i, n;
+
+  array = xcalloc (htbl->count? htbl->count : 1, sizeof *array);
+  for (i=n=0; i < htbl->size; i++)
+    for (item = htbl->tbl[i]; item; item = item->next)
+      array[n++] = item;
+  return array;
+}
+
+
+/* Release all items of the hash table HTBL.  */
+void
+hashtbl_release (hashtbl_t htbl)
+{
+  hashitem_t item, next;
+  unsigned int i;
+
+  for (i=0; i < htbl->size; i++)
+    for (item = htbl->tbl[i]; item; item = next)
+      {
+        next = item->next;
+        xfree (item);
+      }
+  xfree (htbl->tbl);
+  htbl->tbl = NULL;
+  htbl->size = 0;
+  htbl->count = 0;
+}
+
+
+
 /* Write buffer BUF of length LEN to stream FP.  Escape all characters
    in a way that the stream can be used for a colon delimited line
    format including structured URL like fields.  */
@@ -101,9 +101,33 @@ extern gpg_err_source_t default_errsource;
 /* The size of a buffer suitable to hold a string with an amount.  */
 #define AMOUNTBUF_SIZE 48
 
+/* An amount of money in the minor units of its currency (e.g. the
+   cents of an Euro amount).  */
+typedef long long money_t;
+
 /* The size of our standard timestamp ("YYYYMMDDTHHMMSS").  */
 #define TIMESTAMP_SIZE 16
 
+/* The header of an item in a hash table keyed by strings.  It must
+   be the first member of the structures stored in such a table.  */
+struct hashitem_s
+{
+  struct hashitem_s *next;  /* Next item in the same bucket.  */
+  unsigned int hash;
+  size_t keylen;            /* The length of KEY.  */
+  char *key;                /* Stored right after the structure.  */
+};
+typedef struct hashitem_s *hashitem_t;
+
+/* A hash table keyed by strings.  */
+struct hashtbl_s
+{
+  hashitem_t *tbl;
+  unsigned int size;
+  unsigned int count;
+};
+typedef struct hashtbl_s *hashtbl_t;
+
 
 /*-- util.c --*/
 void severe_error (void);
@@ -167,8 +191,15 @@ char *zb32_encode (const void *data, unsigned int databits);
 char *get_current_time (char *timestamp);
 char *get_full_isotime (int offset);
 
-unsigned int convert_amount (const char *string, int decdigits);
-char *reconvert_amount (int cents, int decdigits);
+gpg_error_t parse_money (const char *string, int decdigits,
+                         money_t *r_value);
+char *format_money (char *buffer, size_t bufsize,
+                    money_t value, int decdigits);
+
+void *hashtbl_find_create (hashtbl_t htbl, const char *key, size_t keylen,
+                           size_t itemsize);
+void *hashtbl_items (hashtbl_t htbl);
+void hashtbl_release (hashtbl_t htbl);
 
 void write_escaped (const char *string, estream_t fp);
 void write_meta_field (keyvalue_t dict, estream_t fp);